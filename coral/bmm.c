@@ -0,0 +1,304 @@
+#include "bmm.h"
+#include "gemm.h"
+#include "tensor.h"
+#include "parallel.h"
+#include "memory.h"
+#include "tune.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// multiply-adds below which a batch is not worth waking the pool for
+#define BMM_PARALLEL_MIN_WORK (1 << 16) // unless tuned (see bmm_tune)
+#define BMM_TUNE_KEY "bmm_parallel_min_work"
+
+/**
+ * SMALL KERNELS
+ * b is packed row major (k x n) before these are called, so that its rows are contiguous
+*/
+
+// c (m x N) <- a (m x k) * b (k x N), for a compile time N
+#define BMM_DEFINE_SMALL_KERNEL(N) \
+    static void bmm_kernel_##N(size_t m, size_t k, const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride, \
+                               const tensor_entry_t* restrict b, tensor_entry_t* restrict c){ \
+        for(size_t i = 0; i < m; i++){ \
+            tensor_entry_t accumulator[N] = {0}; \
+            const tensor_entry_t* a_row = a + i * a_row_stride; \
+            for(size_t p = 0; p < k; p++){ \
+                tensor_entry_t a_entry = a_row[p * a_column_stride]; \
+                const tensor_entry_t* restrict b_row = b + p * N; \
+                _Pragma("GCC unroll 64") \
+                for(size_t j = 0; j < N; j++){ \
+                    accumulator[j] += a_entry * b_row[j]; \
+                } \
+            } \
+            memcpy(c + i * N, accumulator, sizeof(accumulator)); \
+        } \
+    }
+
+BMM_DEFINE_SMALL_KERNEL(4)
+BMM_DEFINE_SMALL_KERNEL(8)
+BMM_DEFINE_SMALL_KERNEL(16)
+BMM_DEFINE_SMALL_KERNEL(32)
+BMM_DEFINE_SMALL_KERNEL(64)
+
+// the same for any n up to BMM_SMALL_MAX
+static void bmm_kernel_any(size_t m, size_t n, size_t k, const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride,
+                           const tensor_entry_t* restrict b, tensor_entry_t* restrict c){
+    for(size_t i = 0; i < m; i++){
+        tensor_entry_t accumulator[BMM_SMALL_MAX] = {0};
+        const tensor_entry_t* a_row = a + i * a_row_stride;
+        for(size_t p = 0; p < k; p++){
+            tensor_entry_t a_entry = a_row[p * a_column_stride];
+            const tensor_entry_t* restrict b_row = b + p * n;
+            for(size_t j = 0; j < n; j++){
+                accumulator[j] += a_entry * b_row[j];
+            }
+        }
+        memcpy(c + i * n, accumulator, n * sizeof(tensor_entry_t));
+    }
+}
+
+static void bmm_small(size_t m, size_t n, size_t k, const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride,
+                      const tensor_entry_t* b, size_t b_row_stride, size_t b_column_stride, tensor_entry_t* c){
+    tensor_entry_t packed_b[BMM_SMALL_MAX * BMM_SMALL_MAX];
+    if(b_column_stride != 1 || b_row_stride != n){
+        for(size_t p = 0; p < k; p++){
+            for(size_t j = 0; j < n; j++){
+                packed_b[p * n + j] = b[p * b_row_stride + j * b_column_stride];
+            }
+        }
+        b = packed_b;
+    }
+    switch(n){
+        case 4: bmm_kernel_4(m, k, a, a_row_stride, a_column_stride, b, c); break;
+        case 8: bmm_kernel_8(m, k, a, a_row_stride, a_column_stride, b, c); break;
+        case 16: bmm_kernel_16(m, k, a, a_row_stride, a_column_stride, b, c); break;
+        case 32: bmm_kernel_32(m, k, a, a_row_stride, a_column_stride, b, c); break;
+        case 64: bmm_kernel_64(m, k, a, a_row_stride, a_column_stride, b, c); break;
+        default: bmm_kernel_any(m, n, k, a, a_row_stride, a_column_stride, b, c);
+    }
+}
+
+/**
+ * BATCHES
+*/
+
+typedef struct {
+    size_t num_batches;
+    size_t m;
+    size_t n;
+    size_t k;
+    const tensor_entry_t* a;
+    const size_t* a_offsets;
+    size_t a_row_stride;
+    size_t a_column_stride;
+    const tensor_entry_t* b;
+    const size_t* b_offsets;
+    size_t b_row_stride;
+    size_t b_column_stride;
+    tensor_entry_t* c;
+} bmm_task_t;
+
+static void bmm_range(bmm_task_t* task, size_t start, size_t end){
+    bool small = task->m <= BMM_SMALL_MAX && task->n <= BMM_SMALL_MAX && task->k <= BMM_SMALL_MAX;
+    for(size_t batch = start; batch < end; batch++){
+        const tensor_entry_t* a = task->a + task->a_offsets[batch];
+        const tensor_entry_t* b = task->b + task->b_offsets[batch];
+        tensor_entry_t* c = task->c + batch * task->m * task->n;
+        if(small){
+            bmm_small(task->m, task->n, task->k, a, task->a_row_stride, task->a_column_stride, b, task->b_row_stride, task->b_column_stride, c);
+        }else{
+            gemm(task->m, task->n, task->k, a, task->a_row_stride, task->a_column_stride, b, task->b_row_stride, task->b_column_stride, c, task->n, false, NULL);
+        }
+    }
+}
+
+static void bmm_thread_task(void* context, int thread_index, int num_threads){
+    bmm_task_t* task = (bmm_task_t*) context;
+    size_t start, end;
+    parallel_range(task->num_batches, thread_index, num_threads, &start, &end);
+    bmm_range(task, start, end);
+}
+
+static int num_threads_setting = 0;
+static thread_pool_t* bmm_pool = NULL;
+// a batch started while another one holds the pool runs on the calling thread alone
+static pthread_mutex_t bmm_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bmm_set_num_threads(int num_threads){
+    pthread_mutex_lock(&bmm_pool_lock);
+    num_threads_setting = num_threads;
+    if(bmm_pool != NULL){
+        thread_pool_free(bmm_pool);
+        bmm_pool = NULL;
+    }
+    pthread_mutex_unlock(&bmm_pool_lock);
+}
+
+void bmm_strided(size_t num_batches, size_t m, size_t n, size_t k,
+    const tensor_entry_t* a, const size_t* a_offsets, size_t a_row_stride, size_t a_column_stride,
+    const tensor_entry_t* b, const size_t* b_offsets, size_t b_row_stride, size_t b_column_stride,
+    tensor_entry_t* c){
+    bmm_task_t task = {num_batches, m, n, k, a, a_offsets, a_row_stride, a_column_stride, b, b_offsets, b_row_stride, b_column_stride, c};
+    bool worth_splitting = num_batches > 1 && num_batches * m * n * k >= tune_lookup_size(BMM_TUNE_KEY, BMM_PARALLEL_MIN_WORK);
+    if(worth_splitting && pthread_mutex_trylock(&bmm_pool_lock) == 0){
+        int num_threads = num_threads_setting > 0 ? num_threads_setting : parallel_num_cores();
+        if(bmm_pool == NULL && num_threads > 1){
+            bmm_pool = thread_pool_new(num_threads);
+        }
+        if(bmm_pool != NULL){
+            thread_pool_run(bmm_pool, &bmm_thread_task, &task);
+            pthread_mutex_unlock(&bmm_pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&bmm_pool_lock);
+    }
+    bmm_range(&task, 0, num_batches);
+}
+
+// batches of 8 x 8 x 8 products
+#define BMM_TUNE_SIDE 8
+#define BMM_TUNE_MATRIX (BMM_TUNE_SIDE * BMM_TUNE_SIDE)
+
+typedef struct {
+    tensor_entry_t* a;
+    tensor_entry_t* b;
+    tensor_entry_t* c;
+    size_t* offsets;
+} tune_buffers_t;
+
+static void tune_workload(void* context, size_t size){
+    tune_buffers_t* buffers = (tune_buffers_t*) context;
+    size_t num_batches = size / (BMM_TUNE_MATRIX * BMM_TUNE_SIDE);
+    bmm_strided(num_batches, BMM_TUNE_SIDE, BMM_TUNE_SIDE, BMM_TUNE_SIDE, buffers->a, buffers->offsets, BMM_TUNE_SIDE, 1,
+                buffers->b, buffers->offsets, BMM_TUNE_SIDE, 1, buffers->c);
+}
+
+void bmm_tune(){
+    size_t max_work = (size_t) 1 << 24;
+    size_t max_batches = max_work / (BMM_TUNE_MATRIX * BMM_TUNE_SIDE);
+    size_t bytes = max_batches * BMM_TUNE_MATRIX * sizeof(tensor_entry_t);
+    tune_buffers_t buffers = {memory_alloc(bytes), memory_alloc(bytes), memory_alloc(bytes), (size_t*) malloc(max_batches * sizeof(size_t))};
+    for(size_t batch = 0; batch < max_batches; batch++){
+        buffers.offsets[batch] = batch * BMM_TUNE_MATRIX;
+    }
+    tune_threshold(BMM_TUNE_KEY, &tune_workload, &buffers, (size_t) 1 << 12, max_work);
+    memory_free(buffers.a, bytes);
+    memory_free(buffers.b, bytes);
+    memory_free(buffers.c, bytes);
+    free(buffers.offsets);
+}
+
+/**
+ * TENSORS
+*/
+
+// the broadcast batch dimensions of two stacks of matrices, and where each batch starts in either
+typedef struct {
+    int num_batch_dims;
+    size_t batch_dims[TENSOR_MAX_DIMS];
+    size_t num_batches;
+    size_t* offsets[2];
+} batch_plan_t;
+
+static void batch_plan_init(batch_plan_t* plan, tensor_t* left_tensor, tensor_t* right_tensor){
+    tensor_t* operands[2] = {left_tensor, right_tensor};
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(left_tensor) >= 2 && TENSOR_NUM_DIMS(right_tensor) >= 2, "Batched matrix multiplication requires at least two dimensional tensors!\n");
+    int num_batch_dims = MAX(TENSOR_NUM_DIMS(left_tensor), TENSOR_NUM_DIMS(right_tensor)) - 2;
+    plan->num_batch_dims = num_batch_dims;
+    plan->num_batches = 1;
+    size_t steps[2][TENSOR_MAX_DIMS];
+    for(int dim_index = 0; dim_index < num_batch_dims; dim_index++){
+        size_t length = 1;
+        size_t operand_dims[2];
+        for(int operand = 0; operand < 2; operand++){
+            int operand_dim = dim_index - (num_batch_dims + 2 - TENSOR_NUM_DIMS(operands[operand]));
+            operand_dims[operand] = operand_dim >= 0 ? operands[operand]->shape->dims[operand_dim] : 1;
+            steps[operand][dim_index] = operand_dims[operand] > 1 ? operands[operand]->shape->strides[operand_dim] : 0;
+            length = MAX(length, operand_dims[operand]);
+        }
+        bool compatible = (operand_dims[0] == 1 || operand_dims[0] == length) && (operand_dims[1] == 1 || operand_dims[1] == length);
+        NDEBUG_ASSERT(compatible, "Batch dimensions are not broadcast compatible!\n");
+        plan->batch_dims[dim_index] = length;
+        plan->num_batches *= length;
+    }
+    for(int operand = 0; operand < 2; operand++){
+        plan->offsets[operand] = (size_t*) malloc(MAX(plan->num_batches, (size_t) 1) * sizeof(size_t));
+    }
+    for(size_t batch = 0; batch < plan->num_batches; batch++){
+        size_t remainder = batch;
+        size_t offsets[2] = {0, 0};
+        for(int dim_index = num_batch_dims - 1; dim_index >= 0; dim_index--){
+            size_t index = remainder % plan->batch_dims[dim_index];
+            remainder /= plan->batch_dims[dim_index];
+            offsets[0] += index * steps[0][dim_index];
+            offsets[1] += index * steps[1][dim_index];
+        }
+        plan->offsets[0][batch] = offsets[0];
+        plan->offsets[1][batch] = offsets[1];
+    }
+}
+
+static void batch_plan_free(batch_plan_t* plan){
+    free(plan->offsets[0]);
+    free(plan->offsets[1]);
+}
+
+// (batch dims..., rows x columns)
+static tensor_t* batch_plan_new_output(batch_plan_t* plan, size_t rows, size_t columns){
+    size_t dims[TENSOR_MAX_DIMS];
+    memcpy(dims, plan->batch_dims, plan->num_batch_dims * sizeof(size_t));
+    dims[plan->num_batch_dims] = rows;
+    dims[plan->num_batch_dims + 1] = columns;
+    return tensor_new(shape_new(plan->num_batch_dims + 2, dims));
+}
+
+static inline size_t matrix_rows(tensor_t* tensor){
+    return tensor->shape->dims[TENSOR_NUM_DIMS(tensor) - 2];
+}
+
+static inline size_t matrix_columns(tensor_t* tensor){
+    return tensor->shape->dims[TENSOR_NUM_DIMS(tensor) - 1];
+}
+
+tensor_t* tensor_bmm(tensor_t* left_tensor, tensor_t* right_tensor){
+    batch_plan_t plan;
+    batch_plan_init(&plan, left_tensor, right_tensor);
+    NDEBUG_ASSERT(matrix_columns(left_tensor) == matrix_rows(right_tensor), "Inner dimensions of matrix multiplication do not match!\n");
+    size_t m = matrix_rows(left_tensor);
+    size_t k = matrix_columns(left_tensor);
+    size_t n = matrix_columns(right_tensor);
+    tensor_t* new_tensor = batch_plan_new_output(&plan, m, n);
+    bmm_strided(plan.num_batches, m, n, k, left_tensor->data, plan.offsets[0], k, 1, right_tensor->data, plan.offsets[1], n, 1, new_tensor->data);
+    batch_plan_free(&plan);
+    return new_tensor;
+}
+
+// output_grad (..., m x n) * right^T (..., n x k)
+tensor_t* tensor_bmm_left_grad(tensor_t* output_grad, tensor_t* right_tensor){
+    batch_plan_t plan;
+    batch_plan_init(&plan, output_grad, right_tensor);
+    size_t m = matrix_rows(output_grad);
+    size_t n = matrix_columns(output_grad);
+    size_t k = matrix_rows(right_tensor);
+    tensor_t* grad = batch_plan_new_output(&plan, m, k);
+    bmm_strided(plan.num_batches, m, k, n, output_grad->data, plan.offsets[0], n, 1, right_tensor->data, plan.offsets[1], 1, n, grad->data);
+    batch_plan_free(&plan);
+    return grad;
+}
+
+// left^T (..., k x m) * output_grad (..., m x n)
+tensor_t* tensor_bmm_right_grad(tensor_t* output_grad, tensor_t* left_tensor){
+    batch_plan_t plan;
+    batch_plan_init(&plan, left_tensor, output_grad);
+    size_t m = matrix_rows(output_grad);
+    size_t n = matrix_columns(output_grad);
+    size_t k = matrix_columns(left_tensor);
+    tensor_t* grad = batch_plan_new_output(&plan, k, n);
+    bmm_strided(plan.num_batches, k, n, m, left_tensor->data, plan.offsets[0], 1, k, output_grad->data, plan.offsets[1], n, 1, grad->data);
+    batch_plan_free(&plan);
+    return grad;
+}
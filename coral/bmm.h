@@ -0,0 +1,40 @@
+#ifndef BMM_H
+#define BMM_H
+
+#include "tensor.h"
+
+/**
+ * BATCHED MATRIX MULTIPLICATION
+ * tensors are stacks of matrices along their leading (batch) dimensions, which broadcast as in
+ * shape_get_broadcast_shape: (..., m x k) * (..., k x n) -> (broadcast batch dims..., m x n)
+ *
+ * matrices with every side at most BMM_SMALL_MAX are multiplied by their own kernels rather than by gemm, whose
+ * packing buffers cost more than the product itself at these sizes; when n is one of 4, 8, 16, 32 or 64, the
+ * kernel accumulates a row of the output in registers with a fully unrolled loop
+ * large enough batches are split over a thread pool
+*/
+
+#define BMM_SMALL_MAX 64
+
+/**
+ * c[batch] <- a[batch] * b[batch] for each of num_batches batches, where a is m x k, b is k x n and c is m x n
+ * matrix batch of a starts at a + a_offsets[batch] (likewise b), and has (row, column) strides as in gemm
+ * c is contiguous, batch after batch
+*/
+void bmm_strided(size_t num_batches, size_t m, size_t n, size_t k,
+    const tensor_entry_t* a, const size_t* a_offsets, size_t a_row_stride, size_t a_column_stride,
+    const tensor_entry_t* b, const size_t* b_offsets, size_t b_row_stride, size_t b_column_stride,
+    tensor_entry_t* c);
+
+// threads used for large batches (0, the default, for one per core)
+void bmm_set_num_threads(int num_threads);
+// tunes the work (multiply-adds) from which batches are split over threads (see tune.h)
+void bmm_tune();
+
+// left (..., m x k) * right (..., k x n); both need at least two dimensions
+tensor_t* tensor_bmm(tensor_t* left_tensor, tensor_t* right_tensor);
+// the gradients of tensor_bmm, in the broadcast batch shape (to be reduced to that of the input)
+tensor_t* tensor_bmm_left_grad(tensor_t* output_grad, tensor_t* right_tensor);
+tensor_t* tensor_bmm_right_grad(tensor_t* output_grad, tensor_t* left_tensor);
+
+#endif // BMM_H
@@ -0,0 +1,158 @@
+#include "checkpoint.h"
+#include "tensor.h"
+#include "variable.h"
+#include "assert.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t aligned_offset(size_t offset){
+    return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+/**
+ * SAVE
+*/
+
+// write(2) until done, so payloads go from the tensor to the kernel without a stdio staging buffer
+static bool write_all(int fd, const void* data, size_t num_bytes){
+    const char* bytes = (const char*) data;
+    while(num_bytes > 0){
+        ssize_t written = write(fd, bytes, num_bytes);
+        if(written <= 0){
+            return false;
+        }
+        bytes += written;
+        num_bytes -= (size_t) written;
+    }
+    return true;
+}
+
+void checkpoint_save(const char* path, int num_variables, const char** names, variable_t** variables){
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.num_tensors = num_variables;
+    // the table is laid out up front, so the payloads can then be streamed in order
+    checkpoint_entry_t* entries = (checkpoint_entry_t*) calloc(num_variables > 0 ? num_variables : 1, sizeof(checkpoint_entry_t));
+    size_t offset = sizeof(header) + num_variables * sizeof(checkpoint_entry_t);
+    for(int index = 0; index < num_variables; index++){
+        tensor_t* tensor = variables[index]->tensor;
+        NDEBUG_ASSERT(strlen(names[index]) < CHECKPOINT_MAX_NAME, "Checkpoint tensor name is too long!\n");
+        strcpy(entries[index].name, names[index]);
+        entries[index].num_dims = TENSOR_NUM_DIMS(tensor);
+        for(int dim = 0; dim < TENSOR_NUM_DIMS(tensor); dim++){
+            entries[index].dims[dim] = tensor->shape->dims[dim];
+        }
+        offset = aligned_offset(offset);
+        entries[index].offset = offset;
+        entries[index].size = tensor->shape->size;
+        offset += tensor->shape->size * sizeof(tensor_entry_t);
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    NDEBUG_ASSERT(fd >= 0, "Could not open checkpoint file for writing!\n");
+    bool ok = write_all(fd, &header, sizeof(header)) && write_all(fd, entries, num_variables * sizeof(checkpoint_entry_t));
+    size_t position = sizeof(header) + num_variables * sizeof(checkpoint_entry_t);
+    char padding[CHECKPOINT_ALIGNMENT] = {0};
+    for(int index = 0; index < num_variables && ok; index++){
+        ok = write_all(fd, padding, entries[index].offset - position);
+        size_t num_bytes = entries[index].size * sizeof(tensor_entry_t);
+        ok = ok && write_all(fd, variables[index]->tensor->data, num_bytes);
+        position = entries[index].offset + num_bytes;
+    }
+    ok = (close(fd) == 0) && ok;
+    free(entries);
+    NDEBUG_ASSERT(ok, "Could not write checkpoint file!\n");
+}
+
+/**
+ * LOAD
+*/
+
+checkpoint_t* checkpoint_open(const char* path){
+    int fd = open(path, O_RDONLY);
+    NDEBUG_ASSERT(fd >= 0, "Could not open checkpoint file!\n");
+    struct stat file_stat;
+    int error = fstat(fd, &file_stat);
+    NDEBUG_ASSERT(error == 0, "Could not stat checkpoint file!\n");
+    size_t mapping_size = (size_t) file_stat.st_size;
+    NDEBUG_ASSERT(mapping_size >= sizeof(checkpoint_header_t), "Checkpoint file is truncated!\n");
+    // writable but private: loaded tensors are ordinary tensors, and writing one copies only the pages it touches
+    void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    NDEBUG_ASSERT(mapping != MAP_FAILED, "Could not map checkpoint file!\n");
+    close(fd);
+    checkpoint_header_t* header = (checkpoint_header_t*) mapping;
+    NDEBUG_ASSERT(memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) == 0, "Not a checkpoint file!\n");
+    size_t table_end = sizeof(checkpoint_header_t) + header->num_tensors * sizeof(checkpoint_entry_t);
+    NDEBUG_ASSERT(table_end <= mapping_size, "Checkpoint file is truncated!\n");
+    checkpoint_t* checkpoint = (checkpoint_t*) malloc(sizeof(checkpoint_t));
+    checkpoint->mapping = mapping;
+    checkpoint->mapping_size = mapping_size;
+    checkpoint->num_tensors = header->num_tensors;
+    checkpoint->entries = (checkpoint_entry_t*) ((char*) mapping + sizeof(checkpoint_header_t));
+    for(size_t index = 0; index < checkpoint->num_tensors; index++){
+        checkpoint_entry_t* entry = &checkpoint->entries[index];
+        NDEBUG_ASSERT(entry->num_dims >= 1 && entry->num_dims <= TENSOR_MAX_DIMS, "Checkpoint tensor has an invalid shape!\n");
+        NDEBUG_ASSERT(entry->offset == aligned_offset(entry->offset), "Checkpoint payload is misaligned!\n");
+        NDEBUG_ASSERT(entry->offset + entry->size * sizeof(tensor_entry_t) <= mapping_size, "Checkpoint file is truncated!\n");
+    }
+    return checkpoint;
+}
+
+static checkpoint_entry_t* checkpoint_find(checkpoint_t* checkpoint, const char* name){
+    for(size_t index = 0; index < checkpoint->num_tensors; index++){
+        if(strncmp(checkpoint->entries[index].name, name, CHECKPOINT_MAX_NAME) == 0){
+            return &checkpoint->entries[index];
+        }
+    }
+    return NULL;
+}
+
+static tensor_entry_t* checkpoint_payload(checkpoint_t* checkpoint, checkpoint_entry_t* entry){
+    return (tensor_entry_t*) ((char*) checkpoint->mapping + entry->offset);
+}
+
+tensor_t* checkpoint_get(checkpoint_t* checkpoint, const char* name){
+    checkpoint_entry_t* entry = checkpoint_find(checkpoint, name);
+    if(entry == NULL){
+        return NULL;
+    }
+    size_t dims[TENSOR_MAX_DIMS];
+    for(size_t dim = 0; dim < entry->num_dims; dim++){
+        dims[dim] = entry->dims[dim];
+    }
+    tensor_t* tensor = (tensor_t*) malloc(sizeof(tensor_t));
+    tensor->shape = shape_new((int) entry->num_dims, dims);
+    tensor->data = checkpoint_payload(checkpoint, entry);
+    tensor->storage = NULL;
+    return tensor;
+}
+
+void checkpoint_load(checkpoint_t* checkpoint, int num_variables, const char** names, variable_t** variables){
+    for(int index = 0; index < num_variables; index++){
+        checkpoint_entry_t* entry = checkpoint_find(checkpoint, names[index]);
+        NDEBUG_ASSERT(entry != NULL, "Checkpoint has no tensor with that name!\n");
+        shape_t* shape = variables[index]->tensor->shape;
+        bool same_shape = entry->num_dims == (uint64_t) shape->num_dims;
+        for(int dim = 0; dim < shape->num_dims && same_shape; dim++){
+            same_shape = entry->dims[dim] == shape->dims[dim];
+        }
+        NDEBUG_ASSERT(same_shape, "Checkpoint tensor does not match the shape of the variable!\n");
+        tensor_t* tensor = variables[index]->tensor;
+        if(tensor_owns_data(tensor)){
+            tensor_point_to(tensor, checkpoint_payload(checkpoint, entry));
+        }else{
+            // eg. a slice of the flat buffer of an optimizer, which has to keep reading (and stepping) the tensor
+            tensor_make_writable(tensor);
+            memcpy(tensor->data, checkpoint_payload(checkpoint, entry), entry->size * sizeof(tensor_entry_t));
+        }
+    }
+}
+
+void checkpoint_close(checkpoint_t* checkpoint){
+    munmap(checkpoint->mapping, checkpoint->mapping_size);
+    free(checkpoint);
+}
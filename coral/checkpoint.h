@@ -0,0 +1,58 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "tensor.h"
+#include "variable.h"
+#include <stdint.h>
+
+/**
+ * CHECKPOINT FILE FORMAT
+ * a checkpoint_header_t, a table of num_tensors checkpoint_entry_t's, then the payload of every tensor
+ * (contiguous floats, native byte order), each starting at a multiple of CHECKPOINT_ALIGNMENT
+*/
+
+#define CHECKPOINT_MAGIC "CORALCK1"
+#define CHECKPOINT_ALIGNMENT 64
+#define CHECKPOINT_MAX_NAME 64 // including the terminating null
+
+typedef struct {
+    char magic[8];
+    uint64_t num_tensors;
+} checkpoint_header_t;
+
+typedef struct {
+    char name[CHECKPOINT_MAX_NAME];
+    uint64_t num_dims;
+    uint64_t dims[TENSOR_MAX_DIMS];
+    uint64_t offset; // of the payload, from the start of the file
+    uint64_t size; // in entries
+    uint64_t reserved;
+} checkpoint_entry_t;
+
+typedef struct {
+    void* mapping;
+    size_t mapping_size;
+    size_t num_tensors;
+    checkpoint_entry_t* entries; // inside the mapping
+} checkpoint_t;
+
+// writes the tensor of every variable under the matching name, straight from the tensor data
+void checkpoint_save(const char* path, int num_variables, const char** names, variable_t** variables);
+
+/**
+ * mmaps the file privately: nothing is read until it is touched, every process loading the same file
+ * shares its page cache pages, and a page is only copied (and then private) on its first write
+*/
+checkpoint_t* checkpoint_open(const char* path);
+// a tensor whose data points into the mapping, or NULL if there is no tensor with that name
+tensor_t* checkpoint_get(checkpoint_t* checkpoint, const char* name);
+// points the tensor of every variable at its (shape checked) payload in the mapping, releasing the buffer it held;
+// a tensor which does not own its buffer (a view, or a parameter moved into the flat buffer of an optimizer) has the
+// payload copied in instead, so that an optimizer keeps stepping what the model reads
+// either order works: loading before making the optimizer saves the copy of the loaded parameters into its buffer
+// only when it is made, loading after it copies straight into the buffer
+void checkpoint_load(checkpoint_t* checkpoint, int num_variables, const char** names, variable_t** variables);
+// tensors obtained from the checkpoint are invalid afterwards
+void checkpoint_close(checkpoint_t* checkpoint);
+
+#endif // CHECKPOINT_H
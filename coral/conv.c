@@ -0,0 +1,333 @@
+#include "conv.h"
+#include "gemm.h"
+#include "tensor.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// im2col is done one tile of output positions at a time, so the column buffer never grows beyond this budget
+// (rather than being sized by the whole output), and each tile is consumed by the gemm while it is still in cache
+#define CONV_TILE_BYTES (256 * 1024)
+#define CONV_ALIGNMENT 64
+
+typedef struct {
+    size_t batch;
+    size_t in_channels;
+    size_t height;
+    size_t width;
+    size_t out_channels;
+    size_t kernel_height;
+    size_t kernel_width;
+    size_t output_height;
+    size_t output_width;
+    size_t group_in_channels;
+    size_t group_out_channels;
+    size_t patch_size; // group_in_channels * kernel_height * kernel_width
+    size_t tile; // output positions per im2col tile
+} conv2d_geometry_t;
+
+static size_t output_extent(size_t input_extent, size_t kernel_extent, size_t stride, size_t padding, size_t dilation){
+    size_t effective_kernel_extent = dilation * (kernel_extent - 1) + 1;
+    NDEBUG_ASSERT(stride > 0 && input_extent + 2 * padding >= effective_kernel_extent, "Kernel does not fit in padded input!\n");
+    return (input_extent + 2 * padding - effective_kernel_extent) / stride + 1;
+}
+
+static conv2d_geometry_t conv2d_geometry(tensor_t* input, tensor_t* weight, const conv2d_params_t* params){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(input) == 4 && TENSOR_NUM_DIMS(weight) == 4, "Convolution requires four dimensional (NCHW) input and weight!\n");
+    conv2d_geometry_t geometry;
+    geometry.batch = input->shape->dims[0];
+    geometry.in_channels = input->shape->dims[1];
+    geometry.height = input->shape->dims[2];
+    geometry.width = input->shape->dims[3];
+    geometry.out_channels = weight->shape->dims[0];
+    geometry.kernel_height = weight->shape->dims[2];
+    geometry.kernel_width = weight->shape->dims[3];
+    bool divisible = params->groups > 0 && geometry.in_channels % params->groups == 0 && geometry.out_channels % params->groups == 0;
+    NDEBUG_ASSERT(divisible, "Channels are not divisible by groups!\n");
+    geometry.group_in_channels = geometry.in_channels / params->groups;
+    geometry.group_out_channels = geometry.out_channels / params->groups;
+    NDEBUG_ASSERT(weight->shape->dims[1] == geometry.group_in_channels, "Weight channels do not match input channels!\n");
+    geometry.output_height = output_extent(geometry.height, geometry.kernel_height, params->stride[0], params->padding[0], params->dilation[0]);
+    geometry.output_width = output_extent(geometry.width, geometry.kernel_width, params->stride[1], params->padding[1], params->dilation[1]);
+    geometry.patch_size = geometry.group_in_channels * geometry.kernel_height * geometry.kernel_width;
+    size_t num_positions = geometry.output_height * geometry.output_width;
+    geometry.tile = MIN(MAX(CONV_TILE_BYTES / (geometry.patch_size * sizeof(tensor_entry_t)), (size_t) 1), num_positions);
+    return geometry;
+}
+
+// 1x1 kernels with unit stride and no padding read the input directly, no im2col required
+static inline bool conv2d_is_pointwise(conv2d_geometry_t* geometry, const conv2d_params_t* params){
+    return geometry->kernel_height == 1 && geometry->kernel_width == 1 && params->stride[0] == 1 && params->stride[1] == 1 && params->padding[0] == 0 && params->padding[1] == 0;
+}
+
+static tensor_entry_t* tile_buffer_new(size_t size){
+    tensor_entry_t* buffer;
+    int error = posix_memalign((void**) &buffer, CONV_ALIGNMENT, MAX(size, (size_t) 1) * sizeof(tensor_entry_t));
+    NDEBUG_ASSERT(error == 0, "Could not allocate im2col buffer!\n");
+    return buffer;
+}
+
+/**
+ * IM2COL
+ * col is (patch_size x tile): col[patch_index * tile + t] is the input entry under kernel entry patch_index
+ * (channel, kernel row, kernel column) for output position position_start + t, or zero in the padding
+*/
+
+// add_back selects col2im (image += col) instead of im2col (col <- image)
+static void im2col_tile(tensor_entry_t* image, conv2d_geometry_t* geometry, const conv2d_params_t* params, size_t position_start, size_t tile, tensor_entry_t* col, bool add_back){
+    size_t first_row = position_start / geometry->output_width;
+    size_t first_column = position_start % geometry->output_width;
+    for(size_t channel = 0; channel < geometry->group_in_channels; channel++){
+        tensor_entry_t* channel_image = image + channel * geometry->height * geometry->width;
+        for(size_t kernel_row = 0; kernel_row < geometry->kernel_height; kernel_row++){
+            for(size_t kernel_column = 0; kernel_column < geometry->kernel_width; kernel_column++){
+                size_t patch_index = (channel * geometry->kernel_height + kernel_row) * geometry->kernel_width + kernel_column;
+                tensor_entry_t* col_row = col + patch_index * tile;
+                long row_offset = (long) (kernel_row * params->dilation[0]) - (long) params->padding[0];
+                long column_offset = (long) (kernel_column * params->dilation[1]) - (long) params->padding[1];
+                size_t output_row = first_row;
+                size_t output_column = first_column;
+                for(size_t t = 0; t < tile; t++){
+                    long input_row = (long) (output_row * params->stride[0]) + row_offset;
+                    long input_column = (long) (output_column * params->stride[1]) + column_offset;
+                    bool in_bounds = input_row >= 0 && input_row < (long) geometry->height && input_column >= 0 && input_column < (long) geometry->width;
+                    if(add_back){
+                        if(in_bounds){
+                            channel_image[input_row * geometry->width + input_column] += col_row[t];
+                        }
+                    }else{
+                        col_row[t] = in_bounds ? channel_image[input_row * geometry->width + input_column] : 0;
+                    }
+                    if(++output_column == geometry->output_width){
+                        output_column = 0;
+                        output_row++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * CONVOLUTION
+*/
+
+tensor_t* tensor_conv2d(tensor_t* input, tensor_t* weight, tensor_t* bias, const conv2d_params_t* params){
+    conv2d_geometry_t geometry = conv2d_geometry(input, weight, params);
+    NDEBUG_ASSERT(bias == NULL || bias->shape->size == geometry.out_channels, "Bias does not match output channels!\n");
+    size_t dims[4] = {geometry.batch, geometry.out_channels, geometry.output_height, geometry.output_width};
+    tensor_t* output = tensor_new(shape_new(4, dims));
+    size_t num_positions = geometry.output_height * geometry.output_width;
+    size_t image_size = geometry.height * geometry.width;
+    bool pointwise = conv2d_is_pointwise(&geometry, params);
+    tensor_entry_t* col = pointwise ? NULL : tile_buffer_new(geometry.patch_size * geometry.tile);
+    for(size_t batch_index = 0; batch_index < geometry.batch; batch_index++){
+        for(size_t group = 0; group < params->groups; group++){
+            tensor_entry_t* image = input->data + (batch_index * geometry.in_channels + group * geometry.group_in_channels) * image_size;
+            tensor_entry_t* group_weight = weight->data + group * geometry.group_out_channels * geometry.patch_size;
+            size_t first_channel = group * geometry.group_out_channels;
+            tensor_entry_t* group_output = output->data + (batch_index * geometry.out_channels + first_channel) * num_positions;
+            for(size_t position_start = 0; position_start < num_positions; position_start += geometry.tile){
+                size_t tile = MIN(geometry.tile, num_positions - position_start);
+                if(pointwise){
+                    gemm(geometry.group_out_channels, tile, geometry.patch_size, group_weight, geometry.patch_size, 1, image + position_start, image_size, 1, group_output + position_start, num_positions, false, NULL);
+                }else{
+                    im2col_tile(image, &geometry, params, position_start, tile, col, false);
+                    gemm(geometry.group_out_channels, tile, geometry.patch_size, group_weight, geometry.patch_size, 1, col, tile, 1, group_output + position_start, num_positions, false, NULL);
+                }
+                // bias is per output channel (a row of the tile), added while the tile is still in cache
+                if(bias != NULL){
+                    for(size_t channel = 0; channel < geometry.group_out_channels; channel++){
+                        tensor_entry_t* restrict output_row = group_output + channel * num_positions + position_start;
+                        tensor_entry_t channel_bias = bias->data[first_channel + channel];
+                        for(size_t t = 0; t < tile; t++){
+                            output_row[t] += channel_bias;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(col);
+    return output;
+}
+
+// weight_grad += output_grad * col^T and col_grad = weight^T * output_grad (then col2im into input_grad), tile by tile
+void tensor_conv2d_backwards_grad(tensor_t* input, tensor_t* weight, tensor_t* output_grad, const conv2d_params_t* params, tensor_t* input_grad, tensor_t* weight_grad, tensor_t* bias_grad){
+    conv2d_geometry_t geometry = conv2d_geometry(input, weight, params);
+    size_t num_positions = geometry.output_height * geometry.output_width;
+    size_t image_size = geometry.height * geometry.width;
+    bool pointwise = conv2d_is_pointwise(&geometry, params);
+    tensor_entry_t* col = tile_buffer_new(geometry.patch_size * geometry.tile);
+    tensor_entry_t* col_grad = tile_buffer_new(geometry.patch_size * geometry.tile);
+    for(size_t batch_index = 0; batch_index < geometry.batch; batch_index++){
+        for(size_t group = 0; group < params->groups; group++){
+            size_t image_offset = (batch_index * geometry.in_channels + group * geometry.group_in_channels) * image_size;
+            tensor_entry_t* image = input->data + image_offset;
+            size_t weight_offset = group * geometry.group_out_channels * geometry.patch_size;
+            size_t first_channel = group * geometry.group_out_channels;
+            tensor_entry_t* group_output_grad = output_grad->data + (batch_index * geometry.out_channels + first_channel) * num_positions;
+            for(size_t position_start = 0; position_start < num_positions; position_start += geometry.tile){
+                size_t tile = MIN(geometry.tile, num_positions - position_start);
+                tensor_entry_t* tile_output_grad = group_output_grad + position_start;
+                if(weight_grad != NULL){
+                    const tensor_entry_t* tile_col = image + position_start;
+                    size_t col_row_stride = image_size;
+                    if(!pointwise){
+                        im2col_tile(image, &geometry, params, position_start, tile, col, false);
+                        tile_col = col;
+                        col_row_stride = tile;
+                    }
+                    gemm(geometry.group_out_channels, geometry.patch_size, tile, tile_output_grad, num_positions, 1, tile_col, 1, col_row_stride, weight_grad->data + weight_offset, geometry.patch_size, true, NULL);
+                }
+                if(input_grad != NULL){
+                    tensor_entry_t* group_weight = weight->data + weight_offset;
+                    if(pointwise){
+                        gemm(geometry.patch_size, tile, geometry.group_out_channels, group_weight, 1, geometry.patch_size, tile_output_grad, num_positions, 1, input_grad->data + image_offset + position_start, image_size, true, NULL);
+                    }else{
+                        gemm(geometry.patch_size, tile, geometry.group_out_channels, group_weight, 1, geometry.patch_size, tile_output_grad, num_positions, 1, col_grad, tile, false, NULL);
+                        im2col_tile(input_grad->data + image_offset, &geometry, params, position_start, tile, col_grad, true);
+                    }
+                }
+            }
+            if(bias_grad != NULL){
+                for(size_t channel = 0; channel < geometry.group_out_channels; channel++){
+                    const tensor_entry_t* restrict channel_grad = group_output_grad + channel * num_positions;
+                    tensor_entry_t sum = 0;
+                    for(size_t position = 0; position < num_positions; position++){
+                        sum += channel_grad[position];
+                    }
+                    bias_grad->data[first_channel + channel] += sum;
+                }
+            }
+        }
+    }
+    free(col);
+    free(col_grad);
+}
+
+/**
+ * POOLING
+*/
+
+static tensor_t* pool2d_output_new(tensor_t* input, const pool2d_params_t* params){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(input) == 4, "Pooling requires four dimensional (NCHW) input!\n");
+    // so that every window overlaps the input (see pool2d_window)
+    bool padding_fits = params->padding[0] <= params->kernel_size[0] / 2 && params->padding[1] <= params->kernel_size[1] / 2;
+    NDEBUG_ASSERT(padding_fits, "Pooling padding cannot exceed half the kernel size!\n");
+    size_t dims[4] = {
+        input->shape->dims[0],
+        input->shape->dims[1],
+        output_extent(input->shape->dims[2], params->kernel_size[0], params->stride[0], params->padding[0], 1),
+        output_extent(input->shape->dims[3], params->kernel_size[1], params->stride[1], params->padding[1], 1),
+    };
+    return tensor_new(shape_new(4, dims));
+}
+
+// clips the window of output entry (output_row, output_column) to the input, as half open ranges
+static inline void pool2d_window(const pool2d_params_t* params, size_t height, size_t width, size_t output_row, size_t output_column, size_t* row_start, size_t* row_end, size_t* column_start, size_t* column_end){
+    long first_row = (long) (output_row * params->stride[0]) - (long) params->padding[0];
+    long first_column = (long) (output_column * params->stride[1]) - (long) params->padding[1];
+    *row_start = (size_t) MAX(first_row, 0L);
+    *column_start = (size_t) MAX(first_column, 0L);
+    *row_end = (size_t) MIN(first_row + (long) params->kernel_size[0], (long) height);
+    *column_end = (size_t) MIN(first_column + (long) params->kernel_size[1], (long) width);
+}
+
+tensor_t* tensor_max_pool2d(tensor_t* input, const pool2d_params_t* params, size_t** argmax_out){
+    tensor_t* output = pool2d_output_new(input, params);
+    size_t* argmax = NULL;
+    if(argmax_out != NULL){
+        argmax = (size_t*) malloc(output->shape->size * sizeof(size_t));
+        *argmax_out = argmax;
+    }
+    size_t height = input->shape->dims[2];
+    size_t width = input->shape->dims[3];
+    size_t output_height = output->shape->dims[2];
+    size_t output_width = output->shape->dims[3];
+    size_t num_planes = input->shape->dims[0] * input->shape->dims[1];
+    for(size_t plane = 0; plane < num_planes; plane++){
+        size_t plane_offset = plane * height * width;
+        for(size_t output_row = 0; output_row < output_height; output_row++){
+            for(size_t output_column = 0; output_column < output_width; output_column++){
+                size_t row_start, row_end, column_start, column_end;
+                pool2d_window(params, height, width, output_row, output_column, &row_start, &row_end, &column_start, &column_end);
+                tensor_entry_t max = -INFINITY;
+                size_t max_offset = plane_offset;
+                for(size_t row = row_start; row < row_end; row++){
+                    for(size_t column = column_start; column < column_end; column++){
+                        size_t offset = plane_offset + row * width + column;
+                        if(input->data[offset] > max){
+                            max = input->data[offset];
+                            max_offset = offset;
+                        }
+                    }
+                }
+                size_t output_index = (plane * output_height + output_row) * output_width + output_column;
+                output->data[output_index] = max;
+                if(argmax != NULL){
+                    argmax[output_index] = max_offset;
+                }
+            }
+        }
+    }
+    return output;
+}
+
+tensor_t* tensor_max_pool2d_backwards_grad(tensor_t* input, tensor_t* output_grad, size_t* argmax){
+    tensor_t* grad = tensor_new_like(input);
+    for(size_t output_index = 0; output_index < output_grad->shape->size; output_index++){
+        grad->data[argmax[output_index]] += output_grad->data[output_index];
+    }
+    return grad;
+}
+
+// also computes the backward pass (input_grad += output_grad / window size) when output_grad is given
+static void avg_pool2d(tensor_t* input, tensor_t* output, const pool2d_params_t* params, tensor_t* output_grad, tensor_t* input_grad){
+    size_t height = input->shape->dims[2];
+    size_t width = input->shape->dims[3];
+    size_t output_height = (output_grad ? output_grad : output)->shape->dims[2];
+    size_t output_width = (output_grad ? output_grad : output)->shape->dims[3];
+    size_t num_planes = input->shape->dims[0] * input->shape->dims[1];
+    tensor_entry_t scale = 1 / (tensor_entry_t) (params->kernel_size[0] * params->kernel_size[1]);
+    for(size_t plane = 0; plane < num_planes; plane++){
+        size_t plane_offset = plane * height * width;
+        for(size_t output_row = 0; output_row < output_height; output_row++){
+            for(size_t output_column = 0; output_column < output_width; output_column++){
+                size_t row_start, row_end, column_start, column_end;
+                pool2d_window(params, height, width, output_row, output_column, &row_start, &row_end, &column_start, &column_end);
+                size_t output_index = (plane * output_height + output_row) * output_width + output_column;
+                if(output_grad != NULL){
+                    tensor_entry_t update = output_grad->data[output_index] * scale;
+                    for(size_t row = row_start; row < row_end; row++){
+                        for(size_t column = column_start; column < column_end; column++){
+                            input_grad->data[plane_offset + row * width + column] += update;
+                        }
+                    }
+                }else{
+                    tensor_entry_t sum = 0;
+                    for(size_t row = row_start; row < row_end; row++){
+                        for(size_t column = column_start; column < column_end; column++){
+                            sum += input->data[plane_offset + row * width + column];
+                        }
+                    }
+                    output->data[output_index] = sum * scale;
+                }
+            }
+        }
+    }
+}
+
+tensor_t* tensor_avg_pool2d(tensor_t* input, const pool2d_params_t* params){
+    tensor_t* output = pool2d_output_new(input, params);
+    avg_pool2d(input, output, params, NULL, NULL);
+    return output;
+}
+
+tensor_t* tensor_avg_pool2d_backwards_grad(tensor_t* input, tensor_t* output_grad, const pool2d_params_t* params){
+    tensor_t* grad = tensor_new_like(input);
+    avg_pool2d(input, NULL, params, output_grad, grad);
+    return grad;
+}
@@ -0,0 +1,40 @@
+#ifndef CONV_H
+#define CONV_H
+
+#include "tensor.h"
+
+// (height, width) pairs
+typedef struct {
+    size_t stride[2];
+    size_t padding[2];
+    size_t dilation[2];
+    size_t groups;
+} conv2d_params_t;
+
+typedef struct {
+    size_t kernel_size[2];
+    size_t stride[2];
+    size_t padding[2]; // at most half the kernel size, so that no window lies in the padding alone
+} pool2d_params_t;
+
+static inline conv2d_params_t conv2d_params_default(){
+    conv2d_params_t params = {{1, 1}, {0, 0}, {1, 1}, 1};
+    return params;
+}
+
+/**
+ * all tensors are NCHW: input (batch x in_channels x height x width),
+ * weight (out_channels x in_channels / groups x kernel_height x kernel_width), bias (out_channels) or NULL
+*/
+tensor_t* tensor_conv2d(tensor_t* input, tensor_t* weight, tensor_t* bias, const conv2d_params_t* params);
+// accumulates into input_grad, weight_grad, bias_grad (each may be NULL)
+void tensor_conv2d_backwards_grad(tensor_t* input, tensor_t* weight, tensor_t* output_grad, const conv2d_params_t* params, tensor_t* input_grad, tensor_t* weight_grad, tensor_t* bias_grad);
+
+// if argmax is not NULL, *argmax is set to a new array holding, for every output entry, the offset into input of the max
+tensor_t* tensor_max_pool2d(tensor_t* input, const pool2d_params_t* params, size_t** argmax);
+tensor_t* tensor_max_pool2d_backwards_grad(tensor_t* input, tensor_t* output_grad, size_t* argmax);
+// padding counts towards the window size
+tensor_t* tensor_avg_pool2d(tensor_t* input, const pool2d_params_t* params);
+tensor_t* tensor_avg_pool2d_backwards_grad(tensor_t* input, tensor_t* output_grad, const pool2d_params_t* params);
+
+#endif // CONV_H
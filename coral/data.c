@@ -0,0 +1,289 @@
+#include "data.h"
+#include "tensor.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * DATASET
+*/
+
+static size_t aligned_offset(size_t offset){
+    return (offset + DATASET_ALIGNMENT - 1) / DATASET_ALIGNMENT * DATASET_ALIGNMENT;
+}
+
+void dataset_save(const char* path, tensor_t* records){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(records) >= 1, "Dataset requires a leading record dimension!\n");
+    dataset_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+    header.num_records = records->shape->dims[0];
+    header.num_dims = TENSOR_NUM_DIMS(records) - 1;
+    for(int dim = 1; dim < TENSOR_NUM_DIMS(records); dim++){
+        header.dims[dim - 1] = records->shape->dims[dim];
+    }
+    header.data_offset = aligned_offset(sizeof(header));
+    FILE* file = fopen(path, "wb");
+    NDEBUG_ASSERT(file != NULL, "Could not open dataset file for writing!\n");
+    char padding[DATASET_ALIGNMENT] = {0};
+    size_t written = fwrite(&header, sizeof(header), 1, file);
+    written += fwrite(padding, 1, header.data_offset - sizeof(header), file) == header.data_offset - sizeof(header);
+    written += fwrite(records->data, sizeof(tensor_entry_t), records->shape->size, file) == records->shape->size;
+    bool closed = fclose(file) == 0;
+    NDEBUG_ASSERT(written == 3 && closed, "Could not write dataset file!\n");
+}
+
+dataset_t* dataset_open(const char* path){
+    int fd = open(path, O_RDONLY);
+    NDEBUG_ASSERT(fd >= 0, "Could not open dataset file!\n");
+    struct stat file_stat;
+    int error = fstat(fd, &file_stat);
+    NDEBUG_ASSERT(error == 0, "Could not stat dataset file!\n");
+    size_t mapping_size = (size_t) file_stat.st_size;
+    NDEBUG_ASSERT(mapping_size >= sizeof(dataset_header_t), "Dataset file is truncated!\n");
+    // private and writable: batches are plain tensors, and a write to one copies the page instead of faulting
+    void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    NDEBUG_ASSERT(mapping != MAP_FAILED, "Could not map dataset file!\n");
+    close(fd);
+    dataset_header_t* header = (dataset_header_t*) mapping;
+    NDEBUG_ASSERT(memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) == 0, "Not a dataset file!\n");
+    NDEBUG_ASSERT(header->num_dims <= DATASET_MAX_RECORD_DIMS, "Dataset records have too many dimensions!\n");
+    NDEBUG_ASSERT(header->data_offset == aligned_offset(header->data_offset), "Dataset records are misaligned!\n");
+    dataset_t* dataset = (dataset_t*) malloc(sizeof(dataset_t));
+    dataset->mapping = mapping;
+    dataset->mapping_size = mapping_size;
+    dataset->num_records = header->num_records;
+    dataset->record_num_dims = (int) header->num_dims;
+    dataset->record_size = 1;
+    for(int dim = 0; dim < dataset->record_num_dims; dim++){
+        dataset->record_dims[dim] = header->dims[dim];
+        dataset->record_size *= header->dims[dim];
+    }
+    size_t data_size = dataset->num_records * dataset->record_size * sizeof(tensor_entry_t);
+    NDEBUG_ASSERT(header->data_offset + data_size <= mapping_size, "Dataset file is truncated!\n");
+    dataset->records = (tensor_entry_t*) ((char*) mapping + header->data_offset);
+    return dataset;
+}
+
+void dataset_close(dataset_t* dataset){
+    munmap(dataset->mapping, dataset->mapping_size);
+    free(dataset);
+}
+
+/**
+ * LOADER THREAD
+*/
+
+static uint64_t splitmix64_next(uint64_t* state){
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Fisher-Yates, drawing from [0, i] by multiply-shift rather than modulo
+static void shuffle_permutation(size_t* permutation, size_t size, uint64_t* rng_state){
+    for(size_t i = size; i > 1; i--){
+        size_t j = (size_t) (((__uint128_t) splitmix64_next(rng_state) * i) >> 64);
+        size_t swap = permutation[i - 1];
+        permutation[i - 1] = permutation[j];
+        permutation[j] = swap;
+    }
+}
+
+// fault the pages of a run of records in from the loader thread, so the consumer does not stall on them
+static void prefetch_records(const tensor_entry_t* records, size_t size){
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) records / page_size * page_size;
+    uintptr_t end = (uintptr_t) (records + size);
+    if(end <= start){
+        return;
+    }
+    madvise((void*) start, end - start, MADV_WILLNEED);
+    for(uintptr_t page = start; page < end; page += page_size){
+        (void) *(const volatile char*) page;
+    }
+}
+
+// a batch holding the records [start, start + size) in loader order
+static void fill_slot(dataloader_t* loader, dataloader_slot_t* slot, size_t start, size_t size){
+    for(int index = 0; index < loader->num_datasets; index++){
+        dataset_t* dataset = loader->datasets[index];
+        tensor_t* batch = slot->batches[index];
+        batch->shape->dims[0] = size;
+        batch->shape->size = size * dataset->record_size;
+        if(!loader->shuffle){
+            batch->data = dataset->records + start * dataset->record_size;
+            prefetch_records(batch->data, batch->shape->size);
+            continue;
+        }
+        size_t record_bytes = dataset->record_size * sizeof(tensor_entry_t);
+        for(size_t record = 0; record < size; record++){
+            memcpy(slot->buffers[index] + record * dataset->record_size, dataset->records + loader->permutation[start + record] * dataset->record_size, record_bytes);
+        }
+    }
+    slot->size = size;
+}
+
+// waits for the next slot to be free and returns it, or NULL once the loader is stopping
+static dataloader_slot_t* acquire_free_slot(dataloader_t* loader){
+    dataloader_slot_t* slot = &loader->slots[loader->produced % DATALOADER_NUM_SLOTS];
+    pthread_mutex_lock(&loader->lock);
+    while(slot->ready && !loader->stop){
+        pthread_cond_wait(&loader->slot_free, &loader->lock);
+    }
+    bool stop = loader->stop;
+    pthread_mutex_unlock(&loader->lock);
+    return stop ? NULL : slot;
+}
+
+static void publish_slot(dataloader_t* loader, dataloader_slot_t* slot){
+    pthread_mutex_lock(&loader->lock);
+    slot->ready = true;
+    loader->produced++;
+    pthread_cond_signal(&loader->slot_ready);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+static void* dataloader_thread(void* arg){
+    dataloader_t* loader = (dataloader_t*) arg;
+    size_t num_records = loader->datasets[0]->num_records;
+    while(true){
+        if(loader->shuffle){
+            shuffle_permutation(loader->permutation, num_records, &loader->rng_state);
+        }
+        for(size_t start = 0; start < num_records; start += loader->batch_size){
+            dataloader_slot_t* slot = acquire_free_slot(loader);
+            if(slot == NULL){
+                return NULL;
+            }
+            fill_slot(loader, slot, start, MIN(loader->batch_size, num_records - start));
+            publish_slot(loader, slot);
+        }
+        dataloader_slot_t* end_of_epoch = acquire_free_slot(loader);
+        if(end_of_epoch == NULL){
+            return NULL;
+        }
+        end_of_epoch->size = 0;
+        publish_slot(loader, end_of_epoch);
+    }
+}
+
+/**
+ * LOADER
+*/
+
+static tensor_t* batch_tensor_new(dataset_t* dataset, size_t batch_size, tensor_entry_t* data){
+    size_t dims[TENSOR_MAX_DIMS];
+    dims[0] = batch_size;
+    for(int dim = 0; dim < dataset->record_num_dims; dim++){
+        dims[dim + 1] = dataset->record_dims[dim];
+    }
+    tensor_t* batch = (tensor_t*) malloc(sizeof(tensor_t));
+    batch->shape = shape_new(dataset->record_num_dims + 1, dims);
+    batch->data = data;
+    batch->storage = NULL;
+    return batch;
+}
+
+dataloader_t* dataloader_new(int num_datasets, dataset_t** datasets, size_t batch_size, bool shuffle, uint64_t seed){
+    NDEBUG_ASSERT(num_datasets > 0 && batch_size > 0, "Loader requires at least one dataset and a positive batch size!\n");
+    dataloader_t* loader = (dataloader_t*) malloc(sizeof(dataloader_t));
+    loader->num_datasets = num_datasets;
+    loader->datasets = (dataset_t**) malloc(num_datasets * sizeof(dataset_t*));
+    size_t num_records = datasets[0]->num_records;
+    for(int index = 0; index < num_datasets; index++){
+        NDEBUG_ASSERT(datasets[index]->num_records == num_records, "Datasets must have the same number of records!\n");
+        loader->datasets[index] = datasets[index];
+        // hint the kernel's readahead
+        madvise(datasets[index]->mapping, datasets[index]->mapping_size, shuffle ? MADV_RANDOM : MADV_SEQUENTIAL);
+    }
+    loader->batch_size = batch_size;
+    loader->shuffle = shuffle;
+    loader->rng_state = seed;
+    loader->permutation = NULL;
+    if(shuffle){
+        loader->permutation = (size_t*) malloc((num_records > 0 ? num_records : 1) * sizeof(size_t));
+        for(size_t record = 0; record < num_records; record++){
+            loader->permutation[record] = record;
+        }
+    }
+    for(int slot_index = 0; slot_index < DATALOADER_NUM_SLOTS; slot_index++){
+        dataloader_slot_t* slot = &loader->slots[slot_index];
+        slot->batches = (tensor_t**) malloc(num_datasets * sizeof(tensor_t*));
+        slot->buffers = (tensor_entry_t**) calloc(num_datasets, sizeof(tensor_entry_t*));
+        for(int index = 0; index < num_datasets; index++){
+            if(shuffle){
+                size_t buffer_bytes = MAX(batch_size * datasets[index]->record_size, (size_t) 1) * sizeof(tensor_entry_t);
+                int error = posix_memalign((void**) &slot->buffers[index], DATASET_ALIGNMENT, buffer_bytes);
+                NDEBUG_ASSERT(error == 0, "Could not allocate batch buffer!\n");
+            }
+            slot->batches[index] = batch_tensor_new(datasets[index], batch_size, slot->buffers[index]);
+        }
+        slot->size = 0;
+        slot->ready = false;
+    }
+    loader->produced = 0;
+    loader->consumed = 0;
+    loader->stop = false;
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->slot_ready, NULL);
+    pthread_cond_init(&loader->slot_free, NULL);
+    int error = pthread_create(&loader->thread, NULL, &dataloader_thread, loader);
+    NDEBUG_ASSERT(error == 0, "Could not start loader thread!\n");
+    return loader;
+}
+
+bool dataloader_next(dataloader_t* loader, tensor_t** batches){
+    pthread_mutex_lock(&loader->lock);
+    // the batch handed out by the previous call is done with: let the thread refill its slot
+    if(loader->consumed > 0){
+        loader->slots[(loader->consumed - 1) % DATALOADER_NUM_SLOTS].ready = false;
+        pthread_cond_signal(&loader->slot_free);
+    }
+    dataloader_slot_t* slot = &loader->slots[loader->consumed % DATALOADER_NUM_SLOTS];
+    while(!slot->ready){
+        pthread_cond_wait(&loader->slot_ready, &loader->lock);
+    }
+    loader->consumed++;
+    pthread_mutex_unlock(&loader->lock);
+    if(slot->size == 0){
+        return false;
+    }
+    for(int index = 0; index < loader->num_datasets; index++){
+        batches[index] = slot->batches[index];
+    }
+    return true;
+}
+
+void dataloader_free(dataloader_t* loader){
+    pthread_mutex_lock(&loader->lock);
+    loader->stop = true;
+    pthread_cond_broadcast(&loader->slot_free);
+    pthread_mutex_unlock(&loader->lock);
+    pthread_join(loader->thread, NULL);
+    for(int slot_index = 0; slot_index < DATALOADER_NUM_SLOTS; slot_index++){
+        dataloader_slot_t* slot = &loader->slots[slot_index];
+        for(int index = 0; index < loader->num_datasets; index++){
+            free(slot->batches[index]->shape->dims);
+            free(slot->batches[index]->shape->strides);
+            free(slot->batches[index]->shape);
+            free(slot->batches[index]);
+            free(slot->buffers[index]);
+        }
+        free(slot->batches);
+        free(slot->buffers);
+    }
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->slot_ready);
+    pthread_cond_destroy(&loader->slot_free);
+    free(loader->permutation);
+    free(loader->datasets);
+    free(loader);
+}
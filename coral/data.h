@@ -0,0 +1,88 @@
+#ifndef DATA_H
+#define DATA_H
+
+#include "tensor.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * DATASET FILE FORMAT
+ * a dataset_header_t, then num_records contiguous records of record_size floats (native byte order),
+ * starting at data_offset (a multiple of DATASET_ALIGNMENT, so the records are 64 byte aligned in the mapping)
+*/
+
+#define DATASET_MAGIC "CORALDS1"
+#define DATASET_ALIGNMENT 64
+#define DATASET_MAX_RECORD_DIMS (TENSOR_MAX_DIMS - 1)
+
+typedef struct {
+    char magic[8];
+    uint64_t num_records;
+    uint64_t num_dims; // dims of a single record
+    uint64_t dims[DATASET_MAX_RECORD_DIMS];
+    uint64_t data_offset;
+} dataset_header_t;
+
+typedef struct {
+    void* mapping;
+    size_t mapping_size;
+    size_t num_records;
+    int record_num_dims; // 0 for scalar records (e.g. class labels)
+    size_t record_dims[DATASET_MAX_RECORD_DIMS];
+    size_t record_size;
+    tensor_entry_t* records; // num_records x record_size, inside the mapping
+} dataset_t;
+
+// writes tensor (num_records x record dims...) as a dataset
+void dataset_save(const char* path, tensor_t* records);
+// mmaps the file: records are paged in on demand and never copied unless a batch needs gathering
+// the mapping is private, so writes to a zero-copy batch stay in memory and never reach the file
+dataset_t* dataset_open(const char* path);
+void dataset_close(dataset_t* dataset);
+
+/**
+ * PREFETCHING LOADER
+ * a background thread prepares the next batch while the current one is in use (double buffering)
+ * - in order, a batch is a contiguous run of records, so its tensor points straight into the mapping and
+ *   the thread only faults the pages of the next run in
+ * - shuffled, the thread gathers the records of the next batch (by a per epoch index permutation) into a buffer
+ * several datasets (e.g. inputs and targets) with the same number of records are batched in lockstep
+*/
+
+#define DATALOADER_NUM_SLOTS 2
+
+typedef struct {
+    tensor_t** batches; // one per dataset
+    tensor_entry_t** buffers; // gather buffers, one per dataset
+    size_t size; // number of records, 0 marks the end of an epoch
+    bool ready;
+} dataloader_slot_t;
+
+typedef struct {
+    int num_datasets;
+    dataset_t** datasets;
+    size_t batch_size;
+    bool shuffle;
+    uint64_t rng_state;
+    size_t* permutation;
+    dataloader_slot_t slots[DATALOADER_NUM_SLOTS];
+    size_t produced; // number of slots filled by the thread so far
+    size_t consumed; // number of slots handed out by dataloader_next so far
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_ready;
+    pthread_cond_t slot_free;
+} dataloader_t;
+
+dataloader_t* dataloader_new(int num_datasets, dataset_t** datasets, size_t batch_size, bool shuffle, uint64_t seed);
+/**
+ * sets batches[i] to the next batch of datasets[i] (batch_size x record dims..., smaller at the end of an epoch)
+ * and returns true, or returns false once at the end of every epoch
+ * the batches stay valid until the next call
+*/
+bool dataloader_next(dataloader_t* loader, tensor_t** batches);
+void dataloader_free(dataloader_t* loader);
+
+#endif // DATA_H
@@ -0,0 +1,151 @@
+#include "data_parallel.h"
+#include "nn.h"
+#include "grad.h"
+#include "parallel.h"
+#include "tensor.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdlib.h>
+
+// chunk boundaries fall on cache lines, so that no two workers write the same line of a gradient
+#define DATA_PARALLEL_CHUNK_ENTRIES (64 / sizeof(tensor_entry_t))
+
+data_parallel_t* data_parallel_new(module_t* model, int num_workers){
+    if(num_workers <= 0){
+        num_workers = parallel_num_cores();
+    }
+    data_parallel_t* runner = (data_parallel_t*) malloc(sizeof(data_parallel_t));
+    runner->num_workers = num_workers;
+    runner->model = model;
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        NDEBUG_ASSERT(model->params[param_index]->sparse_gradient == NULL, "Row sparse gradients are not reduced across workers!\n");
+    }
+    runner->replicas = (module_t**) malloc(num_workers * sizeof(module_t*));
+    for(int worker = 0; worker < num_workers; worker++){
+        runner->replicas[worker] = module_replicate(model);
+    }
+    runner->pool = thread_pool_new(num_workers);
+    runner->num_entries = 0;
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        runner->num_entries += model->params[param_index]->tensor->shape->size;
+    }
+    runner->losses = (tensor_entry_t*) calloc(num_workers, sizeof(tensor_entry_t));
+    runner->weights = (tensor_entry_t*) calloc(num_workers, sizeof(tensor_entry_t));
+    return runner;
+}
+
+/**
+ * FORWARD AND BACKWARD
+*/
+
+// rows [start, end) of tensor, without a copy
+static tensor_t* shard_view(tensor_t* tensor, size_t start, size_t end){
+    size_t dims[TENSOR_MAX_DIMS];
+    for(int dim = 0; dim < TENSOR_NUM_DIMS(tensor); dim++){
+        dims[dim] = tensor->shape->dims[dim];
+    }
+    dims[0] = end - start;
+    tensor_t* shard = (tensor_t*) malloc(sizeof(tensor_t));
+    shard->shape = shape_new(TENSOR_NUM_DIMS(tensor), dims);
+    shard->data = tensor->data + start * tensor->shape->strides[0];
+    shard->storage = NULL;
+    return shard;
+}
+
+static void forward_backward_task(void* arg, int thread_index, int num_threads){
+    data_parallel_t* runner = (data_parallel_t*) arg;
+    size_t batch_size = runner->batch[0]->shape->dims[0];
+    size_t start, end;
+    parallel_range(batch_size, thread_index, num_threads, &start, &end);
+    runner->weights[thread_index] = (tensor_entry_t) (end - start) / batch_size;
+    runner->losses[thread_index] = 0;
+    if(start == end){
+        return;
+    }
+    tensor_t* shard[runner->num_inputs];
+    for(int input_index = 0; input_index < runner->num_inputs; input_index++){
+        shard[input_index] = shard_view(runner->batch[input_index], start, end);
+    }
+    // the whole graph of the shard is released once its gradients have reached the replica's parameters
+    tensor_scope_t scope;
+    tensor_scope_begin(&scope);
+    variable_t* loss = (*runner->loss_fn)(runner->replicas[thread_index], shard, runner->context);
+    backwards(loss);
+    runner->losses[thread_index] = tensor_get_entry(loss->tensor, 0);
+    tensor_scope_end(&scope, 0, NULL);
+    for(int input_index = 0; input_index < runner->num_inputs; input_index++){
+        shape_free(shard[input_index]->shape);
+        free(shard[input_index]);
+    }
+}
+
+/**
+ * ALL-REDUCE
+*/
+
+// gradient[lo, hi) of the model's param_index-th parameter += the weighted sum of those of the replicas, which are zeroed
+static void reduce_range(data_parallel_t* runner, int param_index, size_t lo, size_t hi){
+    tensor_entry_t* restrict total = runner->model->params[param_index]->gradient->data + lo;
+    size_t size = hi - lo;
+    for(int worker = 0; worker < runner->num_workers; worker++){
+        tensor_entry_t weight = runner->weights[worker];
+        tensor_entry_t* restrict replica = runner->replicas[worker]->params[param_index]->gradient->data + lo;
+        for(size_t index = 0; index < size; index++){
+            total[index] += weight * replica[index];
+            replica[index] = 0;
+        }
+    }
+}
+
+// each worker reduces one contiguous chunk of the concatenation of all parameters
+static void reduce_task(void* arg, int thread_index, int num_threads){
+    data_parallel_t* runner = (data_parallel_t*) arg;
+    size_t num_lines = (runner->num_entries + DATA_PARALLEL_CHUNK_ENTRIES - 1) / DATA_PARALLEL_CHUNK_ENTRIES;
+    size_t start, end;
+    parallel_range(num_lines, thread_index, num_threads, &start, &end);
+    start *= DATA_PARALLEL_CHUNK_ENTRIES;
+    end = MIN(end * DATA_PARALLEL_CHUNK_ENTRIES, runner->num_entries);
+    size_t offset = 0;
+    for(int param_index = 0; param_index < runner->model->num_params && offset < end; param_index++){
+        size_t size = runner->model->params[param_index]->tensor->shape->size;
+        size_t lo = MAX(start, offset);
+        size_t hi = MIN(end, offset + size);
+        if(lo < hi){
+            reduce_range(runner, param_index, lo - offset, hi - offset);
+        }
+        offset += size;
+    }
+}
+
+tensor_entry_t data_parallel_step(data_parallel_t* runner, int num_inputs, tensor_t** batch, data_parallel_loss_fn_t loss_fn, void* context){
+    NDEBUG_ASSERT(num_inputs > 0, "Data parallel step needs a batch!\n");
+    for(int input_index = 1; input_index < num_inputs; input_index++){
+        NDEBUG_ASSERT(batch[input_index]->shape->dims[0] == batch[0]->shape->dims[0], "Batch tensors must have the same number of rows!\n");
+    }
+    runner->num_inputs = num_inputs;
+    runner->batch = batch;
+    runner->loss_fn = loss_fn;
+    runner->context = context;
+    thread_pool_run(runner->pool, &forward_backward_task, runner);
+    // the reduction writes gradients in place, so none may still share its buffer (see tensor_make_writable)
+    for(int param_index = 0; param_index < runner->model->num_params; param_index++){
+        tensor_make_writable(runner->model->params[param_index]->gradient);
+        for(int worker = 0; worker < runner->num_workers; worker++){
+            tensor_make_writable(runner->replicas[worker]->params[param_index]->gradient);
+        }
+    }
+    thread_pool_run(runner->pool, &reduce_task, runner);
+    tensor_entry_t loss = 0;
+    for(int worker = 0; worker < runner->num_workers; worker++){
+        loss += runner->weights[worker] * runner->losses[worker];
+    }
+    return loss;
+}
+
+void data_parallel_free(data_parallel_t* runner){
+    thread_pool_free(runner->pool);
+    free(runner->replicas);
+    free(runner->losses);
+    free(runner->weights);
+    free(runner);
+}
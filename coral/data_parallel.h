@@ -0,0 +1,44 @@
+#ifndef DATA_PARALLEL_H
+#define DATA_PARALLEL_H
+
+#include "nn.h"
+#include "parallel.h"
+#include "tensor.h"
+
+// builds the (scalar, mean over the shard) loss of replica on one shard of the mini-batch
+// shard[i] holds this worker's rows of batch[i]; everything it allocates is released after the step
+typedef variable_t* (* data_parallel_loss_fn_t)(module_t* replica, tensor_t** shard, void* context);
+
+/**
+ * DATA PARALLEL RUNNER
+ * every worker thread owns a replica of the model (see module_replicate), builds the graph of its shard
+ * of the mini-batch and backpropagates through it with no shared autograd state
+ * the replica gradients are then all-reduced into the gradients of the model: the parameter space is cut into
+ * one contiguous chunk per worker, and each worker sums its chunk over all replicas (zeroing them in the same pass)
+*/
+typedef struct {
+    int num_workers;
+    module_t* model;
+    module_t** replicas;
+    thread_pool_t* pool;
+    size_t num_entries; // over all parameters
+    // state of the current step
+    int num_inputs;
+    tensor_t** batch;
+    data_parallel_loss_fn_t loss_fn;
+    void* context;
+    tensor_entry_t* losses; // per worker
+    tensor_entry_t* weights; // per worker, shard size / batch size
+} data_parallel_t;
+
+// num_workers <= 0 for one per core
+data_parallel_t* data_parallel_new(module_t* model, int num_workers);
+/**
+ * splits every tensor of batch along its first dimension, one shard per worker, and accumulates the gradient
+ * of the mean loss over the whole batch into the gradients of the model's parameters
+ * returns that loss
+*/
+tensor_entry_t data_parallel_step(data_parallel_t* runner, int num_inputs, tensor_t** batch, data_parallel_loss_fn_t loss_fn, void* context);
+void data_parallel_free(data_parallel_t* runner);
+
+#endif // DATA_PARALLEL_H
@@ -0,0 +1,179 @@
+#include "distributed.h"
+#include "variable.h"
+#include "transport.h"
+#include "grad.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * COMMUNICATION THREAD
+*/
+
+// gradients in, sum over ranks, mean out
+static void reduce_bucket(distributed_t* distributed, gradient_bucket_t* bucket){
+    size_t offset = 0;
+    for(int index = 0; index < bucket->num_params; index++){
+        tensor_t* gradient = distributed->params[bucket->param_indices[index]]->gradient;
+        memcpy(bucket->buffer + offset, gradient->data, gradient->shape->size * sizeof(tensor_entry_t));
+        offset += gradient->shape->size;
+    }
+    transport_all_reduce(distributed->transport, bucket->buffer, bucket->size);
+    tensor_entry_t scale = (tensor_entry_t) 1 / distributed->transport->world_size;
+    offset = 0;
+    for(int index = 0; index < bucket->num_params; index++){
+        tensor_t* gradient = distributed->params[bucket->param_indices[index]]->gradient;
+        tensor_make_writable(gradient);
+        tensor_entry_t* restrict destination = gradient->data;
+        const tensor_entry_t* restrict source = bucket->buffer + offset;
+        for(size_t entry = 0; entry < gradient->shape->size; entry++){
+            destination[entry] = scale * source[entry];
+        }
+        offset += gradient->shape->size;
+    }
+}
+
+static void* distributed_thread(void* arg){
+    distributed_t* distributed = (distributed_t*) arg;
+    size_t step = 0;
+    pthread_mutex_lock(&distributed->lock);
+    while(true){
+        for(int bucket_index = 0; bucket_index < distributed->num_buckets; bucket_index++){
+            gradient_bucket_t* bucket = &distributed->buckets[bucket_index];
+            while(bucket->num_ready < bucket->num_params && !distributed->flushing && !distributed->stop){
+                pthread_cond_wait(&distributed->bucket_ready, &distributed->lock);
+            }
+            if(distributed->stop){
+                pthread_mutex_unlock(&distributed->lock);
+                return NULL;
+            }
+            pthread_mutex_unlock(&distributed->lock);
+            reduce_bucket(distributed, bucket);
+            pthread_mutex_lock(&distributed->lock);
+            distributed->num_reduced++;
+            pthread_cond_signal(&distributed->bucket_done);
+        }
+        // wait for distributed_finish to reset the buckets for the next step
+        while(distributed->step == step && !distributed->stop){
+            pthread_cond_wait(&distributed->bucket_ready, &distributed->lock);
+        }
+        step = distributed->step;
+    }
+}
+
+static void gradient_ready_hook(variable_t* variable, void* context){
+    UNUSED(variable);
+    gradient_hook_context_t* hook_context = (gradient_hook_context_t*) context;
+    distributed_t* distributed = hook_context->distributed;
+    gradient_bucket_t* bucket = &distributed->buckets[hook_context->bucket];
+    pthread_mutex_lock(&distributed->lock);
+    // its bucket may already be being reduced, which a second pass would race with
+    NDEBUG_ASSERT(!distributed->ready[hook_context->param], "A parameter was completed twice in a step!\n");
+    distributed->ready[hook_context->param] = true;
+    if(++bucket->num_ready == bucket->num_params){
+        pthread_cond_broadcast(&distributed->bucket_ready);
+    }
+    pthread_mutex_unlock(&distributed->lock);
+}
+
+/**
+ * CONSTRUCTOR
+*/
+
+distributed_t* distributed_new(transport_t* transport, int num_params, variable_t** params, size_t bucket_size){
+    NDEBUG_ASSERT(num_params > 0, "Nothing to distribute!\n");
+    distributed_t* distributed = (distributed_t*) malloc(sizeof(distributed_t));
+    distributed->transport = transport;
+    distributed->num_params = num_params;
+    distributed->params = (variable_t**) malloc(num_params * sizeof(variable_t*));
+    memcpy(distributed->params, params, num_params * sizeof(variable_t*));
+    // backwards completes the last parameters first, so buckets are filled from the end
+    distributed->buckets = (gradient_bucket_t*) calloc(num_params, sizeof(gradient_bucket_t));
+    distributed->hook_contexts = (gradient_hook_context_t*) malloc(num_params * sizeof(gradient_hook_context_t));
+    distributed->ready = (bool*) calloc(num_params, sizeof(bool));
+    int num_buckets = 0;
+    for(int param_index = num_params - 1; param_index >= 0; param_index--){
+        NDEBUG_ASSERT(params[param_index]->sparse_gradient == NULL, "Row sparse gradients are not reduced across ranks!\n");
+        NDEBUG_ASSERT(variable_requires_grad(params[param_index]), "Parameters which do not require grad are not reduced across ranks!\n");
+        size_t param_size = params[param_index]->gradient->shape->size;
+        gradient_bucket_t* bucket = &distributed->buckets[num_buckets > 0 ? num_buckets - 1 : 0];
+        if(num_buckets == 0 || (bucket->size > 0 && bucket->size + param_size > bucket_size)){
+            bucket = &distributed->buckets[num_buckets++];
+            bucket->param_indices = (int*) malloc(num_params * sizeof(int));
+        }
+        bucket->param_indices[bucket->num_params++] = param_index;
+        bucket->size += param_size;
+        distributed->hook_contexts[param_index].distributed = distributed;
+        distributed->hook_contexts[param_index].param = param_index;
+        distributed->hook_contexts[param_index].bucket = num_buckets - 1;
+        set_grad_hook(params[param_index], &gradient_ready_hook, &distributed->hook_contexts[param_index]);
+    }
+    distributed->num_buckets = num_buckets;
+    for(int bucket_index = 0; bucket_index < num_buckets; bucket_index++){
+        distributed->buckets[bucket_index].buffer = (tensor_entry_t*) malloc(distributed->buckets[bucket_index].size * sizeof(tensor_entry_t));
+    }
+    distributed->num_reduced = 0;
+    distributed->flushing = false;
+    distributed->step = 0;
+    distributed->stop = false;
+    pthread_mutex_init(&distributed->lock, NULL);
+    pthread_cond_init(&distributed->bucket_ready, NULL);
+    pthread_cond_init(&distributed->bucket_done, NULL);
+    int error = pthread_create(&distributed->thread, NULL, &distributed_thread, distributed);
+    NDEBUG_ASSERT(error == 0, "Could not start communication thread!\n");
+    return distributed;
+}
+
+// every rank but 0 contributes zeros, so the sum is rank 0's parameters
+void distributed_sync_params(distributed_t* distributed){
+    for(int param_index = 0; param_index < distributed->num_params; param_index++){
+        tensor_t* tensor = distributed->params[param_index]->tensor;
+        tensor_make_writable(tensor);
+        if(distributed->transport->rank != 0){
+            memset(tensor->data, 0, tensor->shape->size * sizeof(tensor_entry_t));
+        }
+        transport_all_reduce(distributed->transport, tensor->data, tensor->shape->size);
+    }
+}
+
+void distributed_finish(distributed_t* distributed){
+    pthread_mutex_lock(&distributed->lock);
+    distributed->flushing = true;
+    pthread_cond_broadcast(&distributed->bucket_ready);
+    while(distributed->num_reduced < distributed->num_buckets){
+        pthread_cond_wait(&distributed->bucket_done, &distributed->lock);
+    }
+    for(int bucket_index = 0; bucket_index < distributed->num_buckets; bucket_index++){
+        distributed->buckets[bucket_index].num_ready = 0;
+    }
+    memset(distributed->ready, 0, distributed->num_params * sizeof(bool));
+    distributed->num_reduced = 0;
+    distributed->flushing = false;
+    distributed->step++;
+    pthread_cond_broadcast(&distributed->bucket_ready);
+    pthread_mutex_unlock(&distributed->lock);
+}
+
+void distributed_free(distributed_t* distributed){
+    pthread_mutex_lock(&distributed->lock);
+    distributed->stop = true;
+    pthread_cond_broadcast(&distributed->bucket_ready);
+    pthread_mutex_unlock(&distributed->lock);
+    pthread_join(distributed->thread, NULL);
+    for(int param_index = 0; param_index < distributed->num_params; param_index++){
+        set_grad_hook(distributed->params[param_index], NULL, NULL);
+    }
+    for(int bucket_index = 0; bucket_index < distributed->num_buckets; bucket_index++){
+        free(distributed->buckets[bucket_index].param_indices);
+        free(distributed->buckets[bucket_index].buffer);
+    }
+    pthread_mutex_destroy(&distributed->lock);
+    pthread_cond_destroy(&distributed->bucket_ready);
+    pthread_cond_destroy(&distributed->bucket_done);
+    free(distributed->buckets);
+    free(distributed->hook_contexts);
+    free(distributed->ready);
+    free(distributed->params);
+    free(distributed);
+}
@@ -0,0 +1,64 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "variable.h"
+#include "transport.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * MULTI-PROCESS DATA PARALLEL
+ * every process (rank) runs the same model on its own shard of the data; the gradients of the parameters are
+ * averaged over all ranks through a transport, overlapped with backwards:
+ * - parameters are grouped into buckets of about bucket_size entries, in reverse order (the order backwards
+ *   completes them), so that few, large messages are sent
+ * - a grad hook marks a parameter done as soon as its ref_count reaches zero, and a full bucket is handed to a
+ *   communication thread, which reduces it while backwards carries on with the earlier layers
+ * - a parameter must be completed once per step (one backwards, then distributed_finish): one whose gradient is
+ *   accumulated in several passes, eg. used by two recomputed checkpoint segments, each replay of which completes
+ *   it, would be reduced before its last pass, so fails an assertion instead
+ * - buckets are always reduced in the same order, so every rank makes the same sequence of transport calls
+*/
+
+typedef struct {
+    int num_params;
+    int* param_indices;
+    size_t size;
+    tensor_entry_t* buffer;
+    int num_ready; // params of the bucket whose gradient is complete
+} gradient_bucket_t;
+
+typedef struct distributed distributed_t;
+
+typedef struct {
+    distributed_t* distributed;
+    int param;
+    int bucket;
+} gradient_hook_context_t;
+
+struct distributed {
+    transport_t* transport;
+    int num_params;
+    variable_t** params;
+    int num_buckets;
+    gradient_bucket_t* buckets;
+    gradient_hook_context_t* hook_contexts; // one per param
+    bool* ready; // per param, whether its gradient is complete in this step
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t bucket_ready;
+    pthread_cond_t bucket_done;
+    int num_reduced; // buckets reduced so far in this step
+    bool flushing; // every bucket counts as ready (for parameters backwards never reached)
+    size_t step;
+    bool stop;
+};
+
+distributed_t* distributed_new(transport_t* transport, int num_params, variable_t** params, size_t bucket_size);
+// sets the parameters of every rank to those of rank 0 (not during a step)
+void distributed_sync_params(distributed_t* distributed);
+// call after backwards: returns once every gradient holds its mean over all ranks
+void distributed_finish(distributed_t* distributed);
+void distributed_free(distributed_t* distributed);
+
+#endif // DISTRIBUTED_H
@@ -0,0 +1,217 @@
+#ifndef ELEMENTWISE_H
+#define ELEMENTWISE_H
+
+#include "tensor.h"
+#include "assert.h"
+#include "utils.h"
+#include "vmath.h"
+#include "perf.h"
+#include <stdbool.h>
+
+/**
+ * ELEMENTWISE KERNELS
+ * an op is defined once by an expression, and the macros below expand it into its own (monomorphic) loops, so the
+ * expression is inlined into them and they vectorize, unlike a loop calling a tensor_entry_binary_fn_t per entry
+ * (which the compiler cannot inline, even with -flto); the function pointer versions in tensor.h remain only as
+ * a generic fallback
+ *
+ * a user defined op gets the same code as a built in one, eg. in a header
+ *     ELEMENTWISE_DEFINE_BINARY(squared_difference, (a - b) * (a - b))
+ * defines elementwise_squared_difference(left, right) and elementwise_squared_difference_into(dest, left, right)
+*/
+
+// the built in ops, X(NAME, EXPRESSION): a binary op in terms of the left and right entries a and b, a unary op
+// in terms of the entry x; instantiated by tensor.c
+#define ELEMENTWISE_BINARY_OPS(X) \
+    X(add, a + b) \
+    X(subtract, a - b) \
+    X(multiply, a * b) \
+    X(divide, a / b)
+
+#define ELEMENTWISE_UNARY_OPS(X) \
+    X(abs, x >= 0 ? x : -x) \
+    X(abs_grad, x >= 0 ? 1 : -1) \
+    X(relu, x > 0 ? x : 0) \
+    X(sigmoid, vmath_sigmoidf(x)) \
+    X(tanh, vmath_tanhf(x)) \
+    X(gelu, vmath_geluf(x)) \
+    X(exp, vmath_expf(x)) \
+    X(log, vmath_logf(x))
+
+/**
+ * BROADCAST PLAN
+ * the operands of a broadcast are aligned on their last dimensions, and a dimension of length 1 (or a missing one)
+ * steps by 0; adjacent dimensions along which every operand is contiguous are merged, so that eg. two tensors of
+ * the same shape, or a tensor and a scalar, become a single loop, and a bias broadcast over rows becomes one
+ * contiguous row loop per row
+*/
+
+typedef struct {
+    int num_dims; // after merging, at least 1
+    size_t dims[TENSOR_MAX_DIMS];
+    size_t steps[3][TENSOR_MAX_DIMS]; // dest, left, right
+    size_t num_rows; // product of all but the last dimension
+} broadcast_plan_t;
+
+// dest must have the broadcast shape of left and right, except that it may be smaller (accumulate) when it is left
+static inline void broadcast_plan_init(broadcast_plan_t* plan, tensor_t* dest, tensor_t* left, tensor_t* right){
+    tensor_t* operands[3] = {dest, left, right};
+    int num_dims = MAX(TENSOR_NUM_DIMS(dest), MAX(TENSOR_NUM_DIMS(left), TENSOR_NUM_DIMS(right)));
+    plan->num_dims = 0;
+    plan->num_rows = 1;
+    for(int dim_index = 0; dim_index < num_dims; dim_index++){
+        size_t operand_dims[3];
+        size_t length = 1;
+        for(int operand = 0; operand < 3; operand++){
+            int operand_dim = dim_index - (num_dims - TENSOR_NUM_DIMS(operands[operand]));
+            operand_dims[operand] = operand_dim >= 0 ? operands[operand]->shape->dims[operand_dim] : 1;
+            length = MAX(length, operand_dims[operand]);
+        }
+        bool compatible = (operand_dims[1] == 1 || operand_dims[1] == length) && (operand_dims[2] == 1 || operand_dims[2] == length)
+            && (operand_dims[0] == length || (operand_dims[0] == 1 && dest->data == left->data));
+        NDEBUG_ASSERT(compatible, "Tensors are not broadcast compatible!\n");
+        if(length == 1){
+            continue;
+        }
+        size_t steps[3];
+        for(int operand = 0; operand < 3; operand++){
+            int operand_dim = dim_index - (num_dims - TENSOR_NUM_DIMS(operands[operand]));
+            steps[operand] = operand_dims[operand] > 1 ? operands[operand]->shape->strides[operand_dim] : 0;
+        }
+        int last = plan->num_dims - 1;
+        bool mergeable = last >= 0;
+        for(int operand = 0; operand < 3 && mergeable; operand++){
+            mergeable = plan->steps[operand][last] == steps[operand] * length;
+        }
+        if(mergeable){
+            plan->dims[last] *= length;
+        }else{
+            last = plan->num_dims++;
+            plan->dims[last] = length;
+        }
+        for(int operand = 0; operand < 3; operand++){
+            plan->steps[operand][last] = steps[operand];
+        }
+    }
+    if(plan->num_dims == 0){
+        plan->num_dims = 1;
+        plan->dims[0] = 1;
+        plan->steps[0][0] = plan->steps[1][0] = plan->steps[2][0] = 0;
+    }
+    for(int dim_index = 0; dim_index + 1 < plan->num_dims; dim_index++){
+        plan->num_rows *= plan->dims[dim_index];
+    }
+}
+
+// moves offsets to the start of the next row, counters holding the index along each outer dimension
+static inline void broadcast_plan_next_row(broadcast_plan_t* plan, size_t* counters, size_t* offsets){
+    for(int dim_index = plan->num_dims - 2; dim_index >= 0; dim_index--){
+        for(int operand = 0; operand < 3; operand++){
+            offsets[operand] += plan->steps[operand][dim_index];
+        }
+        if(++counters[dim_index] < plan->dims[dim_index]){
+            return;
+        }
+        counters[dim_index] = 0;
+        for(int operand = 0; operand < 3; operand++){
+            offsets[operand] -= plan->steps[operand][dim_index] * plan->dims[dim_index];
+        }
+    }
+}
+
+/**
+ * GENERATORS
+*/
+
+// elementwise_NAME_into(dest, left, right): dest <- EXPRESSION broadcast over left and right; dest may be left
+// elementwise_NAME(left, right): a new tensor of the broadcast shape
+// each row is one of five loops, by whether the operands step by 1 or 0 along it
+#define ELEMENTWISE_DEFINE_BINARY(NAME, EXPRESSION) \
+    static inline void elementwise_##NAME##_row(tensor_entry_t* dest, const tensor_entry_t* left, const tensor_entry_t* right, \
+                                                 size_t length, size_t dest_step, size_t left_step, size_t right_step){ \
+        if(dest_step == 1 && left_step == 1 && right_step == 1){ \
+            for(size_t index = 0; index < length; index++){ \
+                tensor_entry_t a = left[index]; \
+                tensor_entry_t b = right[index]; \
+                dest[index] = (EXPRESSION); \
+            } \
+        }else if(dest_step == 1 && left_step == 1 && right_step == 0){ \
+            tensor_entry_t b = right[0]; \
+            for(size_t index = 0; index < length; index++){ \
+                tensor_entry_t a = left[index]; \
+                dest[index] = (EXPRESSION); \
+            } \
+        }else if(dest_step == 1 && left_step == 0 && right_step == 1){ \
+            tensor_entry_t a = left[0]; \
+            for(size_t index = 0; index < length; index++){ \
+                tensor_entry_t b = right[index]; \
+                dest[index] = (EXPRESSION); \
+            } \
+        }else if(dest_step == 0 && left_step == 0 && dest == left){ \
+            /* accumulating into a single entry, eg. tensor_reduce_to_shape */ \
+            tensor_entry_t a = left[0]; \
+            for(size_t index = 0; index < length; index++){ \
+                tensor_entry_t b = right[index * right_step]; \
+                a = (EXPRESSION); \
+            } \
+            dest[0] = a; \
+        }else{ \
+            for(size_t index = 0; index < length; index++){ \
+                tensor_entry_t a = left[index * left_step]; \
+                tensor_entry_t b = right[index * right_step]; \
+                dest[index * dest_step] = (EXPRESSION); \
+            } \
+        } \
+    } \
+    static inline void elementwise_##NAME##_into(tensor_t* dest, tensor_t* left, tensor_t* right){ \
+        tensor_make_writable(dest); \
+        perf_scope_t perf_scope; \
+        perf_begin(&perf_scope, "broadcast " #NAME, NULL); \
+        broadcast_plan_t plan; \
+        broadcast_plan_init(&plan, dest, left, right); \
+        int last = plan.num_dims - 1; \
+        size_t counters[TENSOR_MAX_DIMS] = {0}; \
+        size_t offsets[3] = {0, 0, 0}; \
+        for(size_t row = 0; row < plan.num_rows; row++){ \
+            elementwise_##NAME##_row(dest->data + offsets[0], left->data + offsets[1], right->data + offsets[2], plan.dims[last], \
+                                     plan.steps[0][last], plan.steps[1][last], plan.steps[2][last]); \
+            broadcast_plan_next_row(&plan, counters, offsets); \
+        } \
+        perf_end(&perf_scope, dest->shape->size); \
+    } \
+    static inline tensor_t* elementwise_##NAME(tensor_t* left, tensor_t* right){ \
+        tensor_t* new_tensor = tensor_new(shape_get_broadcast_shape(left->shape, right->shape)); \
+        elementwise_##NAME##_into(new_tensor, left, right); \
+        return new_tensor; \
+    }
+
+// elementwise_NAME_into(dest, source): dest <- EXPRESSION of the same shaped source; dest may be source
+// elementwise_NAME(source): a new tensor
+// a fill source (see tensor.h) is read once
+#define ELEMENTWISE_DEFINE_UNARY(NAME, EXPRESSION) \
+    static inline void elementwise_##NAME##_into(tensor_t* dest, tensor_t* source){ \
+        NDEBUG_ASSERT(shape_equal(dest->shape, source->shape), "Destination tensor has improper shape!\n"); \
+        tensor_make_writable(dest); \
+        size_t tensor_size = source->shape->size; \
+        const tensor_entry_t* source_data = source->data; \
+        tensor_entry_t* dest_data = dest->data; \
+        if(tensor_is_fill(source)){ \
+            tensor_entry_t x = source_data[0]; \
+            tensor_entry_t value = (EXPRESSION); \
+            for(size_t index = 0; index < tensor_size; index++){ \
+                dest_data[index] = value; \
+            } \
+            return; \
+        } \
+        for(size_t index = 0; index < tensor_size; index++){ \
+            tensor_entry_t x = source_data[index]; \
+            dest_data[index] = (EXPRESSION); \
+        } \
+    } \
+    static inline tensor_t* elementwise_##NAME(tensor_t* source){ \
+        tensor_t* new_tensor = tensor_new_like(source); \
+        elementwise_##NAME##_into(new_tensor, source); \
+        return new_tensor; \
+    }
+
+#endif // ELEMENTWISE_H
@@ -0,0 +1,326 @@
+#include "gemm.h"
+#include "tensor.h"
+#include "assert.h"
+#include "vmath.h"
+#include "tune.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GEMM_ALIGNMENT 64
+
+// cache blocking: a block_m x block_k panel of a and a block_k x block_n panel of b are packed into
+// contiguous buffers, so that the inner loops stream through memory with unit stride
+// these are the defaults, for shapes without tuned block sizes
+static size_t gemm_block_m = 64;
+static size_t gemm_block_k = 256;
+static size_t gemm_block_n = 1024;
+
+// multiply-adds below which the block sizes are not looked up (nor tuned): every block covers the whole shape
+#define GEMM_TUNE_MIN_WORK ((size_t) 1 << 18)
+
+static inline size_t min_size(size_t left, size_t right){
+    return left < right ? left : right;
+}
+
+static tensor_entry_t* packed_buffer_new(size_t size){
+    tensor_entry_t* buffer;
+    int error = posix_memalign((void**) &buffer, GEMM_ALIGNMENT, (size > 0 ? size : 1) * sizeof(tensor_entry_t));
+    NDEBUG_ASSERT(error == 0, "Could not allocate gemm buffer!\n");
+    return buffer;
+}
+
+/**
+ * PACKING
+*/
+
+// packed_a[i * kb + p] = a[row + i, column + p]
+static void pack_a(size_t mb, size_t kb, const tensor_entry_t* a, size_t row_stride, size_t column_stride, tensor_entry_t* restrict packed_a){
+    for(size_t i = 0; i < mb; i++){
+        for(size_t p = 0; p < kb; p++){
+            packed_a[i * kb + p] = a[i * row_stride + p * column_stride];
+        }
+    }
+}
+
+// packed_b[p * nb + j] = b[row + p, column + j]
+static void pack_b(size_t kb, size_t nb, const tensor_entry_t* b, size_t row_stride, size_t column_stride, tensor_entry_t* restrict packed_b){
+    for(size_t p = 0; p < kb; p++){
+        if(column_stride == 1){
+            memcpy(packed_b + p * nb, b + p * row_stride, nb * sizeof(tensor_entry_t));
+            continue;
+        }
+        for(size_t j = 0; j < nb; j++){
+            packed_b[p * nb + j] = b[p * row_stride + j * column_stride];
+        }
+    }
+}
+
+/**
+ * KERNELS
+*/
+
+// c (mb x nb) += packed_a (mb x kb) * packed_b (kb x nb)
+// four rows of c are updated per sweep over packed_b so that every load of b is reused four times
+static void macro_kernel(size_t mb, size_t nb, size_t kb, const tensor_entry_t* restrict packed_a, const tensor_entry_t* restrict packed_b, tensor_entry_t* c, size_t c_row_stride){
+    size_t i = 0;
+    for(; i + 4 <= mb; i += 4){
+        tensor_entry_t* restrict c0 = c + (i + 0) * c_row_stride;
+        tensor_entry_t* restrict c1 = c + (i + 1) * c_row_stride;
+        tensor_entry_t* restrict c2 = c + (i + 2) * c_row_stride;
+        tensor_entry_t* restrict c3 = c + (i + 3) * c_row_stride;
+        for(size_t p = 0; p < kb; p++){
+            tensor_entry_t a0 = packed_a[(i + 0) * kb + p];
+            tensor_entry_t a1 = packed_a[(i + 1) * kb + p];
+            tensor_entry_t a2 = packed_a[(i + 2) * kb + p];
+            tensor_entry_t a3 = packed_a[(i + 3) * kb + p];
+            const tensor_entry_t* restrict b_row = packed_b + p * nb;
+            for(size_t j = 0; j < nb; j++){
+                c0[j] += a0 * b_row[j];
+                c1[j] += a1 * b_row[j];
+                c2[j] += a2 * b_row[j];
+                c3[j] += a3 * b_row[j];
+            }
+        }
+    }
+    for(; i < mb; i++){
+        tensor_entry_t* restrict c_row = c + i * c_row_stride;
+        for(size_t p = 0; p < kb; p++){
+            tensor_entry_t a_entry = packed_a[i * kb + p];
+            const tensor_entry_t* restrict b_row = packed_b + p * nb;
+            for(size_t j = 0; j < nb; j++){
+                c_row[j] += a_entry * b_row[j];
+            }
+        }
+    }
+}
+
+// c (mb x nb) <- activation(c + bias)
+static void apply_epilogue(size_t mb, size_t nb, tensor_entry_t* c, size_t c_row_stride, const tensor_entry_t* bias, activation_t activation){
+    for(size_t i = 0; i < mb; i++){
+        tensor_entry_t* restrict c_row = c + i * c_row_stride;
+        if(bias != NULL){
+            for(size_t j = 0; j < nb; j++){
+                c_row[j] += bias[j];
+            }
+        }
+        switch(activation){
+            case ACTIVATION_NONE:
+                break;
+            case ACTIVATION_RELU:
+                for(size_t j = 0; j < nb; j++){
+                    c_row[j] = c_row[j] > 0 ? c_row[j] : 0;
+                }
+                break;
+            case ACTIVATION_SIGMOID:
+                for(size_t j = 0; j < nb; j++){
+                    c_row[j] = vmath_sigmoidf(c_row[j]);
+                }
+                break;
+            case ACTIVATION_TANH:
+                for(size_t j = 0; j < nb; j++){
+                    c_row[j] = vmath_tanhf(c_row[j]);
+                }
+                break;
+            default:
+                NDEBUG_ASSERT(0, "Unknown activation!\n");
+        }
+    }
+}
+
+void gemm_epilogue_apply(size_t m, size_t n, tensor_entry_t* c, size_t c_row_stride, const gemm_epilogue_t* epilogue){
+    apply_epilogue(m, n, c, c_row_stride, epilogue->bias, epilogue->activation);
+}
+
+/**
+ * GEMM
+*/
+
+static void gemm_blocked(size_t m, size_t n, size_t k, const size_t* blocks,
+    const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride,
+    const tensor_entry_t* b, size_t b_row_stride, size_t b_column_stride,
+    tensor_entry_t* c, size_t c_row_stride, bool accumulate, const gemm_epilogue_t* epilogue){
+    NDEBUG_ASSERT(!(accumulate && epilogue != NULL), "Cannot apply an epilogue to an accumulating gemm!\n");
+    if(!accumulate){
+        for(size_t i = 0; i < m; i++){
+            memset(c + i * c_row_stride, 0, n * sizeof(tensor_entry_t));
+        }
+    }
+    size_t block_m = min_size(blocks[0], m);
+    size_t block_k = min_size(blocks[1], k);
+    size_t block_n = min_size(blocks[2], n);
+    tensor_entry_t* packed_a = packed_buffer_new(block_m * block_k);
+    tensor_entry_t* packed_b = packed_buffer_new(block_k * block_n);
+    for(size_t jc = 0; jc < n; jc += block_n){
+        size_t nb = min_size(block_n, n - jc);
+        for(size_t pc = 0; pc < k; pc += block_k){
+            size_t kb = min_size(block_k, k - pc);
+            bool last_k_block = (pc + kb == k);
+            pack_b(kb, nb, b + pc * b_row_stride + jc * b_column_stride, b_row_stride, b_column_stride, packed_b);
+            for(size_t ic = 0; ic < m; ic += block_m){
+                size_t mb = min_size(block_m, m - ic);
+                pack_a(mb, kb, a + ic * a_row_stride + pc * a_column_stride, a_row_stride, a_column_stride, packed_a);
+                tensor_entry_t* c_tile = c + ic * c_row_stride + jc;
+                macro_kernel(mb, nb, kb, packed_a, packed_b, c_tile, c_row_stride);
+                // the tile has seen all of k: finish it while it is still in cache
+                if(last_k_block && epilogue != NULL){
+                    apply_epilogue(mb, nb, c_tile, c_row_stride, epilogue->bias ? epilogue->bias + jc : NULL, epilogue->activation);
+                }
+            }
+        }
+        if(k == 0 && epilogue != NULL){
+            apply_epilogue(m, nb, c + jc, c_row_stride, epilogue->bias ? epilogue->bias + jc : NULL, epilogue->activation);
+        }
+    }
+    free(packed_a);
+    free(packed_b);
+}
+
+void gemm_tune_key(char* key, size_t m, size_t n, size_t k, gemm_layout_t a_layout, gemm_layout_t b_layout){
+    static const char layout_names[] = {'r', 'c', 's'};
+    snprintf(key, TUNE_KEY_BYTES, "gemm %zu %zu %zu %c%c", m, n, k, layout_names[a_layout], layout_names[b_layout]);
+}
+
+// [block_m, block_k, block_n] for an m x n x k gemm of operands so laid out
+static void gemm_blocks(size_t m, size_t n, size_t k, gemm_layout_t a_layout, gemm_layout_t b_layout, size_t* blocks){
+    blocks[0] = gemm_block_m;
+    blocks[1] = gemm_block_k;
+    blocks[2] = gemm_block_n;
+    if(m * n * k < GEMM_TUNE_MIN_WORK){
+        return;
+    }
+    char key[TUNE_KEY_BYTES];
+    gemm_tune_key(key, m, n, k, a_layout, b_layout);
+    if(!tune_lookup(key, 3, blocks) && tune_is_online() && tune_claim(key)){
+        gemm_tune(m, n, k, a_layout, b_layout);
+        tune_lookup(key, 3, blocks);
+        tune_save_at_exit();
+    }
+}
+
+void gemm(size_t m, size_t n, size_t k,
+    const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride,
+    const tensor_entry_t* b, size_t b_row_stride, size_t b_column_stride,
+    tensor_entry_t* c, size_t c_row_stride, bool accumulate, const gemm_epilogue_t* epilogue){
+    size_t blocks[3];
+    gemm_blocks(m, n, k, gemm_layout(a_row_stride, a_column_stride), gemm_layout(b_row_stride, b_column_stride), blocks);
+    gemm_blocked(m, n, k, blocks, a, a_row_stride, a_column_stride, b, b_row_stride, b_column_stride, c, c_row_stride, accumulate, epilogue);
+}
+
+/**
+ * TUNING
+ * every combination of the candidate block sizes (clipped to the shape, so that combinations which clip to the
+ * same blocks run once) is timed on operands of the shape and layouts
+*/
+
+static const size_t tune_blocks_m[] = {32, 64, 128};
+static const size_t tune_blocks_k[] = {128, 256, 512};
+static const size_t tune_blocks_n[] = {256, 1024, 4096};
+
+typedef struct {
+    size_t m, n, k;
+    const size_t* blocks;
+    const tensor_entry_t* a;
+    size_t a_strides[2];
+    const tensor_entry_t* b;
+    size_t b_strides[2];
+    tensor_entry_t* c;
+} tune_run_t;
+
+static void tune_run(void* context){
+    tune_run_t* run = (tune_run_t*) context;
+    gemm_blocked(run->m, run->n, run->k, run->blocks, run->a, run->a_strides[0], run->a_strides[1],
+                 run->b, run->b_strides[0], run->b_strides[1], run->c, run->n, false, NULL);
+}
+
+// (row, column) strides of a rows x columns operand so laid out; a strided one every other entry of a row major one
+static void layout_strides(gemm_layout_t layout, size_t rows, size_t columns, size_t* strides){
+    strides[0] = layout == GEMM_LAYOUT_ROWS ? columns : layout == GEMM_LAYOUT_COLUMNS ? 1 : 2 * columns;
+    strides[1] = layout == GEMM_LAYOUT_ROWS ? 1 : layout == GEMM_LAYOUT_COLUMNS ? rows : 2;
+}
+
+// an operand of rows x columns ones, so laid out
+static tensor_entry_t* tune_operand_new(gemm_layout_t layout, size_t rows, size_t columns){
+    size_t size = (layout == GEMM_LAYOUT_STRIDED ? 2 : 1) * rows * columns;
+    tensor_entry_t* operand = packed_buffer_new(size);
+    for(size_t index = 0; index < size; index++){
+        operand[index] = 1;
+    }
+    return operand;
+}
+
+void gemm_tune(size_t m, size_t n, size_t k, gemm_layout_t a_layout, gemm_layout_t b_layout){
+    tensor_entry_t* a = tune_operand_new(a_layout, m, k);
+    tensor_entry_t* b = tune_operand_new(b_layout, k, n);
+    tensor_entry_t* c = packed_buffer_new(m * n);
+    size_t a_strides[2], b_strides[2];
+    layout_strides(a_layout, m, k, a_strides);
+    layout_strides(b_layout, k, n, b_strides);
+    size_t best_blocks[3] = {gemm_block_m, gemm_block_k, gemm_block_n};
+    double best_time = 1e30;
+    size_t num_m = sizeof(tune_blocks_m) / sizeof(size_t);
+    size_t num_k = sizeof(tune_blocks_k) / sizeof(size_t);
+    size_t num_n = sizeof(tune_blocks_n) / sizeof(size_t);
+    for(size_t index_m = 0; index_m < num_m; index_m++){
+        for(size_t index_k = 0; index_k < num_k; index_k++){
+            for(size_t index_n = 0; index_n < num_n; index_n++){
+                // a smaller candidate already covered the whole dimension
+                bool clipped = (index_m > 0 && tune_blocks_m[index_m - 1] >= m) || (index_k > 0 && tune_blocks_k[index_k - 1] >= k)
+                    || (index_n > 0 && tune_blocks_n[index_n - 1] >= n);
+                if(clipped){
+                    continue;
+                }
+                size_t blocks[3] = {tune_blocks_m[index_m], tune_blocks_k[index_k], tune_blocks_n[index_n]};
+                tune_run_t run = {m, n, k, blocks, a, {a_strides[0], a_strides[1]}, b, {b_strides[0], b_strides[1]}, c};
+                double time = tune_time(&tune_run, &run, 2);
+                if(time < best_time){
+                    best_time = time;
+                    memcpy(best_blocks, blocks, sizeof(best_blocks));
+                }
+            }
+        }
+    }
+    char key[TUNE_KEY_BYTES];
+    gemm_tune_key(key, m, n, k, a_layout, b_layout);
+    tune_store(key, 3, best_blocks);
+    free(a);
+    free(b);
+    free(c);
+}
+
+void gemm_epilogue_backwards(size_t m, size_t n, const tensor_entry_t* output, tensor_entry_t* output_grad, activation_t activation, tensor_entry_t* bias_grad){
+    if(bias_grad != NULL){
+        memset(bias_grad, 0, n * sizeof(tensor_entry_t));
+    }
+    for(size_t i = 0; i < m; i++){
+        const tensor_entry_t* restrict y = output + i * n;
+        tensor_entry_t* restrict g = output_grad + i * n;
+        switch(activation){
+            case ACTIVATION_NONE:
+                break;
+            case ACTIVATION_RELU:
+                for(size_t j = 0; j < n; j++){
+                    g[j] = y[j] > 0 ? g[j] : 0;
+                }
+                break;
+            case ACTIVATION_SIGMOID:
+                for(size_t j = 0; j < n; j++){
+                    g[j] *= y[j] * (1 - y[j]);
+                }
+                break;
+            case ACTIVATION_TANH:
+                for(size_t j = 0; j < n; j++){
+                    g[j] *= 1 - y[j] * y[j];
+                }
+                break;
+            default:
+                NDEBUG_ASSERT(0, "Unknown activation!\n");
+        }
+        // the row of g is still in L1 here
+        if(bias_grad != NULL){
+            for(size_t j = 0; j < n; j++){
+                bias_grad[j] += g[j];
+            }
+        }
+    }
+}
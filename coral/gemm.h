@@ -0,0 +1,52 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "tensor.h"
+#include <stdbool.h>
+
+// applied to each output tile of a gemm as soon as it is complete, while it is still in cache
+// output <- activation(output + bias), with bias broadcast along the rows
+typedef struct {
+    const tensor_entry_t* bias; // length n, or NULL
+    activation_t activation;
+} gemm_epilogue_t;
+
+/**
+ * c <- a * b (or c <- c + a * b if accumulate) where a is m x k, b is k x n and c is m x n
+ * a and b are given by (row, column) strides so that transposed operands need no copy
+ * c is row major with rows c_row_stride apart
+ * epilogue may be NULL, and may only be used when not accumulating
+*/
+void gemm(size_t m, size_t n, size_t k,
+    const tensor_entry_t* a, size_t a_row_stride, size_t a_column_stride,
+    const tensor_entry_t* b, size_t b_row_stride, size_t b_column_stride,
+    tensor_entry_t* c, size_t c_row_stride, bool accumulate, const gemm_epilogue_t* epilogue);
+
+// the layout of an operand, on which the best blocking depends, as packing reads it along its rows or columns
+typedef enum {
+    GEMM_LAYOUT_ROWS, // row major: column stride 1
+    GEMM_LAYOUT_COLUMNS, // column major (eg. a transposed operand): row stride 1
+    GEMM_LAYOUT_STRIDED, // neither
+} gemm_layout_t;
+
+static inline gemm_layout_t gemm_layout(size_t row_stride, size_t column_stride){
+    return column_stride == 1 ? GEMM_LAYOUT_ROWS : row_stride == 1 ? GEMM_LAYOUT_COLUMNS : GEMM_LAYOUT_STRIDED;
+}
+
+// "gemm m n k <a><b>", the layouts as r, c or s (see tune.h)
+void gemm_tune_key(char* key, size_t m, size_t n, size_t k, gemm_layout_t a_layout, gemm_layout_t b_layout);
+// benchmarks candidate cache block sizes for an m x n x k gemm of operands so laid out, and stores the fastest
+// gemm uses tuned block sizes for shapes of at least 2^18 multiply-adds, and tunes unseen ones itself when online
+void gemm_tune(size_t m, size_t n, size_t k, gemm_layout_t a_layout, gemm_layout_t b_layout);
+
+// applies epilogue to an m x n output, for kernels other than gemm which share its epilogue
+void gemm_epilogue_apply(size_t m, size_t n, tensor_entry_t* c, size_t c_row_stride, const gemm_epilogue_t* epilogue);
+
+/**
+ * backward of the gemm epilogue for an m x n output
+ * output_grad <- output_grad * activation'(output), computed from the saved output, and
+ * bias_grad (length n, or NULL) <- column sums of the result, in the same pass
+*/
+void gemm_epilogue_backwards(size_t m, size_t n, const tensor_entry_t* output, tensor_entry_t* output_grad, activation_t activation, tensor_entry_t* bias_grad);
+
+#endif // GEMM_H
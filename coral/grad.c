@@ -1,26 +1,52 @@
 #include "grad.h"
 #include "variable.h"
 #include "assert.h"
+#include "rng.h"
+#include "perf.h"
 
+// atomic, so that graphs built concurrently on different threads may share leaves (eg. constants)
+// NOTE: gradients of shared leaves are still accumulated without synchronization
 static inline void increment_ref_count(variable_t* variable){
-    variable->grad_meta->ref_count++;
+    __atomic_fetch_add(&variable->grad_meta->ref_count, 1, __ATOMIC_RELAXED);
 }
 
 static inline void decrement_ref_count(variable_t* variable){
-    variable->grad_meta->ref_count--;
+    __atomic_fetch_sub(&variable->grad_meta->ref_count, 1, __ATOMIC_RELAXED);
 }
 
 static inline int get_ref_count(variable_t* variable){
-    return variable->grad_meta->ref_count;
+    return __atomic_load_n(&variable->grad_meta->ref_count, __ATOMIC_RELAXED);
+}
+
+// the gradient of an op output is allocated (zeroed) only once it requires grad or is accumulated into
+static void ensure_gradient(variable_t* variable){
+    if(variable->gradient == NULL){
+        NDEBUG_ASSERT(variable->sparse_gradient == NULL, "Variable with a row sparse gradient can only be used through variable_index_select!\n");
+        variable->gradient = tensor_new_zeros_like(variable->tensor);
+    }
+}
+
+// adds update, reduced to the shape of the gradient, into the gradient of variable
+// an update of the same shape (which may be a fill tensor) is added as it is, in a single pass
+static void accumulate_gradient(variable_t* variable, tensor_t* gradient_update){
+    ensure_gradient(variable);
+    if(shape_equal(gradient_update->shape, variable->gradient->shape)){
+        tensor_in_place_add(variable->gradient, gradient_update);
+        return;
+    }
+    tensor_t* reduced_gradient_update = tensor_reduce_to_shape(gradient_update, variable->gradient->shape);
+    tensor_in_place_add(variable->gradient, reduced_gradient_update);
 }
 
 // propogate gradient update from output into input
 // here, output = fn(input)
 static void update_unary_grad(input_t* input, variable_t* output){
     variable_unary_grad_op_t gradient_fn = (variable_unary_grad_op_t) (input->grad_op);
+    perf_scope_t perf_scope;
+    perf_begin(&perf_scope, NULL, (const void*) gradient_fn);
     tensor_t* gradient_update = (*gradient_fn)(input->variable, output);
-    tensor_t* reduced_gradient_update = tensor_reduce_to_shape(gradient_update, input->variable->gradient->shape);
-    tensor_in_place_add(input->variable->gradient, reduced_gradient_update);
+    perf_end(&perf_scope, output->tensor->shape->size);
+    accumulate_gradient(input->variable, gradient_update);
     decrement_ref_count(input->variable);
 }
 
@@ -28,18 +54,59 @@ static void update_unary_grad(input_t* input, variable_t* output){
 // here, output = fn(input, other_input)
 static void update_binary_grad(input_t* input, input_t* other_input, variable_t* output){
     variable_binary_grad_op_t gradient_fn = (variable_binary_grad_op_t) (input->grad_op);
+    perf_scope_t perf_scope;
+    perf_begin(&perf_scope, NULL, (const void*) gradient_fn);
     tensor_t* gradient_update = (*gradient_fn)(input->variable, other_input->variable, output);
-    tensor_t* reduced_gradient_update = tensor_reduce_to_shape(gradient_update, input->variable->gradient->shape);
-    printf("REDUCED GRADIENT:\n\n");
-    tensor_display(reduced_gradient_update);
-    tensor_in_place_add(input->variable->gradient, reduced_gradient_update);
+    perf_end(&perf_scope, output->tensor->shape->size);
+    accumulate_gradient(input->variable, gradient_update);
     decrement_ref_count(input->variable);
 }
 
+// propogate gradient updates from output into all of its inputs at once
+// here, output = fn(input_1, ..., input_n), and the op computes every update in a single call
+static void update_fused_grads(variable_t* output){
+    grad_meta_t* grad_meta = output->grad_meta;
+    tensor_t* gradient_updates[GRAD_META_MAX_INPUTS] = {NULL};
+    perf_scope_t perf_scope;
+    perf_begin(&perf_scope, NULL, (const void*) grad_meta->fused_grad_op);
+    (*grad_meta->fused_grad_op)(output, gradient_updates);
+    perf_end(&perf_scope, output->tensor->shape->size);
+    for(int input_index = 0; input_index < grad_meta->num_inputs; input_index++){
+        variable_t* input = grad_meta->inputs[input_index]->variable;
+        if(!variable_requires_grad(input)){
+            continue;
+        }
+        if(gradient_updates[input_index] != NULL){
+            accumulate_gradient(input, gradient_updates[input_index]);
+        }
+        decrement_ref_count(input);
+    }
+}
+
 // accumulate gradient updates into argument gradients
 static inline void update_binary_grads(input_t* left_input, input_t* right_input, variable_t* output){
-    update_binary_grad(left_input, right_input, output);
-    update_binary_grad(right_input, left_input, output);
+    if(variable_requires_grad(left_input->variable)){
+        update_binary_grad(left_input, right_input, output);
+    }
+    if(variable_requires_grad(right_input->variable)){
+        update_binary_grad(right_input, left_input, output);
+    }
+}
+
+// inputs which do not require grad were never counted, and are never visited
+static inline bool ready_for_backwards(variable_t* variable){
+    return variable_requires_grad(variable) && get_ref_count(variable) == 0;
+}
+
+// true iff the variable at input_index is also an earlier input of the same node
+// (so that a node is never recursed into twice)
+static inline bool appears_in_earlier_input(grad_meta_t* grad_meta, int input_index){
+    for(int earlier_index = 0; earlier_index < input_index; earlier_index++){
+        if(grad_meta->inputs[earlier_index]->variable == grad_meta->inputs[input_index]->variable){
+            return true;
+        }
+    }
+    return false;
 }
 
 // accumulates gradient update into argument(s') gradient
@@ -47,20 +114,36 @@ static inline void update_binary_grads(input_t* left_input, input_t* right_input
 // so as recurse in a way that respects gradient
 // graph's topological ordering
 static void actual_backwards(variable_t* root){
-    if(root->grad_meta->num_inputs == 1){
+    grad_meta_t* grad_meta = root->grad_meta;
+    for(int saved_index = 0; saved_index < grad_meta->num_saved; saved_index++){
+        bool unchanged = tensor_version(grad_meta->saved[saved_index]) == grad_meta->saved_versions[saved_index];
+        NDEBUG_ASSERT(unchanged, "A tensor needed for backwards has been modified by an in place operation!\n");
+    }
+    if(root->grad_meta->grad_hook != NULL){
+        (*root->grad_meta->grad_hook)(root, root->grad_meta->grad_hook_context);
+    }
+    if(root->grad_meta->fused_grad_op != NULL){
+        update_fused_grads(root);
+        for(int input_index = 0; input_index < root->grad_meta->num_inputs; input_index++){
+            variable_t* input = root->grad_meta->inputs[input_index]->variable;
+            if(ready_for_backwards(input) && !appears_in_earlier_input(root->grad_meta, input_index)){
+                actual_backwards(input);
+            }
+        }
+    }else if(root->grad_meta->num_inputs == 1){
         input_t* input = root->grad_meta->inputs[0];
         update_unary_grad(input, root);
-        if(get_ref_count(input->variable) == 0){
+        if(ready_for_backwards(input->variable)){
             actual_backwards(input->variable);
-        } 
+        }
     }else if(root->grad_meta->num_inputs == 2){
         input_t* input1 = root->grad_meta->inputs[0];
         input_t* input2 = root->grad_meta->inputs[1];
         update_binary_grads(input1, input2, root);
-        if(get_ref_count(input1->variable) == 0){
+        if(ready_for_backwards(input1->variable)){
             actual_backwards(input1->variable);
         }
-        if(get_ref_count(input2->variable) == 0){
+        if(ready_for_backwards(input2->variable) && input2->variable != input1->variable){
             actual_backwards(input2->variable);
         }
     }
@@ -68,32 +151,156 @@ static void actual_backwards(variable_t* root){
 
 void backwards(variable_t* root){
     NDEBUG_ASSERT(is_scalar(root), "Error: root variable is not a scalar.");
+    // a root which does not require grad (eg. a loss of constants) is left alone, gradient included
+    if(!variable_requires_grad(root)){
+        return;
+    }
     // set root gradient to 1
+    ensure_gradient(root);
     tensor_set_to_scalar_value(root->gradient, 1);
     actual_backwards(root);
 }
 
+void save_for_backwards(variable_t* output, variable_t* saved){
+    grad_meta_t* grad_meta = output->grad_meta;
+    NDEBUG_ASSERT(grad_meta->num_saved < GRAD_META_MAX_SAVED, "Too many saved tensors for grad meta.");
+    grad_meta->saved[grad_meta->num_saved] = saved->tensor;
+    grad_meta->saved_versions[grad_meta->num_saved] = tensor_version(saved->tensor);
+    grad_meta->num_saved++;
+}
+
+void set_grad_hook(variable_t* variable, variable_grad_hook_t hook, void* context){
+    variable->grad_meta->grad_hook = hook;
+    variable->grad_meta->grad_hook_context = context;
+}
+
+/**
+ * GRAD MODE
+*/
+
+static __thread bool grad_enabled = true;
+
+bool grad_is_enabled(){
+    return grad_enabled;
+}
+
+bool grad_set_enabled(bool enabled){
+    bool previous = grad_enabled;
+    grad_enabled = enabled;
+    return previous;
+}
+
+/**
+ * ACTIVATION CHECKPOINTING
+*/
+
+typedef struct {
+    variable_segment_fn_t segment;
+    void* context;
+    rng_record_t random_draws; // replayed, so that eg. dropout masks match the forward pass
+} segment_context_t;
+
+// replays the segment from a detached copy of its input, and backpropagates the output gradient through the replay
+// parameters accumulate their gradients directly; the replayed graph and all of its tensors are freed afterwards
+void checkpoint_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    segment_context_t* context = (segment_context_t*) output->grad_meta->context;
+    variable_t* input = output->grad_meta->inputs[0]->variable;
+    bool previous_mode = grad_set_enabled(true);
+    tensor_scope_t scope;
+    tensor_scope_begin(&scope);
+    variable_t* replay_input = variable_new_from_tensor(input->tensor);
+    rng_replay_begin(&context->random_draws);
+    variable_t* replay_output = (*context->segment)(replay_input, context->context);
+    rng_replay_end(&context->random_draws);
+    ensure_gradient(replay_output);
+    tensor_in_place_add(replay_output->gradient, output->gradient);
+    actual_backwards(replay_output);
+    tensor_scope_end(&scope, 1, &replay_input->gradient);
+    grad_set_enabled(previous_mode);
+    gradient_updates[0] = replay_input->gradient;
+}
+
+variable_t* variable_checkpoint(variable_segment_fn_t segment, void* context, variable_t* input, segment_policy_t policy){
+    if(policy == SEGMENT_STORE || !grad_is_enabled()){
+        return (*segment)(input, context);
+    }
+    segment_context_t* segment_context = (segment_context_t*) malloc(sizeof(segment_context_t));
+    segment_context->segment = segment;
+    segment_context->context = context;
+    grad_set_enabled(false);
+    tensor_scope_t scope;
+    tensor_scope_begin(&scope);
+    rng_record_begin(&segment_context->random_draws);
+    variable_t* segment_output = (*segment)(input, context);
+    rng_record_end(&segment_context->random_draws);
+    // and its tangent, see FORWARD MODE in variable.h
+    tensor_t* kept[2] = {segment_output->tensor, segment_output->tangent};
+    tensor_scope_end(&scope, kept[1] != NULL ? 2 : 1, kept);
+    grad_set_enabled(true);
+    // a node of its own, since the segment may hand back its input or a parameter
+    variable_t* output = variable_new_from_tensor(kept[0]);
+    output->tangent = kept[1];
+    set_fused_grad_meta(output, 1, &input, &checkpoint_backwards_grad, segment_context);
+    // the replay starts from it
+    save_for_backwards(output, input);
+    // parameters reached through context are not inputs of the node, so whether any of them requires grad is unknown
+    output->grad_meta->requires_grad = true;
+    return output;
+}
+
 
 void set_unary_grad_meta(variable_t* output, variable_t* parent, variable_unary_grad_op_t grad_op){
     input_t* input = input_new(parent, (variable_grad_op_t) grad_op);
-    grad_meta_t* new_grad_meta = (grad_meta_t*) malloc(sizeof(grad_meta_t));
-    new_grad_meta->ref_count = 0;
+    grad_meta_t* new_grad_meta = grad_meta_new();
     new_grad_meta->num_inputs = 1;
     new_grad_meta->inputs[0] = input;
+    new_grad_meta->requires_grad = variable_requires_grad(parent);
     output->grad_meta = new_grad_meta;
-    increment_ref_count(parent);
+    if(variable_requires_grad(parent)){
+        increment_ref_count(parent);
+        ensure_gradient(output);
+    }
 }
 
 
 void set_binary_grad_meta(variable_t* output, variable_t* input1, variable_t* input2, variable_binary_grad_op_t grad_op1, variable_binary_grad_op_t grad_op2){
     input_t* diff_input1 = input_new(input1, (variable_grad_op_t) grad_op1);
     input_t* diff_input2 = input_new(input2, (variable_grad_op_t) grad_op2);
-    grad_meta_t* new_grad_meta = (grad_meta_t*) malloc(sizeof(grad_meta_t));
-    new_grad_meta->ref_count = 0;
+    grad_meta_t* new_grad_meta = grad_meta_new();
     new_grad_meta->num_inputs = 2;
     new_grad_meta->inputs[0] = diff_input1;
     new_grad_meta->inputs[1] = diff_input2;
+    new_grad_meta->requires_grad = variable_requires_grad(input1) || variable_requires_grad(input2);
+    output->grad_meta = new_grad_meta;
+    if(new_grad_meta->requires_grad){
+        ensure_gradient(output);
+    }
+    if(variable_requires_grad(input1)){
+        increment_ref_count(input1);
+    }
+    if(variable_requires_grad(input2)){
+        increment_ref_count(input2);
+    }
+}
+
+// registers inputs (up to GRAD_META_MAX_INPUTS) of output whose gradients are all computed by a single fused_grad_op
+// context is handed to the grad op through output->grad_meta->context
+void set_fused_grad_meta(variable_t* output, int num_inputs, variable_t** inputs, variable_fused_grad_op_t fused_grad_op, void* context){
+    NDEBUG_ASSERT(num_inputs <= GRAD_META_MAX_INPUTS, "Too many inputs for grad meta.");
+    grad_meta_t* new_grad_meta = grad_meta_new();
+    new_grad_meta->num_inputs = num_inputs;
+    new_grad_meta->fused_grad_op = fused_grad_op;
+    new_grad_meta->context = context;
+    new_grad_meta->requires_grad = false;
+    for(int input_index = 0; input_index < num_inputs; input_index++){
+        new_grad_meta->inputs[input_index] = input_new(inputs[input_index], NULL);
+        if(variable_requires_grad(inputs[input_index])){
+            new_grad_meta->requires_grad = true;
+            increment_ref_count(inputs[input_index]);
+        }
+    }
     output->grad_meta = new_grad_meta;
-    increment_ref_count(input1);
-    increment_ref_count(input2);
+    if(new_grad_meta->requires_grad){
+        ensure_gradient(output);
+    }
 }
@@ -6,5 +6,42 @@
 void backwards(variable_t* root);
 void set_unary_grad_meta(variable_t* child, variable_t* parent, variable_unary_grad_op_t grad_op);
 void set_binary_grad_meta(variable_t* child, variable_t* parent1, variable_t* parent2, variable_binary_grad_op_t grad_op1, variable_binary_grad_op_t grad_op2);
+void set_fused_grad_meta(variable_t* output, int num_inputs, variable_t** inputs, variable_fused_grad_op_t fused_grad_op, void* context);
+// records that the grad op(s) of output read the tensor of saved (an input, or output itself) for their values rather
+// than their shape, so that backwards fails, instead of computing a wrong gradient, if it has been written in place
+// since (see tensor_version); called after the grad meta of output is set
+void save_for_backwards(variable_t* output, variable_t* saved);
+// hook is called whenever backwards has finished accumulating the gradient of variable (ie. its ref_count reached zero),
+// while the rest of backwards is still to run; meant for leaves, whose grad_meta is never replaced
+void set_grad_hook(variable_t* variable, variable_grad_hook_t hook, void* context);
+
+/**
+ * GRAD MODE
+ * per thread; while disabled, ops build no graph and save nothing for backward
+*/
+
+bool grad_is_enabled();
+// returns the previous mode
+bool grad_set_enabled(bool enabled);
+
+/**
+ * ACTIVATION CHECKPOINTING
+ * a segment is a function of one input variable (and of leaf parameters reached through context)
+ * - SEGMENT_STORE: run as usual, every intermediate stays alive until backwards reaches it
+ * - SEGMENT_RECOMPUTE: run without grad, keep only the input and the output, free everything else,
+ *   and run the segment again (with grad) when backwards reaches its output
+ * checkpointing every sqrt(depth) layers of a deep chain keeps O(sqrt(depth)) activations alive
+ * NOTE: a recomputed segment must be deterministic (apart from draws from an rng_t, which are replayed), and must
+ * not keep the variables it creates
+*/
+
+typedef variable_t* (* variable_segment_fn_t)(variable_t* input, void* context);
+
+typedef enum {
+    SEGMENT_STORE,
+    SEGMENT_RECOMPUTE,
+} segment_policy_t;
+
+variable_t* variable_checkpoint(variable_segment_fn_t segment, void* context, variable_t* input, segment_policy_t policy);
 
 #endif // GRAD_H
\ No newline at end of file
@@ -0,0 +1,960 @@
+#include "jit.h"
+#include "memory.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+_Static_assert(sizeof(tensor_entry_t) == sizeof(float), "Generated code is written in floats!");
+
+#define JIT_PATH_BYTES 4096
+#define JIT_TEXT_BYTES 256
+#define JIT_FN_NAME "coral_jit_step"
+#define JIT_NUM_FLAGS 5
+// arena buffers start on a cache line
+#define JIT_ALIGNMENT_ENTRIES (MEMORY_ALIGNMENT / sizeof(tensor_entry_t))
+
+/**
+ * TRACING
+*/
+
+static __thread jit_trace_t* current_trace = NULL;
+
+void jit_trace_begin(jit_trace_t* trace){
+    trace->num_nodes = 0;
+    trace->capacity = 0;
+    trace->nodes = NULL;
+    trace->parent = current_trace;
+    current_trace = trace;
+}
+
+void jit_trace_end(jit_trace_t* trace){
+    NDEBUG_ASSERT(current_trace == trace, "Traces must be ended in reverse order of beginning!\n");
+    current_trace = trace->parent;
+}
+
+void jit_trace_clear(jit_trace_t* trace){
+    free(trace->nodes);
+    trace->nodes = NULL;
+    trace->num_nodes = 0;
+    trace->capacity = 0;
+}
+
+void jit_record(jit_op_t op, variable_t* output, int num_inputs, variable_t** inputs, activation_t activation){
+    jit_trace_t* trace = current_trace;
+    if(trace == NULL){
+        return;
+    }
+    if(trace->num_nodes == trace->capacity){
+        trace->capacity = MAX(2 * trace->capacity, (size_t) 32);
+        trace->nodes = (jit_node_t*) realloc(trace->nodes, trace->capacity * sizeof(jit_node_t));
+    }
+    jit_node_t* node = &trace->nodes[trace->num_nodes++];
+    node->op = op;
+    node->output = output;
+    node->num_inputs = num_inputs;
+    for(int input_index = 0; input_index < num_inputs; input_index++){
+        node->inputs[input_index] = inputs[input_index];
+    }
+    node->activation = activation;
+}
+
+/**
+ * GRAPH
+ * values are the leaves and the outputs of the nodes reachable from the loss; their buffers are slots, the leaves'
+ * bound to their tensors on every run and the rest laid out in one arena
+*/
+
+typedef struct {
+    variable_t* variable;
+    int producer; // node index, -1 for a leaf
+    int num_dims;
+    size_t dims[TENSOR_MAX_DIMS];
+    size_t size;
+    bool requires_grad;
+    bool stored; // has a buffer, rather than living in a register of the loop nest of its group
+    int data_slot;
+    int grad_slot;
+} value_t;
+
+typedef struct {
+    jit_op_t op;
+    activation_t activation;
+    int output;
+    int num_inputs;
+    int inputs[GRAD_META_MAX_INPUTS];
+    bool live;
+    int group; // consecutive elementwise nodes of one shape share a group, and so a loop nest
+    int scratch_slot; // linear with an activation: the pre-activation gradient
+} node_t;
+
+typedef struct {
+    int num_values;
+    value_t* values; // at most one per input and output of the trace
+    int num_nodes;
+    node_t* nodes;
+    int num_slots;
+    size_t* slot_offsets; // into the arena, in entries (SIZE_MAX for leaf slots)
+    size_t arena_entries;
+} graph_t;
+
+static bool is_elementwise(jit_op_t op){
+    return op <= JIT_OP_LOG;
+}
+
+static int value_find(graph_t* graph, variable_t* variable){
+    for(int value_index = 0; value_index < graph->num_values; value_index++){
+        if(graph->values[value_index].variable == variable){
+            return value_index;
+        }
+    }
+    return -1;
+}
+
+static int value_new(graph_t* graph, variable_t* variable, int producer){
+    value_t* value = &graph->values[graph->num_values];
+    value->variable = variable;
+    value->producer = producer;
+    value->num_dims = TENSOR_NUM_DIMS(variable->tensor);
+    for(int dim = 0; dim < value->num_dims; dim++){
+        value->dims[dim] = variable->tensor->shape->dims[dim];
+    }
+    value->size = variable->tensor->shape->size;
+    value->requires_grad = false;
+    value->stored = producer < 0;
+    value->data_slot = -1;
+    value->grad_slot = -1;
+    return graph->num_values++;
+}
+
+static bool same_shape(value_t* left, value_t* right){
+    if(left->num_dims != right->num_dims){
+        return false;
+    }
+    for(int dim = 0; dim < left->num_dims; dim++){
+        if(left->dims[dim] != right->dims[dim]){
+            return false;
+        }
+    }
+    return true;
+}
+
+static int slot_new(graph_t* graph, size_t size, bool in_arena){
+    graph->slot_offsets = (size_t*) realloc(graph->slot_offsets, (graph->num_slots + 1) * sizeof(size_t));
+    graph->slot_offsets[graph->num_slots] = SIZE_MAX;
+    if(in_arena){
+        graph->slot_offsets[graph->num_slots] = graph->arena_entries;
+        graph->arena_entries += (size + JIT_ALIGNMENT_ENTRIES - 1) / JIT_ALIGNMENT_ENTRIES * JIT_ALIGNMENT_ENTRIES;
+    }
+    return graph->num_slots++;
+}
+
+static void graph_free(graph_t* graph){
+    free(graph->values);
+    free(graph->nodes);
+    free(graph->slot_offsets);
+}
+
+// the values whose old contents the backward of node reads (beyond its output gradient)
+static void mark_saved(graph_t* graph, node_t* node){
+    value_t* values = graph->values;
+    bool rg[GRAD_META_MAX_INPUTS];
+    for(int input_index = 0; input_index < node->num_inputs; input_index++){
+        rg[input_index] = values[node->inputs[input_index]].requires_grad;
+    }
+    switch(node->op){
+        case JIT_OP_MULTIPLY:
+        case JIT_OP_MATMUL:
+            values[node->inputs[1]].stored |= rg[0];
+            values[node->inputs[0]].stored |= rg[1];
+            break;
+        case JIT_OP_SQUARE:
+        case JIT_OP_ABS:
+        case JIT_OP_LOG:
+            values[node->inputs[0]].stored |= rg[0];
+            break;
+        case JIT_OP_RELU:
+        case JIT_OP_SIGMOID:
+        case JIT_OP_TANH:
+        case JIT_OP_EXP:
+            values[node->output].stored |= rg[0];
+            break;
+        case JIT_OP_LINEAR:
+            values[node->inputs[1]].stored |= rg[0];
+            values[node->inputs[0]].stored |= rg[1];
+            break;
+        default:
+            break;
+    }
+}
+
+// false if the graph has an op the jit does not support
+static bool graph_build(graph_t* graph, jit_trace_t* trace, variable_t* loss, int* loss_value){
+    size_t max_values = trace->num_nodes * (GRAD_META_MAX_INPUTS + 1);
+    graph->values = (value_t*) malloc(MAX(max_values, (size_t) 1) * sizeof(value_t));
+    graph->nodes = (node_t*) malloc(MAX(trace->num_nodes, (size_t) 1) * sizeof(node_t));
+    for(size_t trace_index = 0; trace_index < trace->num_nodes; trace_index++){
+        jit_node_t* record = &trace->nodes[trace_index];
+        node_t* node = &graph->nodes[graph->num_nodes];
+        node->op = record->op;
+        node->activation = record->activation;
+        node->num_inputs = record->num_inputs;
+        node->live = false;
+        node->scratch_slot = -1;
+        for(int input_index = 0; input_index < record->num_inputs; input_index++){
+            variable_t* input = record->inputs[input_index];
+            int value_index = value_find(graph, input);
+            if(value_index < 0){
+                // made by an op which was not traced (or with grad disabled), or a view or copy: the program would
+                // keep reading its data as it was, rather than recompute it
+                if(input->grad_meta->derived || input->grad_meta->num_inputs > 0 || (variable_requires_grad(input) && input->gradient == NULL)){
+                    return false;
+                }
+                value_index = value_new(graph, input, -1);
+                graph->values[value_index].requires_grad = variable_requires_grad(input);
+            }
+            node->inputs[input_index] = value_index;
+        }
+        NDEBUG_ASSERT(value_find(graph, record->output) < 0, "Traced variable produced twice!\n");
+        node->output = value_new(graph, record->output, graph->num_nodes);
+        graph->num_nodes++;
+    }
+    *loss_value = value_find(graph, loss);
+    if(*loss_value < 0 || graph->values[*loss_value].producer < 0){
+        return false;
+    }
+    NDEBUG_ASSERT(graph->values[*loss_value].size == 1, "Compiled loss must be a scalar!\n");
+    // only what the loss depends on
+    bool* needed = (bool*) calloc(graph->num_values, sizeof(bool));
+    needed[*loss_value] = true;
+    for(int node_index = graph->num_nodes - 1; node_index >= 0; node_index--){
+        node_t* node = &graph->nodes[node_index];
+        node->live = needed[node->output];
+        for(int input_index = 0; input_index < node->num_inputs && node->live; input_index++){
+            needed[node->inputs[input_index]] = true;
+        }
+    }
+    free(needed);
+    int group = -1;
+    node_t* previous = NULL;
+    for(int node_index = 0; node_index < graph->num_nodes; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live){
+            continue;
+        }
+        value_t* output = &graph->values[node->output];
+        for(int input_index = 0; input_index < node->num_inputs; input_index++){
+            output->requires_grad |= graph->values[node->inputs[input_index]].requires_grad;
+        }
+        bool fused = previous != NULL && is_elementwise(previous->op) && is_elementwise(node->op)
+            && same_shape(&graph->values[previous->output], output);
+        node->group = fused ? group : ++group;
+        previous = node;
+    }
+    // a value is kept in memory if it is the loss, leaves its group, is not computed elementwise, or is read by backward
+    graph->values[*loss_value].stored = true;
+    for(int node_index = 0; node_index < graph->num_nodes; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live){
+            continue;
+        }
+        graph->values[node->output].stored |= !is_elementwise(node->op);
+        for(int input_index = 0; input_index < node->num_inputs; input_index++){
+            value_t* input = &graph->values[node->inputs[input_index]];
+            if(input->producer >= 0 && graph->nodes[input->producer].group != node->group){
+                input->stored = true;
+            }
+        }
+        if(graph->values[node->output].requires_grad){
+            mark_saved(graph, node);
+        }
+    }
+    // slots: leaves first, so that they are bound in order
+    for(int pass = 0; pass < 2; pass++){
+        for(int value_index = 0; value_index < graph->num_values; value_index++){
+            value_t* value = &graph->values[value_index];
+            bool is_leaf = value->producer < 0;
+            if(is_leaf != (pass == 0) || (!is_leaf && !graph->nodes[value->producer].live)){
+                continue;
+            }
+            if(value->stored){
+                value->data_slot = slot_new(graph, value->size, !is_leaf);
+            }
+            if(value->requires_grad){
+                value->grad_slot = slot_new(graph, value->size, !is_leaf);
+            }
+        }
+    }
+    for(int node_index = 0; node_index < graph->num_nodes; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(node->live && node->op == JIT_OP_LINEAR && node->activation != ACTIVATION_NONE && graph->values[node->output].requires_grad){
+            node->scratch_slot = slot_new(graph, graph->values[node->output].size, true);
+        }
+    }
+    return true;
+}
+
+/**
+ * CODE GENERATION
+*/
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+} source_t;
+
+static void emit(source_t* source, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(source->length + length + 1 > source->capacity){
+        source->capacity = MAX(2 * source->capacity, source->length + length + 1);
+        source->text = (char*) realloc(source->text, source->capacity);
+    }
+    va_start(args, format);
+    vsnprintf(source->text + source->length, length + 1, format, args);
+    va_end(args);
+    source->length += length;
+}
+
+static const char* op_name(jit_op_t op){
+    static const char* names[] = {"add", "subtract", "multiply", "square", "abs", "relu", "sigmoid", "tanh", "exp", "log",
+                                  "sum", "mean", "matmul", "linear"};
+    return names[op];
+}
+
+// the offset into operand at loop indices i0, i1, ... over the dims of shape (by which operand is broadcast), or i
+// when the loop nest is flat
+static void offset_text(char* text, value_t* operand, value_t* shape, bool flat){
+    if(flat){
+        snprintf(text, JIT_TEXT_BYTES, "i");
+        return;
+    }
+    size_t length = 0;
+    size_t stride = 1;
+    text[0] = '\0';
+    for(int dim = shape->num_dims - 1; dim >= 0; dim--){
+        int operand_dim = dim - (shape->num_dims - operand->num_dims);
+        if(operand_dim < 0){
+            break;
+        }
+        if(operand->dims[operand_dim] != 1){
+            const char* separator = length > 0 ? " + " : "";
+            if(stride == 1){
+                length += snprintf(text + length, JIT_TEXT_BYTES - length, "%si%d", separator, dim);
+            }else{
+                length += snprintf(text + length, JIT_TEXT_BYTES - length, "%si%d * %zu", separator, dim, stride);
+            }
+        }
+        stride *= operand->dims[operand_dim];
+    }
+    if(length == 0){
+        snprintf(text, JIT_TEXT_BYTES, "0");
+    }
+}
+
+static void open_loops(source_t* source, value_t* shape, bool flat){
+    if(flat){
+        emit(source, "    for(size_t i = 0; i < %zu; i++){\n", shape->size);
+        return;
+    }
+    for(int dim = 0; dim < shape->num_dims; dim++){
+        emit(source, "    for(size_t i%d = 0; i%d < %zu; i%d++){\n", dim, dim, shape->dims[dim], dim);
+    }
+}
+
+static void close_loops(source_t* source, value_t* shape, bool flat){
+    int depth = flat ? 1 : shape->num_dims;
+    for(int loop = 0; loop < depth; loop++){
+        emit(source, "    }\n");
+    }
+}
+
+// loads (once per loop body) the entry of value the body reads, as l<value>
+static void emit_load(source_t* source, graph_t* graph, bool* loaded, int value_index, value_t* shape, bool flat){
+    if(loaded[value_index]){
+        return;
+    }
+    char offset[JIT_TEXT_BYTES];
+    offset_text(offset, &graph->values[value_index], shape, flat);
+    emit(source, "        float l%d = x%d[%s];\n", value_index, value_index, offset);
+    loaded[value_index] = true;
+}
+
+// the name of the entry of value_index in the forward loop body of group
+static void operand_text(char* text, graph_t* graph, int value_index, int group){
+    value_t* value = &graph->values[value_index];
+    bool in_group = value->producer >= 0 && graph->nodes[value->producer].group == group;
+    snprintf(text, JIT_TEXT_BYTES, in_group ? "v%d" : "l%d", value_index);
+}
+
+static void forward_expression(char* text, jit_op_t op, const char* a, const char* b){
+    switch(op){
+        case JIT_OP_ADD: snprintf(text, JIT_TEXT_BYTES, "%s + %s", a, b); break;
+        case JIT_OP_SUBTRACT: snprintf(text, JIT_TEXT_BYTES, "%s - %s", a, b); break;
+        case JIT_OP_MULTIPLY: snprintf(text, JIT_TEXT_BYTES, "%s * %s", a, b); break;
+        case JIT_OP_SQUARE: snprintf(text, JIT_TEXT_BYTES, "%s * %s", a, a); break;
+        case JIT_OP_ABS: snprintf(text, JIT_TEXT_BYTES, "fabsf(%s)", a); break;
+        case JIT_OP_RELU: snprintf(text, JIT_TEXT_BYTES, "(%s > 0 ? %s : 0)", a, a); break;
+        case JIT_OP_SIGMOID: snprintf(text, JIT_TEXT_BYTES, "1 / (1 + expf(-%s))", a); break;
+        case JIT_OP_TANH: snprintf(text, JIT_TEXT_BYTES, "tanhf(%s)", a); break;
+        case JIT_OP_EXP: snprintf(text, JIT_TEXT_BYTES, "expf(%s)", a); break;
+        case JIT_OP_LOG: snprintf(text, JIT_TEXT_BYTES, "logf(%s)", a); break;
+        default: NDEBUG_ASSERT(0, "Not an elementwise op!\n");
+    }
+}
+
+// the gradient of input input_index, given the output gradient d, inputs a (and b) and output y
+static void backward_expression(char* text, jit_op_t op, int input_index, const char* d, const char* a, const char* b, const char* y){
+    switch(op){
+        case JIT_OP_ADD: snprintf(text, JIT_TEXT_BYTES, "%s", d); break;
+        case JIT_OP_SUBTRACT: snprintf(text, JIT_TEXT_BYTES, input_index == 0 ? "%s" : "-%s", d); break;
+        case JIT_OP_MULTIPLY: snprintf(text, JIT_TEXT_BYTES, "%s * %s", d, input_index == 0 ? b : a); break;
+        case JIT_OP_SQUARE: snprintf(text, JIT_TEXT_BYTES, "2 * %s * %s", a, d); break;
+        case JIT_OP_ABS: snprintf(text, JIT_TEXT_BYTES, "(%s >= 0 ? %s : -%s)", a, d, d); break;
+        case JIT_OP_RELU: snprintf(text, JIT_TEXT_BYTES, "(%s > 0 ? %s : 0)", y, d); break;
+        case JIT_OP_SIGMOID: snprintf(text, JIT_TEXT_BYTES, "%s * %s * (1 - %s)", d, y, y); break;
+        case JIT_OP_TANH: snprintf(text, JIT_TEXT_BYTES, "%s * (1 - %s * %s)", d, y, y); break;
+        case JIT_OP_EXP: snprintf(text, JIT_TEXT_BYTES, "%s * %s", d, y); break;
+        case JIT_OP_LOG: snprintf(text, JIT_TEXT_BYTES, "%s / %s", d, a); break;
+        default: NDEBUG_ASSERT(0, "Not an elementwise op!\n");
+    }
+}
+
+// a group is flat when nothing in it is broadcast, so one index serves every operand
+static bool group_is_flat(graph_t* graph, int first, int last, value_t* shape){
+    for(int node_index = first; node_index <= last; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        for(int input_index = 0; node->live && input_index < node->num_inputs; input_index++){
+            if(graph->values[node->inputs[input_index]].size != shape->size){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void emit_group_forward(source_t* source, graph_t* graph, int first, int last){
+    value_t* shape = &graph->values[graph->nodes[last].output];
+    bool flat = group_is_flat(graph, first, last, shape);
+    bool* loaded = (bool*) calloc(graph->num_values, sizeof(bool));
+    char offset[JIT_TEXT_BYTES];
+    offset_text(offset, shape, shape, flat);
+    emit(source, "    //");
+    for(int node_index = first; node_index <= last; node_index++){
+        emit(source, graph->nodes[node_index].live ? " %s" : "", op_name(graph->nodes[node_index].op));
+    }
+    emit(source, "\n");
+    open_loops(source, shape, flat);
+    for(int node_index = first; node_index <= last; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live){
+            continue;
+        }
+        char operands[2][JIT_TEXT_BYTES];
+        for(int input_index = 0; input_index < node->num_inputs; input_index++){
+            value_t* input = &graph->values[node->inputs[input_index]];
+            if(input->producer < 0 || graph->nodes[input->producer].group != node->group){
+                emit_load(source, graph, loaded, node->inputs[input_index], shape, flat);
+            }
+            operand_text(operands[input_index], graph, node->inputs[input_index], node->group);
+        }
+        char expression[JIT_TEXT_BYTES];
+        forward_expression(expression, node->op, operands[0], node->num_inputs > 1 ? operands[1] : operands[0]);
+        emit(source, "        float v%d = %s;\n", node->output, expression);
+        if(graph->values[node->output].stored){
+            emit(source, "        x%d[%s] = v%d;\n", node->output, offset, node->output);
+        }
+    }
+    close_loops(source, shape, flat);
+    free(loaded);
+}
+
+static void emit_group_backward(source_t* source, graph_t* graph, int first, int last){
+    value_t* shape = &graph->values[graph->nodes[last].output];
+    bool flat = group_is_flat(graph, first, last, shape);
+    bool* loaded = (bool*) calloc(graph->num_values, sizeof(bool));
+    char offset[JIT_TEXT_BYTES];
+    offset_text(offset, shape, shape, flat);
+    open_loops(source, shape, flat);
+    // within an iteration, every later node of the group has added into the gradient of a node before it is read
+    for(int node_index = last; node_index >= first; node_index--){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live || !graph->values[node->output].requires_grad){
+            continue;
+        }
+        char operands[4][JIT_TEXT_BYTES];
+        emit(source, "        float d%d = g%d[%s];\n", node->output, node->output, offset);
+        snprintf(operands[3], JIT_TEXT_BYTES, "d%d", node->output);
+        for(int input_index = 0; input_index < node->num_inputs; input_index++){
+            if(graph->values[node->inputs[input_index]].stored){
+                emit_load(source, graph, loaded, node->inputs[input_index], shape, flat);
+            }
+            snprintf(operands[input_index], JIT_TEXT_BYTES, "l%d", node->inputs[input_index]);
+        }
+        if(graph->values[node->output].stored){
+            emit_load(source, graph, loaded, node->output, shape, flat);
+        }
+        snprintf(operands[2], JIT_TEXT_BYTES, "l%d", node->output);
+        for(int input_index = 0; input_index < node->num_inputs; input_index++){
+            int input = node->inputs[input_index];
+            if(!graph->values[input].requires_grad){
+                continue;
+            }
+            char expression[JIT_TEXT_BYTES];
+            char input_offset[JIT_TEXT_BYTES];
+            backward_expression(expression, node->op, input_index, operands[3], operands[0],
+                                node->num_inputs > 1 ? operands[1] : operands[0], operands[2]);
+            offset_text(input_offset, &graph->values[input], shape, flat);
+            emit(source, "        g%d[%s] += %s;\n", input, input_offset, expression);
+        }
+    }
+    close_loops(source, shape, flat);
+    free(loaded);
+}
+
+static void activation_text(char* text, activation_t activation, const char* v){
+    switch(activation){
+        case ACTIVATION_RELU: snprintf(text, JIT_TEXT_BYTES, "%s > 0 ? %s : 0", v, v); break;
+        case ACTIVATION_SIGMOID: snprintf(text, JIT_TEXT_BYTES, "1 / (1 + expf(-%s))", v); break;
+        case ACTIVATION_TANH: snprintf(text, JIT_TEXT_BYTES, "tanhf(%s)", v); break;
+        default: snprintf(text, JIT_TEXT_BYTES, "%s", v);
+    }
+}
+
+static void activation_grad_text(char* text, activation_t activation, const char* d, const char* y){
+    switch(activation){
+        case ACTIVATION_RELU: snprintf(text, JIT_TEXT_BYTES, "%s > 0 ? %s : 0", y, d); break;
+        case ACTIVATION_SIGMOID: snprintf(text, JIT_TEXT_BYTES, "%s * %s * (1 - %s)", d, y, y); break;
+        case ACTIVATION_TANH: snprintf(text, JIT_TEXT_BYTES, "%s * (1 - %s * %s)", d, y, y); break;
+        default: snprintf(text, JIT_TEXT_BYTES, "%s", d);
+    }
+}
+
+// matmul is linear without bias or activation
+static void emit_linear_forward(source_t* source, graph_t* graph, node_t* node){
+    int input = node->inputs[0];
+    int weight = node->inputs[1];
+    int bias = node->num_inputs == 3 ? node->inputs[2] : -1;
+    size_t m = graph->values[input].dims[0];
+    size_t k = graph->values[input].dims[1];
+    size_t n = graph->values[weight].dims[1];
+    int out = node->output;
+    emit(source, "    // %s: %zu x %zu x %zu\n", op_name(node->op), m, k, n);
+    emit(source, "    for(size_t i = 0; i < %zu; i++){\n", m);
+    if(bias >= 0){
+        emit(source, "        for(size_t j = 0; j < %zu; j++){ x%d[i * %zu + j] = x%d[j]; }\n", n, out, n, bias);
+    }else{
+        emit(source, "        for(size_t j = 0; j < %zu; j++){ x%d[i * %zu + j] = 0; }\n", n, out, n);
+    }
+    emit(source, "        for(size_t p = 0; p < %zu; p++){\n", k);
+    emit(source, "            float a = x%d[i * %zu + p];\n", input, k);
+    emit(source, "            for(size_t j = 0; j < %zu; j++){ x%d[i * %zu + j] += a * x%d[p * %zu + j]; }\n", n, out, n, weight, n);
+    emit(source, "        }\n");
+    if(node->op == JIT_OP_LINEAR && node->activation != ACTIVATION_NONE){
+        char expression[JIT_TEXT_BYTES];
+        activation_text(expression, node->activation, "v");
+        emit(source, "        for(size_t j = 0; j < %zu; j++){ float v = x%d[i * %zu + j]; x%d[i * %zu + j] = %s; }\n", n, out, n, out, n, expression);
+    }
+    emit(source, "    }\n");
+}
+
+static void emit_linear_backward(source_t* source, graph_t* graph, node_t* node){
+    int input = node->inputs[0];
+    int weight = node->inputs[1];
+    int bias = node->num_inputs == 3 ? node->inputs[2] : -1;
+    size_t m = graph->values[input].dims[0];
+    size_t k = graph->values[input].dims[1];
+    size_t n = graph->values[weight].dims[1];
+    int out = node->output;
+    char pre_activation[JIT_TEXT_BYTES];
+    snprintf(pre_activation, JIT_TEXT_BYTES, "g%d", out);
+    if(node->scratch_slot >= 0){
+        char expression[JIT_TEXT_BYTES];
+        char gradient[JIT_TEXT_BYTES];
+        char output[JIT_TEXT_BYTES];
+        snprintf(gradient, JIT_TEXT_BYTES, "g%d[i]", out);
+        snprintf(output, JIT_TEXT_BYTES, "x%d[i]", out);
+        activation_grad_text(expression, node->activation, gradient, output);
+        snprintf(pre_activation, JIT_TEXT_BYTES, "p%d", out);
+        emit(source, "    for(size_t i = 0; i < %zu; i++){ p%d[i] = %s; }\n", m * n, out, expression);
+    }
+    if(bias >= 0 && graph->values[bias].requires_grad){
+        emit(source, "    for(size_t i = 0; i < %zu; i++){\n", m);
+        emit(source, "        for(size_t j = 0; j < %zu; j++){ g%d[j] += %s[i * %zu + j]; }\n", n, bias, pre_activation, n);
+        emit(source, "    }\n");
+    }
+    if(graph->values[input].requires_grad){
+        emit(source, "    for(size_t i = 0; i < %zu; i++){\n", m);
+        emit(source, "        for(size_t p = 0; p < %zu; p++){\n", k);
+        emit(source, "            float sum = 0;\n");
+        emit(source, "            for(size_t j = 0; j < %zu; j++){ sum += %s[i * %zu + j] * x%d[p * %zu + j]; }\n", n, pre_activation, n, weight, n);
+        emit(source, "            g%d[i * %zu + p] += sum;\n", input, k);
+        emit(source, "        }\n");
+        emit(source, "    }\n");
+    }
+    if(graph->values[weight].requires_grad){
+        emit(source, "    for(size_t i = 0; i < %zu; i++){\n", m);
+        emit(source, "        for(size_t p = 0; p < %zu; p++){\n", k);
+        emit(source, "            float a = x%d[i * %zu + p];\n", input, k);
+        emit(source, "            for(size_t j = 0; j < %zu; j++){ g%d[p * %zu + j] += a * %s[i * %zu + j]; }\n", n, weight, n, pre_activation, n);
+        emit(source, "        }\n");
+        emit(source, "    }\n");
+    }
+}
+
+static void emit_reduction_forward(source_t* source, graph_t* graph, node_t* node){
+    value_t* input = &graph->values[node->inputs[0]];
+    emit(source, "    // %s: %zu\n", op_name(node->op), input->size);
+    emit(source, "    {\n");
+    emit(source, "    float sum = 0;\n");
+    emit(source, "    for(size_t i = 0; i < %zu; i++){ sum += x%d[i]; }\n", input->size, node->inputs[0]);
+    emit(source, node->op == JIT_OP_MEAN ? "    x%d[0] = sum / %zu;\n" : "    x%d[0] = sum;\n", node->output, input->size);
+    emit(source, "    }\n");
+}
+
+static void emit_reduction_backward(source_t* source, graph_t* graph, node_t* node){
+    value_t* input = &graph->values[node->inputs[0]];
+    if(!input->requires_grad){
+        return;
+    }
+    emit(source, "    {\n");
+    if(node->op == JIT_OP_MEAN){
+        emit(source, "    float d = (1.0f / %zu) * g%d[0];\n", input->size, node->output);
+    }else{
+        emit(source, "    float d = g%d[0];\n", node->output);
+    }
+    emit(source, "    for(size_t i = 0; i < %zu; i++){ g%d[i] += d; }\n", input->size, node->inputs[0]);
+    emit(source, "    }\n");
+}
+
+// the last node of the group starting at first
+static int group_end(graph_t* graph, int first){
+    int last = first;
+    for(int node_index = first + 1; node_index < graph->num_nodes; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live){
+            continue;
+        }
+        if(node->group != graph->nodes[first].group){
+            break;
+        }
+        last = node_index;
+    }
+    return last;
+}
+
+static void generate(source_t* source, graph_t* graph, int loss_value){
+    emit(source, "// generated by the coral graph jit\n");
+    emit(source, "#include <math.h>\n#include <string.h>\n#include <stddef.h>\n\n");
+    emit(source, "void " JIT_FN_NAME "(float* const* s){\n");
+    for(int value_index = 0; value_index < graph->num_values; value_index++){
+        value_t* value = &graph->values[value_index];
+        if(value->data_slot >= 0){
+            emit(source, "    float* restrict x%d = s[%d]; // %zu\n", value_index, value->data_slot, value->size);
+        }
+        if(value->grad_slot >= 0){
+            emit(source, "    float* restrict g%d = s[%d];\n", value_index, value->grad_slot);
+        }
+    }
+    for(int node_index = 0; node_index < graph->num_nodes; node_index++){
+        if(graph->nodes[node_index].scratch_slot >= 0){
+            emit(source, "    float* restrict p%d = s[%d];\n", graph->nodes[node_index].output, graph->nodes[node_index].scratch_slot);
+        }
+    }
+    emit(source, "\n    // forward\n");
+    for(int node_index = 0; node_index < graph->num_nodes; node_index++){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live){
+            continue;
+        }
+        if(is_elementwise(node->op)){
+            int last = group_end(graph, node_index);
+            emit_group_forward(source, graph, node_index, last);
+            node_index = last;
+        }else if(node->op == JIT_OP_SUM || node->op == JIT_OP_MEAN){
+            emit_reduction_forward(source, graph, node);
+        }else{
+            emit_linear_forward(source, graph, node);
+        }
+    }
+    if(!graph->values[loss_value].requires_grad){
+        emit(source, "}\n");
+        return;
+    }
+    emit(source, "\n    // backward\n");
+    for(int value_index = 0; value_index < graph->num_values; value_index++){
+        value_t* value = &graph->values[value_index];
+        if(value->grad_slot >= 0 && value->producer >= 0){
+            emit(source, "    memset(g%d, 0, %zu * sizeof(float));\n", value_index, value->size);
+        }
+    }
+    emit(source, "    g%d[0] = 1;\n", loss_value);
+    for(int node_index = graph->num_nodes - 1; node_index >= 0; node_index--){
+        node_t* node = &graph->nodes[node_index];
+        if(!node->live || !graph->values[node->output].requires_grad){
+            continue;
+        }
+        if(is_elementwise(node->op)){
+            int first = node_index;
+            while(first > 0 && (!graph->nodes[first - 1].live || graph->nodes[first - 1].group == node->group)){
+                first--;
+            }
+            while(!graph->nodes[first].live){
+                first++;
+            }
+            emit_group_backward(source, graph, first, node_index);
+            node_index = first;
+        }else if(node->op == JIT_OP_SUM || node->op == JIT_OP_MEAN){
+            emit_reduction_backward(source, graph, node);
+        }else{
+            emit_linear_backward(source, graph, node);
+        }
+    }
+    emit(source, "}\n");
+}
+
+/**
+ * COMPILATION AND CACHE
+*/
+
+static char* cache_dir_setting = NULL;
+static const char* const jit_flags[JIT_NUM_FLAGS] = {"-O3", "-march=native", "-std=gnu99", "-fPIC", "-shared"};
+
+extern char** environ;
+
+void jit_set_cache_dir(const char* dir){
+    free(cache_dir_setting);
+    cache_dir_setting = strdup(dir);
+}
+
+// per user, as whoever can write into the directory can have their code loaded
+static void cache_dir(char* dir){
+    const char* setting = cache_dir_setting != NULL ? cache_dir_setting : getenv("CORAL_JIT_CACHE_DIR");
+    const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if(setting != NULL){
+        snprintf(dir, JIT_PATH_BYTES, "%s", setting);
+    }else if(xdg_cache_home != NULL && xdg_cache_home[0] == '/'){
+        snprintf(dir, JIT_PATH_BYTES, "%s/coral-jit", xdg_cache_home);
+    }else{
+        snprintf(dir, JIT_PATH_BYTES, "/tmp/coral-jit-%u", (unsigned int) geteuid());
+    }
+}
+
+// made if missing; false unless it is a directory (not a link) of this user which nobody else can write or read
+static bool cache_dir_is_private(const char* dir){
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST){
+        return false;
+    }
+    struct stat status;
+    return lstat(dir, &status) == 0 && S_ISDIR(status.st_mode) && status.st_uid == geteuid() && (status.st_mode & 077) == 0;
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const char* bytes, size_t length){
+    for(size_t index = 0; index < length; index++){
+        hash ^= (unsigned char) bytes[index];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// -march=native code only runs where it was compiled, so the host is part of the key
+static uint64_t source_hash(source_t* source){
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    uint64_t hash = hash_bytes(14695981039346656037ull, source->text, source->length);
+    for(int flag = 0; flag < JIT_NUM_FLAGS; flag++){
+        hash = hash_bytes(hash, jit_flags[flag], strlen(jit_flags[flag]) + 1);
+    }
+    return hash_bytes(hash, host, strlen(host));
+}
+
+static bool write_file(const char* path, const char* text, size_t length){
+    // exclusively, so that nothing left at the path is written through
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    FILE* file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(file == NULL){
+        if(fd >= 0){
+            close(fd);
+        }
+        return false;
+    }
+    bool written = fwrite(text, 1, length, file) == length;
+    return (fclose(file) == 0) && written;
+}
+
+// runs compiler (looked up in $PATH, never through a shell) with the flags, its output discarded; true on success
+static bool run_compiler(const char* compiler, const char* source_path, const char* object_path){
+    char* argv[JIT_NUM_FLAGS + 6];
+    int num_args = 0;
+    argv[num_args++] = (char*) compiler;
+    for(int flag = 0; flag < JIT_NUM_FLAGS; flag++){
+        argv[num_args++] = (char*) jit_flags[flag];
+    }
+    argv[num_args++] = "-o";
+    argv[num_args++] = (char*) object_path;
+    argv[num_args++] = (char*) source_path;
+    argv[num_args++] = "-lm";
+    argv[num_args] = NULL;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    pid_t pid;
+    int error = posix_spawnp(&pid, compiler, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if(error != 0){
+        return false;
+    }
+    int status;
+    while(waitpid(pid, &status, 0) < 0){
+        if(errno != EINTR){
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// compiles into a file of its own, then renames it into place, so that processes compiling the same graph at once
+// never load a partly written object
+static bool compile(const char* source_path, const char* object_path){
+    char temporary_path[JIT_PATH_BYTES + 32];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", object_path, (int) getpid());
+    const char* compilers[3] = {getenv("CORAL_JIT_CC"), "clang", "cc"};
+    for(int compiler_index = 0; compiler_index < 3; compiler_index++){
+        if(compilers[compiler_index] == NULL){
+            continue;
+        }
+        if(run_compiler(compilers[compiler_index], source_path, temporary_path)){
+            return rename(temporary_path, object_path) == 0;
+        }
+    }
+    unlink(temporary_path);
+    return false;
+}
+
+// a regular file (not a link) of this user
+static bool is_own_file(const char* path){
+    struct stat status;
+    return lstat(path, &status) == 0 && S_ISREG(status.st_mode) && status.st_uid == geteuid();
+}
+
+static void* load(source_t* source, uint64_t hash, bool* from_cache){
+    char dir[JIT_PATH_BYTES];
+    cache_dir(dir);
+    *from_cache = false;
+    if(!cache_dir_is_private(dir)){
+        return NULL;
+    }
+    char object_path[JIT_PATH_BYTES + 64];
+    snprintf(object_path, sizeof(object_path), "%s/coral_jit_%016" PRIx64 ".so", dir, hash);
+    void* handle = is_own_file(object_path) ? dlopen(object_path, RTLD_NOW | RTLD_LOCAL) : NULL;
+    *from_cache = handle != NULL;
+    if(handle != NULL){
+        return handle;
+    }
+    // the source is kept beside the object, for inspection
+    char source_path[JIT_PATH_BYTES + 64];
+    char temporary_path[JIT_PATH_BYTES + 96];
+    snprintf(source_path, sizeof(source_path), "%s/coral_jit_%016" PRIx64 ".c", dir, hash);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d.c", source_path, (int) getpid());
+    if(!write_file(temporary_path, source->text, source->length) || rename(temporary_path, source_path) != 0){
+        unlink(temporary_path);
+        return NULL;
+    }
+    if(!compile(source_path, object_path) || !is_own_file(object_path)){
+        return NULL;
+    }
+    return dlopen(object_path, RTLD_NOW | RTLD_LOCAL);
+}
+
+/**
+ * PROGRAMS
+*/
+
+jit_program_t* jit_compile(jit_trace_t* trace, variable_t* loss){
+    graph_t graph = {0, NULL, 0, NULL, 0, NULL, 0};
+    int loss_value;
+    if(!graph_build(&graph, trace, loss, &loss_value)){
+        graph_free(&graph);
+        return NULL;
+    }
+    source_t source = {NULL, 0, 0};
+    generate(&source, &graph, loss_value);
+    uint64_t hash = source_hash(&source);
+    bool from_cache;
+    void* handle = load(&source, hash, &from_cache);
+    free(source.text);
+    jit_fn_t fn = handle != NULL ? (jit_fn_t) dlsym(handle, JIT_FN_NAME) : NULL;
+    if(fn == NULL){
+        if(handle != NULL){
+            dlclose(handle);
+        }
+        graph_free(&graph);
+        return NULL;
+    }
+    jit_program_t* program = (jit_program_t*) malloc(sizeof(jit_program_t));
+    program->handle = handle;
+    program->fn = fn;
+    program->hash = hash;
+    program->from_cache = from_cache;
+    program->num_slots = graph.num_slots;
+    program->slots = (tensor_entry_t**) malloc(MAX(graph.num_slots, 1) * sizeof(tensor_entry_t*));
+    program->arena_bytes = graph.arena_entries * sizeof(tensor_entry_t);
+    program->arena = (tensor_entry_t*) memory_alloc(program->arena_bytes);
+    for(int slot = 0; slot < graph.num_slots; slot++){
+        size_t offset = graph.slot_offsets[slot];
+        program->slots[slot] = offset != SIZE_MAX ? program->arena + offset : NULL;
+    }
+    program->num_leaves = 0;
+    program->leaves = (jit_leaf_t*) malloc(MAX(graph.num_values, 1) * sizeof(jit_leaf_t));
+    for(int value_index = 0; value_index < graph.num_values; value_index++){
+        value_t* value = &graph.values[value_index];
+        if(value->producer < 0 && value->data_slot >= 0){
+            jit_leaf_t* leaf = &program->leaves[program->num_leaves++];
+            leaf->variable = value->variable;
+            leaf->size = value->size;
+            leaf->data_slot = value->data_slot;
+            leaf->grad_slot = value->grad_slot;
+        }
+    }
+    program->loss_slot = graph.values[loss_value].data_slot;
+    graph_free(&graph);
+    return program;
+}
+
+tensor_entry_t jit_run(jit_program_t* program){
+    for(int leaf_index = 0; leaf_index < program->num_leaves; leaf_index++){
+        jit_leaf_t* leaf = &program->leaves[leaf_index];
+        variable_t* variable = leaf->variable;
+        NDEBUG_ASSERT(variable->tensor->shape->size == leaf->size, "Leaf shape changed since the graph was compiled!\n");
+        program->slots[leaf->data_slot] = variable->tensor->data;
+        if(leaf->grad_slot >= 0){
+            tensor_make_writable(variable->gradient);
+            program->slots[leaf->grad_slot] = variable->gradient->data;
+        }
+    }
+    (*program->fn)(program->slots);
+    return program->slots[program->loss_slot][0];
+}
+
+void jit_program_free(jit_program_t* program){
+    dlclose(program->handle);
+    memory_free(program->arena, program->arena_bytes);
+    free(program->slots);
+    free(program->leaves);
+    free(program);
+}
@@ -0,0 +1,116 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "variable.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * GRAPH JIT
+ * while a trace is open (per thread), the variable ops run are recorded in it; jit_compile turns the graph under a
+ * scalar loss into a single C function, forward then backward, in which every shape and stride is a constant and every
+ * run of elementwise ops over the same shape is fused into one loop nest (keeping in memory only the values that
+ * backward or a later op reads), compiles it with the system C compiler (-O3 -march=native) into a shared object and
+ * loads it with dlopen
+ * objects are cached on disk under a hash of the generated source (which spells out every op and shape) and of the
+ * host, so a later process compiling the same graph loads the object without compiling
+ *
+ * a compiled program reads the current data of the leaves of the graph (the variables no traced op produced: inputs,
+ * parameters, constants) and adds into the gradients of those which require grad, as backwards would; a step
+ * overwrites the inputs in place (or points their tensors at new data of the same shape) and calls jit_run
+ * supported ops: add, subtract, multiply, square, abs, relu, sigmoid, tanh, exp, log (and their in place forms),
+ * sum, mean, matmul and linear, and so the mae and mse losses; jit_compile returns NULL for a graph with any other op,
+ * reading the output of an op which was not traced (or ran with grad disabled) or a view or copy, or when no compiler
+ * works, so that the caller can keep running the graph through backwards
+*/
+
+typedef enum {
+    JIT_OP_ADD,
+    JIT_OP_SUBTRACT,
+    JIT_OP_MULTIPLY,
+    JIT_OP_SQUARE,
+    JIT_OP_ABS,
+    JIT_OP_RELU,
+    JIT_OP_SIGMOID,
+    JIT_OP_TANH,
+    JIT_OP_EXP,
+    JIT_OP_LOG,
+    JIT_OP_SUM,
+    JIT_OP_MEAN,
+    JIT_OP_MATMUL,
+    JIT_OP_LINEAR, // inputs are [input, weight, (bias)]
+} jit_op_t;
+
+typedef struct {
+    jit_op_t op;
+    variable_t* output;
+    int num_inputs;
+    variable_t* inputs[GRAD_META_MAX_INPUTS];
+    activation_t activation; // linear only
+} jit_node_t;
+
+typedef struct jit_trace jit_trace_t;
+
+struct jit_trace {
+    size_t num_nodes;
+    size_t capacity;
+    jit_node_t* nodes;
+    jit_trace_t* parent;
+};
+
+void jit_trace_begin(jit_trace_t* trace);
+void jit_trace_end(jit_trace_t* trace);
+// frees the recorded nodes
+void jit_trace_clear(jit_trace_t* trace);
+
+// called by the ops themselves; does nothing while no trace is open
+void jit_record(jit_op_t op, variable_t* output, int num_inputs, variable_t** inputs, activation_t activation);
+
+static inline void jit_record_unary(jit_op_t op, variable_t* output, variable_t* input){
+    jit_record(op, output, 1, &input, ACTIVATION_NONE);
+}
+
+static inline void jit_record_binary(jit_op_t op, variable_t* output, variable_t* left, variable_t* right){
+    variable_t* inputs[2] = {left, right};
+    jit_record(op, output, 2, inputs, ACTIVATION_NONE);
+}
+
+/**
+ * PROGRAMS
+*/
+
+typedef void (* jit_fn_t)(tensor_entry_t* const* slots);
+
+typedef struct {
+    variable_t* variable;
+    size_t size;
+    int data_slot;
+    int grad_slot; // -1 unless it requires grad
+} jit_leaf_t;
+
+typedef struct {
+    void* handle;
+    jit_fn_t fn;
+    uint64_t hash;
+    bool from_cache; // loaded without compiling
+    int num_slots;
+    tensor_entry_t** slots; // the buffers handed to fn: leaf data and gradients, then the arena
+    tensor_entry_t* arena; // node values, node gradients and scratch
+    size_t arena_bytes;
+    int num_leaves;
+    jit_leaf_t* leaves;
+    int loss_slot;
+} jit_program_t;
+
+// default: $CORAL_JIT_CACHE_DIR, otherwise $XDG_CACHE_HOME/coral-jit, otherwise /tmp/coral-jit-<uid>; made with mode
+// 0700 if missing, and never used (jit_compile returns NULL) unless it is a directory of this user which nobody else
+// can access, since objects found in it are loaded into the process
+void jit_set_cache_dir(const char* dir);
+// the graph under loss, which must be a scalar produced by a traced op; compilers tried (run from $PATH, without a shell) are $CORAL_JIT_CC, clang, cc
+jit_program_t* jit_compile(jit_trace_t* trace, variable_t* loss);
+// forward and backward: returns the loss, and adds into the gradients of the leaves which require grad
+// a program is run by one thread at a time
+tensor_entry_t jit_run(jit_program_t* program);
+void jit_program_free(jit_program_t* program);
+
+#endif // JIT_H
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE // MAP_HUGETLB, MADV_HUGEPAGE
+#include "memory.h"
+#include "parallel.h"
+#include "assert.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// below this, faulting pages in on the allocating thread costs less than waking the pool
+#define MEMORY_PARALLEL_TOUCH_BYTES ((size_t) 32 << 20)
+
+static memory_pages_t pages_setting = MEMORY_PAGES_TRANSPARENT;
+
+void memory_set_pages(memory_pages_t pages){
+    __atomic_store_n(&pages_setting, pages, __ATOMIC_RELAXED);
+}
+
+static inline size_t round_up(size_t bytes, size_t multiple){
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+/**
+ * FIRST TOUCH
+*/
+
+typedef struct {
+    char* data;
+    size_t num_pages;
+    size_t page_bytes;
+} touch_t;
+
+static void touch_task(void* context, int thread_index, int num_threads){
+    touch_t* touch = (touch_t*) context;
+    size_t start, end;
+    parallel_range(touch->num_pages, thread_index, num_threads, &start, &end);
+    for(size_t page = start; page < end; page++){
+        // volatile, since the page already reads as zero and the store would otherwise be dropped
+        ((volatile char*) touch->data)[page * touch->page_bytes] = 0;
+    }
+}
+
+static int num_threads_setting = 0;
+static thread_pool_t* touch_pool = NULL;
+// an allocation made while another one holds the pool is left to fault in lazily
+static pthread_mutex_t touch_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void memory_set_num_threads(int num_threads){
+    pthread_mutex_lock(&touch_pool_lock);
+    num_threads_setting = num_threads;
+    if(touch_pool != NULL){
+        thread_pool_free(touch_pool);
+        touch_pool = NULL;
+    }
+    pthread_mutex_unlock(&touch_pool_lock);
+}
+
+static void first_touch(void* data, size_t bytes){
+    if(bytes < MEMORY_PARALLEL_TOUCH_BYTES || pthread_mutex_trylock(&touch_pool_lock) != 0){
+        return;
+    }
+    int num_threads = num_threads_setting > 0 ? num_threads_setting : parallel_num_cores();
+    if(touch_pool == NULL && num_threads > 1){
+        touch_pool = thread_pool_new(num_threads);
+    }
+    if(touch_pool != NULL){
+        size_t page_bytes = (size_t) sysconf(_SC_PAGESIZE);
+        touch_t touch = {(char*) data, (bytes + page_bytes - 1) / page_bytes, page_bytes};
+        thread_pool_run(touch_pool, &touch_task, &touch);
+    }
+    pthread_mutex_unlock(&touch_pool_lock);
+}
+
+/**
+ * ALLOCATION
+ * mappings are whole huge pages long (only the pages touched take memory), so that a buffer is unmapped by its
+ * size alone whichever way it was mapped
+*/
+
+// a huge page aligned anonymous mapping of length bytes, on transparent huge pages if advise
+static void* map_aligned(size_t length, bool advise){
+    size_t padded_length = length + MEMORY_HUGE_PAGE_BYTES;
+    char* base = (char*) mmap(NULL, padded_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED){
+        return NULL;
+    }
+    char* data = (char*) round_up((uintptr_t) base, MEMORY_HUGE_PAGE_BYTES);
+    if(data > base){
+        munmap(base, data - base);
+    }
+    munmap(data + length, (base + padded_length) - (data + length));
+    if(advise){
+        // only a hint: without transparent huge page support this fails and 4 KiB pages are used
+        madvise(data, length, MADV_HUGEPAGE);
+    }
+    return data;
+}
+
+static void* map_large(size_t bytes){
+    size_t length = round_up(bytes, MEMORY_HUGE_PAGE_BYTES);
+    memory_pages_t pages = __atomic_load_n(&pages_setting, __ATOMIC_RELAXED);
+    if(pages == MEMORY_PAGES_HUGETLB){
+        void* data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(data != MAP_FAILED){
+            return data;
+        }
+    }
+    return map_aligned(length, pages != MEMORY_PAGES_SMALL);
+}
+
+void* memory_alloc(size_t bytes){
+    if(bytes >= MEMORY_LARGE_BYTES){
+        void* data = map_large(bytes);
+        NDEBUG_ASSERT(data != NULL, "Could not map tensor memory!\n");
+        // fresh anonymous pages are already zero
+        first_touch(data, bytes);
+        return data;
+    }
+    void* data;
+    int error = posix_memalign(&data, MEMORY_ALIGNMENT, bytes > 0 ? bytes : 1);
+    NDEBUG_ASSERT(error == 0, "Could not allocate tensor memory!\n");
+    memset(data, 0, bytes);
+    return data;
+}
+
+void memory_free(void* data, size_t bytes){
+    if(data == NULL){
+        return;
+    }
+    if(bytes >= MEMORY_LARGE_BYTES){
+        munmap(data, round_up(bytes, MEMORY_HUGE_PAGE_BYTES));
+    }else{
+        free(data);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * TENSOR MEMORY
+ * every buffer is zeroed and starts on a MEMORY_ALIGNMENT boundary (a cache line, and a full vector register)
+ * buffers of at least MEMORY_LARGE_BYTES are mapped rather than taken from the heap:
+ * - on 2 MiB pages, to cut TLB misses over multi-GB activations: explicitly (hugetlb) when so set and pages are
+ *   reserved, otherwise transparently (madvise), falling back to 4 KiB pages when neither is available
+ * - from 32 MiB up, first touched in parallel by a pool of its own, so that faulting in
+ *   (and zeroing) the pages is split over cores rather than left to the allocating thread
+ * NOTE: the touching threads are not pinned, nor those of the compute kernels, which split their work their own
+ * way: pages are not placed on the NUMA node of the thread which later works on them
+*/
+
+#define MEMORY_ALIGNMENT 64
+#define MEMORY_HUGE_PAGE_BYTES ((size_t) 2 << 20)
+#define MEMORY_LARGE_BYTES MEMORY_HUGE_PAGE_BYTES
+
+typedef enum {
+    MEMORY_PAGES_SMALL, // 4 KiB pages only
+    MEMORY_PAGES_TRANSPARENT, // madvise(MADV_HUGEPAGE), the default
+    MEMORY_PAGES_HUGETLB, // MAP_HUGETLB, then as MEMORY_PAGES_TRANSPARENT if no huge pages are reserved
+} memory_pages_t;
+
+void memory_set_pages(memory_pages_t pages);
+// threads used for first touch (0, the default, for one per core)
+void memory_set_num_threads(int num_threads);
+
+// bytes may be 0
+void* memory_alloc(size_t bytes);
+// bytes must be those the buffer was allocated with
+void memory_free(void* data, size_t bytes);
+
+#endif // MEMORY_H
@@ -0,0 +1,189 @@
+#include "nn.h"
+#include "variable.h"
+#include "tensor.h"
+#include "assert.h"
+#include "grad.h"
+#include "rng.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct {
+    activation_t activation;
+} linear_context_t;
+
+typedef struct {
+    int num_modules;
+    module_t** modules;
+} sequential_context_t;
+
+static module_t* module_new(int num_params, module_forward_fn_t forward, module_replicate_fn_t replicate, void* context){
+    module_t* new_module = (module_t*) malloc(sizeof(module_t));
+    new_module->num_params = num_params;
+    new_module->params = (variable_t**) malloc(num_params * sizeof(variable_t*));
+    new_module->forward = forward;
+    new_module->replicate = replicate;
+    new_module->context = context;
+    return new_module;
+}
+
+void module_set_requires_grad(module_t* module, bool requires_grad){
+    for(int param_index = 0; param_index < module->num_params; param_index++){
+        variable_set_requires_grad(module->params[param_index], requires_grad);
+    }
+}
+
+variable_t* module_forward(module_t* module, variable_t* input){
+    return (*module->forward)(module, input);
+}
+
+module_t* module_replicate(module_t* module){
+    return (*module->replicate)(module);
+}
+
+// the replica shares the tensor (not just the data), so it follows the parameter if an optimizer moves its data
+static variable_t* param_replicate(variable_t* param){
+    variable_t* replica = variable_new_from_tensor(param->tensor);
+    variable_set_requires_grad(replica, variable_requires_grad(param));
+    return replica;
+}
+
+// for modules whose context is read only configuration
+static module_t* leaf_replicate(module_t* module){
+    module_t* replica = module_new(module->num_params, module->forward, module->replicate, module->context);
+    for(int param_index = 0; param_index < module->num_params; param_index++){
+        replica->params[param_index] = param_replicate(module->params[param_index]);
+    }
+    return replica;
+}
+
+/**
+ * LINEAR
+ * params: weight (in_features x out_features), bias (out_features)
+*/
+
+static variable_t* linear_forward(module_t* module, variable_t* input){
+    linear_context_t* context = (linear_context_t*) module->context;
+    variable_t* bias = (module->num_params == 2) ? module->params[1] : NULL;
+    return variable_linear(input, module->params[0], bias, context->activation);
+}
+
+module_t* module_linear_new(size_t in_features, size_t out_features, bool use_bias, activation_t activation){
+    linear_context_t* context = (linear_context_t*) malloc(sizeof(linear_context_t));
+    context->activation = activation;
+    module_t* new_module = module_new(use_bias ? 2 : 1, &linear_forward, &leaf_replicate, context);
+    variable_t* weight = variable_new(2, in_features, out_features);
+    // uniform in [-1/sqrt(in_features), 1/sqrt(in_features)]
+    tensor_entry_t bound = 1 / sqrtf((tensor_entry_t) in_features);
+    rng_uniform(rng_default(), weight->tensor, -bound, bound);
+    new_module->params[0] = weight;
+    if(use_bias){
+        new_module->params[1] = variable_new(1, out_features);
+    }
+    return new_module;
+}
+
+/**
+ * DROPOUT
+ * params: none
+*/
+
+typedef struct {
+    tensor_entry_t p;
+    rng_t* rng;
+} dropout_context_t;
+
+static variable_t* dropout_forward(module_t* module, variable_t* input){
+    dropout_context_t* context = (dropout_context_t*) module->context;
+    return variable_dropout(input, context->p, context->rng);
+}
+
+module_t* module_dropout_new(tensor_entry_t p, uint64_t seed){
+    dropout_context_t* context = (dropout_context_t*) malloc(sizeof(dropout_context_t));
+    context->p = p;
+    context->rng = rng_new(seed);
+    return module_new(0, &dropout_forward, &leaf_replicate, context);
+}
+
+/**
+ * SEQUENTIAL
+*/
+
+static variable_t* sequential_forward(module_t* module, variable_t* input){
+    sequential_context_t* context = (sequential_context_t*) module->context;
+    variable_t* output = input;
+    for(int module_index = 0; module_index < context->num_modules; module_index++){
+        output = module_forward(context->modules[module_index], output);
+    }
+    return output;
+}
+
+static module_t* sequential_replicate(module_t* module);
+
+module_t* module_sequential_new(int num_modules, module_t** modules){
+    sequential_context_t* context = (sequential_context_t*) malloc(sizeof(sequential_context_t));
+    context->num_modules = num_modules;
+    context->modules = (module_t**) malloc(num_modules * sizeof(module_t*));
+    memcpy(context->modules, modules, num_modules * sizeof(module_t*));
+    int num_params = 0;
+    for(int module_index = 0; module_index < num_modules; module_index++){
+        num_params += modules[module_index]->num_params;
+    }
+    module_t* new_module = module_new(num_params, &sequential_forward, &sequential_replicate, context);
+    int param_index = 0;
+    for(int module_index = 0; module_index < num_modules; module_index++){
+        for(int child_index = 0; child_index < modules[module_index]->num_params; child_index++){
+            new_module->params[param_index++] = modules[module_index]->params[child_index];
+        }
+    }
+    return new_module;
+}
+
+// a sequential of replicas of the children (params are gathered from them, so they are replicated exactly once)
+static module_t* sequential_replicate(module_t* module){
+    sequential_context_t* context = (sequential_context_t*) module->context;
+    module_t* children[context->num_modules];
+    for(int module_index = 0; module_index < context->num_modules; module_index++){
+        children[module_index] = module_replicate(context->modules[module_index]);
+    }
+    module_t* replica = module_sequential_new(context->num_modules, children);
+    replica->forward = module->forward;
+    return replica;
+}
+
+/**
+ * CHECKPOINTED SEQUENTIAL
+ * a sequential of sequential segments
+*/
+
+static variable_t* segment_forward(variable_t* input, void* context){
+    return module_forward((module_t*) context, input);
+}
+
+// the last segment is stored: backward reaches it first, so recomputing it would save nothing
+static variable_t* checkpointed_sequential_forward(module_t* module, variable_t* input){
+    sequential_context_t* context = (sequential_context_t*) module->context;
+    variable_t* output = input;
+    for(int segment_index = 0; segment_index < context->num_modules; segment_index++){
+        segment_policy_t policy = (segment_index + 1 < context->num_modules) ? SEGMENT_RECOMPUTE : SEGMENT_STORE;
+        output = variable_checkpoint(&segment_forward, context->modules[segment_index], output, policy);
+    }
+    return output;
+}
+
+module_t* module_sequential_checkpointed_new(int num_modules, module_t** modules, int segment_length){
+    NDEBUG_ASSERT(num_modules > 0, "Sequential needs at least one module!\n");
+    if(segment_length <= 0){
+        segment_length = (int) ceil(sqrt((double) num_modules));
+    }
+    int num_segments = (num_modules + segment_length - 1) / segment_length;
+    module_t* segments[num_segments];
+    for(int segment_index = 0; segment_index < num_segments; segment_index++){
+        int start = segment_index * segment_length;
+        segments[segment_index] = module_sequential_new(MIN(segment_length, num_modules - start), modules + start);
+    }
+    module_t* new_module = module_sequential_new(num_segments, segments);
+    new_module->forward = &checkpointed_sequential_forward;
+    return new_module;
+}
@@ -0,0 +1,41 @@
+#ifndef NN_H
+#define NN_H
+
+#include "variable.h"
+#include "tensor.h"
+#include <stdbool.h>
+
+typedef struct module module_t;
+
+// input -> output, with module as "self"
+typedef variable_t* (* module_forward_fn_t)(module_t* module, variable_t* input);
+// see module_replicate
+typedef module_t* (* module_replicate_fn_t)(module_t* module);
+
+// a (possibly composite) layer which owns its parameters
+// params of a composite module are the concatenation of those of its children,
+// so that module->params can be handed directly to an optimizer
+struct module {
+    int num_params;
+    variable_t** params;
+    module_forward_fn_t forward;
+    module_replicate_fn_t replicate;
+    void* context; // module specific state
+};
+
+module_t* module_linear_new(size_t in_features, size_t out_features, bool use_bias, activation_t activation);
+// draws its masks from a generator of its own (shared by its replicas), so is reproducible from seed
+module_t* module_dropout_new(tensor_entry_t p, uint64_t seed);
+module_t* module_sequential_new(int num_modules, module_t** modules);
+// a sequential whose modules are grouped into segments of segment_length (0 for about sqrt(num_modules)),
+// every segment but the last recomputing its activations during backward (see variable_checkpoint)
+module_t* module_sequential_checkpointed_new(int num_modules, module_t** modules, int segment_length);
+
+// freezes (false) or unfreezes the parameters of module, eg. a pretrained backbone while fine-tuning a head on it
+void module_set_requires_grad(module_t* module, bool requires_grad);
+variable_t* module_forward(module_t* module, variable_t* input);
+// a module computing the same function with the same parameter tensors, but whose parameters have their own
+// gradients and graph state, so that each thread can build and backpropagate its own graph through it
+module_t* module_replicate(module_t* module);
+
+#endif // NN_H
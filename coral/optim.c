@@ -0,0 +1,206 @@
+#include "optim.h"
+#include "variable.h"
+#include "tensor.h"
+#include "sparse.h"
+#include "assert.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// every parameter slice starts on a 64 byte boundary
+#define OPTIM_ALIGNMENT 64
+#define OPTIM_ALIGNMENT_ENTRIES (OPTIM_ALIGNMENT / sizeof(tensor_entry_t))
+
+static inline size_t round_up_to_alignment(size_t num_entries){
+    return (num_entries + OPTIM_ALIGNMENT_ENTRIES - 1) / OPTIM_ALIGNMENT_ENTRIES * OPTIM_ALIGNMENT_ENTRIES;
+}
+
+static tensor_entry_t* flat_buffer_new(size_t size){
+    tensor_entry_t* buffer;
+    int error = posix_memalign((void**) &buffer, OPTIM_ALIGNMENT, size * sizeof(tensor_entry_t));
+    NDEBUG_ASSERT(error == 0, "Could not allocate optimizer buffer!\n");
+    memset(buffer, 0, size * sizeof(tensor_entry_t));
+    return buffer;
+}
+
+/**
+ * CONSTRUCTORS
+*/
+
+// moves the data and gradients of params into contiguous buffers
+// padding entries are zero and stay zero, so the step loop can run over them unconditionally
+static optimizer_t* optimizer_new(optimizer_kind_t kind, variable_t** params, int num_params){
+    NDEBUG_ASSERT(num_params > 0, "Optimizer needs at least one parameter!\n");
+    optimizer_t* optimizer = (optimizer_t*) calloc(1, sizeof(optimizer_t));
+    optimizer->kind = kind;
+    optimizer->params = (variable_t**) malloc(num_params * sizeof(variable_t*));
+    optimizer->sparse_params = (variable_t**) malloc(num_params * sizeof(variable_t*));
+    for(int param_index = 0; param_index < num_params; param_index++){
+        if(!variable_requires_grad(params[param_index])){
+            continue;
+        }
+        if(params[param_index]->sparse_gradient != NULL){
+            optimizer->sparse_params[optimizer->num_sparse_params++] = params[param_index];
+        }else{
+            optimizer->params[optimizer->num_params++] = params[param_index];
+        }
+    }
+    params = optimizer->params;
+    num_params = optimizer->num_params;
+    size_t size = 0;
+    for(int param_index = 0; param_index < num_params; param_index++){
+        size += round_up_to_alignment(params[param_index]->tensor->shape->size);
+    }
+    optimizer->size = size;
+    optimizer->param_data = flat_buffer_new(size);
+    optimizer->grad_data = flat_buffer_new(size);
+    size_t offset = 0;
+    for(int param_index = 0; param_index < num_params; param_index++){
+        variable_t* param = params[param_index];
+        // the slices become the storages of the tensors, so that their old buffers are released
+        tensor_move_into(param->tensor, optimizer->param_data + offset);
+        tensor_move_into(param->gradient, optimizer->grad_data + offset);
+        offset += round_up_to_alignment(param->tensor->shape->size);
+    }
+    optimizer->sparse_state1 = (tensor_entry_t**) calloc(optimizer->num_sparse_params, sizeof(tensor_entry_t*));
+    optimizer->sparse_state2 = (tensor_entry_t**) calloc(optimizer->num_sparse_params, sizeof(tensor_entry_t*));
+    return optimizer;
+}
+
+// per sparse parameter state buffers, shaped as the parameter
+static void sparse_state_new(optimizer_t* optimizer, tensor_entry_t** sparse_state){
+    for(int param_index = 0; param_index < optimizer->num_sparse_params; param_index++){
+        sparse_state[param_index] = flat_buffer_new(optimizer->sparse_params[param_index]->tensor->shape->size);
+    }
+}
+
+optimizer_t* optimizer_sgd_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t momentum, tensor_entry_t weight_decay){
+    optimizer_t* optimizer = optimizer_new(OPTIMIZER_SGD, params, num_params);
+    optimizer->learning_rate = learning_rate;
+    optimizer->momentum = momentum;
+    optimizer->weight_decay = weight_decay;
+    optimizer->state1 = flat_buffer_new(optimizer->size);
+    sparse_state_new(optimizer, optimizer->sparse_state1);
+    return optimizer;
+}
+
+optimizer_t* optimizer_adam_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t beta1, tensor_entry_t beta2, tensor_entry_t epsilon, tensor_entry_t weight_decay){
+    optimizer_t* optimizer = optimizer_new(OPTIMIZER_ADAM, params, num_params);
+    optimizer->learning_rate = learning_rate;
+    optimizer->beta1 = beta1;
+    optimizer->beta2 = beta2;
+    optimizer->epsilon = epsilon;
+    optimizer->weight_decay = weight_decay;
+    optimizer->state1 = flat_buffer_new(optimizer->size);
+    optimizer->state2 = flat_buffer_new(optimizer->size);
+    sparse_state_new(optimizer, optimizer->sparse_state1);
+    sparse_state_new(optimizer, optimizer->sparse_state2);
+    return optimizer;
+}
+
+// Adam with weight decay applied directly to the parameters rather than folded into the gradient
+optimizer_t* optimizer_adamw_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t beta1, tensor_entry_t beta2, tensor_entry_t epsilon, tensor_entry_t weight_decay){
+    optimizer_t* optimizer = optimizer_adam_new(params, num_params, learning_rate, beta1, beta2, epsilon, weight_decay);
+    optimizer->decoupled_weight_decay = true;
+    return optimizer;
+}
+
+/**
+ * FUSED UPDATE KERNELS
+ * NOTE: each kernel is a single pass over restrict-qualified flat buffers with no calls in the loop body,
+ * so that it is vectorized by the compiler; gradients are zeroed in the same pass
+*/
+
+static void sgd_step(size_t size, tensor_entry_t* restrict param, tensor_entry_t* restrict grad, tensor_entry_t* restrict momentum_buffer, tensor_entry_t learning_rate, tensor_entry_t momentum, tensor_entry_t weight_decay){
+    for(size_t index = 0; index < size; index++){
+        tensor_entry_t update = grad[index] + weight_decay * param[index];
+        update += momentum * momentum_buffer[index];
+        momentum_buffer[index] = update;
+        param[index] -= learning_rate * update;
+        grad[index] = 0;
+    }
+}
+
+static void adam_step(size_t size, tensor_entry_t* restrict param, tensor_entry_t* restrict grad, tensor_entry_t* restrict first_moment, tensor_entry_t* restrict second_moment, tensor_entry_t step_size, tensor_entry_t beta1, tensor_entry_t beta2, tensor_entry_t epsilon, tensor_entry_t inverse_sqrt_correction2, tensor_entry_t coupled_decay, tensor_entry_t decoupled_decay){
+    for(size_t index = 0; index < size; index++){
+        tensor_entry_t g = grad[index] + coupled_decay * param[index];
+        tensor_entry_t m = beta1 * first_moment[index] + (1 - beta1) * g;
+        tensor_entry_t v = beta2 * second_moment[index] + (1 - beta2) * g * g;
+        first_moment[index] = m;
+        second_moment[index] = v;
+        tensor_entry_t denominator = sqrtf(v) * inverse_sqrt_correction2 + epsilon;
+        param[index] = param[index] * decoupled_decay - step_size * m / denominator;
+        grad[index] = 0;
+    }
+}
+
+/**
+ * STEP
+*/
+
+typedef struct {
+    tensor_entry_t step_size;
+    tensor_entry_t inverse_sqrt_correction2;
+    tensor_entry_t coupled_decay;
+    tensor_entry_t decoupled_decay;
+} adam_factors_t;
+
+// the kernel of the optimizer over size entries of the given parameter, gradient and state buffers
+static void run_step(optimizer_t* optimizer, const adam_factors_t* factors, size_t size, tensor_entry_t* param, tensor_entry_t* grad, tensor_entry_t* state1, tensor_entry_t* state2){
+    switch(optimizer->kind){
+        case OPTIMIZER_SGD:
+            sgd_step(size, param, grad, state1, optimizer->learning_rate, optimizer->momentum, optimizer->weight_decay);
+            break;
+        case OPTIMIZER_ADAM:
+            adam_step(size, param, grad, state1, state2, factors->step_size, optimizer->beta1, optimizer->beta2, optimizer->epsilon, factors->inverse_sqrt_correction2, factors->coupled_decay, factors->decoupled_decay);
+            break;
+        default:
+            NDEBUG_ASSERT(0, "Unknown optimizer!\n");
+    }
+}
+
+// the same kernels, on the touched rows of a sparse parameter and the matching rows of its state
+static void sparse_step(optimizer_t* optimizer, const adam_factors_t* factors, int sparse_index){
+    variable_t* param = optimizer->sparse_params[sparse_index];
+    row_sparse_t* gradient = param->sparse_gradient;
+    row_sparse_coalesce(gradient);
+    size_t row_size = gradient->row_size;
+    tensor_entry_t* state1 = optimizer->sparse_state1[sparse_index];
+    tensor_entry_t* state2 = optimizer->sparse_state2[sparse_index];
+    tensor_make_writable(param->tensor);
+    for(size_t index = 0; index < gradient->num_touched; index++){
+        size_t offset = gradient->rows[index] * row_size;
+        run_step(optimizer, factors, row_size, param->tensor->data + offset, gradient->values + index * row_size,
+                 state1 + offset, state2 != NULL ? state2 + offset : NULL);
+    }
+    row_sparse_clear(gradient);
+}
+
+// updates every parameter from its accumulated gradient, then zeros the gradient
+void optimizer_step(optimizer_t* optimizer){
+    optimizer->step_count++;
+    adam_factors_t factors = {0, 0, 0, 0};
+    if(optimizer->kind == OPTIMIZER_ADAM){
+        tensor_entry_t correction1 = 1 - powf(optimizer->beta1, optimizer->step_count);
+        tensor_entry_t correction2 = 1 - powf(optimizer->beta2, optimizer->step_count);
+        factors.step_size = optimizer->learning_rate / correction1;
+        factors.inverse_sqrt_correction2 = 1 / sqrtf(correction2);
+        factors.coupled_decay = optimizer->decoupled_weight_decay ? 0 : optimizer->weight_decay;
+        factors.decoupled_decay = optimizer->decoupled_weight_decay ? 1 - optimizer->learning_rate * optimizer->weight_decay : 1;
+    }
+    // parameters live in the flat buffer, which is written directly: only their versions are bumped
+    for(int param_index = 0; param_index < optimizer->num_params; param_index++){
+        tensor_make_writable(optimizer->params[param_index]->tensor);
+    }
+    run_step(optimizer, &factors, optimizer->size, optimizer->param_data, optimizer->grad_data, optimizer->state1, optimizer->state2);
+    for(int sparse_index = 0; sparse_index < optimizer->num_sparse_params; sparse_index++){
+        sparse_step(optimizer, &factors, sparse_index);
+    }
+}
+
+void optimizer_zero_grad(optimizer_t* optimizer){
+    memset(optimizer->grad_data, 0, optimizer->size * sizeof(tensor_entry_t));
+    for(int sparse_index = 0; sparse_index < optimizer->num_sparse_params; sparse_index++){
+        row_sparse_clear(optimizer->sparse_params[sparse_index]->sparse_gradient);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef OPTIM_H
+#define OPTIM_H
+
+#include "variable.h"
+#include <stdbool.h>
+
+typedef enum {
+    OPTIMIZER_SGD,
+    OPTIMIZER_ADAM,
+} optimizer_kind_t;
+
+// fused multi-tensor optimizer
+// on construction the data and gradients of every parameter are moved into two flat buffers
+// (each parameter's tensor and gradient take their slices as storage, releasing their old buffers), and the state buffers share the same layout,
+// so that a step is one streaming loop over param/grad/state instead of one small loop per parameter
+// parameters with a row sparse gradient (eg. embedding tables) are kept out of the flat buffers: a step only updates
+// (and only advances the state of) the rows their gradient touched, so that it costs the rows looked up rather than
+// the size of the table; momentum and weight decay are thereby applied lazily, to rows as they are touched
+// parameters which do not require grad (are frozen) when the optimizer is made are left out of it altogether
+typedef struct {
+    optimizer_kind_t kind;
+    int num_params;
+    variable_t** params;
+    int num_sparse_params;
+    variable_t** sparse_params;
+    tensor_entry_t** sparse_state1; // one buffer of the size of each sparse parameter
+    tensor_entry_t** sparse_state2;
+    size_t size; // total number of entries in each flat buffer (including alignment padding)
+    tensor_entry_t* param_data;
+    tensor_entry_t* grad_data;
+    tensor_entry_t* state1; // momentum buffer (SGD), first moment (Adam)
+    tensor_entry_t* state2; // second moment (Adam), NULL for SGD
+    tensor_entry_t learning_rate;
+    tensor_entry_t momentum;
+    tensor_entry_t beta1;
+    tensor_entry_t beta2;
+    tensor_entry_t epsilon;
+    tensor_entry_t weight_decay;
+    bool decoupled_weight_decay; // AdamW
+    size_t step_count;
+} optimizer_t;
+
+optimizer_t* optimizer_sgd_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t momentum, tensor_entry_t weight_decay);
+optimizer_t* optimizer_adam_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t beta1, tensor_entry_t beta2, tensor_entry_t epsilon, tensor_entry_t weight_decay);
+optimizer_t* optimizer_adamw_new(variable_t** params, int num_params, tensor_entry_t learning_rate, tensor_entry_t beta1, tensor_entry_t beta2, tensor_entry_t epsilon, tensor_entry_t weight_decay);
+
+void optimizer_step(optimizer_t* optimizer);
+void optimizer_zero_grad(optimizer_t* optimizer);
+
+#endif // OPTIM_H
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE // sched_setaffinity
+#include "parallel.h"
+#include "assert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+
+typedef struct {
+    thread_pool_t* pool;
+    int thread_index;
+} worker_args_t;
+
+static void* thread_pool_worker(void* arg){
+    worker_args_t* args = (worker_args_t*) arg;
+    thread_pool_t* pool = args->pool;
+    int thread_index = args->thread_index;
+    free(args);
+    size_t seen_generation = 0;
+    while(true){
+        pthread_mutex_lock(&pool->lock);
+        while(pool->generation == seen_generation && !pool->stop){
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if(pool->stop){
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen_generation = pool->generation;
+        thread_pool_task_t task = pool->task;
+        void* context = pool->context;
+        pthread_mutex_unlock(&pool->lock);
+        (*task)(context, thread_index, pool->num_threads);
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->num_pending == 0){
+            pthread_cond_signal(&pool->work_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+thread_pool_t* thread_pool_new(int num_threads){
+    NDEBUG_ASSERT(num_threads > 0, "Thread pool needs at least one thread!\n");
+    thread_pool_t* pool = (thread_pool_t*) malloc(sizeof(thread_pool_t));
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->task = NULL;
+    pool->context = NULL;
+    pool->generation = 0;
+    pool->num_pending = 0;
+    pool->stop = false;
+    for(int thread_index = 1; thread_index < num_threads; thread_index++){
+        worker_args_t* args = (worker_args_t*) malloc(sizeof(worker_args_t));
+        args->pool = pool;
+        args->thread_index = thread_index;
+        int error = pthread_create(&pool->threads[thread_index], NULL, &thread_pool_worker, args);
+        NDEBUG_ASSERT(error == 0, "Could not start worker thread!\n");
+    }
+    return pool;
+}
+
+void thread_pool_run(thread_pool_t* pool, thread_pool_task_t task, void* context){
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->context = context;
+    pool->num_pending = pool->num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    (*task)(context, 0, pool->num_threads);
+    pthread_mutex_lock(&pool->lock);
+    while(pool->num_pending > 0){
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(thread_pool_t* pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for(int thread_index = 1; thread_index < pool->num_threads; thread_index++){
+        pthread_join(pool->threads[thread_index], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
+
+int parallel_num_cores(){
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cores > 0 ? (int) num_cores : 1;
+}
+
+// cpu list format of sysfs, eg. "0-15,32-47"
+static bool read_node_cpus(int node, cpu_set_t* cpus){
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if(file == NULL){
+        return false;
+    }
+    CPU_ZERO(cpus);
+    int first, last;
+    while(fscanf(file, "%d", &first) == 1){
+        last = first;
+        int separator = fgetc(file);
+        if(separator == '-'){
+            if(fscanf(file, "%d", &last) != 1){
+                break;
+            }
+            separator = fgetc(file);
+        }
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++){
+            CPU_SET(cpu, cpus);
+        }
+        if(separator != ','){
+            break;
+        }
+    }
+    fclose(file);
+    return CPU_COUNT(cpus) > 0;
+}
+
+bool parallel_pin_to_node(int node, int num_nodes){
+    cpu_set_t cpus;
+    if(!read_node_cpus(node, &cpus)){
+        size_t start, end;
+        parallel_range((size_t) parallel_num_cores(), node % num_nodes, num_nodes, &start, &end);
+        CPU_ZERO(&cpus);
+        for(size_t cpu = start; cpu < end && cpu < CPU_SETSIZE; cpu++){
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
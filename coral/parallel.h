@@ -0,0 +1,41 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// runs on every thread of a pool, thread_index in [0, num_threads)
+typedef void (* thread_pool_task_t)(void* context, int thread_index, int num_threads);
+
+// persistent worker threads, so that dispatching a task costs a wake up rather than a thread creation
+typedef struct {
+    int num_threads; // including the calling thread, which runs as thread 0
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    thread_pool_task_t task;
+    void* context;
+    size_t generation; // incremented per task, so workers can tell a new task from a spurious wake up
+    int num_pending;
+    bool stop;
+} thread_pool_t;
+
+thread_pool_t* thread_pool_new(int num_threads);
+// runs task on all threads of pool and returns once every thread has finished
+void thread_pool_run(thread_pool_t* pool, thread_pool_task_t task, void* context);
+void thread_pool_free(thread_pool_t* pool);
+
+int parallel_num_cores();
+// restricts the calling process to the cores of NUMA node (socket) node, or when the node layout is unknown, to
+// the node-th of num_nodes equal ranges of cores; returns false if affinity could not be set
+bool parallel_pin_to_node(int node, int num_nodes);
+
+// the [start, end) share of thread_index when size items are split evenly over num_threads
+static inline void parallel_range(size_t size, int thread_index, int num_threads, size_t* start, size_t* end){
+    *start = size * thread_index / num_threads;
+    *end = size * (thread_index + 1) / num_threads;
+}
+
+#endif // PARALLEL_H
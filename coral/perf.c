@@ -0,0 +1,363 @@
+#define _GNU_SOURCE // dladdr
+#include "perf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_MAX_OPS 256
+#define PERF_MAX_KEYS 1024 // an op named by a string literal has a key per translation unit using it
+
+int perf_setting = -1;
+
+/**
+ * COUNTERS
+ * each thread opens its counters the first time it runs a scope, as one group (read in a single syscall), closing
+ * them when it exits; a counter which cannot be opened is left out, and a thread without any still times its scopes
+*/
+
+typedef struct {
+    uint32_t type;
+    uint64_t config;
+} perf_event_config_t;
+
+#define PERF_CACHE_READ_MISS(CACHE) \
+    ((CACHE) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const perf_event_config_t event_configs[PERF_NUM_COUNTERS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1_MISSES] = {PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+typedef struct {
+    bool opened;
+    int leader_fd; // -1 without any counter
+    int fds[PERF_NUM_COUNTERS];
+    int num_counted;
+    int slots[PERF_NUM_COUNTERS]; // the position of each counter in a group read, -1 if not counted
+} perf_thread_t;
+
+static __thread perf_thread_t thread_counters = {false, -1, {0}, 0, {0}};
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static int open_event(const perf_event_config_t* config, int group_fd){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = config->type;
+    attr.config = config->config;
+    attr.disabled = group_fd < 0; // the leader enables the group once every member is in
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void close_counters(void* arg){
+    perf_thread_t* counters = (perf_thread_t*) arg;
+    for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+        if(counters->slots[counter] >= 0){
+            close(counters->fds[counter]);
+        }
+    }
+    counters->leader_fd = -1;
+    counters->num_counted = 0;
+}
+
+static void create_thread_key(){
+    pthread_key_create(&thread_key, &close_counters);
+}
+
+static perf_thread_t* get_thread_counters(){
+    perf_thread_t* counters = &thread_counters;
+    if(counters->opened){
+        return counters;
+    }
+    counters->opened = true;
+    for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+        int fd = open_event(&event_configs[counter], counters->leader_fd);
+        counters->slots[counter] = -1;
+        if(fd < 0){
+            continue;
+        }
+        if(counters->leader_fd < 0){
+            counters->leader_fd = fd;
+        }
+        counters->fds[counter] = fd;
+        counters->slots[counter] = counters->num_counted++;
+    }
+    if(counters->leader_fd >= 0){
+        if(ioctl(counters->leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0){
+            close_counters(counters);
+            for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+                counters->slots[counter] = -1;
+            }
+            return counters;
+        }
+        pthread_once(&thread_key_once, &create_thread_key);
+        pthread_setspecific(thread_key, counters);
+    }
+    return counters;
+}
+
+// the counts of the thread so far, scaled up by the time its group was multiplexed out; false if it cannot be read
+static bool read_counters(perf_thread_t* counters, uint64_t* counts, bool* counted){
+    for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+        counted[counter] = false;
+    }
+    if(counters->leader_fd < 0){
+        return false;
+    }
+    // nr, time enabled, time running, then a value per counter
+    uint64_t values[3 + PERF_NUM_COUNTERS];
+    ssize_t bytes = read(counters->leader_fd, values, (3 + counters->num_counted) * sizeof(uint64_t));
+    if(bytes != (ssize_t) ((3 + counters->num_counted) * sizeof(uint64_t)) || values[2] == 0){
+        return false;
+    }
+    double scale = (double) values[1] / values[2];
+    for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+        int slot = counters->slots[counter];
+        if(slot >= 0){
+            counts[counter] = (uint64_t) (values[3 + slot] * scale);
+            counted[counter] = true;
+        }
+    }
+    return true;
+}
+
+bool perf_counters_available(){
+    return get_thread_counters()->leader_fd >= 0;
+}
+
+/**
+ * SETTINGS
+*/
+
+static void report_at_exit(){
+    perf_report(stderr);
+}
+
+static void resolve_from_environment(){
+    const char* variable = getenv("CORAL_PERF");
+    int enabled = variable != NULL && strcmp(variable, "1") == 0;
+    int unresolved = -1;
+    // a setting made in the meantime wins
+    if(__atomic_compare_exchange_n(&perf_setting, &unresolved, enabled, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && enabled){
+        atexit(&report_at_exit);
+    }
+}
+
+bool perf_resolve_enabled(){
+    static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+    pthread_once(&resolve_once, &resolve_from_environment);
+    return __atomic_load_n(&perf_setting, __ATOMIC_RELAXED) == 1;
+}
+
+void perf_set_enabled(bool enabled){
+    __atomic_store_n(&perf_setting, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * AGGREGATION
+ * per op, under a lock taken once per scope; ops are found by key, and keys of the same name share their op
+*/
+
+typedef struct {
+    char name[PERF_NAME_BYTES];
+    perf_stats_t stats;
+} perf_op_t;
+
+typedef struct {
+    const void* key;
+    int op_index;
+} perf_key_t;
+
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static perf_op_t ops[PERF_MAX_OPS];
+static int num_ops = 0;
+static perf_key_t keys[PERF_MAX_KEYS];
+static int num_keys = 0;
+static uint64_t num_dropped = 0; // scopes of ops past PERF_MAX_OPS (or keys past PERF_MAX_KEYS)
+
+static uint64_t now_nanoseconds(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// a grad op is named by its symbol, when exported (see -rdynamic in the Makefile)
+static void resolve_name(const perf_scope_t* scope, char* name){
+    if(scope->name != NULL){
+        snprintf(name, PERF_NAME_BYTES, "%s", scope->name);
+        return;
+    }
+    Dl_info info;
+    if(dladdr((void*) scope->key, &info) != 0 && info.dli_sname != NULL && info.dli_saddr == scope->key){
+        snprintf(name, PERF_NAME_BYTES, "%s", info.dli_sname);
+    }else{
+        snprintf(name, PERF_NAME_BYTES, "grad op %p", scope->key);
+    }
+}
+
+static int find_op_locked(const char* name){
+    for(int op_index = 0; op_index < num_ops; op_index++){
+        if(strcmp(ops[op_index].name, name) == 0){
+            return op_index;
+        }
+    }
+    return -1;
+}
+
+// -1 when full
+static int find_or_add_key_locked(const perf_scope_t* scope){
+    for(int key_index = 0; key_index < num_keys; key_index++){
+        if(keys[key_index].key == scope->key){
+            return keys[key_index].op_index;
+        }
+    }
+    if(num_keys == PERF_MAX_KEYS){
+        return -1;
+    }
+    char name[PERF_NAME_BYTES];
+    resolve_name(scope, name);
+    int op_index = find_op_locked(name);
+    if(op_index < 0){
+        if(num_ops == PERF_MAX_OPS){
+            return -1;
+        }
+        op_index = num_ops++;
+        memset(&ops[op_index], 0, sizeof(perf_op_t));
+        snprintf(ops[op_index].name, PERF_NAME_BYTES, "%s", name);
+    }
+    keys[num_keys++] = (perf_key_t) {scope->key, op_index};
+    return op_index;
+}
+
+void perf_scope_start(perf_scope_t* scope, const char* name, const void* key){
+    scope->name = name;
+    scope->key = name != NULL ? (const void*) name : key;
+    read_counters(get_thread_counters(), scope->start_counts, scope->counted);
+    // last, so that reading the counters is not timed
+    scope->start_nanoseconds = now_nanoseconds();
+}
+
+void perf_scope_stop(perf_scope_t* scope, size_t num_entries){
+    uint64_t nanoseconds = now_nanoseconds() - scope->start_nanoseconds;
+    uint64_t counts[PERF_NUM_COUNTERS];
+    bool counted[PERF_NUM_COUNTERS];
+    read_counters(get_thread_counters(), counts, counted);
+    pthread_mutex_lock(&perf_lock);
+    int op_index = find_or_add_key_locked(scope);
+    if(op_index < 0){
+        num_dropped++;
+        pthread_mutex_unlock(&perf_lock);
+        return;
+    }
+    perf_stats_t* stats = &ops[op_index].stats;
+    stats->num_calls++;
+    stats->num_entries += num_entries;
+    stats->nanoseconds += nanoseconds;
+    for(int counter = 0; counter < PERF_NUM_COUNTERS; counter++){
+        // scaling may make a count step back by a little
+        if(scope->counted[counter] && counted[counter] && counts[counter] >= scope->start_counts[counter]){
+            stats->counts[counter] += counts[counter] - scope->start_counts[counter];
+            stats->counted[counter] = true;
+        }
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+bool perf_lookup(const char* name, perf_stats_t* stats){
+    pthread_mutex_lock(&perf_lock);
+    int op_index = find_op_locked(name);
+    if(op_index >= 0){
+        *stats = ops[op_index].stats;
+    }
+    pthread_mutex_unlock(&perf_lock);
+    return op_index >= 0;
+}
+
+void perf_reset(){
+    pthread_mutex_lock(&perf_lock);
+    num_ops = 0;
+    num_keys = 0;
+    num_dropped = 0;
+    pthread_mutex_unlock(&perf_lock);
+}
+
+/**
+ * REPORT
+*/
+
+static bool any_counted(const perf_op_t* op_list, int count, perf_counter_t counter){
+    for(int op_index = 0; op_index < count; op_index++){
+        if(op_list[op_index].stats.counted[counter]){
+            return true;
+        }
+    }
+    return false;
+}
+
+static int compare_ops_by_cycles(const void* left, const void* right){
+    const perf_stats_t* left_stats = &((const perf_op_t*) left)->stats;
+    const perf_stats_t* right_stats = &((const perf_op_t*) right)->stats;
+    if(left_stats->counts[PERF_CYCLES] != right_stats->counts[PERF_CYCLES]){
+        return left_stats->counts[PERF_CYCLES] < right_stats->counts[PERF_CYCLES] ? 1 : -1;
+    }
+    return left_stats->nanoseconds < right_stats->nanoseconds ? 1 : left_stats->nanoseconds > right_stats->nanoseconds ? -1 : 0;
+}
+
+// the count per entry of an op, or "-" where it was not counted
+static void print_per_entry(FILE* file, const perf_stats_t* stats, perf_counter_t counter){
+    if(stats->counted[counter] && stats->num_entries > 0){
+        fprintf(file, " %12.4f", (double) stats->counts[counter] / stats->num_entries);
+    }else{
+        fprintf(file, " %12s", "-");
+    }
+}
+
+void perf_report(FILE* file){
+    // a snapshot, so that the lock is not held while printing
+    perf_op_t* snapshot = malloc(PERF_MAX_OPS * sizeof(perf_op_t));
+    pthread_mutex_lock(&perf_lock);
+    int count = num_ops;
+    uint64_t dropped = num_dropped;
+    memcpy(snapshot, ops, count * sizeof(perf_op_t));
+    pthread_mutex_unlock(&perf_lock);
+    // by time alone where no cycles were counted, as all cycle counts are then 0
+    qsort(snapshot, count, sizeof(perf_op_t), &compare_ops_by_cycles);
+    fprintf(file, "coral perf: %d ops (inclusive of nested ops, calling threads only)\n", count);
+    if(!any_counted(snapshot, count, PERF_CYCLES) && !any_counted(snapshot, count, PERF_INSTRUCTIONS)){
+        fprintf(file, "hardware counters unavailable: calls, entries and time only\n");
+    }
+    fprintf(file, "%-32s %10s %14s %12s %8s %12s %12s %12s %12s\n",
+            "op", "calls", "entries", "ms", "IPC", "cycles/entry", "L1 miss/ent", "LLC miss/ent", "br miss/ent");
+    for(int op_index = 0; op_index < count; op_index++){
+        const perf_stats_t* stats = &snapshot[op_index].stats;
+        fprintf(file, "%-32s %10llu %14llu %12.3f", snapshot[op_index].name, (unsigned long long) stats->num_calls,
+                (unsigned long long) stats->num_entries, stats->nanoseconds / 1e6);
+        if(stats->counted[PERF_CYCLES] && stats->counted[PERF_INSTRUCTIONS] && stats->counts[PERF_CYCLES] > 0){
+            fprintf(file, " %8.2f", (double) stats->counts[PERF_INSTRUCTIONS] / stats->counts[PERF_CYCLES]);
+        }else{
+            fprintf(file, " %8s", "-");
+        }
+        print_per_entry(file, stats, PERF_CYCLES);
+        print_per_entry(file, stats, PERF_L1_MISSES);
+        print_per_entry(file, stats, PERF_LLC_MISSES);
+        print_per_entry(file, stats, PERF_BRANCH_MISSES);
+        fprintf(file, "\n");
+    }
+    if(dropped > 0){
+        fprintf(file, "%llu scopes dropped: more than %d ops\n", (unsigned long long) dropped, PERF_MAX_OPS);
+    }
+    free(snapshot);
+}
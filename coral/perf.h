@@ -0,0 +1,87 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * HARDWARE COUNTERS
+ * optional instrumentation of op scopes with the Linux perf_event_open counters below, aggregated per op across a
+ * run, so that compute bound kernels (high IPC) can be told from memory bound ones (cache misses per entry)
+ * - covered: the broadcast kernels (elementwise.h, and tensor_broadcast_fn), tensor_reduce_to_shape, and each grad
+ *   op run by backwards (named by its symbol, see -rdynamic in the Makefile)
+ * - counts are inclusive (a reduction run by a grad op is counted in both) and of the calling thread only (not of
+ *   the workers a kernel may split its work over)
+ * - off by default, when a scope costs a single branch; with perf_set_enabled (or $CORAL_PERF=1, which also prints
+ *   the report to stderr at exit), each scope reads the counters of its thread at either end
+ * where counters cannot be opened (no PMU, as in most VMs and containers, or perf_event_paranoid), calls, entries
+ * and wall time are still aggregated, and the report marks the missing counters
+*/
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1_MISSES, // L1 data cache read misses
+    PERF_LLC_MISSES, // last level cache read misses
+    PERF_BRANCH_MISSES,
+    PERF_NUM_COUNTERS,
+} perf_counter_t;
+
+#define PERF_NAME_BYTES 64
+
+typedef struct {
+    uint64_t num_calls;
+    uint64_t num_entries; // as given by each scope, eg. the entries of its output
+    uint64_t nanoseconds;
+    uint64_t counts[PERF_NUM_COUNTERS]; // scaled up when the kernel multiplexed the counters
+    bool counted[PERF_NUM_COUNTERS]; // false for a counter which could not be opened
+} perf_stats_t;
+
+typedef struct {
+    bool active;
+    const void* key;
+    const char* name;
+    uint64_t start_nanoseconds;
+    uint64_t start_counts[PERF_NUM_COUNTERS];
+    bool counted[PERF_NUM_COUNTERS];
+} perf_scope_t;
+
+void perf_set_enabled(bool enabled);
+// the setting, resolved from $CORAL_PERF until set
+bool perf_resolve_enabled();
+// whether any counter can be opened on this machine
+bool perf_counters_available();
+
+extern int perf_setting; // -1 until resolved, see perf_is_enabled
+
+static inline bool perf_is_enabled(){
+    int setting = __atomic_load_n(&perf_setting, __ATOMIC_RELAXED);
+    return setting < 0 ? perf_resolve_enabled() : setting == 1;
+}
+
+void perf_scope_start(perf_scope_t* scope, const char* name, const void* key);
+void perf_scope_stop(perf_scope_t* scope, size_t num_entries);
+
+// an op is keyed by name (a string literal), or by key (eg. a grad op) with a NULL name, named by its symbol
+static inline void perf_begin(perf_scope_t* scope, const char* name, const void* key){
+    scope->active = perf_is_enabled();
+    if(scope->active){
+        perf_scope_start(scope, name, key);
+    }
+}
+
+static inline void perf_end(perf_scope_t* scope, size_t num_entries){
+    if(scope->active){
+        perf_scope_stop(scope, num_entries);
+    }
+}
+
+// the stats of the op of that name, summed over its keys; false if it never ran
+bool perf_lookup(const char* name, perf_stats_t* stats);
+// per op (by cycles, or by time without counters): calls, entries, time, IPC and misses per entry
+void perf_report(FILE* file);
+void perf_reset();
+
+#endif // PERF_H
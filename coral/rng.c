@@ -0,0 +1,314 @@
+#include "rng.h"
+#include "tensor.h"
+#include "parallel.h"
+#include "memory.h"
+#include "tune.h"
+#include "assert.h"
+#include "utils.h"
+#include "vmath.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define RNG_CHUNK 1024 // entries generated at a time, a multiple of 4
+#define RNG_PARALLEL_MIN_ENTRIES (1 << 18) // unless tuned (see rng_tune)
+#define RNG_TUNE_KEY "rng_parallel_min_entries"
+
+/**
+ * PHILOX4X32-10
+ * Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"
+*/
+
+static inline void philox4x32(uint64_t block, uint64_t seed, uint32_t* words){
+    uint32_t c0 = (uint32_t) block, c1 = (uint32_t) (block >> 32), c2 = 0, c3 = 0;
+    uint32_t k0 = (uint32_t) seed, k1 = (uint32_t) (seed >> 32);
+    for(int round = 0; round < 10; round++){
+        uint64_t product0 = (uint64_t) 0xD2511F53u * c0;
+        uint64_t product1 = (uint64_t) 0xCD9E8D57u * c2;
+        uint32_t next0 = (uint32_t) (product1 >> 32) ^ c1 ^ k0;
+        uint32_t next2 = (uint32_t) (product0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) product1;
+        c3 = (uint32_t) product0;
+        c0 = next0;
+        c2 = next2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    words[0] = c0;
+    words[1] = c1;
+    words[2] = c2;
+    words[3] = c3;
+}
+
+// the words of entries [start, start + length) of the draw at offset, start a multiple of 4
+// words must hold length rounded up to a multiple of 4
+static void rng_words(uint64_t seed, uint64_t offset, size_t start, size_t length, uint32_t* words){
+    for(size_t index = 0; index < length; index += 4){
+        philox4x32(offset + (start + index) / 4, seed, words + index);
+    }
+}
+
+// in [0, 1)
+static inline tensor_entry_t uniform_from_word(uint32_t word){
+    return (tensor_entry_t) (word >> 8) * (1.0f / (1 << 24));
+}
+
+// in (-1, 1), symmetric and never +-1, so that erfinv is finite
+static inline tensor_entry_t open_symmetric_from_word(uint32_t word){
+    return ((tensor_entry_t) (int32_t) (2 * (word >> 9) + 1) - (1 << 23)) * (1.0f / (1 << 23));
+}
+
+// Giles, "Approximating the erfinv function", single precision version, with both branches selected between
+static inline tensor_entry_t erfinvf(tensor_entry_t x){
+    tensor_entry_t w = -vmath_logf((1 - x) * (1 + x));
+    tensor_entry_t central = w - 2.5f;
+    tensor_entry_t p = 2.81022636e-08f;
+    p = 3.43273939e-07f + p * central;
+    p = -3.5233877e-06f + p * central;
+    p = -4.39150654e-06f + p * central;
+    p = 0.00021858087f + p * central;
+    p = -0.00125372503f + p * central;
+    p = -0.00417768164f + p * central;
+    p = 0.246640727f + p * central;
+    p = 1.50140941f + p * central;
+    tensor_entry_t tail = sqrtf(w) - 3;
+    tensor_entry_t q = -0.000200214257f;
+    q = 0.000100950558f + q * tail;
+    q = 0.00134934322f + q * tail;
+    q = -0.00367342844f + q * tail;
+    q = 0.00573950773f + q * tail;
+    q = -0.0076224613f + q * tail;
+    q = 0.00943887047f + q * tail;
+    q = 1.00167406f + q * tail;
+    q = 2.83297682f + q * tail;
+    return (w < 5 ? p : q) * x;
+}
+
+/**
+ * FILLS
+ * split into chunks of RNG_CHUNK entries over a thread pool; each chunk is generated into a buffer of words and
+ * transformed from there, both loops being vectorizable
+*/
+
+typedef enum {
+    FILL_UNIFORM,
+    FILL_NORMAL,
+    FILL_TRUNCATED_NORMAL,
+    FILL_DROPOUT,
+} fill_kind_t;
+
+typedef struct {
+    fill_kind_t kind;
+    uint64_t seed;
+    uint64_t offset;
+    tensor_entry_t scale; // high - low, std, std, 1 / (1 - p)
+    tensor_entry_t shift; // low, mean, mean, p
+    tensor_entry_t* source; // dropout only
+    tensor_entry_t* dest;
+    size_t size;
+} fill_t;
+
+static void fill_chunk(fill_t* fill, size_t start, size_t length){
+    uint32_t words[RNG_CHUNK];
+    rng_words(fill->seed, fill->offset, start, length, words);
+    tensor_entry_t* dest = fill->dest + start;
+    tensor_entry_t scale = fill->scale;
+    tensor_entry_t shift = fill->shift;
+    switch(fill->kind){
+        case FILL_UNIFORM:
+            for(size_t index = 0; index < length; index++){
+                dest[index] = shift + scale * uniform_from_word(words[index]);
+            }
+            break;
+        case FILL_NORMAL:
+            for(size_t index = 0; index < length; index++){
+                dest[index] = shift + scale * (tensor_entry_t) M_SQRT2 * erfinvf(open_symmetric_from_word(words[index]));
+            }
+            break;
+        case FILL_TRUNCATED_NORMAL:
+            // erf(2 / sqrt(2)): the uniform is squeezed onto the CDF between -2 and 2 std
+            for(size_t index = 0; index < length; index++){
+                tensor_entry_t x = 0.954499736f * open_symmetric_from_word(words[index]);
+                dest[index] = shift + scale * (tensor_entry_t) M_SQRT2 * erfinvf(x);
+            }
+            break;
+        case FILL_DROPOUT:
+            for(size_t index = 0; index < length; index++){
+                tensor_entry_t keep = uniform_from_word(words[index]) >= shift ? scale : 0;
+                dest[index] = fill->source[start + index] * keep;
+            }
+            break;
+    }
+}
+
+static void fill_task(void* context, int thread_index, int num_threads){
+    fill_t* fill = (fill_t*) context;
+    size_t num_chunks = (fill->size + RNG_CHUNK - 1) / RNG_CHUNK;
+    size_t start, end;
+    parallel_range(num_chunks, thread_index, num_threads, &start, &end);
+    for(size_t chunk = start; chunk < end; chunk++){
+        size_t chunk_start = chunk * RNG_CHUNK;
+        fill_chunk(fill, chunk_start, MIN((size_t) RNG_CHUNK, fill->size - chunk_start));
+    }
+}
+
+static int num_threads_setting = 0;
+static thread_pool_t* fill_pool = NULL;
+// a fill started while another one holds the pool runs on the calling thread alone
+static pthread_mutex_t fill_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void rng_set_num_threads(int num_threads){
+    pthread_mutex_lock(&fill_pool_lock);
+    num_threads_setting = num_threads;
+    if(fill_pool != NULL){
+        thread_pool_free(fill_pool);
+        fill_pool = NULL;
+    }
+    pthread_mutex_unlock(&fill_pool_lock);
+}
+
+static void fill_run(fill_t* fill){
+    bool worth_splitting = fill->size >= tune_lookup_size(RNG_TUNE_KEY, RNG_PARALLEL_MIN_ENTRIES);
+    if(worth_splitting && pthread_mutex_trylock(&fill_pool_lock) == 0){
+        int num_threads = num_threads_setting > 0 ? num_threads_setting : parallel_num_cores();
+        if(fill_pool == NULL && num_threads > 1){
+            fill_pool = thread_pool_new(num_threads);
+        }
+        if(fill_pool != NULL){
+            thread_pool_run(fill_pool, &fill_task, fill);
+            pthread_mutex_unlock(&fill_pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&fill_pool_lock);
+    }
+    fill_task(fill, 0, 1);
+}
+
+static void tune_workload(void* context, size_t size){
+    fill_t fill = {FILL_NORMAL, 0, 0, 1, 0, NULL, (tensor_entry_t*) context, size};
+    fill_run(&fill);
+}
+
+void rng_tune(){
+    size_t max_entries = (size_t) 1 << 22;
+    tensor_entry_t* dest = (tensor_entry_t*) memory_alloc(max_entries * sizeof(tensor_entry_t));
+    tune_threshold(RNG_TUNE_KEY, &tune_workload, dest, (size_t) 1 << 12, max_entries);
+    memory_free(dest, max_entries * sizeof(tensor_entry_t));
+}
+
+/**
+ * GENERATORS
+*/
+
+rng_t* rng_new(uint64_t seed){
+    rng_t* rng = (rng_t*) malloc(sizeof(rng_t));
+    rng->seed = seed;
+    rng->offset = 0;
+    return rng;
+}
+
+static rng_t default_rng = {0, 0};
+
+rng_t* rng_default(){
+    return &default_rng;
+}
+
+static __thread rng_record_t* current_record = NULL;
+
+static uint64_t record_reserve(rng_record_t* record, rng_t* rng, uint64_t num_blocks){
+    if(record == NULL){
+        return __atomic_fetch_add(&rng->offset, num_blocks, __ATOMIC_RELAXED);
+    }
+    if(record->replaying){
+        NDEBUG_ASSERT(record->cursor < record->num_draws, "Replay makes more random draws than were recorded!\n");
+        return record->offsets[record->cursor++];
+    }
+    uint64_t offset = record_reserve(record->parent, rng, num_blocks);
+    if(record->num_draws == record->capacity){
+        record->capacity = MAX(2 * record->capacity, (size_t) 8);
+        record->offsets = (uint64_t*) realloc(record->offsets, record->capacity * sizeof(uint64_t));
+    }
+    record->offsets[record->num_draws++] = offset;
+    return offset;
+}
+
+uint64_t rng_reserve(rng_t* rng, size_t num_entries){
+    return record_reserve(current_record, rng, (num_entries + 3) / 4);
+}
+
+static void rng_fill(rng_t* rng, tensor_t* tensor, fill_kind_t kind, tensor_entry_t scale, tensor_entry_t shift){
+    tensor_make_writable(tensor);
+    fill_t fill = {kind, rng->seed, rng_reserve(rng, tensor->shape->size), scale, shift, NULL, tensor->data, tensor->shape->size};
+    fill_run(&fill);
+}
+
+void rng_uniform(rng_t* rng, tensor_t* tensor, tensor_entry_t low, tensor_entry_t high){
+    rng_fill(rng, tensor, FILL_UNIFORM, high - low, low);
+}
+
+void rng_normal(rng_t* rng, tensor_t* tensor, tensor_entry_t mean, tensor_entry_t std){
+    rng_fill(rng, tensor, FILL_NORMAL, std, mean);
+}
+
+void rng_truncated_normal(rng_t* rng, tensor_t* tensor, tensor_entry_t mean, tensor_entry_t std){
+    rng_fill(rng, tensor, FILL_TRUNCATED_NORMAL, std, mean);
+}
+
+void rng_xavier_uniform(rng_t* rng, tensor_t* tensor, size_t fan_in, size_t fan_out){
+    tensor_entry_t bound = sqrtf(6.0f / (fan_in + fan_out));
+    rng_uniform(rng, tensor, -bound, bound);
+}
+
+void rng_xavier_normal(rng_t* rng, tensor_t* tensor, size_t fan_in, size_t fan_out){
+    rng_normal(rng, tensor, 0, sqrtf(2.0f / (fan_in + fan_out)));
+}
+
+void rng_he_uniform(rng_t* rng, tensor_t* tensor, size_t fan_in){
+    tensor_entry_t bound = sqrtf(6.0f / fan_in);
+    rng_uniform(rng, tensor, -bound, bound);
+}
+
+void rng_he_normal(rng_t* rng, tensor_t* tensor, size_t fan_in){
+    rng_normal(rng, tensor, 0, sqrtf(2.0f / fan_in));
+}
+
+tensor_t* tensor_dropout(tensor_t* tensor, tensor_entry_t p, uint64_t seed, uint64_t offset){
+    NDEBUG_ASSERT(0 <= p && p < 1, "Dropout probability must be in [0, 1)!\n");
+    tensor_t* new_tensor = tensor_new_like(tensor);
+    fill_t fill = {FILL_DROPOUT, seed, offset, 1 / (1 - p), p, tensor->data, new_tensor->data, tensor->shape->size};
+    fill_run(&fill);
+    return new_tensor;
+}
+
+/**
+ * RECORD AND REPLAY
+*/
+
+void rng_record_begin(rng_record_t* record){
+    record->num_draws = 0;
+    record->capacity = 0;
+    record->offsets = NULL;
+    record->cursor = 0;
+    record->replaying = false;
+    record->parent = current_record;
+    current_record = record;
+}
+
+void rng_record_end(rng_record_t* record){
+    NDEBUG_ASSERT(current_record == record, "Random records must be ended in reverse order of beginning!\n");
+    current_record = record->parent;
+}
+
+void rng_replay_begin(rng_record_t* record){
+    record->cursor = 0;
+    record->replaying = true;
+    record->parent = current_record;
+    current_record = record;
+}
+
+void rng_replay_end(rng_record_t* record){
+    NDEBUG_ASSERT(current_record == record, "Random records must be ended in reverse order of beginning!\n");
+    record->replaying = false;
+    current_record = record->parent;
+}
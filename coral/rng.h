@@ -0,0 +1,73 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "tensor.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * COUNTER BASED RANDOM NUMBERS
+ * entry i of a draw is a pure function of (seed, counter), Philox4x32-10 of the counter offset + i / 4, so that
+ * - a draw is split over any number of threads with bit identical results
+ * - a draw is reproduced from (seed, offset) alone, eg. a dropout mask in backward, rather than stored
+ * a generator only hands out ranges of counters (atomically, so it may be shared between threads)
+ *
+ * distributions:
+ * - uniform: 24 random bits, in [low, high)
+ * - normal: inverse CDF of 23 random bits (through erfinv), so never more than 5.3 std from the mean
+ * - truncated normal: the same, restricted to within 2 std of the mean (exactly, not by resampling)
+*/
+
+typedef struct {
+    uint64_t seed;
+    uint64_t offset; // counters (blocks of 4 entries) handed out so far
+} rng_t;
+
+rng_t* rng_new(uint64_t seed);
+// the generator used for default initialisations (eg. module_linear_new), seeded with 0
+rng_t* rng_default();
+// threads used for large fills (0, the default, for one per core); the result never depends on it
+void rng_set_num_threads(int num_threads);
+// tunes the size from which fills are split over threads (see tune.h)
+void rng_tune();
+// reserves the counters of a draw of num_entries entries, returning the first
+uint64_t rng_reserve(rng_t* rng, size_t num_entries);
+
+void rng_uniform(rng_t* rng, tensor_t* tensor, tensor_entry_t low, tensor_entry_t high);
+void rng_normal(rng_t* rng, tensor_t* tensor, tensor_entry_t mean, tensor_entry_t std);
+void rng_truncated_normal(rng_t* rng, tensor_t* tensor, tensor_entry_t mean, tensor_entry_t std);
+
+// glorot: variance 2 / (fan_in + fan_out); he: variance 2 / fan_in (for relu layers)
+void rng_xavier_uniform(rng_t* rng, tensor_t* tensor, size_t fan_in, size_t fan_out);
+void rng_xavier_normal(rng_t* rng, tensor_t* tensor, size_t fan_in, size_t fan_out);
+void rng_he_uniform(rng_t* rng, tensor_t* tensor, size_t fan_in);
+void rng_he_normal(rng_t* rng, tensor_t* tensor, size_t fan_in);
+
+// entries of tensor are zeroed with probability p, and the rest scaled by 1 / (1 - p), by the draw at offset;
+// as this is linear, the same call on the output gradient is the backward pass
+tensor_t* tensor_dropout(tensor_t* tensor, tensor_entry_t p, uint64_t seed, uint64_t offset);
+
+/**
+ * RECORD AND REPLAY
+ * while a record is open (per thread), the offset of every draw is logged in it; while it is replayed, draws are
+ * handed the logged offsets in order instead, so that a recomputation (see variable_checkpoint) sees the same
+ * random numbers, eg. the same dropout masks, as the original computation
+*/
+
+typedef struct rng_record rng_record_t;
+
+struct rng_record {
+    size_t num_draws;
+    size_t capacity;
+    uint64_t* offsets;
+    size_t cursor; // next draw to replay
+    bool replaying;
+    rng_record_t* parent;
+};
+
+void rng_record_begin(rng_record_t* record);
+void rng_record_end(rng_record_t* record);
+void rng_replay_begin(rng_record_t* record);
+void rng_replay_end(rng_record_t* record);
+
+#endif // RNG_H
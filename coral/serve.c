@@ -0,0 +1,512 @@
+#include "serve.h"
+#include "grad.h"
+#include "shape.h"
+#include "assert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+typedef struct connection connection_t;
+
+struct connection {
+    serve_server_t* server;
+    int fd;
+    tensor_entry_t* reply; // the output rows of its pending request, copied from the batch
+    size_t reply_capacity; // entries
+    bool replied; // to its pending request
+    bool failed; // the client went away mid request, so gets no reply
+    connection_t* next;
+};
+
+typedef struct {
+    connection_t* connection;
+    size_t row; // of the batch
+    size_t num_rows;
+    double arrival;
+} request_t;
+
+typedef struct {
+    tensor_entry_t* input; // max_batch_size x input_size
+    size_t num_rows; // reserved, including those still being read
+    int num_reading;
+    size_t num_requests;
+    request_t* requests; // at most one per row
+} batch_t;
+
+struct serve_server {
+    module_t* model;
+    size_t input_size;
+    size_t output_size;
+    serve_policy_t policy;
+    int listen_fd;
+    pthread_t accept_thread;
+    pthread_t batch_thread;
+    bool started;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t batch_ready; // the filling batch got a request, or finished reading one
+    pthread_cond_t batch_swapped;
+    pthread_cond_t replied;
+    pthread_cond_t connection_closed;
+    batch_t batches[2];
+    int filling; // the other batch is idle or running
+    connection_t* connections;
+    // stats
+    double start_time;
+    uint64_t num_requests;
+    uint64_t num_rows;
+    uint64_t num_batches;
+    uint64_t num_latencies;
+    double latencies[SERVE_LATENCY_WINDOW]; // ring, of the latest requests
+};
+
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+static bool read_all(int fd, void* data, size_t bytes){
+    char* cursor = (char*) data;
+    while(bytes > 0){
+        ssize_t count = recv(fd, cursor, bytes, 0);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return false;
+        }
+        cursor += count;
+        bytes -= count;
+    }
+    return true;
+}
+
+// read_all, failing once deadline (on the monotonic clock) passes
+static bool read_all_until(int fd, void* data, size_t bytes, double deadline){
+    char* cursor = (char*) data;
+    while(bytes > 0){
+        double remaining = deadline - now();
+        struct pollfd poll_fd = {fd, POLLIN, 0};
+        int ready = remaining > 0 ? poll(&poll_fd, 1, (int) (remaining * 1000) + 1) : 0;
+        if(ready < 0 && errno == EINTR){
+            continue;
+        }
+        if(ready <= 0){
+            return false;
+        }
+        ssize_t count = recv(fd, cursor, bytes, 0);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return false;
+        }
+        cursor += count;
+        bytes -= count;
+    }
+    return true;
+}
+
+// without SIGPIPE, as a client may hang up before its reply
+static bool write_all(int fd, const void* data, size_t bytes){
+    const char* cursor = (const char*) data;
+    while(bytes > 0){
+        ssize_t count = send(fd, cursor, bytes, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return false;
+        }
+        cursor += count;
+        bytes -= count;
+    }
+    return true;
+}
+
+// reads and drops bytes, eg. the rows of a refused request
+static bool skip_all(int fd, size_t bytes){
+    char buffer[4096];
+    while(bytes > 0){
+        size_t count = bytes < sizeof(buffer) ? bytes : sizeof(buffer);
+        if(!read_all(fd, buffer, count)){
+            return false;
+        }
+        bytes -= count;
+    }
+    return true;
+}
+
+/**
+ * SERVER
+*/
+
+serve_server_t* serve_server_new(module_t* model, size_t input_size, size_t output_size, serve_policy_t policy){
+    NDEBUG_ASSERT(policy.max_batch_size > 0, "Batches need at least one row!\n");
+    serve_server_t* server = (serve_server_t*) calloc(1, sizeof(serve_server_t));
+    server->model = model;
+    server->input_size = input_size;
+    server->output_size = output_size;
+    server->policy = policy;
+    server->listen_fd = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    // the batching thread waits for deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&server->batch_ready, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&server->batch_swapped, NULL);
+    pthread_cond_init(&server->replied, NULL);
+    pthread_cond_init(&server->connection_closed, NULL);
+    for(int batch_index = 0; batch_index < 2; batch_index++){
+        batch_t* batch = &server->batches[batch_index];
+        batch->input = (tensor_entry_t*) calloc(policy.max_batch_size * input_size, sizeof(tensor_entry_t));
+        batch->requests = (request_t*) malloc(policy.max_batch_size * sizeof(request_t));
+    }
+    return server;
+}
+
+static void answer_stats(serve_server_t* server, int fd){
+    serve_stats_t stats;
+    serve_stats(server, &stats);
+    write_all(fd, &stats, sizeof(stats));
+}
+
+// reserves rows of the filling batch for a request, and reads them in; NULL if the server is stopping
+static request_t* request_read(connection_t* connection, size_t num_rows, double arrival){
+    serve_server_t* server = connection->server;
+    pthread_mutex_lock(&server->lock);
+    while(!server->stop && server->batches[server->filling].num_rows + num_rows > server->policy.max_batch_size){
+        pthread_cond_wait(&server->batch_swapped, &server->lock);
+    }
+    if(server->stop){
+        pthread_mutex_unlock(&server->lock);
+        return NULL;
+    }
+    batch_t* batch = &server->batches[server->filling];
+    request_t* request = &batch->requests[batch->num_requests++];
+    request->connection = connection;
+    request->row = batch->num_rows;
+    request->num_rows = num_rows;
+    request->arrival = arrival;
+    batch->num_rows += num_rows;
+    batch->num_reading++;
+    connection->replied = false;
+    pthread_mutex_unlock(&server->lock);
+    size_t row_bytes = server->input_size * sizeof(tensor_entry_t);
+    double deadline = now() + SERVE_READ_TIMEOUT;
+    bool read = read_all_until(connection->fd, batch->input + request->row * server->input_size, num_rows * row_bytes, deadline);
+    pthread_mutex_lock(&server->lock);
+    // its rows still go through the batch, whose other requests are waiting on it, and a client which hung up or
+    // stalled mid request gets no reply (and is disconnected)
+    connection->failed = !read;
+    batch->num_reading--;
+    pthread_cond_broadcast(&server->batch_ready);
+    pthread_mutex_unlock(&server->lock);
+    return request;
+}
+
+// the reply is written from the thread of its connection, so that a client slow to read it holds up only itself
+static bool answer_rows(connection_t* connection, size_t num_rows, double arrival){
+    serve_server_t* server = connection->server;
+    uint32_t status = SERVE_OK;
+    bool written = write_all(connection->fd, &status, sizeof(status))
+        && write_all(connection->fd, connection->reply, num_rows * server->output_size * sizeof(tensor_entry_t));
+    double done = now();
+    pthread_mutex_lock(&server->lock);
+    server->latencies[server->num_latencies++ % SERVE_LATENCY_WINDOW] = done - arrival;
+    pthread_mutex_unlock(&server->lock);
+    return written;
+}
+
+// the rows are read (and dropped), so that the connection can go on
+static bool refuse(connection_t* connection, size_t num_rows, uint32_t status){
+    size_t row_bytes = connection->server->input_size * sizeof(tensor_entry_t);
+    return skip_all(connection->fd, num_rows * row_bytes) && write_all(connection->fd, &status, sizeof(status));
+}
+
+static void* connection_main(void* arg){
+    connection_t* connection = (connection_t*) arg;
+    serve_server_t* server = connection->server;
+    uint32_t num_rows;
+    while(read_all(connection->fd, &num_rows, sizeof(num_rows))){
+        double arrival = now();
+        if(num_rows == 0){
+            answer_stats(server, connection->fd);
+            continue;
+        }
+        if(num_rows > server->policy.max_batch_size){
+            if(!refuse(connection, num_rows, SERVE_TOO_MANY_ROWS)){
+                break;
+            }
+            continue;
+        }
+        if(num_rows * server->output_size > connection->reply_capacity){
+            connection->reply_capacity = num_rows * server->output_size;
+            connection->reply = (tensor_entry_t*) realloc(connection->reply, connection->reply_capacity * sizeof(tensor_entry_t));
+        }
+        if(request_read(connection, num_rows, arrival) == NULL){
+            break;
+        }
+        pthread_mutex_lock(&server->lock);
+        while(!connection->replied){
+            pthread_cond_wait(&server->replied, &server->lock);
+        }
+        bool failed = connection->failed;
+        pthread_mutex_unlock(&server->lock);
+        if(failed || !answer_rows(connection, num_rows, arrival)){
+            break;
+        }
+    }
+    pthread_mutex_lock(&server->lock);
+    connection_t** link = &server->connections;
+    while(*link != connection){
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    close(connection->fd);
+    free(connection->reply);
+    free(connection);
+    pthread_cond_broadcast(&server->connection_closed);
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+static void* accept_main(void* arg){
+    serve_server_t* server = (serve_server_t*) arg;
+    while(true){
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            return NULL; // shut down
+        }
+        connection_t* connection = (connection_t*) calloc(1, sizeof(connection_t));
+        connection->server = server;
+        connection->fd = fd;
+        connection->replied = true;
+        pthread_mutex_lock(&server->lock);
+        if(server->stop){
+            pthread_mutex_unlock(&server->lock);
+            close(fd);
+            free(connection);
+            return NULL;
+        }
+        connection->next = server->connections;
+        server->connections = connection;
+        pthread_mutex_unlock(&server->lock);
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&thread, &attr, &connection_main, connection);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// runs batch, and copies the rows of each of its requests from the output to their connection
+static void batch_run(serve_server_t* server, batch_t* batch){
+    size_t dims[2] = {batch->num_rows, server->input_size};
+    tensor_t* input_tensor = (tensor_t*) malloc(sizeof(tensor_t));
+    input_tensor->shape = shape_new(2, dims);
+    input_tensor->data = batch->input;
+    input_tensor->storage = NULL;
+    // everything the forward allocated is released with the batch
+    tensor_scope_t scope;
+    tensor_scope_begin(&scope);
+    variable_t* input = variable_new_from_tensor(input_tensor);
+    variable_t* output = module_forward(server->model, input);
+    NDEBUG_ASSERT(output->tensor->shape->size == batch->num_rows * server->output_size, "Model output does not match the output size!\n");
+    size_t row_bytes = server->output_size * sizeof(tensor_entry_t);
+    for(size_t request_index = 0; request_index < batch->num_requests; request_index++){
+        request_t* request = &batch->requests[request_index];
+        if(!request->connection->failed){
+            const tensor_entry_t* rows = output->tensor->data + request->row * server->output_size;
+            memcpy(request->connection->reply, rows, request->num_rows * row_bytes);
+        }
+    }
+    tensor_scope_end(&scope, 0, NULL);
+    shape_free(input_tensor->shape);
+    free(input_tensor);
+    free(input->grad_meta);
+    free(input);
+}
+
+static void* batch_main(void* arg){
+    serve_server_t* server = (serve_server_t*) arg;
+    grad_set_enabled(false);
+    pthread_mutex_lock(&server->lock);
+    while(true){
+        batch_t* batch = &server->batches[server->filling];
+        while(!server->stop && batch->num_requests == 0){
+            pthread_cond_wait(&server->batch_ready, &server->lock);
+        }
+        if(server->stop){
+            break;
+        }
+        // until the batch is full or its first request has waited long enough, then until every row is read in
+        double deadline = batch->requests[0].arrival + server->policy.max_wait;
+        struct timespec deadline_time = {(time_t) deadline, (long) ((deadline - (time_t) deadline) * 1e9)};
+        while(!server->stop && batch->num_rows < server->policy.max_batch_size && now() < deadline){
+            pthread_cond_timedwait(&server->batch_ready, &server->lock, &deadline_time);
+        }
+        while(batch->num_reading > 0){
+            pthread_cond_wait(&server->batch_ready, &server->lock);
+        }
+        server->filling = 1 - server->filling;
+        pthread_cond_broadcast(&server->batch_swapped);
+        pthread_mutex_unlock(&server->lock);
+        batch_run(server, batch);
+        pthread_mutex_lock(&server->lock);
+        for(size_t request_index = 0; request_index < batch->num_requests; request_index++){
+            batch->requests[request_index].connection->replied = true;
+        }
+        server->num_requests += batch->num_requests;
+        server->num_rows += batch->num_rows;
+        server->num_batches++;
+        batch->num_requests = 0;
+        batch->num_rows = 0;
+        pthread_cond_broadcast(&server->replied);
+        // requests too large for what was left of the other batch may fit in this one
+        pthread_cond_broadcast(&server->batch_swapped);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+bool serve_start(serve_server_t* server, const char* path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+        return false;
+    }
+    if(bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, 128) != 0){
+        close(fd);
+        return false;
+    }
+    server->listen_fd = fd;
+    server->start_time = now();
+    server->started = true;
+    pthread_create(&server->batch_thread, NULL, &batch_main, server);
+    pthread_create(&server->accept_thread, NULL, &accept_main, server);
+    return true;
+}
+
+static int compare_doubles(const void* left, const void* right){
+    double difference = *(const double*) left - *(const double*) right;
+    return (difference > 0) - (difference < 0);
+}
+
+void serve_stats(serve_server_t* server, serve_stats_t* stats){
+    double latencies[SERVE_LATENCY_WINDOW];
+    pthread_mutex_lock(&server->lock);
+    stats->num_requests = server->num_requests;
+    stats->num_rows = server->num_rows;
+    stats->num_batches = server->num_batches;
+    stats->seconds = server->started ? now() - server->start_time : 0;
+    size_t num_latencies = server->num_latencies < SERVE_LATENCY_WINDOW ? server->num_latencies : SERVE_LATENCY_WINDOW;
+    memcpy(latencies, server->latencies, num_latencies * sizeof(double));
+    pthread_mutex_unlock(&server->lock);
+    stats->requests_per_second = stats->seconds > 0 ? stats->num_requests / stats->seconds : 0;
+    stats->rows_per_second = stats->seconds > 0 ? stats->num_rows / stats->seconds : 0;
+    stats->p50_latency = 0;
+    stats->p99_latency = 0;
+    if(num_latencies > 0){
+        qsort(latencies, num_latencies, sizeof(double), &compare_doubles);
+        stats->p50_latency = latencies[(num_latencies - 1) / 2];
+        stats->p99_latency = latencies[(num_latencies - 1) * 99 / 100];
+    }
+}
+
+void serve_server_free(serve_server_t* server){
+    if(server->started){
+        pthread_mutex_lock(&server->lock);
+        server->stop = true;
+        // wakes the blocked accept and reads; the connection threads then close their sockets
+        shutdown(server->listen_fd, SHUT_RDWR);
+        for(connection_t* connection = server->connections; connection != NULL; connection = connection->next){
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        pthread_cond_broadcast(&server->batch_ready);
+        pthread_cond_broadcast(&server->batch_swapped);
+        pthread_mutex_unlock(&server->lock);
+        pthread_join(server->accept_thread, NULL);
+        pthread_join(server->batch_thread, NULL);
+        pthread_mutex_lock(&server->lock);
+        // a request read in but not run still waits for its reply
+        for(int batch_index = 0; batch_index < 2; batch_index++){
+            batch_t* batch = &server->batches[batch_index];
+            for(size_t request_index = 0; request_index < batch->num_requests; request_index++){
+                batch->requests[request_index].connection->replied = true;
+                batch->requests[request_index].connection->failed = true;
+            }
+        }
+        pthread_cond_broadcast(&server->replied);
+        while(server->connections != NULL){
+            pthread_cond_wait(&server->connection_closed, &server->lock);
+        }
+        pthread_mutex_unlock(&server->lock);
+        close(server->listen_fd);
+    }
+    for(int batch_index = 0; batch_index < 2; batch_index++){
+        free(server->batches[batch_index].input);
+        free(server->batches[batch_index].requests);
+    }
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->batch_ready);
+    pthread_cond_destroy(&server->batch_swapped);
+    pthread_cond_destroy(&server->replied);
+    pthread_cond_destroy(&server->connection_closed);
+    free(server);
+}
+
+/**
+ * CLIENTS
+*/
+
+int serve_connect(const char* path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool serve_infer(int fd, size_t num_rows, const tensor_entry_t* input, size_t input_size, tensor_entry_t* output, size_t output_size){
+    uint32_t header = (uint32_t) num_rows;
+    uint32_t status;
+    return num_rows > 0 && write_all(fd, &header, sizeof(header))
+        && write_all(fd, input, num_rows * input_size * sizeof(tensor_entry_t))
+        && read_all(fd, &status, sizeof(status)) && status == SERVE_OK
+        && read_all(fd, output, num_rows * output_size * sizeof(tensor_entry_t));
+}
+
+bool serve_query_stats(int fd, serve_stats_t* stats){
+    uint32_t header = 0;
+    return write_all(fd, &header, sizeof(header)) && read_all(fd, stats, sizeof(serve_stats_t));
+}
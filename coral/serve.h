@@ -0,0 +1,70 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "nn.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * INFERENCE SERVING
+ * a server answers inference requests for a model over a Unix domain socket, running its forward without grad
+ * - a request is a uint32_t num_rows followed by num_rows x input_size entries, its reply a uint32_t serve_status_t
+ *   followed (if SERVE_OK) by num_rows x output_size entries; a request with num_rows 0 is answered with a
+ *   serve_stats_t instead
+ * - a request has at most max_batch_size rows: a larger one is read in and refused with SERVE_TOO_MANY_ROWS, and
+ *   its connection stays open
+ * - requests are coalesced into dynamic batches: a batch is run once it holds max_batch_size rows, or once its
+ *   first request has waited max_wait seconds, whichever comes first
+ * - each connection thread reads the rows of a request straight into the batch buffer (preallocated, one of two:
+ *   one filling while the other runs); the batching thread copies each request's rows of the output back to its
+ *   connection, whose thread writes the reply, so that a client slow to read its reply holds up no other
+ * - the batch waits on the rows of its requests, which must have arrived SERVE_READ_TIMEOUT seconds after they were
+ *   reserved: a client stalling mid request is disconnected without a reply, having held up its batch that long
+ * a connection sends one request at a time, waiting for its reply; clients wanting more in flight open more
+*/
+
+#define SERVE_LATENCY_WINDOW 4096 // requests over which latency percentiles are taken
+#define SERVE_READ_TIMEOUT 0.1 // seconds
+
+typedef enum {
+    SERVE_OK,
+    SERVE_TOO_MANY_ROWS, // more than max_batch_size
+} serve_status_t;
+
+typedef struct {
+    size_t max_batch_size; // rows
+    double max_wait; // seconds
+} serve_policy_t;
+
+typedef struct {
+    uint64_t num_requests;
+    uint64_t num_rows;
+    uint64_t num_batches;
+    double seconds; // since the server started
+    double requests_per_second;
+    double rows_per_second;
+    double p50_latency; // seconds from a request being read to its reply being written, over the latest requests
+    double p99_latency;
+} serve_stats_t;
+
+typedef struct serve_server serve_server_t;
+
+// model maps (rows x input_size) to (rows x output_size); it is only ever run by the batching thread
+serve_server_t* serve_server_new(module_t* model, size_t input_size, size_t output_size, serve_policy_t policy);
+// listens at path (replacing a socket left there) and serves on threads of its own; false if it cannot listen
+bool serve_start(serve_server_t* server, const char* path);
+void serve_stats(serve_server_t* server, serve_stats_t* stats);
+// closes every connection, and waits for the serving threads to finish
+void serve_server_free(serve_server_t* server);
+
+/**
+ * CLIENTS
+ * blocking; false (or -1) on a closed or failed connection, or a refused request (after which the connection can
+ * still be used)
+*/
+
+int serve_connect(const char* path);
+bool serve_infer(int fd, size_t num_rows, const tensor_entry_t* input, size_t input_size, tensor_entry_t* output, size_t output_size);
+bool serve_query_stats(int fd, serve_stats_t* stats);
+
+#endif // SERVE_H
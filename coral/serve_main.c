@@ -0,0 +1,63 @@
+#include "serve.h"
+#include "nn.h"
+#include "checkpoint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+
+// the serve tool: serves the mlp features[0] -> features[1] -> ... (relu between layers), whose parameters are
+// read from the checkpoint as "params.0", "params.1", ... (weight then bias of each layer), until interrupted,
+// printing its stats every 10 seconds
+// usage: serve <socket> <checkpoint> <max batch size> <max wait ms> <features>...
+
+int main(int argc, char** argv){
+    if(argc < 7){
+        fprintf(stderr, "usage: %s <socket> <checkpoint> <max batch size> <max wait ms> <features>...\n", argv[0]);
+        return 1;
+    }
+    int num_layers = argc - 6;
+    size_t features[num_layers + 1];
+    for(int layer = 0; layer <= num_layers; layer++){
+        features[layer] = strtoull(argv[5 + layer], NULL, 10);
+    }
+    module_t* layers[num_layers];
+    for(int layer = 0; layer < num_layers; layer++){
+        activation_t activation = layer + 1 < num_layers ? ACTIVATION_RELU : ACTIVATION_NONE;
+        layers[layer] = module_linear_new(features[layer], features[layer + 1], true, activation);
+    }
+    module_t* model = module_sequential_new(num_layers, layers);
+    char names[model->num_params][32];
+    const char* name_pointers[model->num_params];
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        snprintf(names[param_index], sizeof(names[param_index]), "params.%d", param_index);
+        name_pointers[param_index] = names[param_index];
+    }
+    checkpoint_t* checkpoint = checkpoint_open(argv[2]);
+    checkpoint_load(checkpoint, model->num_params, name_pointers, model->params);
+    serve_policy_t policy = {strtoull(argv[3], NULL, 10), atof(argv[4]) / 1000};
+    // the serving threads inherit the mask, so that the signals are only taken here
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    serve_server_t* server = serve_server_new(model, features[0], features[num_layers], policy);
+    if(!serve_start(server, argv[1])){
+        fprintf(stderr, "could not listen at %s\n", argv[1]);
+        return 1;
+    }
+    struct timespec interval = {10, 0};
+    while(sigtimedwait(&signals, NULL, &interval) < 0){
+        serve_stats_t stats;
+        serve_stats(server, &stats);
+        printf("%llu requests (%.1f/s), %.1f rows/s, %.2f rows per batch, latency p50 %.3f ms, p99 %.3f ms\n",
+               (unsigned long long) stats.num_requests, stats.requests_per_second, stats.rows_per_second,
+               stats.num_batches > 0 ? (double) stats.num_rows / stats.num_batches : 0.0,
+               1e3 * stats.p50_latency, 1e3 * stats.p99_latency);
+        fflush(stdout);
+    }
+    serve_server_free(server);
+    checkpoint_close(checkpoint);
+    return 0;
+}
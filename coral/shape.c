@@ -24,6 +24,12 @@ shape_t* shape_copy(shape_t* shape){
     return shape_new(shape->num_dims, shape->dims);
 }
 
+void shape_free(shape_t* shape){
+    free(shape->dims);
+    free(shape->strides);
+    free(shape);
+}
+
 bool shape_equal(shape_t* left_shape, shape_t* right_shape){
     if((left_shape->size != right_shape->size) || (left_shape->num_dims != right_shape->num_dims)){
         return 0;
@@ -16,6 +16,7 @@ typedef struct {
 
 shape_t* shape_new(int num_dims, size_t* dims);
 shape_t* shape_copy(shape_t* shape);
+void shape_free(shape_t* shape);
 bool shape_equal(shape_t* left_shape, shape_t* right_shape);
 shape_t* shape_get_broadcast_shape(shape_t* left_shape, shape_t* right_shape);
 bool shape_broadcast_compatible(shape_t* left_shape, shape_t* right_shape);
@@ -27,4 +28,14 @@ static inline bool shape_is_scalar(shape_t* shape){
     return shape->size == 1;
 }
 
+// true iff some dimension steps by 0 (longer than 1, so that the shape reads an entry more than once)
+static inline bool shape_is_expanded(shape_t* shape){
+    for(int dim_index = 0; dim_index < shape->num_dims; dim_index++){
+        if(shape->strides[dim_index] == 0 && shape->dims[dim_index] > 1){
+            return true;
+        }
+    }
+    return false;
+}
+
 #endif // SHAPE_H
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include "sparse.h"
+#include "tensor.h"
+#include "gemm.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * CONSTRUCTORS AND CONVERSIONS
+*/
+
+sparse_tensor_t* sparse_tensor_new(size_t num_rows, size_t num_columns, size_t num_nonzeros){
+    sparse_tensor_t* sparse = (sparse_tensor_t*) malloc(sizeof(sparse_tensor_t));
+    sparse->num_rows = num_rows;
+    sparse->num_columns = num_columns;
+    sparse->num_nonzeros = num_nonzeros;
+    sparse->row_offsets = (size_t*) malloc((num_rows + 1) * sizeof(size_t));
+    sparse->columns = (size_t*) malloc(num_nonzeros * sizeof(size_t));
+    sparse->values = (tensor_entry_t*) malloc(num_nonzeros * sizeof(tensor_entry_t));
+    return sparse;
+}
+
+sparse_tensor_t* sparse_tensor_from_dense(tensor_t* tensor){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(tensor) == 2, "Sparse tensors are two dimensional!\n");
+    size_t num_rows = tensor->shape->dims[0];
+    size_t num_columns = tensor->shape->dims[1];
+    size_t num_nonzeros = 0;
+    for(size_t index = 0; index < tensor->shape->size; index++){
+        num_nonzeros += tensor->data[index] != 0;
+    }
+    sparse_tensor_t* sparse = sparse_tensor_new(num_rows, num_columns, num_nonzeros);
+    size_t nonzero = 0;
+    for(size_t row = 0; row < num_rows; row++){
+        sparse->row_offsets[row] = nonzero;
+        const tensor_entry_t* dense_row = tensor->data + row * num_columns;
+        for(size_t column = 0; column < num_columns; column++){
+            if(dense_row[column] != 0){
+                sparse->columns[nonzero] = column;
+                sparse->values[nonzero] = dense_row[column];
+                nonzero++;
+            }
+        }
+    }
+    sparse->row_offsets[num_rows] = nonzero;
+    return sparse;
+}
+
+// a counting sort by row, stable so that each row keeps the order of its triplets
+sparse_tensor_t* sparse_tensor_from_coo(size_t num_rows, size_t num_columns, size_t num_nonzeros, const size_t* rows, const size_t* columns, const tensor_entry_t* values){
+    sparse_tensor_t* sparse = sparse_tensor_new(num_rows, num_columns, num_nonzeros);
+    memset(sparse->row_offsets, 0, (num_rows + 1) * sizeof(size_t));
+    for(size_t nonzero = 0; nonzero < num_nonzeros; nonzero++){
+        NDEBUG_ASSERT(rows[nonzero] < num_rows && columns[nonzero] < num_columns, "Sparse entry out of bounds!\n");
+        sparse->row_offsets[rows[nonzero] + 1]++;
+    }
+    for(size_t row = 0; row < num_rows; row++){
+        sparse->row_offsets[row + 1] += sparse->row_offsets[row];
+    }
+    size_t* next = (size_t*) malloc(num_rows * sizeof(size_t));
+    memcpy(next, sparse->row_offsets, num_rows * sizeof(size_t));
+    for(size_t nonzero = 0; nonzero < num_nonzeros; nonzero++){
+        size_t destination = next[rows[nonzero]]++;
+        sparse->columns[destination] = columns[nonzero];
+        sparse->values[destination] = values[nonzero];
+    }
+    free(next);
+    return sparse;
+}
+
+tensor_t* sparse_tensor_to_dense(sparse_tensor_t* sparse){
+    size_t dims[2] = {sparse->num_rows, sparse->num_columns};
+    tensor_t* tensor = tensor_new(shape_new(2, dims));
+    tensor_in_place_add_sparse(tensor, sparse);
+    return tensor;
+}
+
+void sparse_tensor_free(sparse_tensor_t* sparse){
+    free(sparse->row_offsets);
+    free(sparse->columns);
+    free(sparse->values);
+    free(sparse);
+}
+
+/**
+ * SPMM
+*/
+
+void spmm(sparse_tensor_t* a, const tensor_entry_t* b, size_t n, tensor_entry_t* c, const gemm_epilogue_t* epilogue){
+    for(size_t row = 0; row < a->num_rows; row++){
+        tensor_entry_t* restrict c_row = c + row * n;
+        memset(c_row, 0, n * sizeof(tensor_entry_t));
+        for(size_t nonzero = a->row_offsets[row]; nonzero < a->row_offsets[row + 1]; nonzero++){
+            tensor_entry_t value = a->values[nonzero];
+            const tensor_entry_t* restrict b_row = b + a->columns[nonzero] * n;
+            for(size_t j = 0; j < n; j++){
+                c_row[j] += value * b_row[j];
+            }
+        }
+        // the row is still in cache
+        if(epilogue != NULL){
+            gemm_epilogue_apply(1, n, c_row, n, epilogue);
+        }
+    }
+}
+
+void spmm_transpose_accumulate(sparse_tensor_t* a, const tensor_entry_t* b, size_t n, tensor_entry_t* c){
+    for(size_t row = 0; row < a->num_rows; row++){
+        const tensor_entry_t* restrict b_row = b + row * n;
+        for(size_t nonzero = a->row_offsets[row]; nonzero < a->row_offsets[row + 1]; nonzero++){
+            tensor_entry_t value = a->values[nonzero];
+            tensor_entry_t* restrict c_row = c + a->columns[nonzero] * n;
+            for(size_t j = 0; j < n; j++){
+                c_row[j] += value * b_row[j];
+            }
+        }
+    }
+}
+
+tensor_t* tensor_sparse_matmul(sparse_tensor_t* left, tensor_t* right){
+    return tensor_sparse_linear(left, right, NULL, ACTIVATION_NONE);
+}
+
+tensor_t* tensor_sparse_linear(sparse_tensor_t* input, tensor_t* weight, tensor_t* bias, activation_t activation){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(weight) == 2, "Linear requires a two dimensional weight!\n");
+    NDEBUG_ASSERT(input->num_columns == weight->shape->dims[0], "Input and weight dimensions do not match!\n");
+    NDEBUG_ASSERT(bias == NULL || bias->shape->size == weight->shape->dims[1], "Bias and weight dimensions do not match!\n");
+    size_t n = weight->shape->dims[1];
+    size_t dims[2] = {input->num_rows, n};
+    tensor_t* new_tensor = tensor_new(shape_new(2, dims));
+    gemm_epilogue_t epilogue = {bias ? bias->data : NULL, activation};
+    spmm(input, weight->data, n, new_tensor->data, &epilogue);
+    return new_tensor;
+}
+
+/**
+ * SPARSE-DENSE ELEMENTWISE OPS
+*/
+
+sparse_tensor_t* sparse_tensor_multiply_dense(sparse_tensor_t* sparse, tensor_t* dense){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(dense) == 2 && dense->shape->dims[0] == sparse->num_rows && dense->shape->dims[1] == sparse->num_columns, "Sparse and dense shapes do not match!\n");
+    sparse_tensor_t* product = sparse_tensor_new(sparse->num_rows, sparse->num_columns, sparse->num_nonzeros);
+    memcpy(product->row_offsets, sparse->row_offsets, (sparse->num_rows + 1) * sizeof(size_t));
+    memcpy(product->columns, sparse->columns, sparse->num_nonzeros * sizeof(size_t));
+    for(size_t row = 0; row < sparse->num_rows; row++){
+        const tensor_entry_t* dense_row = dense->data + row * sparse->num_columns;
+        for(size_t nonzero = sparse->row_offsets[row]; nonzero < sparse->row_offsets[row + 1]; nonzero++){
+            product->values[nonzero] = sparse->values[nonzero] * dense_row[sparse->columns[nonzero]];
+        }
+    }
+    return product;
+}
+
+void tensor_in_place_add_sparse(tensor_t* dense, sparse_tensor_t* sparse){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(dense) == 2 && dense->shape->dims[0] == sparse->num_rows && dense->shape->dims[1] == sparse->num_columns, "Sparse and dense shapes do not match!\n");
+    tensor_make_writable(dense);
+    for(size_t row = 0; row < sparse->num_rows; row++){
+        tensor_entry_t* dense_row = dense->data + row * sparse->num_columns;
+        for(size_t nonzero = sparse->row_offsets[row]; nonzero < sparse->row_offsets[row + 1]; nonzero++){
+            dense_row[sparse->columns[nonzero]] += sparse->values[nonzero];
+        }
+    }
+}
+
+/**
+ * ROW SPARSE MATRICES
+*/
+
+row_sparse_t* row_sparse_new(size_t num_rows, size_t row_size){
+    row_sparse_t* sparse = (row_sparse_t*) malloc(sizeof(row_sparse_t));
+    sparse->num_rows = num_rows;
+    sparse->row_size = row_size;
+    sparse->num_touched = 0;
+    sparse->capacity = 0;
+    sparse->rows = NULL;
+    sparse->values = NULL;
+    return sparse;
+}
+
+tensor_entry_t* row_sparse_append(row_sparse_t* sparse, size_t row){
+    NDEBUG_ASSERT(row < sparse->num_rows, "Row out of bounds!\n");
+    if(sparse->num_touched == sparse->capacity){
+        sparse->capacity = MAX(2 * sparse->capacity, (size_t) 16);
+        sparse->rows = (size_t*) realloc(sparse->rows, sparse->capacity * sizeof(size_t));
+        sparse->values = (tensor_entry_t*) realloc(sparse->values, sparse->capacity * sparse->row_size * sizeof(tensor_entry_t));
+    }
+    sparse->rows[sparse->num_touched] = row;
+    return sparse->values + sparse->num_touched++ * sparse->row_size;
+}
+
+typedef struct {
+    size_t row;
+    size_t position; // in the list of touched rows
+} touched_row_t;
+
+static int touched_row_compare(const void* left, const void* right){
+    const touched_row_t* left_row = (const touched_row_t*) left;
+    const touched_row_t* right_row = (const touched_row_t*) right;
+    if(left_row->row != right_row->row){
+        return left_row->row < right_row->row ? -1 : 1;
+    }
+    return left_row->position < right_row->position ? -1 : (left_row->position > right_row->position);
+}
+
+void row_sparse_coalesce(row_sparse_t* sparse){
+    size_t num_touched = sparse->num_touched;
+    size_t row_size = sparse->row_size;
+    if(num_touched == 0){
+        return;
+    }
+    touched_row_t* order = (touched_row_t*) malloc(num_touched * sizeof(touched_row_t));
+    for(size_t position = 0; position < num_touched; position++){
+        order[position].row = sparse->rows[position];
+        order[position].position = position;
+    }
+    qsort(order, num_touched, sizeof(touched_row_t), &touched_row_compare);
+    tensor_entry_t* values = (tensor_entry_t*) malloc(num_touched * row_size * sizeof(tensor_entry_t));
+    size_t num_unique = 0;
+    for(size_t index = 0; index < num_touched; index++){
+        const tensor_entry_t* restrict source = sparse->values + order[index].position * row_size;
+        if(num_unique > 0 && sparse->rows[num_unique - 1] == order[index].row){
+            tensor_entry_t* restrict destination = values + (num_unique - 1) * row_size;
+            for(size_t entry = 0; entry < row_size; entry++){
+                destination[entry] += source[entry];
+            }
+        }else{
+            // rows is rewritten in place: num_unique never passes index
+            sparse->rows[num_unique] = order[index].row;
+            memcpy(values + num_unique * row_size, source, row_size * sizeof(tensor_entry_t));
+            num_unique++;
+        }
+    }
+    free(order);
+    free(sparse->values);
+    sparse->values = values;
+    sparse->num_touched = num_unique;
+    sparse->capacity = num_touched;
+}
+
+void row_sparse_clear(row_sparse_t* sparse){
+    sparse->num_touched = 0;
+}
+
+tensor_t* row_sparse_to_dense(row_sparse_t* sparse){
+    size_t dims[2] = {sparse->num_rows, sparse->row_size};
+    tensor_t* tensor = tensor_new(shape_new(2, dims));
+    for(size_t index = 0; index < sparse->num_touched; index++){
+        tensor_entry_t* restrict destination = tensor->data + sparse->rows[index] * sparse->row_size;
+        const tensor_entry_t* restrict source = sparse->values + index * sparse->row_size;
+        for(size_t entry = 0; entry < sparse->row_size; entry++){
+            destination[entry] += source[entry];
+        }
+    }
+    return tensor;
+}
+
+void row_sparse_free(row_sparse_t* sparse){
+    free(sparse->rows);
+    free(sparse->values);
+    free(sparse);
+}
@@ -0,0 +1,80 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "tensor.h"
+#include "gemm.h"
+
+/**
+ * CSR SPARSE MATRICES
+ * the nonzeros of row i are entries [row_offsets[i], row_offsets[i + 1]) of columns and values
+ * columns need not be sorted within a row, and a repeated (row, column) counts as the sum of its values
+*/
+
+typedef struct {
+    size_t num_rows;
+    size_t num_columns;
+    size_t num_nonzeros;
+    size_t* row_offsets; // num_rows + 1
+    size_t* columns;
+    tensor_entry_t* values;
+} sparse_tensor_t;
+
+// offsets, columns and values are left for the caller to fill
+sparse_tensor_t* sparse_tensor_new(size_t num_rows, size_t num_columns, size_t num_nonzeros);
+// from a two dimensional tensor, keeping its nonzero entries
+sparse_tensor_t* sparse_tensor_from_dense(tensor_t* tensor);
+// from (rows[i], columns[i], values[i]) triplets in any order
+sparse_tensor_t* sparse_tensor_from_coo(size_t num_rows, size_t num_columns, size_t num_nonzeros, const size_t* rows, const size_t* columns, const tensor_entry_t* values);
+tensor_t* sparse_tensor_to_dense(sparse_tensor_t* sparse);
+void sparse_tensor_free(sparse_tensor_t* sparse);
+
+/**
+ * SPMM
+ * b and c are dense and row major; the work is proportional to the number of nonzeros of a times n
+*/
+
+// c (m x n) <- epilogue(a * b), for a sparse (m x k) and b (k x n); epilogue may be NULL
+void spmm(sparse_tensor_t* a, const tensor_entry_t* b, size_t n, tensor_entry_t* c, const gemm_epilogue_t* epilogue);
+// c (k x n) <- c + a^T * b, for a sparse (m x k) and b (m x n), scattering rows of b rather than transposing a
+void spmm_transpose_accumulate(sparse_tensor_t* a, const tensor_entry_t* b, size_t n, tensor_entry_t* c);
+
+// sparse (m x k) * right (k x n) -> (m x n)
+tensor_t* tensor_sparse_matmul(sparse_tensor_t* left, tensor_t* right);
+// activation(input * weight + bias), as tensor_linear, for a sparse (batch x in) input
+tensor_t* tensor_sparse_linear(sparse_tensor_t* input, tensor_t* weight, tensor_t* bias, activation_t activation);
+
+/**
+ * SPARSE-DENSE ELEMENTWISE OPS
+*/
+
+// the entries of dense at the nonzeros of sparse, times those of sparse; same sparsity as sparse
+sparse_tensor_t* sparse_tensor_multiply_dense(sparse_tensor_t* sparse, tensor_t* dense);
+// dense <- dense + sparse
+void tensor_in_place_add_sparse(tensor_t* dense, sparse_tensor_t* sparse);
+
+/**
+ * ROW SPARSE MATRICES
+ * a (num_rows x row_size) matrix which is zero outside of a list of touched rows, eg. the gradient of an embedding
+ * table, of which a step only touches the rows that were looked up
+ * a row may be listed more than once (meaning the sum of its values) until row_sparse_coalesce
+*/
+
+typedef struct {
+    size_t num_rows;
+    size_t row_size;
+    size_t num_touched;
+    size_t capacity; // in rows
+    size_t* rows;
+    tensor_entry_t* values; // num_touched x row_size
+} row_sparse_t;
+
+row_sparse_t* row_sparse_new(size_t num_rows, size_t row_size);
+// lists row once more, returning where its row_size values are to be written (valid until the next append)
+tensor_entry_t* row_sparse_append(row_sparse_t* sparse, size_t row);
+// sorts the touched rows and sums repeated ones
+void row_sparse_coalesce(row_sparse_t* sparse);
+void row_sparse_clear(row_sparse_t* sparse);
+tensor_t* row_sparse_to_dense(row_sparse_t* sparse);
+void row_sparse_free(row_sparse_t* sparse);
+
+#endif // SPARSE_H
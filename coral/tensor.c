@@ -1,10 +1,16 @@
 #include "tensor.h"
 #include "utils.h"
 #include "assert.h"
+#include "gemm.h"
+#include "vmath.h"
+#include "elementwise.h"
+#include "memory.h"
+#include "perf.h"
 #include <stdio.h>
 #include <stdlib.h> 
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 // NOTE: for now using static inline over macro for type safety
 // macro doesn't feel right here
@@ -19,19 +25,132 @@ static inline size_t tensor_get_size(tensor_t* tensor){
 // }
 
 static inline size_t tensor_get_size_in_bytes(tensor_t* tensor){
-    return tensor_get_size(tensor) * sizeof(tensor_entry_t);
+    return tensor->shape->size * sizeof(tensor_entry_t);
+}
+
+static __thread tensor_scope_t* current_scope = NULL;
+
+static void tensor_scope_record(tensor_scope_t* scope, tensor_t* tensor){
+    if(scope->num_tensors == scope->capacity){
+        scope->capacity = MAX(2 * scope->capacity, (size_t) 64);
+        scope->tensors = (tensor_t**) realloc(scope->tensors, scope->capacity * sizeof(tensor_t*));
+    }
+    scope->tensors[scope->num_tensors++] = tensor;
 }
 
 // create new tensor
-// entries are set to zero by default
-tensor_t* tensor_new(shape_t* shape){
-    tensor_entry_t* data = (tensor_entry_t*) calloc(shape->size, sizeof(tensor_entry_t));
+// entries are set to zero by default, see memory.h for where they live
+static tensor_storage_t* tensor_storage_new(size_t bytes){
+    tensor_storage_t* storage = (tensor_storage_t*) malloc(sizeof(tensor_storage_t));
+    storage->data = (tensor_entry_t*) memory_alloc(bytes);
+    storage->bytes = bytes;
+    storage->ref_count = 1;
+    storage->pinned = false;
+    storage->borrowed = false;
+    storage->version = 0;
+    return storage;
+}
+
+static void tensor_storage_release(tensor_storage_t* storage){
+    if(__atomic_sub_fetch(&storage->ref_count, 1, __ATOMIC_ACQ_REL) == 0){
+        if(!storage->borrowed){
+            memory_free(storage->data, storage->bytes);
+        }
+        free(storage);
+    }
+}
+
+// a tensor struct for storage, recorded in the current scope
+static tensor_t* tensor_new_with_storage(shape_t* shape, tensor_storage_t* storage){
     tensor_t* new_tensor = (tensor_t*) malloc(sizeof(tensor_t));
-    new_tensor->data = data;
+    new_tensor->data = storage->data;
     new_tensor->shape = shape_copy(shape);
+    new_tensor->storage = storage;
+    if(current_scope != NULL){
+        tensor_scope_record(current_scope, new_tensor);
+    }
     return new_tensor;
 }
 
+// create new tensor
+// entries are set to zero by default, see memory.h for where they live
+tensor_t* tensor_new(shape_t* shape){
+    return tensor_new_with_storage(shape, tensor_storage_new(shape->size * sizeof(tensor_entry_t)));
+}
+
+void tensor_free(tensor_t* tensor){
+    if(tensor->storage != NULL){
+        tensor_storage_release(tensor->storage);
+    }
+    shape_free(tensor->shape);
+    free(tensor);
+}
+
+void tensor_unshare(tensor_t* tensor){
+    tensor_storage_t* shared = tensor->storage;
+    tensor_storage_t* storage = tensor_storage_new(shared->bytes);
+    memcpy(storage->data, shared->data, shared->bytes);
+    // the contents are unchanged, and versions of the tensor keep increasing across the move
+    storage->version = shared->version;
+    tensor->storage = storage;
+    tensor->data = storage->data;
+    tensor_storage_release(shared);
+}
+
+void tensor_move_into(tensor_t* tensor, tensor_entry_t* data){
+    NDEBUG_ASSERT(!tensor_is_fill(tensor), "Cannot move a fill tensor!\n");
+    size_t bytes = tensor_get_size_in_bytes(tensor);
+    memcpy(data, tensor->data, bytes);
+    tensor_storage_t* storage = (tensor_storage_t*) malloc(sizeof(tensor_storage_t));
+    storage->data = data;
+    storage->bytes = bytes;
+    storage->ref_count = 1;
+    storage->pinned = true;
+    storage->borrowed = true;
+    storage->version = 0;
+    if(tensor->storage != NULL){
+        storage->version = tensor->storage->version;
+        tensor_storage_release(tensor->storage);
+    }
+    tensor->storage = storage;
+    tensor->data = data;
+}
+
+void tensor_point_to(tensor_t* tensor, tensor_entry_t* data){
+    NDEBUG_ASSERT(tensor_owns_data(tensor), "Tensor does not own its data!\n");
+    if(tensor->storage != NULL){
+        tensor_storage_release(tensor->storage);
+        tensor->storage = NULL;
+    }
+    tensor->data = data;
+}
+
+void tensor_scope_begin(tensor_scope_t* scope){
+    scope->num_tensors = 0;
+    scope->capacity = 0;
+    scope->tensors = NULL;
+    scope->parent = current_scope;
+    current_scope = scope;
+}
+
+void tensor_scope_end(tensor_scope_t* scope, int num_kept, tensor_t** kept){
+    NDEBUG_ASSERT(current_scope == scope, "Tensor scopes must end in the reverse order they began!\n");
+    current_scope = scope->parent;
+    for(size_t index = 0; index < scope->num_tensors; index++){
+        tensor_t* tensor = scope->tensors[index];
+        bool keep = false;
+        for(int kept_index = 0; kept_index < num_kept && !keep; kept_index++){
+            keep = (kept[kept_index]->data == tensor->data);
+        }
+        if(keep && current_scope != NULL){
+            tensor_scope_record(current_scope, tensor);
+        }else if(!keep){
+            tensor_free(tensor);
+        }
+    }
+    free(scope->tensors);
+}
+
 // TODO - ensure this is inlined
 tensor_t* tensor_new_like(tensor_t* tensor){
     return tensor_new(tensor->shape);
@@ -48,6 +167,18 @@ tensor_t* tensor_new_zeros_like(tensor_t* tensor){
     return tensor_new(tensor->shape);
 }
 
+tensor_t* tensor_new_fill(shape_t* shape, tensor_entry_t value){
+    tensor_storage_t* storage = tensor_storage_new(sizeof(tensor_entry_t));
+    storage->data[0] = value;
+    tensor_t* new_tensor = tensor_new_with_storage(shape, storage);
+    memset(new_tensor->shape->strides, 0, shape->num_dims * sizeof(size_t));
+    return new_tensor;
+}
+
+tensor_t* tensor_new_fill_like(tensor_t* tensor, tensor_entry_t value){
+    return tensor_new_fill(tensor->shape, value);
+}
+
 tensor_t* tensor_new_from_entry(tensor_entry_t entry){
     size_t dims = 1;
     tensor_t* new_tensor = tensor_new(shape_new(1, &dims));
@@ -57,22 +188,44 @@ tensor_t* tensor_new_from_entry(tensor_entry_t entry){
 
 
 tensor_t* tensor_copy(tensor_t* old_tensor){
+    tensor_storage_t* storage = old_tensor->storage;
+    bool shareable = storage != NULL && old_tensor->data == storage->data && !storage->pinned;
+    if(shareable){
+        __atomic_add_fetch(&storage->ref_count, 1, __ATOMIC_ACQ_REL);
+        tensor_t* new_tensor = tensor_new_with_storage(old_tensor->shape, storage);
+        // shape_copy lays out the copy contiguously, which a fill tensor is not
+        memcpy(new_tensor->shape->strides, old_tensor->shape->strides, TENSOR_NUM_DIMS(old_tensor) * sizeof(size_t));
+        return new_tensor;
+    }
     tensor_t* new_tensor = tensor_new_like(old_tensor);
     memcpy(new_tensor->data, old_tensor->data, tensor_get_size_in_bytes(old_tensor));
     return new_tensor;
 }
 
 void tensor_in_place_view_as_shape(tensor_t* tensor, shape_t* new_shape){
-    NDEBUG_ASSERT(new_shape->size == tensor->shape->size, "Tensor cannot be viewed in that shape!\n");
+    NDEBUG_ASSERT(new_shape->size == tensor->shape->size && !tensor_is_fill(tensor), "Tensor cannot be viewed in that shape!\n");
     tensor->shape = shape_copy(new_shape);
 }
 
 // creates new tensor with desired shape pointing to the same underlying data
 tensor_t* tensor_view_as_shape(tensor_t* tensor, shape_t* new_shape){
-    NDEBUG_ASSERT(new_shape->size == tensor->shape->size, "Tensor cannot be viewed in that shape!\n");
+    NDEBUG_ASSERT(new_shape->size == tensor->shape->size && !tensor_is_fill(tensor), "Tensor cannot be viewed in that shape!\n");
+    // a view leaves the contents (and so the version) alone
+    if(tensor_is_shared(tensor)){
+        tensor_unshare(tensor);
+    }
+    tensor_storage_t* storage = tensor->storage;
+    if(storage != NULL){
+        storage->pinned = true;
+        __atomic_add_fetch(&storage->ref_count, 1, __ATOMIC_ACQ_REL);
+    }
     tensor_t* new_tensor = (tensor_t*) malloc(sizeof(tensor_t));
     new_tensor->data = tensor->data;
     new_tensor->shape = shape_copy(new_shape);
+    new_tensor->storage = storage;
+    if(current_scope != NULL){
+        tensor_scope_record(current_scope, new_tensor);
+    }
     return new_tensor;
 }
 
@@ -84,6 +237,15 @@ bool tensor_equal(tensor_t* left_tensor, tensor_t* right_tensor){
     if(!shape_equal(left_tensor->shape, right_tensor->shape)){
         return 0;
     }
+    // a fill tensor holds a single entry, so is compared entry by entry
+    if(tensor_is_fill(left_tensor) || tensor_is_fill(right_tensor)){
+        for(size_t index = 0; index < left_tensor->shape->size; index++){
+            if(tensor_get_entry(left_tensor, index) != tensor_get_entry(right_tensor, index)){
+                return 0;
+            }
+        }
+        return 1;
+    }
     int cmp = memcmp(left_tensor->data, right_tensor->data, tensor_get_size_in_bytes(left_tensor)); 
     return (cmp == 0);
 }
@@ -103,26 +265,26 @@ bool tensor_is_scalar(tensor_t* tensor){
 */
 
 void tensor_set_to_scalar_value(tensor_t* tensor, tensor_entry_t value){
-    size_t tensor_size = tensor_get_size(tensor);
+    tensor_make_writable(tensor);
+    size_t tensor_size = tensor->shape->size;
     for(size_t index = 0; index < tensor_size; index++){
-        tensor_set_entry(tensor, index, value);
+        tensor->data[index] = value;
     }
 }
 
 void tensor_in_place_apply_index_fn(tensor_t* tensor, tensor_index_fn_t index_fn){
-    size_t tensor_size = tensor_get_size(tensor);
+    tensor_make_writable(tensor);
+    size_t tensor_size = tensor->shape->size;
     for(size_t index = 0; index < tensor_size; index++){
-        tensor_entry_t entry_value = (*index_fn)(index);
-        tensor_set_entry(tensor, index, entry_value);
+        tensor->data[index] = (*index_fn)(index);
     }
 }
 
 void tensor_in_place_apply_entry_fn(tensor_t* tensor, tensor_entry_unary_fn_t entry_fn){
-    size_t tensor_size = tensor_get_size(tensor);
+    tensor_make_writable(tensor);
+    size_t tensor_size = tensor->shape->size;
     for(size_t index = 0; index < tensor_size; index++){
-        tensor_entry_t entry_old_value = tensor_get_entry(tensor, index);
-        tensor_entry_t entry_new_value = (*entry_fn)(entry_old_value);
-        tensor_set_entry(tensor, index, entry_new_value);
+        tensor->data[index] = (*entry_fn)(tensor->data[index]);
     }
 }
 
@@ -177,6 +339,16 @@ void tensor_display_dim_3(tensor_t* tensor){
     printf("\n");
 }
 
+void tensor_display_dim_4(tensor_t* tensor){
+    size_t block_size = tensor->shape->strides[0];
+    shape_t* block_shape = shape_new(3, tensor->shape->dims + 1);
+    for(size_t dim0_index = 0; dim0_index < tensor->shape->dims[0]; dim0_index++){
+        tensor_t block = {tensor->data + dim0_index * block_size, block_shape, NULL};
+        tensor_display_dim_3(&block);
+    }
+    shape_free(block_shape);
+}
+
 void tensor_display(tensor_t* tensor){
     shape_display(tensor->shape);
     switch(TENSOR_NUM_DIMS(tensor)){
@@ -189,8 +361,11 @@ void tensor_display(tensor_t* tensor){
         case 3:
             tensor_display_dim_3(tensor);
             break;
+        case 4:
+            tensor_display_dim_4(tensor);
+            break;
         default:
-            NDEBUG(0, "Display not supported for tensors of dimension greater than three!");
+            NDEBUG_ASSERT(0, "Display not supported for tensors of dimension greater than four!");
     }
 }
 
@@ -218,34 +393,27 @@ bool tensor_broadcast_compatible(tensor_t* left_tensor, tensor_t* right_tensor){
 }
 
 /**
- * tensor_entry_t x tensor_entry_t -> tensor_entry_t
- * tensor_entry_t -> tensor_entry_t
+ * ELEMENTWISE OPS
+ * the built in ops of elementwise.h, each expanded into its own kernels
 */
 
-static inline tensor_entry_t tensor_entry_add(tensor_entry_t left_entry, tensor_entry_t right_entry) {
-    return left_entry + right_entry;
-}
-
-static inline tensor_entry_t tensor_entry_multiply(tensor_entry_t left_entry, tensor_entry_t right_entry) {
-    return left_entry * right_entry;
-}
-
-static inline tensor_entry_t tensor_entry_subtract(tensor_entry_t left_entry, tensor_entry_t right_entry) {
-    return left_entry - right_entry;
-}
-
-static inline tensor_entry_t tensor_entry_divide(tensor_entry_t left_entry, tensor_entry_t right_entry) {
-    NDEBUG_ASSERT(right_entry != 0, "Cannot divide by zero!");
-    return left_entry / right_entry;
-}
+ELEMENTWISE_BINARY_OPS(ELEMENTWISE_DEFINE_BINARY)
+ELEMENTWISE_UNARY_OPS(ELEMENTWISE_DEFINE_UNARY)
 
-static inline tensor_entry_t tensor_entry_abs_grad(tensor_entry_t entry){
-    return entry >= 0 ? 1 : -1;
+// hoisted out of the divide kernels, so that they remain vectorizable
+static bool tensor_has_zero_entry(tensor_t* tensor){
+    size_t tensor_size = tensor->shape->size;
+    bool has_zero = false;
+    for(size_t index = 0; index < tensor_size; index++){
+        has_zero |= tensor->data[index] == 0;
+    }
+    return has_zero;
 }
 
-static inline tensor_entry_t tensor_entry_abs(tensor_entry_t entry){
-    return entry >= 0 ? entry : -entry;
-}
+/**
+ * GENERIC FALLBACK
+ * an arbitrary tensor_entry_binary_fn_t, called per entry
+*/
 
 // called when dim_index + 1 = dest_tensor->shape->num_dims
 void base_in_place_broadcast(tensor_t* dest_tensor, tensor_t* source_tensor1, tensor_t* source_tensor2, size_t dest_offset, size_t offset1, size_t offset2, int dim_index, tensor_entry_binary_fn_t tensor_entry_binary_fn){
@@ -280,18 +448,30 @@ void recursive_in_place_broadcast_fn(tensor_t* dest_tensor, tensor_t* source_ten
 void in_place_broadcast_fn(tensor_t* dest_tensor, tensor_t* source_tensor1, tensor_t* source_tensor2, tensor_entry_binary_fn_t tensor_entry_binary_fn){
     NDEBUG_ASSERT(dest_tensor != source_tensor1 && dest_tensor != source_tensor2, "Destination and source tensors cannot alias the same memory - undefined behavior!");
     NDEBUG_ASSERT(shape_equal(shape_get_broadcast_shape(source_tensor1->shape, source_tensor2->shape), dest_tensor->shape), "Destination tensor has improper shape!");
-    shape_display(source_tensor1->shape);
-    shape_display(source_tensor2->shape);
     NDEBUG_ASSERT(tensor_broadcast_compatible(source_tensor1, source_tensor2), "Tensors are not broadcast compatible!\n");
+    // once, as the recursion stores through tensor_set_entry
+    tensor_make_writable(dest_tensor);
+    perf_scope_t perf_scope;
+    perf_begin(&perf_scope, "broadcast_fn", NULL);
     int source_dims1 = TENSOR_NUM_DIMS(source_tensor1);
     int source_dims2 = TENSOR_NUM_DIMS(source_tensor2);
     // pad the smaller tensor with leading dimensions of length 1 so that both tensors have the same number of dimensions
+    // (read only, so a temporary that owns nothing rather than a view)
+    tensor_t extended = {NULL, NULL, NULL};
     if(source_dims1 < source_dims2){
-        source_tensor1 = tensor_view_as_shape(source_tensor1, shape_extend_to_dims(source_tensor1->shape, source_dims2));
+        extended.data = source_tensor1->data;
+        extended.shape = shape_extend_to_dims(source_tensor1->shape, source_dims2);
+        source_tensor1 = &extended;
     }else if(source_dims1 > source_dims2){
-        source_tensor2 = tensor_view_as_shape(source_tensor2, shape_extend_to_dims(source_tensor2->shape, source_dims1));
+        extended.data = source_tensor2->data;
+        extended.shape = shape_extend_to_dims(source_tensor2->shape, source_dims1);
+        source_tensor2 = &extended;
     }
     recursive_in_place_broadcast_fn(dest_tensor, source_tensor1, source_tensor2, 0, 0, 0, 0, tensor_entry_binary_fn);
+    if(extended.shape != NULL){
+        shape_free(extended.shape);
+    }
+    perf_end(&perf_scope, dest_tensor->shape->size);
 }
 
 // TODO : allow for broadcasting of different sizes
@@ -302,16 +482,29 @@ tensor_t* tensor_broadcast_fn(tensor_t* left_tensor, tensor_t* right_tensor, ten
     return new_tensor;
 }
 
+// through the broadcast kernels, which read any strides
+tensor_t* tensor_materialize(tensor_t* tensor){
+    tensor_t* new_tensor = tensor_new(tensor->shape);
+    elementwise_add_into(new_tensor, new_tensor, tensor);
+    return new_tensor;
+}
+
 /**
  * sums along a subset of the dimensions so that the resulting tensor has shape target_shape
 */
 tensor_t* tensor_reduce_to_shape(tensor_t* tensor, shape_t* target_shape){
     NDEBUG_ASSERT(shape_broadcast_compatible(tensor->shape, target_shape), "Tensor is not compatible with target shape.");
     NDEBUG_ASSERT(target_shape->num_dims <= TENSOR_NUM_DIMS(tensor), "Target shape has too many dimensions.");
+    perf_scope_t perf_scope;
+    perf_begin(&perf_scope, "reduce_to_shape", NULL);
     shape_t* extended_target_shape = shape_extend_to_dims(target_shape, TENSOR_NUM_DIMS(tensor));
     tensor_t* reduced_tensor = tensor_new(extended_target_shape);
-    recursive_in_place_broadcast_fn(reduced_tensor, reduced_tensor, tensor, 0, 0, 0, 0, &tensor_entry_add);
-    return tensor_view_as_shape(reduced_tensor, target_shape);
+    elementwise_add_into(reduced_tensor, reduced_tensor, tensor);
+    // reshaped rather than viewed, so that the result owns (and can share) its buffer
+    tensor_in_place_view_as_shape(reduced_tensor, target_shape);
+    // by the entries read
+    perf_end(&perf_scope, tensor->shape->size);
+    return reduced_tensor;
 }
 
 /**
@@ -326,37 +519,39 @@ tensor_t* tensor_reduce_to_shape(tensor_t* tensor, shape_t* target_shape){
  */
 void tensor_in_place_add(tensor_t* left_tensor, tensor_t* right_tensor){
     NDEBUG_ASSERT(shape_equal(shape_get_broadcast_shape(left_tensor->shape, right_tensor->shape), left_tensor->shape), "Left tensor has improper shape for in place operation!");
-    left_tensor->data = tensor_add(left_tensor, right_tensor)->data;
+    elementwise_add_into(left_tensor, left_tensor, right_tensor);
 }
 
 void tensor_in_place_subtract(tensor_t* left_tensor, tensor_t* right_tensor){
     NDEBUG_ASSERT(shape_equal(shape_get_broadcast_shape(left_tensor->shape, right_tensor->shape), left_tensor->shape), "Left tensor has improper shape for in place operation!");
-    left_tensor->data = tensor_subtract(left_tensor, right_tensor)->data;
+    elementwise_subtract_into(left_tensor, left_tensor, right_tensor);
 }
 
 void tensor_in_place_multiply(tensor_t* left_tensor, tensor_t* right_tensor){
     NDEBUG_ASSERT(shape_equal(shape_get_broadcast_shape(left_tensor->shape, right_tensor->shape), left_tensor->shape), "Left tensor has improper shape for in place operation!");
-    left_tensor = tensor_multiply(left_tensor, right_tensor);
+    elementwise_multiply_into(left_tensor, left_tensor, right_tensor);
 }
 
 void tensor_in_place_divide(tensor_t* left_tensor, tensor_t* right_tensor){
     NDEBUG_ASSERT(shape_equal(shape_get_broadcast_shape(left_tensor->shape, right_tensor->shape), left_tensor->shape), "Left tensor has improper shape for in place operation!");
-    left_tensor = tensor_divide(left_tensor, right_tensor);
+    NDEBUG_ASSERT(!tensor_has_zero_entry(right_tensor), "Cannot divide by zero!");
+    elementwise_divide_into(left_tensor, left_tensor, right_tensor);
 }
 
 void tensor_in_place_multiply_by_scalar(tensor_t* tensor, tensor_entry_t value){
-    size_t tensor_size = tensor_get_size(tensor);
+    tensor_make_writable(tensor);
+    size_t tensor_size = tensor->shape->size;
     for(size_t index = 0; index < tensor_size; index++){
-        tensor_entry_t new_value = tensor_entry_multiply(tensor_get_entry(tensor, index), value);
-        tensor_set_entry(tensor, index, new_value);
+        tensor->data[index] *= value;
     }
 }
 
 void tensor_in_place_divide_by_scalar(tensor_t* tensor, tensor_entry_t value){
-    size_t tensor_size = tensor_get_size(tensor);
+    NDEBUG_ASSERT(value != 0, "Cannot divide by zero!");
+    tensor_make_writable(tensor);
+    size_t tensor_size = tensor->shape->size;
     for(size_t index = 0; index < tensor_size; index++){
-        tensor_entry_t new_value = tensor_entry_divide(tensor_get_entry(tensor, index), value);
-        tensor_set_entry(tensor, index, new_value);
+        tensor->data[index] /= value;
     }
 }
 
@@ -368,28 +563,33 @@ void tensor_in_place_divide_by_scalar(tensor_t* tensor, tensor_entry_t value){
 // of left_tensor and right_tensor
 // assumes that left_tensor and right_tensor are compatible
 tensor_t* tensor_add(tensor_t* left_tensor, tensor_t* right_tensor){
-    return tensor_broadcast_fn(left_tensor, right_tensor, &tensor_entry_add);
+    return elementwise_add(left_tensor, right_tensor);
 }
 
 tensor_t* tensor_subtract(tensor_t* left_tensor, tensor_t* right_tensor){
-    return tensor_broadcast_fn(left_tensor, right_tensor, &tensor_entry_subtract);
+    return elementwise_subtract(left_tensor, right_tensor);
 }
 
 tensor_t* tensor_multiply(tensor_t* left_tensor, tensor_t* right_tensor){
-    return tensor_broadcast_fn(left_tensor, right_tensor, &tensor_entry_multiply);
+    return elementwise_multiply(left_tensor, right_tensor);
 }
 
 tensor_t* tensor_divide(tensor_t* left_tensor, tensor_t* right_tensor){
-    return tensor_broadcast_fn(left_tensor, right_tensor, &tensor_entry_divide);
+    NDEBUG_ASSERT(!tensor_has_zero_entry(right_tensor), "Cannot divide by zero!");
+    return elementwise_divide(left_tensor, right_tensor);
 }
 
 tensor_t* tensor_multiply_by_scalar_grad(tensor_t* tensor, tensor_entry_t value){
     return tensor_new_like_with_value(tensor, value);
 }
 
+// one pass into a new tensor, rather than a copy and a pass over it
 tensor_t* tensor_multiply_by_scalar(tensor_t* tensor, tensor_entry_t value){
-    tensor_t* new_tensor = tensor_copy(tensor);
-    tensor_in_place_multiply_by_scalar(new_tensor, value);
+    tensor_t* new_tensor = tensor_new_like(tensor);
+    size_t tensor_size = tensor->shape->size;
+    for(size_t index = 0; index < tensor_size; index++){
+        new_tensor->data[index] = tensor->data[index] * value;
+    }
     return new_tensor;
 }
 
@@ -399,21 +599,21 @@ tensor_t* tensor_divide_by_scalar_grad(tensor_t* tensor, tensor_entry_t value){
 }
 
 tensor_t* tensor_divide_by_scalar(tensor_t* tensor, tensor_entry_t value){
-    tensor_t* new_tensor = tensor_copy(tensor);
-    tensor_in_place_divide_by_scalar(new_tensor, value);
+    NDEBUG_ASSERT(value != 0, "Cannot divide by zero!");
+    tensor_t* new_tensor = tensor_new_like(tensor);
+    size_t tensor_size = tensor->shape->size;
+    for(size_t index = 0; index < tensor_size; index++){
+        new_tensor->data[index] = tensor->data[index] / value;
+    }
     return new_tensor;
 }
 
 tensor_t* tensor_abs_grad(tensor_t* tensor){
-    tensor_t* grad_tensor = tensor_copy(tensor);
-    tensor_in_place_apply_entry_fn(grad_tensor, &tensor_entry_abs_grad);
-    return grad_tensor;
+    return elementwise_abs_grad(tensor);
 }
 
 tensor_t* tensor_abs(tensor_t* tensor){
-    tensor_t* new_tensor = tensor_copy(tensor);
-    tensor_in_place_apply_entry_fn(new_tensor, &tensor_entry_abs);
-    return new_tensor;
+    return elementwise_abs(tensor);
 }
 
 tensor_t* tensor_sum_grad(tensor_t* tensor){
@@ -421,7 +621,7 @@ tensor_t* tensor_sum_grad(tensor_t* tensor){
 }
 
 tensor_t* tensor_sum(tensor_t* tensor){
-    size_t tensor_size = tensor_get_size(tensor);
+    size_t tensor_size = tensor->shape->size;
     tensor_entry_t sum = 0;
     for(size_t index = 0; index < tensor_size; index++){
         sum += tensor_get_entry(tensor, index);
@@ -430,12 +630,346 @@ tensor_t* tensor_sum(tensor_t* tensor){
 }
 
 tensor_t* tensor_mean_grad(tensor_t* tensor){
-    return tensor_divide_by_scalar(tensor_new_like_with_value(tensor, 1), tensor_get_size(tensor));
+    return tensor_divide_by_scalar(tensor_new_like_with_value(tensor, 1), tensor->shape->size);
 }
 
 tensor_t* tensor_mean(tensor_t* tensor){
-    NDEBUG_ASSERT(tensor_get_size(tensor), "Cannot take mean of tensor of size zero!");
-    return tensor_divide_by_scalar(tensor_sum(tensor), tensor_get_size(tensor));
+    NDEBUG_ASSERT(tensor->shape->size, "Cannot take mean of tensor of size zero!");
+    return tensor_divide_by_scalar(tensor_sum(tensor), tensor->shape->size);
+}
+
+/**
+ * ACTIVATIONS AND TRANSCENDENTALS
+ * NOTE: generated by macro rather than passing a tensor_entry_unary_fn_t, so that each loop inlines its
+ * (branch-free, see vmath.h for accuracy) entry function and is vectorized; the forward kernels are those of the
+ * op registry in elementwise.h
+*/
+
+// tensor_NAME(tensor) and tensor_in_place_NAME(tensor): the NAME kernel of elementwise.h
+#define DEFINE_TENSOR_UNARY_MAP(NAME) \
+    tensor_t* tensor_##NAME(tensor_t* tensor){ \
+        return elementwise_##NAME(tensor); \
+    } \
+    void tensor_in_place_##NAME(tensor_t* tensor){ \
+        elementwise_##NAME##_into(tensor, tensor); \
+    }
+
+// tensor_NAME_backwards_grad(saved, output_grad): entrywise output_grad * f'(x), with f' given by DERIVATIVE in terms of
+// the saved entry x (the output of f where that suffices, so that f is never recomputed, otherwise the input)
+#define DEFINE_TENSOR_BACKWARDS_GRAD_MAP(NAME, DERIVATIVE) \
+    tensor_t* tensor_##NAME##_backwards_grad(tensor_t* saved, tensor_t* output_grad){ \
+        NDEBUG_ASSERT(shape_equal(saved->shape, output_grad->shape), "Saved tensor and gradient shapes do not match!\n"); \
+        tensor_t* grad = tensor_new_like(saved); \
+        size_t tensor_size = tensor_get_size(saved); \
+        const tensor_entry_t* restrict source = saved->data; \
+        const tensor_entry_t* restrict source_grad = output_grad->data; \
+        tensor_entry_t* restrict dest = grad->data; \
+        for(size_t index = 0; index < tensor_size; index++){ \
+            tensor_entry_t x = source[index]; \
+            dest[index] = source_grad[index] * (DERIVATIVE); \
+        } \
+        return grad; \
+    }
+
+DEFINE_TENSOR_UNARY_MAP(relu)
+DEFINE_TENSOR_UNARY_MAP(sigmoid)
+DEFINE_TENSOR_UNARY_MAP(tanh)
+DEFINE_TENSOR_UNARY_MAP(gelu)
+DEFINE_TENSOR_UNARY_MAP(exp)
+DEFINE_TENSOR_UNARY_MAP(log)
+
+// saved output
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(relu, x > 0 ? 1 : 0)
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(sigmoid, x * (1 - x))
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(tanh, 1 - x * x)
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(exp, x)
+// saved input
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(gelu, vmath_gelu_gradf(x))
+DEFINE_TENSOR_BACKWARDS_GRAD_MAP(log, 1 / x)
+
+/**
+ * SOFTMAX
+ * a tensor is viewed as (outer x length x inner) around axis, so each softmax is over length entries that are inner apart
+ * the first pass over the logits keeps a running max and a running sum of exp(x - max), rescaled whenever the max grows,
+ * the second pass writes the output; nothing else is materialised
+*/
+
+#define SOFTMAX_ROW_LANES 8
+#define SOFTMAX_COLUMN_LANES 64
+
+static inline void online_update(tensor_entry_t* running_max, tensor_entry_t* running_sum, tensor_entry_t x){
+    tensor_entry_t new_max = x > *running_max ? x : *running_max;
+    *running_sum = *running_sum * vmath_expf(*running_max - new_max) + vmath_expf(x - new_max);
+    *running_max = new_max;
+}
+
+// max and sum of exp(x - max) over a contiguous row
+// SOFTMAX_ROW_LANES independent running (max, sum) pairs are kept so that the loop vectorizes, and merged at the end
+static void row_max_and_sum(const tensor_entry_t* row, size_t length, tensor_entry_t* max, tensor_entry_t* sum){
+    tensor_entry_t lane_max[SOFTMAX_ROW_LANES];
+    tensor_entry_t lane_sum[SOFTMAX_ROW_LANES];
+    for(int lane = 0; lane < SOFTMAX_ROW_LANES; lane++){
+        lane_max[lane] = -INFINITY;
+        lane_sum[lane] = 0;
+    }
+    size_t index = 0;
+    for(; index + SOFTMAX_ROW_LANES <= length; index += SOFTMAX_ROW_LANES){
+        for(int lane = 0; lane < SOFTMAX_ROW_LANES; lane++){
+            online_update(&lane_max[lane], &lane_sum[lane], row[index + lane]);
+        }
+    }
+    tensor_entry_t row_max = -INFINITY;
+    for(int lane = 0; lane < SOFTMAX_ROW_LANES; lane++){
+        row_max = lane_max[lane] > row_max ? lane_max[lane] : row_max;
+    }
+    for(; index < length; index++){
+        row_max = row[index] > row_max ? row[index] : row_max;
+    }
+    tensor_entry_t row_sum = 0;
+    for(int lane = 0; lane < SOFTMAX_ROW_LANES; lane++){
+        row_sum += lane_sum[lane] * vmath_expf(lane_max[lane] - row_max);
+    }
+    for(index = length - length % SOFTMAX_ROW_LANES; index < length; index++){
+        row_sum += vmath_expf(row[index] - row_max);
+    }
+    *max = row_max;
+    *sum = row_sum;
+}
+
+// same as row_max_and_sum, for num_lanes (<= SOFTMAX_COLUMN_LANES) adjacent softmaxes whose entries are inner apart
+static void column_max_and_sum(const tensor_entry_t* columns, size_t length, size_t inner, size_t num_lanes, tensor_entry_t* max, tensor_entry_t* sum){
+    for(size_t lane = 0; lane < num_lanes; lane++){
+        max[lane] = -INFINITY;
+        sum[lane] = 0;
+    }
+    for(size_t index = 0; index < length; index++){
+        const tensor_entry_t* row = columns + index * inner;
+        for(size_t lane = 0; lane < num_lanes; lane++){
+            online_update(&max[lane], &sum[lane], row[lane]);
+        }
+    }
+}
+
+// writes softmax (or log softmax) of num_lanes adjacent softmaxes given their max and sum
+static void write_softmax(const tensor_entry_t* logits, tensor_entry_t* output, size_t length, size_t inner, size_t num_lanes, const tensor_entry_t* max, const tensor_entry_t* sum, bool log_output){
+    tensor_entry_t shift[SOFTMAX_COLUMN_LANES];
+    tensor_entry_t scale[SOFTMAX_COLUMN_LANES];
+    for(size_t lane = 0; lane < num_lanes; lane++){
+        shift[lane] = log_output ? max[lane] + vmath_logf(sum[lane]) : max[lane];
+        scale[lane] = 1 / sum[lane];
+    }
+    for(size_t index = 0; index < length; index++){
+        const tensor_entry_t* restrict x = logits + index * inner;
+        tensor_entry_t* restrict y = output + index * inner;
+        if(log_output){
+            for(size_t lane = 0; lane < num_lanes; lane++){
+                y[lane] = x[lane] - shift[lane];
+            }
+        }else{
+            for(size_t lane = 0; lane < num_lanes; lane++){
+                y[lane] = vmath_expf(x[lane] - shift[lane]) * scale[lane];
+            }
+        }
+    }
+}
+
+// converts a (possibly negative, numpy style) axis into (outer, length, inner)
+static void axis_extents(tensor_t* tensor, int axis, size_t* outer, size_t* length, size_t* inner){
+    int num_dims = TENSOR_NUM_DIMS(tensor);
+    if(axis < 0){
+        axis += num_dims;
+    }
+    NDEBUG_ASSERT(0 <= axis && axis < num_dims, "Axis out of range!\n");
+    *length = tensor->shape->dims[axis];
+    *inner = tensor->shape->strides[axis];
+    *outer = tensor->shape->size / (*length * *inner);
+}
+
+static tensor_t* softmax(tensor_t* tensor, int axis, bool log_output){
+    size_t outer, length, inner;
+    axis_extents(tensor, axis, &outer, &length, &inner);
+    tensor_t* new_tensor = tensor_new_like(tensor);
+    tensor_entry_t max[SOFTMAX_COLUMN_LANES];
+    tensor_entry_t sum[SOFTMAX_COLUMN_LANES];
+    for(size_t outer_index = 0; outer_index < outer; outer_index++){
+        size_t offset = outer_index * length * inner;
+        for(size_t lane_start = 0; lane_start < inner; lane_start += SOFTMAX_COLUMN_LANES){
+            size_t num_lanes = MIN(SOFTMAX_COLUMN_LANES, inner - lane_start);
+            const tensor_entry_t* logits = tensor->data + offset + lane_start;
+            if(inner == 1){
+                row_max_and_sum(logits, length, &max[0], &sum[0]);
+            }else{
+                column_max_and_sum(logits, length, inner, num_lanes, max, sum);
+            }
+            write_softmax(logits, new_tensor->data + offset + lane_start, length, inner, num_lanes, max, sum, log_output);
+        }
+    }
+    return new_tensor;
+}
+
+tensor_t* tensor_softmax(tensor_t* tensor, int axis){
+    return softmax(tensor, axis, false);
+}
+
+tensor_t* tensor_log_softmax(tensor_t* tensor, int axis){
+    return softmax(tensor, axis, true);
+}
+
+// from the saved output y (softmax, or log softmax if log_output)
+// softmax: grad = y * (g - sum(g * y)), log softmax: grad = g - exp(y) * sum(g)
+static tensor_t* softmax_backwards_grad(tensor_t* output, tensor_t* output_grad, int axis, bool log_output){
+    size_t outer, length, inner;
+    axis_extents(output, axis, &outer, &length, &inner);
+    tensor_t* grad = tensor_new_like(output);
+    tensor_entry_t reduction[SOFTMAX_COLUMN_LANES];
+    for(size_t outer_index = 0; outer_index < outer; outer_index++){
+        size_t offset = outer_index * length * inner;
+        for(size_t lane_start = 0; lane_start < inner; lane_start += SOFTMAX_COLUMN_LANES){
+            size_t num_lanes = MIN(SOFTMAX_COLUMN_LANES, inner - lane_start);
+            const tensor_entry_t* y = output->data + offset + lane_start;
+            const tensor_entry_t* g = output_grad->data + offset + lane_start;
+            tensor_entry_t* dx = grad->data + offset + lane_start;
+            for(size_t lane = 0; lane < num_lanes; lane++){
+                reduction[lane] = 0;
+            }
+            for(size_t index = 0; index < length; index++){
+                for(size_t lane = 0; lane < num_lanes; lane++){
+                    reduction[lane] += log_output ? g[index * inner + lane] : g[index * inner + lane] * y[index * inner + lane];
+                }
+            }
+            for(size_t index = 0; index < length; index++){
+                const tensor_entry_t* restrict y_row = y + index * inner;
+                const tensor_entry_t* restrict g_row = g + index * inner;
+                tensor_entry_t* restrict dx_row = dx + index * inner;
+                if(log_output){
+                    for(size_t lane = 0; lane < num_lanes; lane++){
+                        dx_row[lane] = g_row[lane] - vmath_expf(y_row[lane]) * reduction[lane];
+                    }
+                }else{
+                    for(size_t lane = 0; lane < num_lanes; lane++){
+                        dx_row[lane] = y_row[lane] * (g_row[lane] - reduction[lane]);
+                    }
+                }
+            }
+        }
+    }
+    return grad;
+}
+
+tensor_t* tensor_softmax_backwards_grad(tensor_t* output, tensor_t* output_grad, int axis){
+    return softmax_backwards_grad(output, output_grad, axis, false);
+}
+
+tensor_t* tensor_log_softmax_backwards_grad(tensor_t* output, tensor_t* output_grad, int axis){
+    return softmax_backwards_grad(output, output_grad, axis, true);
+}
+
+// mean over rows of -log softmax(logits)[row, targets[row]] for (num_rows x num_classes) logits
+// one pass over the logits; the log sum exp of every row is written to log_sum_exp for the backward pass
+tensor_t* tensor_cross_entropy(tensor_t* logits, size_t* targets, tensor_entry_t* log_sum_exp){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(logits) == 2, "Cross entropy requires (rows x classes) logits!\n");
+    size_t num_rows = logits->shape->dims[0];
+    size_t num_classes = logits->shape->dims[1];
+    tensor_entry_t loss = 0;
+    for(size_t row = 0; row < num_rows; row++){
+        NDEBUG_ASSERT(targets[row] < num_classes, "Target out of range!\n");
+        const tensor_entry_t* row_logits = logits->data + row * num_classes;
+        tensor_entry_t max, sum;
+        row_max_and_sum(row_logits, num_classes, &max, &sum);
+        log_sum_exp[row] = max + vmath_logf(sum);
+        loss += log_sum_exp[row] - row_logits[targets[row]];
+    }
+    return tensor_new_from_entry(loss / num_rows);
+}
+
+// closed form (softmax - onehot) * output_grad / num_rows, in one pass over the logits
+tensor_t* tensor_cross_entropy_backwards_grad(tensor_t* logits, size_t* targets, tensor_entry_t* log_sum_exp, tensor_t* output_grad){
+    size_t num_rows = logits->shape->dims[0];
+    size_t num_classes = logits->shape->dims[1];
+    tensor_entry_t scale = tensor_get_entry(output_grad, 0) / num_rows;
+    tensor_t* grad = tensor_new_like(logits);
+    for(size_t row = 0; row < num_rows; row++){
+        const tensor_entry_t* restrict x = logits->data + row * num_classes;
+        tensor_entry_t* restrict dx = grad->data + row * num_classes;
+        tensor_entry_t shift = log_sum_exp[row];
+        for(size_t column = 0; column < num_classes; column++){
+            dx[column] = vmath_expf(x[column] - shift) * scale;
+        }
+        dx[targets[row]] -= scale;
+    }
+    return grad;
+}
+
+/**
+ * INDEXING
+ * rows are along dim 0, each row_size contiguous entries
+*/
+
+static shape_t* shape_with_num_rows(shape_t* shape, size_t num_rows){
+    size_t dims[TENSOR_MAX_DIMS];
+    memcpy(dims, shape->dims, shape->num_dims * sizeof(size_t));
+    dims[0] = num_rows;
+    return shape_new(shape->num_dims, dims);
+}
+
+tensor_t* tensor_index_select(tensor_t* tensor, size_t num_indices, const size_t* indices){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(tensor) >= 1, "Cannot index a tensor without dimensions!\n");
+    size_t num_rows = tensor->shape->dims[0];
+    size_t row_size = num_rows > 0 ? tensor->shape->size / num_rows : 0;
+    tensor_t* new_tensor = tensor_new(shape_with_num_rows(tensor->shape, num_indices));
+    for(size_t index = 0; index < num_indices; index++){
+        NDEBUG_ASSERT(indices[index] < num_rows, "Index out of bounds!\n");
+        memcpy(new_tensor->data + index * row_size, tensor->data + indices[index] * row_size, row_size * sizeof(tensor_entry_t));
+    }
+    return new_tensor;
+}
+
+tensor_t* tensor_scatter_add(tensor_t* source, size_t num_indices, const size_t* indices, size_t num_rows){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(source) >= 1 && source->shape->dims[0] == num_indices, "Source needs one row per index!\n");
+    size_t row_size = num_indices > 0 ? source->shape->size / num_indices : 0;
+    tensor_t* new_tensor = tensor_new(shape_with_num_rows(source->shape, num_rows));
+    for(size_t index = 0; index < num_indices; index++){
+        NDEBUG_ASSERT(indices[index] < num_rows, "Index out of bounds!\n");
+        tensor_entry_t* restrict destination = new_tensor->data + indices[index] * row_size;
+        const tensor_entry_t* restrict source_row = source->data + index * row_size;
+        for(size_t entry = 0; entry < row_size; entry++){
+            destination[entry] += source_row[entry];
+        }
+    }
+    return new_tensor;
+}
+
+/**
+ * MATRIX MULTIPLICATION
+*/
+
+// (m x k) * (k x n) -> (m x n)
+tensor_t* tensor_matmul(tensor_t* left_tensor, tensor_t* right_tensor){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(left_tensor) == 2 && TENSOR_NUM_DIMS(right_tensor) == 2, "Matrix multiplication requires two dimensional tensors!\n");
+    NDEBUG_ASSERT(left_tensor->shape->dims[1] == right_tensor->shape->dims[0], "Inner dimensions of matrix multiplication do not match!\n");
+    size_t m = left_tensor->shape->dims[0];
+    size_t k = left_tensor->shape->dims[1];
+    size_t n = right_tensor->shape->dims[1];
+    size_t dims[2] = {m, n};
+    tensor_t* new_tensor = tensor_new(shape_new(2, dims));
+    gemm(m, n, k, left_tensor->data, k, 1, right_tensor->data, n, 1, new_tensor->data, n, false, NULL);
+    return new_tensor;
+}
+
+// activation(input * weight + bias) where input is (batch x in), weight is (in x out) and bias (out) may be NULL
+// bias and activation are applied in the gemm epilogue rather than as separate passes over the output
+tensor_t* tensor_linear(tensor_t* input, tensor_t* weight, tensor_t* bias, activation_t activation){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(input) == 2 && TENSOR_NUM_DIMS(weight) == 2, "Linear requires two dimensional input and weight!\n");
+    NDEBUG_ASSERT(input->shape->dims[1] == weight->shape->dims[0], "Input and weight dimensions do not match!\n");
+    NDEBUG_ASSERT(bias == NULL || tensor_get_size(bias) == weight->shape->dims[1], "Bias and weight dimensions do not match!\n");
+    size_t m = input->shape->dims[0];
+    size_t k = input->shape->dims[1];
+    size_t n = weight->shape->dims[1];
+    size_t dims[2] = {m, n};
+    tensor_t* new_tensor = tensor_new(shape_new(2, dims));
+    gemm_epilogue_t epilogue = {bias ? bias->data : NULL, activation};
+    gemm(m, n, k, input->data, k, 1, weight->data, n, 1, new_tensor->data, n, false, &epilogue);
+    return new_tensor;
 }
 
 /**
@@ -8,11 +8,22 @@
 
 typedef float tensor_entry_t; 
 
-#define TENSOR_MAX_DIMS 3
+#define TENSOR_MAX_DIMS 4
+
+// the buffer behind one or more tensors, see COPY ON WRITE
+typedef struct {
+    tensor_entry_t* data;
+    size_t bytes;
+    int ref_count; // tensors referencing the buffer, as copies of each other or as views
+    bool pinned; // aliased by a view, so never shared by copies
+    bool borrowed; // data is owned elsewhere (see tensor_move_into), and is not freed with the storage
+    unsigned int version; // of the contents, see tensor_version
+} tensor_storage_t;
 
 typedef struct {
     tensor_entry_t* data; // ptr to data
     shape_t* shape; //dimensions of data
+    tensor_storage_t* storage; // shared by copies and views; NULL for data which is not tensor memory (eg. a loaded batch)
 } tensor_t;
 
 // macros for debugging
@@ -20,6 +31,14 @@ typedef struct {
 #define TENSOR_NUM_DIMS(tensor) (tensor)->shape->num_dims
 #define TENSOR_IN_BOUNDS_INDEX(tensor, index) (0 <= (index) && (index) < tensor->num_rows * tensor->num_columns)
 
+// activations which can be fused into the epilogue of a matrix multiplication
+typedef enum {
+    ACTIVATION_NONE,
+    ACTIVATION_RELU,
+    ACTIVATION_SIGMOID,
+    ACTIVATION_TANH,
+} activation_t;
+
 // entry x entry -> entry, applied component wise to create a new tensor from two existing ones
 typedef tensor_entry_t (* tensor_entry_binary_fn_t)(tensor_entry_t left_entry, tensor_entry_t right_entry);
 // entry -> entry, applied component wise to create a new tensor from two existing ones
@@ -31,8 +50,105 @@ tensor_t* tensor_new(shape_t* shape);
 tensor_t* tensor_new_like(tensor_t* old_tensor);
 tensor_t* tensor_new_like_with_value(tensor_t* old_tensor, tensor_entry_t value);
 tensor_t* tensor_new_zeros_like(tensor_t* old_tensor);
+// shares the data of old_tensor until either is written, see COPY ON WRITE
 tensor_t* tensor_copy(tensor_t* old_tensor);
+// aliases the data of tensor: writes through either are seen by both, and the data lives until both are freed
 tensor_t* tensor_view_as_shape(tensor_t* tensor, shape_t* new_shape);
+// releases the data (freed with the last copy or view of it)
+void tensor_free(tensor_t* tensor);
+
+/**
+ * FILL TENSORS
+ * a fill tensor holds a single entry, which every index of its shape reads (its strides are all 0), so that eg. the
+ * gradient of a sum, which is the output gradient at every entry of the input, is made in O(1) rather than as a
+ * full tensor of ones and a pass multiplying it
+ * fills are made by the sum and mean grad ops (whose updates are only ever added into gradients), while the public
+ * tensor functions, eg. tensor_sum_grad, return dense tensors
+ * a fill tensor may be an operand (but never the destination) of the broadcast kernels of elementwise.h (which step
+ * by strides), the in place ops and tensor_reduce_to_shape, of the unary kernels, tensor_equal and tensor_get_entry;
+ * anything else reading its data must tensor_materialize it first
+*/
+
+tensor_t* tensor_new_fill(shape_t* shape, tensor_entry_t value);
+tensor_t* tensor_new_fill_like(tensor_t* tensor, tensor_entry_t value);
+// a new tensor of its own buffer, with the entries tensor reads
+tensor_t* tensor_materialize(tensor_t* tensor);
+
+static inline bool tensor_is_fill(tensor_t* tensor){
+    return shape_is_expanded(tensor->shape);
+}
+
+/**
+ * COPY ON WRITE
+ * a copy shares the storage of the tensor it was made from; whichever of them is first written afterwards moves
+ * to a buffer of its own at that point, so that a copy which is never written (eg. the gradient handed on by an
+ * addition) costs no memory traffic at all
+ * every function which writes into an existing tensor calls tensor_make_writable first, as must code writing
+ * through tensor->data (or tensor_set_entry) directly
+ * a storage which has been viewed is pinned: it is copied eagerly, so that writes through a view are never
+ * separated from the tensor it views
+ * tensor_make_writable also bumps the version of the storage, so that autograd can tell that a tensor saved for
+ * backwards has since been written (see save_for_backwards); like the data, it is not safe to write concurrently
+*/
+
+// moves tensor to a buffer of its own
+void tensor_unshare(tensor_t* tensor);
+// moves the contents of tensor into data, a buffer owned elsewhere (eg. the flat buffer of an optimizer) which
+// outlives it, releasing the storage it held; the new storage is pinned, as data is also written directly by its
+// owner, and keeps the version of the old one
+void tensor_move_into(tensor_t* tensor, tensor_entry_t* data);
+// points tensor at data which is not tensor memory (eg. a mapped checkpoint), releasing the storage it held; only
+// for a tensor which owns its buffer (see tensor_owns_data), as views and owners of its buffer would be left behind
+void tensor_point_to(tensor_t* tensor, tensor_entry_t* data);
+
+// whether tensor may drop its buffer for another: either its data is not tensor memory, or it is the whole of a
+// storage which is neither viewed nor owned elsewhere (copies sharing it keep it)
+static inline bool tensor_owns_data(tensor_t* tensor){
+    tensor_storage_t* storage = tensor->storage;
+    return storage == NULL || (tensor->data == storage->data && !storage->pinned && !storage->borrowed);
+}
+
+// a pinned storage is referenced by views only, which alias it by design
+static inline bool tensor_is_shared(tensor_t* tensor){
+    tensor_storage_t* storage = tensor->storage;
+    return storage != NULL && !storage->pinned && tensor->data == storage->data && __atomic_load_n(&storage->ref_count, __ATOMIC_ACQUIRE) > 1;
+}
+
+static inline void tensor_make_writable(tensor_t* tensor){
+    DEBUG_ASSERT(!tensor_is_fill(tensor), "Cannot write a fill tensor!\n");
+    if(tensor_is_shared(tensor)){
+        tensor_unshare(tensor);
+    }
+    if(tensor->storage != NULL){
+        tensor->storage->version++;
+    }
+}
+
+// changes whenever the contents of tensor are written (in place), whether through it, a view of it, or a copy of it
+// which shared its data; always 0 for tensors without storage (eg. batches of a dataloader), whose writes are not tracked
+static inline unsigned int tensor_version(tensor_t* tensor){
+    return tensor->storage != NULL ? tensor->storage->version : 0;
+}
+
+/**
+ * ALLOCATION SCOPES
+ * while a scope is open (per thread), every tensor made by tensor_new is recorded in it, so that everything
+ * a computation allocated, including temporaries, can be released at once when it ends
+ * scopes nest: tensors kept by an inner scope are handed to the enclosing one
+*/
+
+typedef struct tensor_scope tensor_scope_t;
+
+struct tensor_scope {
+    size_t num_tensors;
+    size_t capacity;
+    tensor_t** tensors;
+    tensor_scope_t* parent;
+};
+
+void tensor_scope_begin(tensor_scope_t* scope);
+// frees every recorded tensor except those sharing data with one of kept
+void tensor_scope_end(tensor_scope_t* scope, int num_kept, tensor_t** kept);
 
 bool tensor_equal(tensor_t* left_tensor, tensor_t* right_tensor);
 
@@ -56,11 +172,14 @@ static inline tensor_entry_t index_identity(size_t index){
  * NOTE: in .h so they'll be inlined
 */
 
+// a storage of a single entry is read at every index, so that a fill tensor reads as its shape
 static inline tensor_entry_t tensor_get_entry(tensor_t* tensor, size_t index){
     // DEBUG_ASSERT(!TENSOR_IN_BOUNDS_INDEX(tensor, index), "Out of bounds!\n");
-    return tensor->data[index];
+    bool single_entry = tensor->storage != NULL && tensor->storage->bytes == sizeof(tensor_entry_t);
+    return tensor->data[single_entry ? 0 : index];
 }
 
+// a raw store, like writing tensor->data: the caller makes tensor writable first, once for all the entries it sets
 static inline void tensor_set_entry(tensor_t* tensor, size_t index, tensor_entry_t value){
     // DEBUG_ASSERT(!TENSOR_IN_BOUNDS_INDEX(tensor, index), "Out of bounds!\n");
     tensor->data[index] = value;
@@ -73,12 +192,20 @@ void tensor_set_to_fn_value(tensor_t* tensor, tensor_index_fn_t index_fn);
 void tensor_display(tensor_t* tensor);
 
 tensor_t* tensor_reduce_to_shape(tensor_t* tensor, shape_t* target_shape);
+// generic fallback, calling entry_fn per entry; built in and user defined ops should use the kernels of elementwise.h
+tensor_t* tensor_broadcast_fn(tensor_t* left_tensor, tensor_t* right_tensor, tensor_entry_binary_fn_t tensor_entry_binary_fn);
 
 void tensor_in_place_add(tensor_t* left_tensor, tensor_t* right_tensor);
 void tensor_in_place_subtract(tensor_t* left_tensor, tensor_t* right_tensor);
 void tensor_in_place_multiply(tensor_t* left_tensor, tensor_t* right_tensor);
 void tensor_in_place_multiply_by_scalar(tensor_t* tensor, tensor_entry_t value);
 void tensor_in_place_divide_by_scalar(tensor_t* tensor, tensor_entry_t value);
+void tensor_in_place_relu(tensor_t* tensor);
+void tensor_in_place_sigmoid(tensor_t* tensor);
+void tensor_in_place_tanh(tensor_t* tensor);
+void tensor_in_place_gelu(tensor_t* tensor);
+void tensor_in_place_exp(tensor_t* tensor);
+void tensor_in_place_log(tensor_t* tensor);
 
 
 tensor_t* tensor_add(tensor_t* left_tensor, tensor_t* right_tensor);
@@ -93,5 +220,31 @@ tensor_t* tensor_sum_grad(tensor_t* tensor);
 tensor_t* tensor_sum(tensor_t* tensor);
 tensor_t* tensor_mean_grad(tensor_t* tensor);
 tensor_t* tensor_mean(tensor_t* tensor);
+tensor_t* tensor_relu(tensor_t* tensor);
+tensor_t* tensor_sigmoid(tensor_t* tensor);
+tensor_t* tensor_tanh(tensor_t* tensor);
+tensor_t* tensor_gelu(tensor_t* tensor);
+tensor_t* tensor_exp(tensor_t* tensor);
+tensor_t* tensor_log(tensor_t* tensor);
+// output_grad * f'(x) from the saved output of f
+tensor_t* tensor_relu_backwards_grad(tensor_t* output, tensor_t* output_grad);
+tensor_t* tensor_sigmoid_backwards_grad(tensor_t* output, tensor_t* output_grad);
+tensor_t* tensor_tanh_backwards_grad(tensor_t* output, tensor_t* output_grad);
+tensor_t* tensor_exp_backwards_grad(tensor_t* output, tensor_t* output_grad);
+// output_grad * f'(x) from the saved input of f
+tensor_t* tensor_gelu_backwards_grad(tensor_t* input, tensor_t* output_grad);
+tensor_t* tensor_log_backwards_grad(tensor_t* input, tensor_t* output_grad);
+tensor_t* tensor_softmax(tensor_t* tensor, int axis);
+tensor_t* tensor_log_softmax(tensor_t* tensor, int axis);
+tensor_t* tensor_softmax_backwards_grad(tensor_t* output, tensor_t* output_grad, int axis);
+tensor_t* tensor_log_softmax_backwards_grad(tensor_t* output, tensor_t* output_grad, int axis);
+tensor_t* tensor_cross_entropy(tensor_t* logits, size_t* targets, tensor_entry_t* log_sum_exp);
+tensor_t* tensor_cross_entropy_backwards_grad(tensor_t* logits, size_t* targets, tensor_entry_t* log_sum_exp, tensor_t* output_grad);
+// rows (along dim 0) indices[0], ..., indices[num_indices - 1] of tensor
+tensor_t* tensor_index_select(tensor_t* tensor, size_t num_indices, const size_t* indices);
+// num_rows rows, row r the sum of the rows i of source with indices[i] = r
+tensor_t* tensor_scatter_add(tensor_t* source, size_t num_indices, const size_t* indices, size_t num_rows);
+tensor_t* tensor_matmul(tensor_t* left_tensor, tensor_t* right_tensor);
+tensor_t* tensor_linear(tensor_t* input, tensor_t* weight, tensor_t* bias, activation_t activation);
 
 #endif // TENSOR_H
\ No newline at end of file
@@ -1,7 +1,36 @@
 #include "tensor.h"
 #include "variable.h"
 #include "assert.h"
+#include "grad.h"
+#include "optim.h"
+#include "nn.h"
+#include "data.h"
+#include "checkpoint.h"
+#include "data_parallel.h"
+#include "distributed.h"
+#include "transport.h"
+#include "elementwise.h"
+#include "rng.h"
+#include "sparse.h"
+#include "memory.h"
+#include "jit.h"
+#include "tune.h"
+#include "serve.h"
+#include "perf.h"
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <math.h>
+#include <string.h>
+
+static bool entry_close(tensor_entry_t actual, tensor_entry_t expected, tensor_entry_t tolerance){
+    return fabsf(actual - expected) <= tolerance * (1 + fabsf(expected));
+}
 
 
 void test_variable_equality(){
@@ -44,6 +73,1588 @@ void test_variable_subtract(){
     printf("PASS.\n");
 }
 
+// a user defined op, expanded into the same kernels as the built in ones
+ELEMENTWISE_DEFINE_BINARY(squared_difference, (a - b) * (a - b))
+
+static tensor_entry_t squared_difference_entry(tensor_entry_t left_entry, tensor_entry_t right_entry){
+    return (left_entry - right_entry) * (left_entry - right_entry);
+}
+
+static tensor_t* tensor_new_test_values(int num_dims, size_t* dims, size_t seed){
+    tensor_t* tensor = tensor_new(shape_new(num_dims, dims));
+    for(size_t index = 0; index < tensor->shape->size; index++){
+        tensor->data[index] = sinf((index + 1) * 12.9898f + seed * 78.233f);
+    }
+    return tensor;
+}
+
+void test_memory(){
+    printf("Testing tensor memory...");
+    size_t small_sizes[3] = {1, 3, 1000};
+    for(int size_index = 0; size_index < 3; size_index++){
+        tensor_t* tensor = tensor_new(shape_new(1, &small_sizes[size_index]));
+        bool aligned = (uintptr_t) tensor->data % MEMORY_ALIGNMENT == 0;
+        NDEBUG_ASSERT(aligned, "Tensor data should be aligned.");
+        tensor_free(tensor);
+    }
+    // large enough to be touched in parallel, in every page mode (hugetlb falls back when no pages are reserved)
+    memory_set_num_threads(3);
+    memory_pages_t modes[3] = {MEMORY_PAGES_SMALL, MEMORY_PAGES_TRANSPARENT, MEMORY_PAGES_HUGETLB};
+    size_t large_size = (40 << 20) / sizeof(tensor_entry_t) + 5;
+    for(int mode_index = 0; mode_index < 3; mode_index++){
+        memory_set_pages(modes[mode_index]);
+        tensor_t* tensor = tensor_new(shape_new(1, &large_size));
+        bool aligned = (uintptr_t) tensor->data % MEMORY_HUGE_PAGE_BYTES == 0;
+        NDEBUG_ASSERT(aligned, "Large tensor data should be huge page aligned.");
+        bool zeroed = true;
+        for(size_t index = 0; index < large_size; index += 1021){
+            zeroed = zeroed && tensor->data[index] == 0;
+        }
+        NDEBUG_ASSERT(zeroed && tensor->data[large_size - 1] == 0, "Large tensor should start zeroed.");
+        tensor->data[large_size - 1] = 1;
+        tensor_free(tensor);
+    }
+    memory_set_pages(MEMORY_PAGES_TRANSPARENT);
+    memory_set_num_threads(0);
+    printf("PASS.\n");
+}
+
+void test_copy_on_write(){
+    printf("Testing copy on write...");
+    size_t dims[2] = {3, 4};
+    tensor_t* original = tensor_new_test_values(2, dims, 1);
+    tensor_t* expected = tensor_new_test_values(2, dims, 1);
+    // a copy shares until either side is written
+    tensor_t* copy = tensor_copy(original);
+    NDEBUG_ASSERT(copy->data == original->data && tensor_is_shared(original), "Copy should share its buffer.");
+    tensor_make_writable(copy);
+    tensor_set_entry(copy, 0, 100);
+    NDEBUG_ASSERT(copy->data != original->data && !tensor_is_shared(original), "Written copy should have its own buffer.");
+    NDEBUG_ASSERT(tensor_equal(original, expected) && tensor_get_entry(copy, 0) == 100, "Writing a copy should leave the original unchanged.");
+    tensor_free(copy);
+    copy = tensor_copy(original);
+    tensor_in_place_multiply_by_scalar(original, 2);
+    NDEBUG_ASSERT(tensor_equal(copy, expected), "Writing the original should leave the copy unchanged.");
+    tensor_t* sum = tensor_add(original, copy);
+    tensor_t* tripled = tensor_multiply_by_scalar(expected, 3);
+    NDEBUG_ASSERT(tensor_equal(sum, tripled), "Sum of written original and copy is wrong.");
+    tensor_free(copy);
+    // a copy outlives the tensor it was made from
+    copy = tensor_copy(original);
+    tensor_free(original);
+    tensor_in_place_divide_by_scalar(copy, 2);
+    NDEBUG_ASSERT(tensor_equal(copy, expected), "Copy should outlive its original.");
+    // a viewed buffer is never shared, so writes through the view reach the tensor
+    tensor_t* shared = tensor_copy(copy);
+    size_t flat_size = 12;
+    shape_t* flat_shape = shape_new(1, &flat_size);
+    tensor_t* view = tensor_view_as_shape(copy, flat_shape);
+    NDEBUG_ASSERT(view->data == copy->data && copy->data != shared->data, "Viewed tensor should stop sharing.");
+    tensor_t* unshared = tensor_copy(copy);
+    NDEBUG_ASSERT(unshared->data != copy->data, "Viewed tensor should be copied eagerly.");
+    tensor_make_writable(view);
+    tensor_set_entry(view, 1, -1);
+    NDEBUG_ASSERT(tensor_get_entry(copy, 1) == -1 && tensor_get_entry(shared, 1) != -1 && tensor_get_entry(unshared, 1) != -1, "View should alias only its tensor.");
+    // copies made inside a scope are released with it, leaving the tensor they share with intact
+    tensor_scope_t scope;
+    tensor_scope_begin(&scope);
+    tensor_t* scoped = tensor_copy(shared);
+    NDEBUG_ASSERT(scoped->data == shared->data, "Scoped copy should share its buffer.");
+    tensor_scope_end(&scope, 0, NULL);
+    NDEBUG_ASSERT(!tensor_is_shared(shared) && tensor_equal(shared, expected), "Scope should release its copy.");
+    // variables copy their tensors without moving data
+    variable_t* variable = variable_new_from_tensor(tensor_copy(expected));
+    variable_t* variable_copied = variable_copy(variable);
+    NDEBUG_ASSERT(variable_copied->tensor->data == variable->tensor->data, "Variable copy should share its buffer.");
+    tensor_free(view);
+    shape_free(flat_shape);
+    tensor_free(unshared);
+    tensor_free(shared);
+    tensor_free(copy);
+    tensor_free(sum);
+    tensor_free(tripled);
+    tensor_free(expected);
+    printf("PASS.\n");
+}
+
+void test_elementwise(){
+    printf("Testing elementwise kernels...");
+    // same shape, trailing and leading broadcasts, a scalar, both sides broadcast, and fewer dimensions on either side
+    size_t left_dims[][TENSOR_MAX_DIMS] = {{2, 3, 5}, {4, 7}, {4, 7}, {3, 1}, {2, 3, 4, 5}, {5}, {3, 1, 5}};
+    size_t right_dims[][TENSOR_MAX_DIMS] = {{2, 3, 5}, {1, 7}, {4, 1}, {1, 4}, {1}, {2, 3, 5}, {1, 4, 1}};
+    int left_num_dims[] = {3, 2, 2, 2, 4, 1, 3};
+    int right_num_dims[] = {3, 2, 2, 2, 1, 3, 3};
+    for(size_t case_index = 0; case_index < sizeof(left_num_dims) / sizeof(int); case_index++){
+        tensor_t* left = tensor_new_test_values(left_num_dims[case_index], left_dims[case_index], 1);
+        tensor_t* right = tensor_new_test_values(right_num_dims[case_index], right_dims[case_index], 2);
+        tensor_t* expected = tensor_broadcast_fn(left, right, &squared_difference_entry);
+        NDEBUG_ASSERT(tensor_equal(elementwise_squared_difference(left, right), expected), "Generated kernel does not match the fallback.");
+        // (a - b)^2 = (a + b)^2 - 4ab
+        tensor_t* sum = tensor_add(left, right);
+        tensor_t* product = tensor_multiply(left, right);
+        for(size_t index = 0; index < sum->shape->size; index++){
+            tensor_entry_t actual = sum->data[index] * sum->data[index] - 4 * product->data[index];
+            NDEBUG_ASSERT(entry_close(actual, expected->data[index], 1e-5), "Built in kernels do not match the fallback.");
+        }
+        if(shape_equal(expected->shape, left->shape)){
+            tensor_t* accumulated = tensor_copy(left);
+            tensor_in_place_subtract(accumulated, right);
+            tensor_in_place_multiply(accumulated, accumulated);
+            NDEBUG_ASSERT(tensor_equal(accumulated, expected), "In place kernels do not match the fallback.");
+        }
+    }
+    // reduction back to a broadcast operand, by rows and by columns
+    size_t dims[2] = {6, 9};
+    tensor_t* tensor = tensor_new_test_values(2, dims, 3);
+    size_t row_dims[1] = {9};
+    size_t column_dims[2] = {6, 1};
+    tensor_t* row_sums = tensor_reduce_to_shape(tensor, shape_new(1, row_dims));
+    tensor_t* column_sums = tensor_reduce_to_shape(tensor, shape_new(2, column_dims));
+    for(size_t row = 0; row < 6; row++){
+        for(size_t column = 0; column < 9; column++){
+            row_sums->data[column] -= tensor->data[row * 9 + column];
+            column_sums->data[row] -= tensor->data[row * 9 + column];
+        }
+    }
+    for(size_t index = 0; index < 9; index++){
+        NDEBUG_ASSERT(fabsf(row_sums->data[index]) < 1e-5, "Reduction over rows is incorrect.");
+    }
+    for(size_t index = 0; index < 6; index++){
+        NDEBUG_ASSERT(fabsf(column_sums->data[index]) < 1e-5, "Reduction over columns is incorrect.");
+    }
+    printf("PASS.\n");
+}
+
+void test_fill(){
+    printf("Testing fill tensors...");
+    size_t dims[2] = {4, 5};
+    shape_t* shape = shape_new(2, dims);
+    tensor_t* fill = tensor_new_fill(shape, 3);
+    NDEBUG_ASSERT(tensor_is_fill(fill) && fill->storage->bytes == sizeof(tensor_entry_t), "Fill tensor holds more than one entry.");
+    // as either operand, in place, and shared by a copy
+    tensor_t* tensor = tensor_new_test_values(2, dims, 1);
+    tensor_t* product = tensor_multiply(tensor, fill);
+    tensor_t* difference = tensor_subtract(fill, tensor);
+    tensor_t* accumulated = tensor_copy(tensor);
+    tensor_in_place_add(accumulated, tensor_copy(fill));
+    for(size_t index = 0; index < 20; index++){
+        NDEBUG_ASSERT(entry_close(product->data[index], 3 * tensor->data[index], 1e-6), "Fill tensor is not read at every index.");
+        NDEBUG_ASSERT(entry_close(difference->data[index], 3 - tensor->data[index], 1e-6), "Fill tensor is not read at every index.");
+        NDEBUG_ASSERT(entry_close(accumulated->data[index], tensor->data[index] + 3, 1e-6), "Fill tensor is not added in place.");
+    }
+    // reduced, and materialized
+    size_t column_dims[2] = {4, 1};
+    tensor_t* row_sums = tensor_reduce_to_shape(fill, shape_new(2, column_dims));
+    tensor_t* dense = tensor_materialize(fill);
+    NDEBUG_ASSERT(!tensor_is_fill(dense) && dense->storage->bytes == 20 * sizeof(tensor_entry_t), "Materialized tensor is not dense.");
+    tensor_t* mean_grad = tensor_mean_grad(tensor);
+    NDEBUG_ASSERT(!tensor_is_fill(mean_grad) && !tensor_is_fill(tensor_sum_grad(tensor)), "Public grads should be dense.");
+    for(size_t index = 0; index < 20; index++){
+        NDEBUG_ASSERT(entry_close(row_sums->data[index / 5], 15, 1e-6), "Fill tensor is not reduced.");
+        NDEBUG_ASSERT(dense->data[index] == 3 && tensor_get_entry(fill, index) == 3, "Fill tensor is not materialized.");
+        NDEBUG_ASSERT(entry_close(mean_grad->data[index], 1.0f / 20, 1e-6), "Mean grad is incorrect.");
+    }
+    // compared with, and through a unary op, as the dense tensor it reads as
+    NDEBUG_ASSERT(tensor_equal(fill, dense) && tensor_equal(dense, fill) && tensor_equal(fill, tensor_copy(fill)), "Fill tensor should equal its entries.");
+    tensor_set_entry(dense, 19, 4);
+    NDEBUG_ASSERT(!tensor_equal(fill, dense), "Fill tensor should not equal other entries.");
+    tensor_t* negative_fill = tensor_new_fill(shape, -2);
+    tensor_t* absolute = tensor_abs(negative_fill);
+    NDEBUG_ASSERT(!tensor_is_fill(absolute), "Unary op of a fill tensor is not dense.");
+    for(size_t index = 0; index < 20; index++){
+        NDEBUG_ASSERT(absolute->data[index] == 2, "Unary op does not read a fill tensor.");
+    }
+    // backwards through a sum: each entry gets the output gradient, including through a broadcast
+    size_t weight_dims[2] = {1, 5};
+    variable_t* input = variable_new_from_tensor(tensor_new_test_values(2, dims, 2));
+    variable_t* weight = variable_new_from_tensor(tensor_new_test_values(2, weight_dims, 3));
+    backwards(variable_sum(variable_multiply(input, weight)));
+    for(size_t index = 0; index < 20; index++){
+        tensor_entry_t expected = weight->tensor->data[index % 5];
+        NDEBUG_ASSERT(entry_close(input->gradient->data[index], expected, 1e-6), "Sum grad is incorrect.");
+    }
+    for(size_t column = 0; column < 5; column++){
+        tensor_entry_t column_sum = 0;
+        for(size_t row = 0; row < 4; row++){
+            column_sum += input->tensor->data[row * 5 + column];
+        }
+        NDEBUG_ASSERT(entry_close(weight->gradient->data[column], column_sum, 1e-5), "Sum grad is not reduced to a broadcast operand.");
+    }
+    shape_free(shape);
+    printf("PASS.\n");
+}
+
+// deterministic pseudo-random fill in [-1, 1]
+static void variable_fill_test_values(variable_t* variable, size_t seed){
+    for(size_t index = 0; index < variable->tensor->shape->size; index++){
+        set_entry(variable, index, sinf((index + 1) * 12.9898f + seed * 78.233f));
+    }
+}
+
+// compares the gradients computed by backwards against central differences of loss_fn
+typedef variable_t* (* test_loss_fn_t)(variable_t** inputs);
+
+static bool gradients_match(test_loss_fn_t loss_fn, variable_t** inputs, int num_inputs, tensor_entry_t tolerance){
+    backwards(loss_fn(inputs));
+    for(int input_index = 0; input_index < num_inputs; input_index++){
+        variable_t* input = inputs[input_index];
+        for(size_t index = 0; index < input->tensor->shape->size; index++){
+            tensor_entry_t entry = get_entry(input, index);
+            tensor_entry_t epsilon = 1e-2;
+            set_entry(input, index, entry + epsilon);
+            tensor_entry_t loss_plus = get_entry(loss_fn(inputs), 0);
+            set_entry(input, index, entry - epsilon);
+            tensor_entry_t loss_minus = get_entry(loss_fn(inputs), 0);
+            set_entry(input, index, entry);
+            tensor_entry_t numerical = (loss_plus - loss_minus) / (2 * epsilon);
+            if(!entry_close(input->gradient->data[index], numerical, tolerance)){
+                printf("input %d, entry %zu: autograd %f, numerical %f\n", input_index, index, input->gradient->data[index], numerical);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void test_optimizer_sgd(){
+    printf("Testing SGD with momentum...");
+    variable_t* x = variable_new(2, 2, 3);
+    variable_t* y = variable_new(1, 5);
+    variable_set_to_scalar_value(x, 1.0);
+    variable_set_to_scalar_value(y, -2.0);
+    variable_t* params[2] = {x, y};
+    optimizer_t* optimizer = optimizer_sgd_new(params, 2, 0.1, 0.9, 0);
+    // the slices of the flat buffers are the storages of the parameters and gradients
+    NDEBUG_ASSERT(x->tensor->storage->data == x->tensor->data && x->tensor->data == optimizer->param_data, "Parameter should be stored in the flat buffer.");
+    NDEBUG_ASSERT(y->gradient->storage->data == y->gradient->data && y->gradient->storage->borrowed, "Gradient should be stored in the flat buffer.");
+    tensor_t* x_before = tensor_copy(x->tensor);
+    unsigned int x_version = tensor_version(x->tensor);
+    for(int step = 0; step < 2; step++){
+        // d/dx sum(x * x) = 2x
+        backwards(variable_add(variable_sum(variable_multiply(x, x)), variable_sum(variable_multiply(y, y))));
+        optimizer_step(optimizer);
+    }
+    // step 1: buf = 2, x = 0.8; step 2: buf = 1.6 + 0.9 * 2 = 3.4, x = 0.8 - 0.34
+    NDEBUG_ASSERT(entry_close(get_entry(x, 5), 0.46, 1e-6), "Unexpected parameter value.");
+    NDEBUG_ASSERT(entry_close(get_entry(y, 4), -0.92, 1e-6), "Unexpected parameter value.");
+    NDEBUG_ASSERT(get_entry(x, 0) == get_entry(x, 5), "Parameter entries should be updated uniformly.");
+    NDEBUG_ASSERT(x->gradient->data[0] == 0 && y->gradient->data[4] == 0, "Step should zero gradients.");
+    // copies do not see the steps, and steps are seen by versions
+    NDEBUG_ASSERT(x_before->data[5] == 1.0 && tensor_version(x->tensor) > x_version, "Steps should be tracked as writes.");
+    tensor_free(x_before);
+    printf("PASS.\n");
+}
+
+void test_optimizer_adam(){
+    printf("Testing Adam/AdamW...");
+    variable_t* x = variable_new(1, 4);
+    variable_t* w = variable_new(1, 4);
+    variable_set_to_scalar_value(x, 1.0);
+    variable_set_to_scalar_value(w, 1.0);
+    optimizer_t* adam = optimizer_adam_new(&x, 1, 0.1, 0.9, 0.999, 1e-8, 0);
+    optimizer_t* adamw = optimizer_adamw_new(&w, 1, 0.1, 0.9, 0.999, 1e-8, 0.5);
+    backwards(variable_sum(variable_multiply(x, x)));
+    backwards(variable_sum(variable_multiply(w, w)));
+    optimizer_step(adam);
+    optimizer_step(adamw);
+    // the first bias corrected Adam step has magnitude learning_rate
+    NDEBUG_ASSERT(entry_close(get_entry(x, 2), 0.9, 1e-5), "Unexpected Adam update.");
+    NDEBUG_ASSERT(entry_close(get_entry(w, 2), 0.95 - 0.1, 1e-5), "Unexpected AdamW update.");
+    NDEBUG_ASSERT(w->gradient->data[3] == 0, "Step should zero gradients.");
+    printf("PASS.\n");
+}
+
+void test_matmul(){
+    printf("Testing blocked matrix multiplication...");
+    // large enough to span several cache blocks along m and k
+    size_t m = 70, k = 300, n = 33;
+    variable_t* a = variable_new(2, m, k);
+    variable_t* b = variable_new(2, k, n);
+    variable_fill_test_values(a, 1);
+    variable_fill_test_values(b, 2);
+    variable_t* c = variable_matmul(a, b);
+    for(size_t i = 0; i < m; i++){
+        for(size_t j = 0; j < n; j++){
+            double expected = 0;
+            for(size_t p = 0; p < k; p++){
+                expected += (double) get_entry(a, i * k + p) * get_entry(b, p * n + j);
+            }
+            NDEBUG_ASSERT(entry_close(get_entry(c, i * n + j), expected, 1e-4), "Expected does not match actual.");
+        }
+    }
+    printf("PASS.\n");
+}
+
+void test_tune(){
+    printf("Testing autotuning...");
+    char path[] = "/tmp/coral-tune-test-XXXXXX";
+    int fd = mkstemp(path);
+    NDEBUG_ASSERT(fd >= 0, "Could not make a tuning file.");
+    close(fd);
+    tune_set_file(path);
+    size_t blocks[3];
+    NDEBUG_ASSERT(!tune_lookup("gemm 70 33 300 rr", 3, blocks), "An empty tuning file should have no values.");
+    variable_t* a = variable_new(2, 70, 300);
+    variable_t* b = variable_new(2, 300, 33);
+    variable_fill_test_values(a, 1);
+    variable_fill_test_values(b, 2);
+    tensor_t* expected = tensor_copy(variable_matmul(a, b)->tensor);
+    // online, the first gemm of the shape and layouts tunes it, and the table is saved (at exit, or here)
+    tune_set_online(true);
+    variable_t* c = variable_matmul(a, b);
+    tune_set_online(false);
+    NDEBUG_ASSERT(tune_save(), "Could not save the tuning file.");
+    NDEBUG_ASSERT(tune_lookup("gemm 70 33 300 rr", 3, blocks), "Online gemm should tune its shape.");
+    for(size_t index = 0; index < expected->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(c->tensor->data[index], expected->data[index], 1e-5), "Tuned gemm should match the default one.");
+    }
+    tensor_free(expected);
+    // a later run loads it
+    size_t loaded_blocks[3];
+    tune_set_file(path);
+    NDEBUG_ASSERT(tune_lookup("gemm 70 33 300 rr", 3, loaded_blocks) && memcmp(blocks, loaded_blocks, sizeof(blocks)) == 0, "Tuned values should be loaded from the file.");
+    NDEBUG_ASSERT(tune_lookup_size("bmm_parallel_min_work", 7) == 7, "Untuned keys should fall back to the default.");
+    NDEBUG_ASSERT(!tune_lookup("gemm 70 33 300 cr", 3, blocks), "A transposed operand should be tuned apart.");
+    // only the first thread to miss a key tunes it, and a claimed key is not saved until it has values
+    NDEBUG_ASSERT(tune_claim("gemm 70 33 300 cr") && !tune_claim("gemm 70 33 300 cr"), "A key should be claimed once.");
+    NDEBUG_ASSERT(!tune_claim("gemm 70 33 300 rr"), "A tuned key should not be claimed.");
+    NDEBUG_ASSERT(!tune_lookup("gemm 70 33 300 cr", 3, blocks) && tune_save(), "A claimed key should have no values.");
+    tune_set_file(path);
+    NDEBUG_ASSERT(tune_claim("gemm 70 33 300 cr"), "A claimed key should not be saved.");
+    // a file tuned on another machine is ignored
+    FILE* file = fopen(path, "w");
+    fprintf(file, "machine elsewhere\ngemm 70 33 300 = 1 1 1\n");
+    fclose(file);
+    tune_set_file(path);
+    NDEBUG_ASSERT(!tune_lookup("gemm 70 33 300 rr", 3, blocks), "Values tuned on another machine should be ignored.");
+    tune_set_file(NULL);
+    unlink(path);
+    printf("PASS.\n");
+}
+
+void test_perf(){
+    printf("Testing perf counters...");
+    perf_reset();
+    perf_set_enabled(true);
+    // the bias is broadcast over rows, so its gradient is reduced back to its shape
+    variable_t* input = variable_new(2, 16, 8);
+    variable_t* bias = variable_new(1, 8);
+    variable_fill_test_values(input, 1);
+    variable_fill_test_values(bias, 2);
+    backwards(variable_sum(variable_multiply(variable_add(input, bias), input)));
+    perf_set_enabled(false);
+    perf_stats_t stats;
+    NDEBUG_ASSERT(perf_lookup("broadcast add", &stats), "Broadcast kernels should be counted.");
+    NDEBUG_ASSERT(stats.num_calls >= 1 && stats.num_entries >= 16 * 8, "Broadcast kernels should count their calls and entries.");
+    NDEBUG_ASSERT(perf_lookup("reduce_to_shape", &stats) && stats.num_calls == 1 && stats.num_entries == 16 * 8, "Reductions to a shape should be counted.");
+    // grad ops are named by their symbols
+    NDEBUG_ASSERT(perf_lookup("multiply_backwards_grad", &stats) && stats.num_calls == 2, "Grad ops should be counted per op.");
+    NDEBUG_ASSERT(perf_lookup("add_backwards_grad", &stats) && stats.num_calls == 2, "Grad ops should be counted per op.");
+    // counters may be unavailable (eg. in a VM), when only calls, entries and time are
+    NDEBUG_ASSERT(stats.counted[PERF_CYCLES] || !perf_counters_available(), "Available counters should be counted.");
+    FILE* file = tmpfile();
+    perf_report(file);
+    NDEBUG_ASSERT(ftell(file) > 0, "Report should be written.");
+    fclose(file);
+    // disabled, scopes are not counted
+    size_t num_calls = stats.num_calls;
+    backwards(variable_sum(variable_add(input, bias)));
+    NDEBUG_ASSERT(perf_lookup("add_backwards_grad", &stats) && stats.num_calls == num_calls, "Disabled scopes should not be counted.");
+    perf_reset();
+    NDEBUG_ASSERT(!perf_lookup("add_backwards_grad", &stats), "Reset should clear every op.");
+    printf("PASS.\n");
+}
+
+// the matrix at batch (row major over the batch dimensions) of a stack, as a two dimensional tensor
+static tensor_t* batch_matrix(tensor_t* tensor, size_t batch){
+    int num_dims = TENSOR_NUM_DIMS(tensor);
+    size_t dims[2] = {tensor->shape->dims[num_dims - 2], tensor->shape->dims[num_dims - 1]};
+    tensor_t* matrix = tensor_new(shape_new(2, dims));
+    memcpy(matrix->data, tensor->data + batch * dims[0] * dims[1], dims[0] * dims[1] * sizeof(tensor_entry_t));
+    return matrix;
+}
+
+static variable_t* bmm_test_loss(variable_t** inputs){
+    return variable_sum(variable_multiply(variable_bmm(inputs[0], inputs[1]), inputs[2]));
+}
+
+void test_bmm(){
+    printf("Testing batched matrix multiplication...");
+    // unrolled widths, other small widths, and one past the small kernels
+    size_t sizes[5][3] = {{4, 4, 4}, {8, 5, 16}, {3, 64, 32}, {5, 6, 64}, {7, 70, 9}};
+    for(int size_index = 0; size_index < 5; size_index++){
+        size_t m = sizes[size_index][0], k = sizes[size_index][1], n = sizes[size_index][2];
+        // (3 x 1 x m x k) * (2 x k x n) -> (3 x 2 x m x n)
+        tensor_t* left = tensor_new_test_values(4, (size_t[]){3, 1, m, k}, 1);
+        tensor_t* right = tensor_new_test_values(3, (size_t[]){2, k, n}, 2);
+        tensor_t* product = tensor_bmm(left, right);
+        NDEBUG_ASSERT(TENSOR_NUM_DIMS(product) == 4 && product->shape->dims[0] == 3 && product->shape->dims[1] == 2, "Batch dimensions should broadcast.");
+        for(size_t batch = 0; batch < 6; batch++){
+            tensor_t* expected = tensor_matmul(batch_matrix(left, batch / 2), batch_matrix(right, batch % 2));
+            tensor_t* actual = batch_matrix(product, batch);
+            for(size_t index = 0; index < m * n; index++){
+                NDEBUG_ASSERT(entry_close(actual->data[index], expected->data[index], 1e-4), "Batched product does not match matmul.");
+            }
+        }
+    }
+    // enough batches to be split over threads, against a single matrix broadcast to all of them
+    tensor_t* left = tensor_new_test_values(3, (size_t[]){256, 16, 16}, 3);
+    tensor_t* right = tensor_new_test_values(2, (size_t[]){16, 16}, 4);
+    tensor_t* product = tensor_bmm(left, right);
+    for(size_t batch = 0; batch < 256; batch += 51){
+        tensor_t* expected = tensor_matmul(batch_matrix(left, batch), right);
+        tensor_t* actual = batch_matrix(product, batch);
+        for(size_t index = 0; index < 16 * 16; index++){
+            NDEBUG_ASSERT(entry_close(actual->data[index], expected->data[index], 1e-4), "Parallel batched product does not match matmul.");
+        }
+    }
+    // gradients, reduced over the broadcast batch dimensions
+    variable_t* inputs[3] = {variable_new(4, 2, 1, 3, 4), variable_new(3, 3, 4, 5), variable_new(4, 2, 3, 3, 5)};
+    for(int input_index = 0; input_index < 3; input_index++){
+        variable_fill_test_values(inputs[input_index], 5 + input_index);
+    }
+    NDEBUG_ASSERT(gradients_match(&bmm_test_loss, inputs, 2, 2e-2), "Batched matmul gradients do not match.");
+    printf("PASS.\n");
+}
+
+static variable_t* matmul_test_loss(variable_t** inputs){
+    return variable_sum(variable_multiply(variable_matmul(inputs[0], inputs[1]), inputs[2]));
+}
+
+static variable_t* linear_test_loss(variable_t** inputs){
+    variable_t* hidden = variable_linear(inputs[0], inputs[1], inputs[2], ACTIVATION_TANH);
+    return variable_sum(variable_multiply(variable_linear(hidden, inputs[3], NULL, ACTIVATION_SIGMOID), inputs[4]));
+}
+
+void test_linear(){
+    printf("Testing linear layer and module_t...");
+    variable_t* inputs[5] = {variable_new(2, 3, 4), variable_new(2, 4, 5), variable_new(1, 5), variable_new(2, 5, 2), variable_new(2, 3, 2)};
+    for(int input_index = 0; input_index < 5; input_index++){
+        variable_fill_test_values(inputs[input_index], input_index);
+    }
+    NDEBUG_ASSERT(gradients_match(&linear_test_loss, inputs, 4, 2e-2), "Linear gradients do not match.");
+    variable_t* matmul_inputs[3] = {variable_new(2, 3, 4), variable_new(2, 4, 2), inputs[4]};
+    variable_fill_test_values(matmul_inputs[0], 7);
+    variable_fill_test_values(matmul_inputs[1], 8);
+    NDEBUG_ASSERT(gradients_match(&matmul_test_loss, matmul_inputs, 2, 2e-2), "Matmul gradients do not match.");
+    // relu epilogue through a module
+    module_t* layers[2] = {module_linear_new(4, 5, true, ACTIVATION_RELU), module_linear_new(5, 2, false, ACTIVATION_NONE)};
+    module_t* mlp = module_sequential_new(2, layers);
+    NDEBUG_ASSERT(mlp->num_params == 3, "Sequential should own the parameters of its children.");
+    variable_t* output = module_forward(mlp, inputs[0]);
+    variable_t* expected_hidden = variable_add(variable_matmul(inputs[0], mlp->params[0]), mlp->params[1]);
+    for(size_t index = 0; index < expected_hidden->tensor->shape->size; index++){
+        tensor_entry_t entry = get_entry(expected_hidden, index);
+        set_entry(expected_hidden, index, entry > 0 ? entry : 0);
+    }
+    variable_t* expected_output = variable_matmul(expected_hidden, mlp->params[2]);
+    for(size_t index = 0; index < output->tensor->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(get_entry(output, index), get_entry(expected_output, index), 1e-5), "Expected does not match actual.");
+    }
+    printf("PASS.\n");
+}
+
+static variable_t* sum_of_squares(variable_t* variable){
+    return variable_sum(variable_multiply(variable, variable));
+}
+
+static void count_grad_hook(variable_t* variable, void* context){
+    UNUSED(variable);
+    (*(int*) context)++;
+}
+
+void test_requires_grad(){
+    printf("Testing requires_grad and graph pruning...");
+    // a target which does not require grad gets no gradient, and leaves that of the prediction unchanged
+    variable_t* actual = variable_new(2, 3, 4);
+    variable_t* expected = variable_new(2, 3, 4);
+    variable_fill_test_values(actual, 1);
+    variable_fill_test_values(expected, 2);
+    backwards(variable_mse_loss(actual, expected));
+    tensor_t* actual_grad = tensor_copy(actual->gradient);
+    tensor_set_to_scalar_value(actual->gradient, 0);
+    tensor_set_to_scalar_value(expected->gradient, 0);
+    variable_set_requires_grad(expected, false);
+    backwards(variable_mse_loss(actual, expected));
+    NDEBUG_ASSERT(tensor_equal(actual->gradient, actual_grad), "Prediction gradient should not depend on the target requiring grad.");
+    for(size_t index = 0; index < expected->gradient->shape->size; index++){
+        NDEBUG_ASSERT(expected->gradient->data[index] == 0, "Target should get no gradient.");
+    }
+    // a root which does not require grad is left alone, gradient included
+    variable_t* constant_loss = variable_mse_loss(expected, expected);
+    backwards(constant_loss);
+    NDEBUG_ASSERT(constant_loss->gradient == NULL, "Root which does not require grad should get no gradient.");
+    // a frozen backbone under a trained head: backwards never enters the backbone
+    module_t* backbone = module_linear_new(4, 5, true, ACTIVATION_TANH);
+    module_t* head = module_linear_new(5, 2, true, ACTIVATION_NONE);
+    module_set_requires_grad(backbone, false);
+    variable_t* input = variable_new(2, 3, 4);
+    variable_fill_test_values(input, 3);
+    variable_set_requires_grad(input, false);
+    variable_t* hidden = module_forward(backbone, input);
+    NDEBUG_ASSERT(!variable_requires_grad(hidden) && variable_requires_grad(module_forward(head, hidden)), "Requires grad should propagate from inputs.");
+    // nor allocates gradients for its outputs, as no forward without grad does
+    NDEBUG_ASSERT(hidden->gradient == NULL, "Outputs which do not require grad should have no gradient.");
+    bool previous_mode = grad_set_enabled(false);
+    NDEBUG_ASSERT(module_forward(head, hidden)->gradient == NULL, "Outputs without grad should have no gradient.");
+    grad_set_enabled(previous_mode);
+    int num_backbone_visits = 0;
+    set_grad_hook(hidden, &count_grad_hook, &num_backbone_visits);
+    variable_t* output = module_forward(head, hidden);
+    backwards(sum_of_squares(output));
+    NDEBUG_ASSERT(num_backbone_visits == 0, "Backwards should prune the frozen backbone.");
+    for(size_t index = 0; index < backbone->params[0]->gradient->shape->size; index++){
+        NDEBUG_ASSERT(backbone->params[0]->gradient->data[index] == 0, "Frozen weight should get no gradient.");
+    }
+    // the head gradient is that of a graph built from the hidden activations as a constant
+    tensor_t* head_weight_grad = tensor_copy(head->params[0]->gradient);
+    tensor_set_to_scalar_value(head->params[0]->gradient, 0);
+    tensor_set_to_scalar_value(head->params[1]->gradient, 0);
+    variable_t* constant_hidden = variable_new_from_tensor(hidden->tensor);
+    backwards(sum_of_squares(module_forward(head, constant_hidden)));
+    NDEBUG_ASSERT(tensor_equal(head->params[0]->gradient, head_weight_grad), "Head gradient should not depend on pruning.");
+    // an optimizer leaves frozen parameters out, so weight decay does not move them
+    module_t* layers[2] = {backbone, head};
+    module_t* model = module_sequential_new(2, layers);
+    tensor_t* frozen_weight = tensor_copy(backbone->params[0]->tensor);
+    optimizer_t* optimizer = optimizer_sgd_new(model->params, model->num_params, 0.1, 0.9, 0.5);
+    NDEBUG_ASSERT(optimizer->num_params == 2, "Optimizer should leave out frozen parameters.");
+    optimizer_step(optimizer);
+    NDEBUG_ASSERT(tensor_equal(backbone->params[0]->tensor, frozen_weight), "Frozen weight should not move.");
+    printf("PASS.\n");
+}
+
+// runs fn in a child process, and returns whether it failed an assertion
+static bool aborts(void (* fn)()){
+    fflush(stdout);
+    pid_t child = fork();
+    if(child == 0){
+        // the expected assertion message is not test output
+        freopen("/dev/null", "w", stderr);
+        (*fn)();
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// the product saved hidden, which relu then overwrites
+static void backwards_through_overwritten_input(){
+    variable_t* weight = variable_new(2, 4, 3);
+    variable_t* scale = variable_new(2, 2, 3);
+    variable_t* input = variable_new(2, 2, 4);
+    variable_fill_test_values(weight, 1);
+    variable_fill_test_values(scale, 2);
+    variable_fill_test_values(input, 3);
+    variable_t* hidden = variable_linear(input, weight, NULL, ACTIVATION_NONE);
+    variable_t* product = variable_multiply(hidden, scale);
+    variable_in_place_relu(hidden);
+    backwards(variable_sum(product));
+}
+
+static void in_place_on_leaf(){
+    variable_t* leaf = variable_new(1, 3);
+    variable_in_place_tanh(leaf);
+}
+
+void test_in_place(){
+    printf("Testing in place ops...");
+    variable_t* input = variable_new(2, 5, 4);
+    variable_t* weight = variable_new(2, 4, 3);
+    variable_t* bias = variable_new(1, 3);
+    variable_t* scale = variable_new(2, 5, 3);
+    variable_fill_test_values(input, 1);
+    variable_fill_test_values(weight, 2);
+    variable_fill_test_values(bias, 3);
+    variable_fill_test_values(scale, 4);
+    variable_set_requires_grad(input, false);
+    variable_t* params[3] = {weight, bias, scale};
+    tensor_t* expected_grads[3];
+    // relu((input * weight + bias) * scale), out of place then in place, gives the same gradients
+    variable_t* hidden = variable_linear(input, weight, NULL, ACTIVATION_NONE);
+    variable_t* output = variable_relu(variable_multiply(variable_add(hidden, bias), scale));
+    backwards(sum_of_squares(output));
+    tensor_t* expected_output = tensor_copy(output->tensor);
+    for(int param_index = 0; param_index < 3; param_index++){
+        expected_grads[param_index] = tensor_copy(params[param_index]->gradient);
+        tensor_set_to_scalar_value(params[param_index]->gradient, 0);
+    }
+    hidden = variable_linear(input, weight, NULL, ACTIVATION_NONE);
+    output = variable_in_place_relu(variable_in_place_multiply(variable_in_place_add(hidden, bias), scale));
+    NDEBUG_ASSERT(output->tensor == hidden->tensor && tensor_equal(output->tensor, expected_output), "In place ops should write into their input.");
+    backwards(sum_of_squares(output));
+    for(int param_index = 0; param_index < 3; param_index++){
+        NDEBUG_ASSERT(tensor_equal(params[param_index]->gradient, expected_grads[param_index]), "In place ops should give the gradients of out of place ones.");
+        tensor_free(expected_grads[param_index]);
+    }
+    tensor_free(expected_output);
+    // a multiplication by itself reads the input from before the write, for both of its gradients: d(a^4)/da = 4a^3
+    variable_t* base = variable_new(1, 3);
+    for(size_t index = 0; index < 3; index++){
+        tensor_set_entry(base->tensor, index, index + 1);
+    }
+    variable_t* square = variable_multiply(base, base);
+    backwards(variable_sum(variable_in_place_multiply(square, square)));
+    for(size_t index = 0; index < 3; index++){
+        tensor_entry_t entry = index + 1;
+        NDEBUG_ASSERT(entry_close(base->gradient->data[index], 4 * entry * entry * entry, 1e-5), "In place multiply by itself should read its input from before the write.");
+    }
+    // writing a tensor bumps its version, whichever copy or view it is written through
+    tensor_t* tensor = tensor_copy(weight->tensor);
+    unsigned int version = tensor_version(tensor);
+    size_t flat_size = 12;
+    shape_t* flat_shape = shape_new(1, &flat_size);
+    tensor_t* view = tensor_view_as_shape(tensor, flat_shape);
+    NDEBUG_ASSERT(tensor_version(tensor) == version, "Viewing should not change the version.");
+    tensor_in_place_relu(view);
+    NDEBUG_ASSERT(tensor_version(tensor) != version && tensor_version(weight->tensor) != tensor_version(tensor), "Writing through a view should change the version of its tensor only.");
+    tensor_free(view);
+    tensor_free(tensor);
+    shape_free(flat_shape);
+    // backwards through a tensor overwritten since it was saved fails, as does overwriting a leaf which requires grad
+    NDEBUG_ASSERT(aborts(&backwards_through_overwritten_input), "Backwards should fail on an overwritten saved tensor.");
+    NDEBUG_ASSERT(aborts(&in_place_on_leaf), "In place ops should not overwrite leaves which require grad.");
+    printf("PASS.\n");
+}
+
+// every op with a tangent rule (but those of indexing and dropout, see test_forward_mode) on the way to a scalar
+static variable_t* forward_mode_test_loss(variable_t** inputs, size_t* targets, variable_t* expected){
+    variable_t* x = inputs[0];
+    variable_t* weight = inputs[1];
+    variable_t* bias = inputs[2];
+    variable_t* scale = inputs[3];
+    variable_t* hidden = variable_linear(variable_multiply(x, scale), weight, bias, ACTIVATION_TANH);
+    variable_t* probabilities = variable_softmax(hidden, 1);
+    variable_t* loss = variable_cross_entropy_loss(hidden, targets);
+    loss = variable_add(loss, variable_mse_loss(probabilities, expected));
+    loss = variable_add(loss, variable_mae_loss(variable_gelu(hidden), expected));
+    loss = variable_add(loss, variable_sum(variable_multiply(variable_log_softmax(variable_matmul(x, weight), -1), probabilities)));
+    variable_t* positive = variable_log(variable_sigmoid(variable_relu(variable_subtract(hidden, bias))));
+    loss = variable_add(loss, variable_sum(variable_exp(positive)));
+    variable_t* product = variable_in_place_multiply(variable_bmm(x, weight), hidden);
+    loss = variable_subtract(loss, variable_sum(variable_in_place_sigmoid(variable_in_place_add(product, bias))));
+    return loss;
+}
+
+void test_forward_mode(){
+    printf("Testing forward mode...");
+    size_t num_directions = 3;
+    size_t x_dims[2] = {4, 3};
+    size_t weight_dims[2] = {3, 5};
+    size_t bias_dims[1] = {5};
+    size_t scale_dims[1] = {3};
+    size_t* dims[4] = {x_dims, weight_dims, bias_dims, scale_dims};
+    int num_dims[4] = {2, 2, 1, 1};
+    variable_t* inputs[4];
+    for(int input_index = 0; input_index < 4; input_index++){
+        inputs[input_index] = variable_new_from_tensor(tensor_new_test_values(num_dims[input_index], dims[input_index], input_index + 1));
+        size_t tangent_dims[3] = {num_directions};
+        memcpy(tangent_dims + 1, dims[input_index], num_dims[input_index] * sizeof(size_t));
+        variable_set_tangent(inputs[input_index], tensor_new_test_values(num_dims[input_index] + 1, tangent_dims, input_index + 5));
+    }
+    // scale broadcasts over the rows of x
+    size_t targets[4] = {0, 4, 2, 2};
+    variable_t* expected = variable_new(2, (size_t) 4, (size_t) 5);
+    variable_set_requires_grad(expected, false);
+    // the derivative along each direction is the inner product of the gradient (from backwards) with it
+    variable_t* loss = forward_mode_test_loss(inputs, targets, expected);
+    NDEBUG_ASSERT(loss->tangent != NULL && loss->tangent->shape->dims[0] == num_directions, "Loss should have a tangent per direction.");
+    backwards(loss);
+    for(size_t direction = 0; direction < num_directions; direction++){
+        tensor_entry_t derivative = 0;
+        for(int input_index = 0; input_index < 4; input_index++){
+            variable_t* input = inputs[input_index];
+            size_t size = input->tensor->shape->size;
+            for(size_t index = 0; index < size; index++){
+                derivative += input->gradient->data[index] * input->tangent->data[direction * size + index];
+            }
+        }
+        NDEBUG_ASSERT(entry_close(loss->tangent->data[direction], derivative, 1e-4), "Tangent does not match the gradient.");
+    }
+    // without grad, a direction at a time, through indexing and dropout
+    bool previous_mode = grad_set_enabled(false);
+    variable_t* x = inputs[0];
+    size_t indices[5] = {3, 0, 3, 1, 2};
+    rng_t* rng = rng_new(7);
+    variable_t* selected = variable_index_select(x, 5, indices);
+    variable_t* dropped = variable_dropout(variable_scatter_add(selected, 5, indices, 4), 0.5, rng);
+    variable_t* flat = variable_view_as(dropped, 1, (size_t) 12);
+    NDEBUG_ASSERT(flat->tangent->shape->dims[0] == num_directions && flat->tangent->shape->dims[1] == 12, "Tangent should have the shape of its variable.");
+    // row 3 is selected twice and so scattered back doubled, and dropout scales (or zeroes) the value and tangent alike
+    for(size_t direction = 0; direction < num_directions; direction++){
+        for(size_t index = 0; index < 12; index++){
+            tensor_entry_t value = flat->tensor->data[index];
+            tensor_entry_t tangent = flat->tangent->data[direction * 12 + index];
+            tensor_entry_t x_value = x->tensor->data[index];
+            tensor_entry_t x_tangent = x->tangent->data[direction * 12 + index];
+            NDEBUG_ASSERT(entry_close(tangent * x_value, value * x_tangent, 1e-4), "Tangent of indexing and dropout is incorrect.");
+        }
+    }
+    grad_set_enabled(previous_mode);
+    printf("PASS.\n");
+}
+
+// inputs are [input, weight, bias, projection, shift, target]
+static variable_t* jit_test_loss(variable_t** inputs){
+    variable_t* hidden = variable_linear(inputs[0], inputs[1], inputs[2], ACTIVATION_TANH);
+    variable_t* output = variable_add(variable_matmul(hidden, inputs[3]), inputs[4]);
+    variable_t* gated = variable_multiply(output, variable_sigmoid(output));
+    variable_t* rectified = variable_in_place_relu(variable_subtract(output, inputs[5]));
+    variable_t* loss = variable_add(variable_mse_loss(gated, inputs[5]), variable_mae_loss(rectified, inputs[5]));
+    return variable_add(loss, variable_sum(variable_exp(hidden)));
+}
+
+// runs the loss through backwards and then through program, from zero gradients
+static bool jit_matches_backwards(jit_program_t* program, variable_t** inputs, int num_inputs){
+    tensor_t* expected_grads[8];
+    variable_t* loss = jit_test_loss(inputs);
+    backwards(loss);
+    for(int input_index = 0; input_index < num_inputs; input_index++){
+        expected_grads[input_index] = tensor_copy(inputs[input_index]->gradient);
+        tensor_set_to_scalar_value(inputs[input_index]->gradient, 0);
+    }
+    bool matches = entry_close(jit_run(program), get_entry(loss, 0), 1e-4);
+    for(int input_index = 0; input_index < num_inputs; input_index++){
+        tensor_t* gradient = inputs[input_index]->gradient;
+        for(size_t index = 0; index < gradient->shape->size; index++){
+            matches &= entry_close(gradient->data[index], expected_grads[input_index]->data[index], 1e-4);
+        }
+        tensor_set_to_scalar_value(gradient, 0);
+        tensor_free(expected_grads[input_index]);
+    }
+    return matches;
+}
+
+static void remove_dir(const char* dir){
+    DIR* stream = opendir(dir);
+    struct dirent* entry;
+    while((entry = readdir(stream)) != NULL){
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0){
+            unlink(path);
+        }
+    }
+    closedir(stream);
+    rmdir(dir);
+}
+
+void test_jit(){
+    printf("Testing graph jit...");
+    char cache_dir[] = "/tmp/coral-jit-test-XXXXXX";
+    NDEBUG_ASSERT(mkdtemp(cache_dir) != NULL, "Could not make a cache directory.");
+    jit_set_cache_dir(cache_dir);
+    variable_t* inputs[6] = {variable_new(2, 4, 3), variable_new(2, 3, 5), variable_new(1, 5), variable_new(2, 5, 2),
+                             variable_new(1, 2), variable_new(2, 4, 2)};
+    for(int input_index = 0; input_index < 6; input_index++){
+        variable_fill_test_values(inputs[input_index], input_index);
+    }
+    variable_set_requires_grad(inputs[0], false);
+    variable_set_requires_grad(inputs[5], false);
+    jit_trace_t trace;
+    jit_trace_begin(&trace);
+    variable_t* loss = jit_test_loss(inputs);
+    jit_trace_end(&trace);
+    jit_program_t* program = jit_compile(&trace, loss);
+    NDEBUG_ASSERT(program != NULL && !program->from_cache, "Graph should compile.");
+    NDEBUG_ASSERT(jit_matches_backwards(program, inputs, 6), "Compiled graph should match backwards.");
+    // new data in the same buffers
+    variable_fill_test_values(inputs[0], 6);
+    variable_fill_test_values(inputs[5], 7);
+    NDEBUG_ASSERT(jit_matches_backwards(program, inputs, 6), "Compiled graph should read the current inputs.");
+    // the same graph again is loaded from the cache
+    jit_program_t* cached_program = jit_compile(&trace, loss);
+    NDEBUG_ASSERT(cached_program != NULL && cached_program->from_cache && cached_program->hash == program->hash, "Compiled graph should be cached.");
+    NDEBUG_ASSERT(jit_matches_backwards(cached_program, inputs, 6), "Cached graph should match backwards.");
+    jit_program_free(cached_program);
+    // a cache directory others can access is never loaded from (nor compiled into)
+    chmod(cache_dir, 0755);
+    NDEBUG_ASSERT(jit_compile(&trace, loss) == NULL, "Cache directory others can access should not be used.");
+    chmod(cache_dir, 0700);
+    jit_program_free(program);
+    jit_trace_clear(&trace);
+    // ops without generated code leave the graph to backwards
+    jit_trace_begin(&trace);
+    loss = variable_sum(variable_softmax(variable_matmul(inputs[0], inputs[1]), 1));
+    jit_trace_end(&trace);
+    NDEBUG_ASSERT(jit_compile(&trace, loss) == NULL, "Graphs with unsupported ops should not compile.");
+    jit_trace_clear(&trace);
+    // a program reads the inputs as they are when it runs
+    variable_t* x = variable_new(2, 3, 5);
+    variable_fill_test_values(x, 8);
+    jit_trace_begin(&trace);
+    loss = variable_sum(variable_relu(x));
+    jit_trace_end(&trace);
+    program = jit_compile(&trace, loss);
+    NDEBUG_ASSERT(program != NULL && entry_close(jit_run(program), get_entry(loss, 0), 1e-5), "Graph should compile.");
+    variable_set_to_scalar_value(x, 0);
+    NDEBUG_ASSERT(jit_run(program) == 0, "Compiled graph should read the current inputs.");
+    jit_program_free(program);
+    jit_trace_clear(&trace);
+    // neither a view nor the output of an op which was not traced is a leaf, as it would be read stale
+    variable_fill_test_values(x, 8);
+    jit_trace_begin(&trace);
+    loss = variable_sum(variable_view_as(variable_relu(x), 1, (size_t) 15));
+    jit_trace_end(&trace);
+    NDEBUG_ASSERT(jit_compile(&trace, loss) == NULL, "Graphs reading an untraced view should not compile.");
+    jit_trace_clear(&trace);
+    bool previous_mode = grad_set_enabled(false);
+    variable_t* untraced = variable_gelu(x);
+    grad_set_enabled(previous_mode);
+    jit_trace_begin(&trace);
+    loss = variable_sum(untraced);
+    jit_trace_end(&trace);
+    NDEBUG_ASSERT(jit_compile(&trace, loss) == NULL, "Graphs reading an untraced op should not compile.");
+    jit_trace_clear(&trace);
+    remove_dir(cache_dir);
+    printf("PASS.\n");
+}
+
+void test_sparse(){
+    printf("Testing sparse tensors...");
+    // about one entry in ten is nonzero
+    variable_t* dense_input = variable_new(2, 6, 40);
+    variable_fill_test_values(dense_input, 11);
+    for(size_t index = 0; index < dense_input->tensor->shape->size; index++){
+        tensor_entry_t entry = get_entry(dense_input, index);
+        set_entry(dense_input, index, fabsf(entry) > 0.99f ? entry : 0);
+    }
+    sparse_tensor_t* sparse_input = sparse_tensor_from_dense(dense_input->tensor);
+    NDEBUG_ASSERT(sparse_input->num_nonzeros > 0 && sparse_input->num_nonzeros < 60, "Unexpected number of nonzeros.");
+    NDEBUG_ASSERT(tensor_equal(sparse_tensor_to_dense(sparse_input), dense_input->tensor), "Dense round trip does not match.");
+    // the same matrix from shuffled triplets, with one entry split in two
+    size_t num_nonzeros = sparse_input->num_nonzeros + 1;
+    size_t rows[num_nonzeros], columns[num_nonzeros];
+    tensor_entry_t values[num_nonzeros];
+    size_t triplet = 0;
+    for(size_t row = sparse_input->num_rows; row-- > 0;){
+        for(size_t nonzero = sparse_input->row_offsets[row]; nonzero < sparse_input->row_offsets[row + 1]; nonzero++){
+            rows[triplet] = row;
+            columns[triplet] = sparse_input->columns[nonzero];
+            values[triplet++] = sparse_input->values[nonzero];
+        }
+    }
+    rows[triplet] = rows[0];
+    columns[triplet] = columns[0];
+    values[triplet] = values[0] / 2;
+    values[0] /= 2;
+    sparse_tensor_t* from_coo = sparse_tensor_from_coo(6, 40, num_nonzeros, rows, columns, values);
+    NDEBUG_ASSERT(tensor_equal(sparse_tensor_to_dense(from_coo), dense_input->tensor), "Triplets do not match.");
+    // linear layer against the dense one, forward and gradients
+    variable_t* weight = variable_new(2, 40, 7);
+    variable_t* bias = variable_new(1, 7);
+    variable_fill_test_values(weight, 12);
+    variable_fill_test_values(bias, 13);
+    variable_t* output = variable_sparse_linear(sparse_input, weight, bias, ACTIVATION_TANH);
+    backwards(sum_of_squares(output));
+    tensor_t* weight_grad = tensor_copy(weight->gradient);
+    tensor_t* bias_grad = tensor_copy(bias->gradient);
+    tensor_set_to_scalar_value(weight->gradient, 0);
+    tensor_set_to_scalar_value(bias->gradient, 0);
+    variable_t* expected = variable_linear(dense_input, weight, bias, ACTIVATION_TANH);
+    backwards(sum_of_squares(expected));
+    for(size_t index = 0; index < output->tensor->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(get_entry(output, index), get_entry(expected, index), 1e-5), "Sparse linear does not match dense.");
+    }
+    for(size_t index = 0; index < weight_grad->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(weight_grad->data[index], weight->gradient->data[index], 1e-5), "Sparse weight gradient does not match dense.");
+    }
+    for(size_t index = 0; index < bias_grad->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(bias_grad->data[index], bias->gradient->data[index], 1e-5), "Sparse bias gradient does not match dense.");
+    }
+    // sampled product
+    tensor_t* dense_other = tensor_new_like(dense_input->tensor);
+    for(size_t index = 0; index < dense_other->shape->size; index++){
+        dense_other->data[index] = index;
+    }
+    tensor_t* product = sparse_tensor_to_dense(sparse_tensor_multiply_dense(sparse_input, dense_other));
+    NDEBUG_ASSERT(tensor_equal(product, tensor_multiply(dense_input->tensor, dense_other)), "Sparse dense product does not match.");
+    printf("PASS.\n");
+}
+
+void test_embedding(){
+    printf("Testing embedding lookup and scatter add...");
+    size_t indices[5] = {2, 7, 2, 0, 9};
+    tensor_t* values = tensor_new(shape_new(2, (size_t[]){10, 3}));
+    for(size_t index = 0; index < values->shape->size; index++){
+        values->data[index] = (tensor_entry_t) index / 10 - 1;
+    }
+    variable_t* table = variable_new_with_row_sparse_grad(tensor_copy(values));
+    variable_t* dense_table = variable_new_from_tensor(tensor_copy(values));
+    variable_t* looked_up = variable_index_select(table, 5, indices);
+    NDEBUG_ASSERT(looked_up->tensor->shape->dims[0] == 5 && looked_up->tensor->shape->dims[1] == 3, "Lookup has the wrong shape.");
+    NDEBUG_ASSERT(get_entry(looked_up, 4) == values->data[7 * 3 + 1], "Lookup has the wrong rows.");
+    // the row sparse gradient, with a repeated row, against the dense one
+    backwards(sum_of_squares(looked_up));
+    backwards(sum_of_squares(variable_index_select(dense_table, 5, indices)));
+    NDEBUG_ASSERT(table->sparse_gradient->num_touched == 5, "Backwards should touch one row per index.");
+    NDEBUG_ASSERT(tensor_equal(row_sparse_to_dense(table->sparse_gradient), dense_table->gradient), "Row sparse gradient does not match dense.");
+    // scatter add against gathering it back
+    variable_t* source = variable_new(2, 5, 3);
+    variable_fill_test_values(source, 14);
+    variable_t* scattered = variable_scatter_add(source, 5, indices, 10);
+    for(size_t entry = 0; entry < 3; entry++){
+        tensor_entry_t expected = get_entry(source, entry) + get_entry(source, 2 * 3 + entry);
+        NDEBUG_ASSERT(entry_close(scattered->tensor->data[2 * 3 + entry], expected, 1e-6), "Scatter add should sum repeated rows.");
+        NDEBUG_ASSERT(scattered->tensor->data[5 * 3 + entry] == 0, "Scatter add should leave other rows zero.");
+    }
+    backwards(sum_of_squares(scattered));
+    NDEBUG_ASSERT(entry_close(source->gradient->data[0], 2 * scattered->tensor->data[2 * 3], 1e-6), "Scatter add gradient should gather rows.");
+    // the sparse Adam step matches the dense one, which leaves rows with zero gradient and state in place
+    optimizer_t* sparse_adam = optimizer_adam_new(&table, 1, 0.1, 0.9, 0.999, 1e-8, 0);
+    optimizer_t* dense_adam = optimizer_adam_new(&dense_table, 1, 0.1, 0.9, 0.999, 1e-8, 0);
+    optimizer_step(sparse_adam);
+    optimizer_step(dense_adam);
+    for(size_t index = 0; index < values->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(table->tensor->data[index], dense_table->tensor->data[index], 1e-6), "Sparse Adam step does not match dense.");
+    }
+    NDEBUG_ASSERT(table->sparse_gradient->num_touched == 0, "Step should clear the sparse gradient.");
+    // weight decay only reaches the rows that were looked up
+    tensor_t* before = tensor_copy(table->tensor);
+    optimizer_t* sparse_sgd = optimizer_sgd_new(&table, 1, 0.1, 0.9, 0.5);
+    backwards(variable_sum(variable_index_select(table, 1, indices)));
+    optimizer_step(sparse_sgd);
+    for(size_t row = 0; row < 10; row++){
+        bool changed = table->tensor->data[row * 3] != before->data[row * 3];
+        NDEBUG_ASSERT(changed == (row == 2), "Sparse step should update exactly the touched rows.");
+    }
+    printf("PASS.\n");
+}
+
+static variable_t* activation_test_loss(variable_t** inputs){
+    variable_t* x = inputs[0];
+    variable_t* positive = variable_exp(variable_tanh(x));
+    variable_t* total = variable_add(variable_sum(variable_multiply(variable_sigmoid(x), inputs[1])), variable_sum(variable_gelu(variable_multiply(x, inputs[1]))));
+    total = variable_add(total, variable_sum(variable_multiply(variable_log(positive), inputs[1])));
+    return variable_add(total, variable_sum(variable_multiply(variable_relu(x), x)));
+}
+
+void test_activations(){
+    printf("Testing activations...");
+    variable_t* x = variable_new(2, 4, 64);
+    variable_fill_test_values(x, 3);
+    variable_t* scaled = variable_new_like_with_value(x, 10.0);
+    x = variable_multiply(x, scaled);
+    variable_t* outputs[6] = {variable_relu(x), variable_sigmoid(x), variable_tanh(x), variable_gelu(x), variable_exp(x), variable_log(variable_abs_value(x))};
+    for(size_t index = 0; index < x->tensor->shape->size; index++){
+        double entry = get_entry(x, index);
+        double expected[6] = {entry > 0 ? entry : 0, 1 / (1 + exp(-entry)), tanh(entry), 0.5 * entry * (1 + tanh(0.7978845608028654 * (entry + 0.044715 * entry * entry * entry))), exp(entry), log(fabs(entry))};
+        for(int output_index = 0; output_index < 6; output_index++){
+            NDEBUG_ASSERT(entry_close(get_entry(outputs[output_index], index), expected[output_index], 1e-6), "Expected does not match actual.");
+        }
+    }
+    variable_t* inputs[2] = {variable_new(2, 3, 5), variable_new(2, 3, 5)};
+    variable_fill_test_values(inputs[0], 4);
+    variable_fill_test_values(inputs[1], 5);
+    NDEBUG_ASSERT(gradients_match(&activation_test_loss, inputs, 2, 2e-2), "Activation gradients do not match.");
+    printf("PASS.\n");
+}
+
+static size_t softmax_test_targets[4] = {2, 0, 6, 3};
+
+static variable_t* softmax_test_loss(variable_t** inputs){
+    variable_t* total = variable_sum(variable_multiply(variable_softmax(inputs[0], 0), inputs[1]));
+    total = variable_add(total, variable_sum(variable_multiply(variable_log_softmax(inputs[0], -1), inputs[1])));
+    return variable_add(total, variable_cross_entropy_loss(inputs[0], softmax_test_targets));
+}
+
+void test_softmax(){
+    printf("Testing softmax and cross entropy...");
+    // axis 0 of (4 x 9) exercises the strided path, the last axis the contiguous one (with a tail)
+    variable_t* x = variable_new(2, 4, 9);
+    variable_fill_test_values(x, 6);
+    set_entry(x, 3, 1000);
+    variable_t* y = variable_softmax(x, 1);
+    variable_t* log_y = variable_log_softmax(x, 1);
+    for(size_t row = 0; row < 4; row++){
+        double max = -INFINITY, sum = 0;
+        for(size_t column = 0; column < 9; column++){
+            max = fmax(max, get_entry(x, row * 9 + column));
+        }
+        for(size_t column = 0; column < 9; column++){
+            sum += exp(get_entry(x, row * 9 + column) - max);
+        }
+        for(size_t column = 0; column < 9; column++){
+            double expected_log = get_entry(x, row * 9 + column) - max - log(sum);
+            NDEBUG_ASSERT(entry_close(get_entry(log_y, row * 9 + column), expected_log, 1e-6), "Expected does not match actual.");
+            NDEBUG_ASSERT(fabs(get_entry(y, row * 9 + column) - exp(expected_log)) < 1e-6, "Expected does not match actual.");
+        }
+    }
+    variable_t* loss = variable_cross_entropy_loss(x, softmax_test_targets);
+    double expected_loss = 0;
+    for(size_t row = 0; row < 4; row++){
+        expected_loss -= get_entry(log_y, row * 9 + softmax_test_targets[row]);
+    }
+    NDEBUG_ASSERT(entry_close(get_entry(loss, 0), expected_loss / 4, 1e-6), "Expected does not match actual.");
+    variable_t* inputs[2] = {variable_new(2, 4, 9), variable_new(2, 4, 9)};
+    variable_fill_test_values(inputs[0], 7);
+    variable_fill_test_values(inputs[1], 8);
+    NDEBUG_ASSERT(gradients_match(&softmax_test_loss, inputs, 1, 2e-2), "Softmax gradients do not match.");
+    printf("PASS.\n");
+}
+
+// direct convolution, for reference
+static double reference_conv2d_entry(variable_t* input, variable_t* weight, const conv2d_params_t* params, size_t n, size_t f, size_t output_row, size_t output_column){
+    size_t in_channels = input->tensor->shape->dims[1], height = input->tensor->shape->dims[2], width = input->tensor->shape->dims[3];
+    size_t group_in_channels = weight->tensor->shape->dims[1], kernel_height = weight->tensor->shape->dims[2], kernel_width = weight->tensor->shape->dims[3];
+    size_t group = f / (weight->tensor->shape->dims[0] / params->groups);
+    double sum = 0;
+    for(size_t c = 0; c < group_in_channels; c++){
+        for(size_t kernel_row = 0; kernel_row < kernel_height; kernel_row++){
+            for(size_t kernel_column = 0; kernel_column < kernel_width; kernel_column++){
+                long row = (long) (output_row * params->stride[0] + kernel_row * params->dilation[0]) - (long) params->padding[0];
+                long column = (long) (output_column * params->stride[1] + kernel_column * params->dilation[1]) - (long) params->padding[1];
+                if(row < 0 || column < 0 || row >= (long) height || column >= (long) width){
+                    continue;
+                }
+                size_t channel = group * group_in_channels + c;
+                sum += (double) get_entry(input, ((n * in_channels + channel) * height + row) * width + column) * get_entry(weight, ((f * group_in_channels + c) * kernel_height + kernel_row) * kernel_width + kernel_column);
+            }
+        }
+    }
+    return sum;
+}
+
+static bool conv2d_matches_reference(variable_t* input, variable_t* weight, variable_t* bias, const conv2d_params_t* params){
+    variable_t* output = variable_conv2d(input, weight, bias, params);
+    size_t* dims = output->tensor->shape->dims;
+    for(size_t index = 0; index < output->tensor->shape->size; index++){
+        size_t output_column = index % dims[3], output_row = index / dims[3] % dims[2], f = index / (dims[2] * dims[3]) % dims[1], n = index / (dims[1] * dims[2] * dims[3]);
+        double expected = reference_conv2d_entry(input, weight, params, n, f, output_row, output_column) + (bias ? get_entry(bias, f) : 0);
+        if(!entry_close(get_entry(output, index), expected, 1e-4)){
+            return false;
+        }
+    }
+    return true;
+}
+
+static conv2d_params_t conv_test_params = {{2, 1}, {1, 2}, {2, 1}, 2};
+static pool2d_params_t pool_test_params = {{2, 3}, {2, 1}, {1, 1}};
+
+static variable_t* conv_test_loss(variable_t** inputs){
+    variable_t* output = variable_conv2d(inputs[0], inputs[1], inputs[2], &conv_test_params);
+    variable_t* total = variable_sum(variable_multiply(variable_max_pool2d(output, &pool_test_params), variable_max_pool2d(output, &pool_test_params)));
+    return variable_add(total, variable_sum(variable_multiply(variable_avg_pool2d(output, &pool_test_params), variable_avg_pool2d(output, &pool_test_params))));
+}
+
+// padding 2 around a kernel of 2, so that whole windows lie in the padding
+static void pool_padding_past_half_kernel(){
+    pool2d_params_t params = {{2, 2}, {1, 1}, {2, 0}};
+    variable_max_pool2d(variable_new(4, 1, 1, 4, 4), &params);
+}
+
+void test_conv2d(){
+    printf("Testing conv2d and pooling...");
+    variable_t* input = variable_new(4, 2, 4, 7, 6);
+    variable_t* weight = variable_new(4, 6, 2, 3, 2);
+    variable_t* bias = variable_new(1, 6);
+    variable_fill_test_values(input, 9);
+    variable_fill_test_values(weight, 10);
+    variable_fill_test_values(bias, 11);
+    NDEBUG_ASSERT(conv2d_matches_reference(input, weight, bias, &conv_test_params), "Expected does not match actual.");
+    conv2d_params_t pointwise = conv2d_params_default();
+    variable_t* pointwise_weight = variable_new(4, 3, 4, 1, 1);
+    variable_fill_test_values(pointwise_weight, 12);
+    NDEBUG_ASSERT(conv2d_matches_reference(input, pointwise_weight, NULL, &pointwise), "Expected does not match actual.");
+    // deep enough that the im2col tile holds fewer output positions than a row (so tiles start mid row)
+    variable_t* deep_input = variable_new(4, 1, 1024, 6, 6);
+    variable_t* deep_weight = variable_new(4, 2, 1024, 3, 3);
+    variable_fill_test_values(deep_input, 13);
+    variable_fill_test_values(deep_weight, 14);
+    conv2d_params_t padded = conv2d_params_default();
+    padded.padding[0] = padded.padding[1] = 1;
+    NDEBUG_ASSERT(conv2d_matches_reference(deep_input, deep_weight, NULL, &padded), "Expected does not match actual.");
+    variable_t* inputs[3] = {variable_new(4, 1, 4, 5, 4), variable_new(4, 4, 2, 2, 2), variable_new(1, 4)};
+    for(int input_index = 0; input_index < 3; input_index++){
+        variable_fill_test_values(inputs[input_index], 15 + input_index);
+    }
+    NDEBUG_ASSERT(gradients_match(&conv_test_loss, inputs, 3, 2e-2), "Convolution gradients do not match.");
+    NDEBUG_ASSERT(aborts(&pool_padding_past_half_kernel), "Pooling padding of more than half the kernel should fail.");
+    printf("PASS.\n");
+}
+
+void test_dataloader(){
+    printf("Testing dataset and loader...");
+    const char* input_path = "/tmp/coral_test_inputs.bin";
+    const char* label_path = "/tmp/coral_test_labels.bin";
+    size_t num_records = 10, record_size = 6;
+    variable_t* inputs = variable_new(3, num_records, 2, 3);
+    variable_t* labels = variable_new(1, num_records);
+    for(size_t index = 0; index < num_records * record_size; index++){
+        tensor_set_entry(inputs->tensor, index, index);
+    }
+    for(size_t record = 0; record < num_records; record++){
+        tensor_set_entry(labels->tensor, record, record);
+    }
+    dataset_save(input_path, inputs->tensor);
+    dataset_save(label_path, labels->tensor);
+    dataset_t* datasets[2] = {dataset_open(input_path), dataset_open(label_path)};
+    NDEBUG_ASSERT(datasets[0]->num_records == num_records && datasets[0]->record_size == record_size && datasets[1]->record_num_dims == 0, "Dataset header does not match.");
+    tensor_t* batches[2];
+    // in order: batches alias the mapping
+    dataloader_t* loader = dataloader_new(2, datasets, 4, false, 0);
+    for(int epoch = 0; epoch < 2; epoch++){
+        size_t start = 0;
+        while(dataloader_next(loader, batches)){
+            size_t expected_size = MIN((size_t) 4, num_records - start);
+            NDEBUG_ASSERT(batches[0]->shape->dims[0] == expected_size && TENSOR_NUM_DIMS(batches[0]) == 3 && TENSOR_NUM_DIMS(batches[1]) == 1, "Batch shape does not match.");
+            NDEBUG_ASSERT(batches[0]->data == datasets[0]->records + start * record_size, "In order batch should not be copied.");
+            NDEBUG_ASSERT(tensor_get_entry(batches[1], expected_size - 1) == start + expected_size - 1, "Expected does not match actual.");
+            start += expected_size;
+        }
+        NDEBUG_ASSERT(start == num_records, "Epoch does not cover the dataset.");
+    }
+    dataloader_free(loader);
+    // shuffled: every record exactly once per epoch, inputs and labels in lockstep
+    loader = dataloader_new(2, datasets, 3, true, 42);
+    for(int epoch = 0; epoch < 3; epoch++){
+        bool seen[10] = {false};
+        size_t count = 0;
+        while(dataloader_next(loader, batches)){
+            for(size_t row = 0; row < batches[1]->shape->dims[0]; row++){
+                size_t record = (size_t) tensor_get_entry(batches[1], row);
+                NDEBUG_ASSERT(record < num_records && !seen[record], "Record repeated within an epoch.");
+                NDEBUG_ASSERT(tensor_get_entry(batches[0], row * record_size + 5) == record * record_size + 5, "Inputs and labels are out of step.");
+                seen[record] = true;
+                count++;
+            }
+        }
+        NDEBUG_ASSERT(count == num_records, "Epoch does not cover the dataset.");
+    }
+    dataloader_free(loader);
+    dataset_close(datasets[0]);
+    dataset_close(datasets[1]);
+    remove(input_path);
+    remove(label_path);
+    printf("PASS.\n");
+}
+
+void test_checkpoint(){
+    printf("Testing checkpoints...");
+    const char* path = "/tmp/coral_test_checkpoint.bin";
+    const char* names[3] = {"hidden.weight", "hidden.bias", "output.weight"};
+    module_t* layers[2] = {module_linear_new(4, 5, true, ACTIVATION_RELU), module_linear_new(5, 2, false, ACTIVATION_NONE)};
+    module_t* mlp = module_sequential_new(2, layers);
+    checkpoint_save(path, 3, names, mlp->params);
+    module_t* loaded_layers[2] = {module_linear_new(4, 5, true, ACTIVATION_RELU), module_linear_new(5, 2, false, ACTIVATION_NONE)};
+    module_t* loaded_mlp = module_sequential_new(2, loaded_layers);
+    set_entry(loaded_mlp->params[0], 0, 100);
+    checkpoint_t* checkpoint = checkpoint_open(path);
+    checkpoint_load(checkpoint, 3, names, loaded_mlp->params);
+    for(int param_index = 0; param_index < 3; param_index++){
+        tensor_t* tensor = loaded_mlp->params[param_index]->tensor;
+        NDEBUG_ASSERT((uintptr_t) tensor->data / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT == (uintptr_t) tensor->data, "Payload is misaligned.");
+        NDEBUG_ASSERT((char*) tensor->data > (char*) checkpoint->mapping && (char*) tensor->data < (char*) checkpoint->mapping + checkpoint->mapping_size, "Loaded tensor should point into the mapping.");
+        NDEBUG_ASSERT(tensor_equal(tensor, mlp->params[param_index]->tensor), "Expected does not match actual.");
+    }
+    variable_t* input = variable_new(2, 3, 4);
+    variable_fill_test_values(input, 1);
+    NDEBUG_ASSERT(variable_equal(module_forward(mlp, input), module_forward(loaded_mlp, input)), "Expected does not match actual.");
+    tensor_t* bias = checkpoint_get(checkpoint, "hidden.bias");
+    NDEBUG_ASSERT(bias != NULL && bias->data == loaded_mlp->params[1]->tensor->data && checkpoint_get(checkpoint, "missing") == NULL, "Lookup by name failed.");
+    // writes are private to this process and never reach the file
+    tensor_entry_t saved_entry = get_entry(mlp->params[0], 0);
+    set_entry(loaded_mlp->params[0], 0, saved_entry + 1);
+    checkpoint_t* reopened = checkpoint_open(path);
+    NDEBUG_ASSERT(tensor_get_entry(checkpoint_get(reopened, "hidden.weight"), 0) == saved_entry, "Checkpoint file was modified.");
+    // parameters in the flat buffer of an optimizer are loaded into it, so that steps still reach the model
+    module_t* trained_layers[2] = {module_linear_new(4, 5, true, ACTIVATION_RELU), module_linear_new(5, 2, false, ACTIVATION_NONE)};
+    module_t* trained_mlp = module_sequential_new(2, trained_layers);
+    optimizer_t* optimizer = optimizer_sgd_new(trained_mlp->params, 3, 0.1, 0, 0);
+    checkpoint_load(reopened, 3, names, trained_mlp->params);
+    NDEBUG_ASSERT(trained_mlp->params[0]->tensor->data == optimizer->param_data, "Loaded parameter should stay in the flat buffer.");
+    NDEBUG_ASSERT(tensor_equal(trained_mlp->params[0]->tensor, mlp->params[0]->tensor), "Expected does not match actual.");
+    backwards(sum_of_squares(module_forward(trained_mlp, input)));
+    tensor_t* gradient = tensor_copy(trained_mlp->params[2]->gradient);
+    optimizer_step(optimizer);
+    for(size_t index = 0; index < gradient->shape->size; index++){
+        tensor_entry_t expected = tensor_get_entry(mlp->params[2]->tensor, index) - 0.1 * gradient->data[index];
+        NDEBUG_ASSERT(entry_close(tensor_get_entry(trained_mlp->params[2]->tensor, index), expected, 1e-5), "Step should update the loaded parameter.");
+    }
+    NDEBUG_ASSERT(!variable_equal(module_forward(mlp, input), module_forward(trained_mlp, input)), "Step should change the model.");
+    tensor_free(gradient);
+    checkpoint_close(reopened);
+    checkpoint_close(checkpoint);
+    remove(path);
+    printf("PASS.\n");
+}
+
+void test_activation_checkpointing(){
+    printf("Testing activation checkpointing...");
+    int depth = 9;
+    module_t* layers[depth];
+    for(int layer_index = 0; layer_index < depth; layer_index++){
+        layers[layer_index] = module_linear_new(6, 6, true, ACTIVATION_TANH);
+        variable_fill_test_values(layers[layer_index]->params[0], layer_index);
+        variable_fill_test_values(layers[layer_index]->params[1], depth + layer_index);
+    }
+    // both share the same parameters
+    module_t* stored = module_sequential_new(depth, layers);
+    module_t* checkpointed = module_sequential_checkpointed_new(depth, layers, 0);
+    variable_t* stored_input = variable_new(2, 4, 6);
+    variable_fill_test_values(stored_input, 42);
+    variable_t* checkpointed_input = variable_new_from_tensor(stored_input->tensor);
+    variable_t* stored_output = module_forward(stored, stored_input);
+    backwards(sum_of_squares(stored_output));
+    tensor_t* stored_grads[2 * depth];
+    for(int param_index = 0; param_index < stored->num_params; param_index++){
+        stored_grads[param_index] = tensor_copy(stored->params[param_index]->gradient);
+        tensor_set_to_scalar_value(stored->params[param_index]->gradient, 0);
+    }
+    variable_t* checkpointed_output = module_forward(checkpointed, checkpointed_input);
+    NDEBUG_ASSERT(tensor_equal(stored_output->tensor, checkpointed_output->tensor), "Expected does not match actual.");
+    backwards(sum_of_squares(checkpointed_output));
+    for(int param_index = 0; param_index < checkpointed->num_params; param_index++){
+        tensor_t* gradient = checkpointed->params[param_index]->gradient;
+        for(size_t index = 0; index < gradient->shape->size; index++){
+            NDEBUG_ASSERT(entry_close(tensor_get_entry(gradient, index), tensor_get_entry(stored_grads[param_index], index), 1e-5), "Parameter gradients do not match.");
+        }
+    }
+    for(size_t index = 0; index < stored_input->gradient->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(tensor_get_entry(checkpointed_input->gradient, index), tensor_get_entry(stored_input->gradient, index), 1e-5), "Input gradients do not match.");
+    }
+    // without grad, ops build no graph
+    bool previous_mode = grad_set_enabled(false);
+    NDEBUG_ASSERT(variable_relu(stored_input)->grad_meta->num_inputs == 0, "No graph should be built without grad.");
+    grad_set_enabled(previous_mode);
+    printf("PASS.\n");
+}
+
+static void tensor_moments(tensor_t* tensor, double* mean, double* variance){
+    double sum = 0, sum_of_squares = 0;
+    for(size_t index = 0; index < tensor->shape->size; index++){
+        sum += tensor->data[index];
+        sum_of_squares += (double) tensor->data[index] * tensor->data[index];
+    }
+    *mean = sum / tensor->shape->size;
+    *variance = sum_of_squares / tensor->shape->size - *mean * *mean;
+}
+
+void test_rng(){
+    printf("Testing random fills and dropout...");
+    size_t size = 1 << 20;
+    tensor_t* serial = tensor_new(shape_new(1, &size));
+    tensor_t* threaded = tensor_new(shape_new(1, &size));
+    rng_set_num_threads(1);
+    rng_normal(rng_new(7), serial, 0, 1);
+    rng_set_num_threads(3);
+    rng_normal(rng_new(7), threaded, 0, 1);
+    rng_set_num_threads(0);
+    NDEBUG_ASSERT(tensor_equal(serial, threaded), "Draws should not depend on the number of threads.");
+    double mean, variance;
+    tensor_moments(serial, &mean, &variance);
+    NDEBUG_ASSERT(fabs(mean) < 5e-3 && fabs(variance - 1) < 1e-2, "Normal draws have the wrong moments.");
+    rng_t* rng = rng_new(8);
+    // the variance of a standard normal truncated to [-2, 2]
+    rng_truncated_normal(rng, serial, 0, 1);
+    tensor_moments(serial, &mean, &variance);
+    NDEBUG_ASSERT(fabs(mean) < 5e-3 && fabs(variance - 0.7737) < 1e-2, "Truncated normal draws have the wrong moments.");
+    rng_uniform(rng, threaded, -3, 1);
+    tensor_moments(threaded, &mean, &variance);
+    NDEBUG_ASSERT(fabs(mean + 1) < 1e-2 && fabs(variance - 16.0 / 12) < 1e-2, "Uniform draws have the wrong moments.");
+    for(size_t index = 0; index < size; index++){
+        NDEBUG_ASSERT(fabsf(serial->data[index]) <= 2 && -3 <= threaded->data[index] && threaded->data[index] < 1, "Draw out of range.");
+    }
+    // the regenerated mask in backward is the one of the forward pass
+    variable_t* input = variable_new(2, 64, 64);
+    variable_fill_test_values(input, 3);
+    variable_t* output = variable_dropout(input, 0.25, rng);
+    backwards(variable_sum(output));
+    size_t num_dropped = 0;
+    for(size_t index = 0; index < 64 * 64; index++){
+        tensor_entry_t gradient = input->gradient->data[index];
+        num_dropped += gradient == 0;
+        NDEBUG_ASSERT(gradient == 0 || gradient == (tensor_entry_t) (1 / 0.75), "Dropout gradient is not the scaled mask.");
+        NDEBUG_ASSERT(get_entry(output, index) == get_entry(input, index) * gradient, "Dropout gradient does not match its output.");
+    }
+    NDEBUG_ASSERT(num_dropped > 900 && num_dropped < 1150, "Dropout drops the wrong fraction.");
+    // a checkpointed segment replays its dropout masks
+    int depth = 4;
+    module_t* stored_layers[2 * depth];
+    module_t* checkpointed_layers[2 * depth];
+    for(int layer_index = 0; layer_index < depth; layer_index++){
+        stored_layers[2 * layer_index] = checkpointed_layers[2 * layer_index] = module_linear_new(8, 8, true, ACTIVATION_TANH);
+        stored_layers[2 * layer_index + 1] = module_dropout_new(0.5, layer_index);
+        checkpointed_layers[2 * layer_index + 1] = module_dropout_new(0.5, layer_index);
+    }
+    module_t* stored = module_sequential_new(2 * depth, stored_layers);
+    module_t* checkpointed = module_sequential_checkpointed_new(2 * depth, checkpointed_layers, 2);
+    variable_t* stored_input = variable_new(2, 4, 8);
+    variable_fill_test_values(stored_input, 4);
+    variable_t* checkpointed_input = variable_new_from_tensor(stored_input->tensor);
+    variable_t* stored_output = module_forward(stored, stored_input);
+    backwards(sum_of_squares(stored_output));
+    variable_t* checkpointed_output = module_forward(checkpointed, checkpointed_input);
+    NDEBUG_ASSERT(tensor_equal(stored_output->tensor, checkpointed_output->tensor), "Checkpointed dropout output does not match.");
+    backwards(sum_of_squares(checkpointed_output));
+    for(size_t index = 0; index < stored_input->gradient->shape->size; index++){
+        NDEBUG_ASSERT(entry_close(tensor_get_entry(checkpointed_input->gradient, index), tensor_get_entry(stored_input->gradient, index), 1e-5), "Checkpointed dropout gradients do not match.");
+    }
+    printf("PASS.\n");
+}
+
+// batch[0]: inputs, batch[1]: class indices
+static variable_t* classifier_loss(module_t* model, tensor_t** batch, void* context){
+    UNUSED(context);
+    size_t rows = batch[0]->shape->dims[0];
+    size_t targets[rows];
+    for(size_t row = 0; row < rows; row++){
+        targets[row] = (size_t) tensor_get_entry(batch[1], row);
+    }
+    return variable_cross_entropy_loss(module_forward(model, variable_new_from_tensor(batch[0])), targets);
+}
+
+void test_data_parallel(){
+    printf("Testing data parallel training...");
+    module_t* layers[2] = {module_linear_new(4, 8, true, ACTIVATION_TANH), module_linear_new(8, 3, true, ACTIVATION_NONE)};
+    module_t* model = module_sequential_new(2, layers);
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        variable_fill_test_values(model->params[param_index], param_index);
+    }
+    variable_t* inputs = variable_new(2, 10, 4);
+    variable_t* targets = variable_new(1, 10);
+    variable_fill_test_values(inputs, 5);
+    for(size_t row = 0; row < 10; row++){
+        tensor_set_entry(targets->tensor, row, row % 3);
+    }
+    tensor_t* batch[2] = {inputs->tensor, targets->tensor};
+    // reference: the whole batch on one thread
+    variable_t* expected_loss = classifier_loss(model, batch, NULL);
+    backwards(expected_loss);
+    tensor_t* expected_grads[4];
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        expected_grads[param_index] = tensor_copy(model->params[param_index]->gradient);
+        tensor_set_to_scalar_value(model->params[param_index]->gradient, 0);
+    }
+    // uneven shards, and more workers than rows (some get none)
+    int worker_counts[2] = {3, 11};
+    for(int run = 0; run < 2; run++){
+        data_parallel_t* runner = data_parallel_new(model, worker_counts[run]);
+        tensor_entry_t loss = data_parallel_step(runner, 2, batch, &classifier_loss, NULL);
+        NDEBUG_ASSERT(entry_close(loss, get_entry(expected_loss, 0), 1e-5), "Expected does not match actual.");
+        for(int param_index = 0; param_index < model->num_params; param_index++){
+            tensor_t* gradient = model->params[param_index]->gradient;
+            for(size_t index = 0; index < gradient->shape->size; index++){
+                NDEBUG_ASSERT(entry_close(tensor_get_entry(gradient, index), tensor_get_entry(expected_grads[param_index], index), 1e-5), "Gradients do not match.");
+            }
+            tensor_set_to_scalar_value(gradient, 0);
+        }
+        data_parallel_free(runner);
+    }
+    printf("PASS.\n");
+}
+
+static tensor_t* rows_view(tensor_t* tensor, size_t start, size_t num_rows){
+    tensor_t* view = tensor_view_as_shape(tensor, tensor->shape);
+    view->shape->dims[0] = num_rows;
+    view->shape->size = num_rows * view->shape->strides[0];
+    view->data += start * view->shape->strides[0];
+    return view;
+}
+
+// one rank of a two process run: rank r trains on rows [4r, 4r + 4), with buckets small enough that there are several
+static void distributed_rank(int rank, bool use_shm, int base_port, tensor_t** batch, tensor_t** expected_grads){
+    const char* hosts[2] = {"127.0.0.1", "127.0.0.1"};
+    transport_t* transport = use_shm ? transport_shm_new("/coral_test", rank, 2, 16) : transport_tcp_new(hosts, base_port, rank, 2);
+    module_t* layers[2] = {module_linear_new(4, 8, true, ACTIVATION_TANH), module_linear_new(8, 3, true, ACTIVATION_NONE)};
+    module_t* model = module_sequential_new(2, layers);
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        variable_fill_test_values(model->params[param_index], param_index);
+    }
+    // a differing start is overwritten by rank 0's parameters
+    if(rank == 1){
+        set_entry(model->params[0], 0, 100);
+    }
+    distributed_t* distributed = distributed_new(transport, model->num_params, model->params, 20);
+    distributed_sync_params(distributed);
+    NDEBUG_ASSERT(distributed->num_buckets > 1, "Expected several buckets.");
+    for(int step = 0; step < 2; step++){
+        tensor_t* shard[2] = {rows_view(batch[0], 4 * rank, 4), rows_view(batch[1], 4 * rank, 4)};
+        backwards(classifier_loss(model, shard, NULL));
+        distributed_finish(distributed);
+        for(int param_index = 0; param_index < model->num_params; param_index++){
+            tensor_t* gradient = model->params[param_index]->gradient;
+            for(size_t index = 0; index < gradient->shape->size; index++){
+                NDEBUG_ASSERT(entry_close(tensor_get_entry(gradient, index), tensor_get_entry(expected_grads[param_index], index), 1e-5), "Gradients do not match.");
+            }
+            tensor_set_to_scalar_value(gradient, 0);
+        }
+    }
+    distributed_free(distributed);
+    transport_free(transport);
+}
+
+// a layer used by two recomputed segments, each replay of which completes its parameters
+static void distributed_param_completed_twice(){
+    transport_t* transport = transport_shm_new("/coral_test_twice", 0, 1, 16);
+    module_t* layer = module_linear_new(4, 4, true, ACTIVATION_TANH);
+    module_t* layers[3] = {layer, layer, module_linear_new(4, 1, true, ACTIVATION_NONE)};
+    module_t* model = module_sequential_checkpointed_new(3, layers, 1);
+    distributed_new(transport, layer->num_params, layer->params, 1000);
+    variable_t* input = variable_new(2, 2, 4);
+    variable_fill_test_values(input, 1);
+    backwards(variable_sum(module_forward(model, input)));
+}
+
+void test_distributed(){
+    printf("Testing multi-process data parallel training...");
+    module_t* layers[2] = {module_linear_new(4, 8, true, ACTIVATION_TANH), module_linear_new(8, 3, true, ACTIVATION_NONE)};
+    module_t* model = module_sequential_new(2, layers);
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        variable_fill_test_values(model->params[param_index], param_index);
+    }
+    variable_t* inputs = variable_new(2, 8, 4);
+    variable_t* targets = variable_new(1, 8);
+    variable_fill_test_values(inputs, 6);
+    for(size_t row = 0; row < 8; row++){
+        tensor_set_entry(targets->tensor, row, (row * 7) % 3);
+    }
+    tensor_t* batch[2] = {inputs->tensor, targets->tensor};
+    // equal shards: the mean over ranks of the shard means is the mean over the batch
+    backwards(classifier_loss(model, batch, NULL));
+    tensor_t* expected_grads[4];
+    for(int param_index = 0; param_index < model->num_params; param_index++){
+        expected_grads[param_index] = model->params[param_index]->gradient;
+    }
+    int base_port = 20000 + getpid() % 20000;
+    for(int use_shm = 0; use_shm < 2; use_shm++){
+        fflush(stdout);
+        pid_t children[2];
+        for(int rank = 0; rank < 2; rank++){
+            children[rank] = fork();
+            if(children[rank] == 0){
+                distributed_rank(rank, use_shm, base_port, batch, expected_grads);
+                _exit(0);
+            }
+        }
+        for(int rank = 0; rank < 2; rank++){
+            int status;
+            waitpid(children[rank], &status, 0);
+            NDEBUG_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "A rank failed.");
+        }
+    }
+    NDEBUG_ASSERT(aborts(&distributed_param_completed_twice), "A parameter completed twice in a step should fail.");
+    shm_unlink("/coral_test_twice");
+    printf("PASS.\n");
+}
+
+#define SERVE_TEST_CLIENTS 4
+#define SERVE_TEST_REQUESTS 25
+
+typedef struct {
+    const char* path;
+    int num_requests;
+    tensor_t* inputs; // a row per client
+    tensor_t* expected; // its output
+    int client;
+    bool matches;
+} serve_client_t;
+
+// sends the row of the client (twice over, every other request) num_requests times
+static void* serve_client_main(void* arg){
+    serve_client_t* client = (serve_client_t*) arg;
+    size_t input_size = client->inputs->shape->dims[1];
+    size_t output_size = client->expected->shape->dims[1];
+    tensor_entry_t input[2 * input_size];
+    tensor_entry_t output[2 * output_size];
+    for(int copy = 0; copy < 2; copy++){
+        memcpy(input + copy * input_size, client->inputs->data + client->client * input_size, input_size * sizeof(tensor_entry_t));
+    }
+    const tensor_entry_t* expected = client->expected->data + client->client * output_size;
+    int fd = serve_connect(client->path);
+    client->matches = fd >= 0;
+    for(int request = 0; request < client->num_requests && client->matches; request++){
+        size_t num_rows = 1 + request % 2;
+        client->matches = serve_infer(fd, num_rows, input, input_size, output, output_size);
+        for(size_t index = 0; index < num_rows * output_size && client->matches; index++){
+            client->matches = entry_close(output[index], expected[index % output_size], 1e-5);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static bool serve_clients_run(const char* path, int num_requests, tensor_t* inputs, tensor_t* expected){
+    pthread_t threads[SERVE_TEST_CLIENTS];
+    serve_client_t clients[SERVE_TEST_CLIENTS];
+    for(int client = 0; client < SERVE_TEST_CLIENTS; client++){
+        clients[client] = (serve_client_t) {path, num_requests, inputs, expected, client, false};
+        pthread_create(&threads[client], NULL, &serve_client_main, &clients[client]);
+    }
+    bool matches = true;
+    for(int client = 0; client < SERVE_TEST_CLIENTS; client++){
+        pthread_join(threads[client], NULL);
+        matches &= clients[client].matches;
+    }
+    return matches;
+}
+
+void test_serve(){
+    printf("Testing inference server...");
+    module_t* layers[2] = {module_linear_new(6, 8, true, ACTIVATION_RELU), module_linear_new(8, 3, true, ACTIVATION_NONE)};
+    module_t* mlp = module_sequential_new(2, layers);
+    variable_t* inputs = variable_new(2, SERVE_TEST_CLIENTS, 6);
+    variable_fill_test_values(inputs, 1);
+    bool previous_mode = grad_set_enabled(false);
+    tensor_t* expected = module_forward(mlp, inputs)->tensor;
+    grad_set_enabled(previous_mode);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/coral-serve-test-%d.sock", (int) getpid());
+    // one request per client fills a batch, which then runs without waiting out max_wait
+    serve_policy_t policy = {SERVE_TEST_CLIENTS, 10.0};
+    serve_server_t* server = serve_server_new(mlp, 6, 3, policy);
+    NDEBUG_ASSERT(serve_start(server, path), "Server should listen.");
+    NDEBUG_ASSERT(serve_clients_run(path, 1, inputs->tensor, expected), "Replies should match the model.");
+    serve_stats_t stats;
+    serve_stats(server, &stats);
+    NDEBUG_ASSERT(stats.num_requests == SERVE_TEST_CLIENTS && stats.num_batches == 1, "Concurrent requests should share a batch.");
+    serve_server_free(server);
+    // requests of one and two rows, batched by a short wait
+    policy = (serve_policy_t) {5, 1e-3};
+    server = serve_server_new(mlp, 6, 3, policy);
+    NDEBUG_ASSERT(serve_start(server, path), "Server should listen.");
+    NDEBUG_ASSERT(serve_clients_run(path, SERVE_TEST_REQUESTS, inputs->tensor, expected), "Replies should match the model.");
+    int fd = serve_connect(path);
+    NDEBUG_ASSERT(serve_query_stats(fd, &stats), "Stats should be served.");
+    close(fd);
+    bool consistent = stats.num_rows >= stats.num_requests && stats.num_batches <= stats.num_requests && stats.p50_latency <= stats.p99_latency;
+    NDEBUG_ASSERT(stats.num_requests == SERVE_TEST_CLIENTS * SERVE_TEST_REQUESTS && consistent, "Stats should count every request.");
+    // a request of more rows than a batch is refused, and the connection goes on
+    tensor_entry_t rows[6 * 6] = {0};
+    tensor_entry_t output[6 * 3];
+    fd = serve_connect(path);
+    NDEBUG_ASSERT(!serve_infer(fd, 6, rows, 6, output, 3), "Too many rows should be refused.");
+    NDEBUG_ASSERT(serve_infer(fd, 1, inputs->tensor->data, 6, output, 3) && entry_close(output[0], expected->data[0], 1e-5), "A refused request should leave the connection open.");
+    close(fd);
+    // a client stalling mid request is dropped, rather than hold up every batch
+    int stalled_fd = serve_connect(path);
+    uint32_t stalled_header = 1;
+    bool stalled = write(stalled_fd, &stalled_header, sizeof(stalled_header)) == sizeof(stalled_header);
+    NDEBUG_ASSERT(stalled && write(stalled_fd, rows, 3 * sizeof(tensor_entry_t)) == 3 * sizeof(tensor_entry_t), "Could not send the stalled request.");
+    NDEBUG_ASSERT(serve_clients_run(path, SERVE_TEST_REQUESTS, inputs->tensor, expected), "A stalled client should not block the others.");
+    NDEBUG_ASSERT(read(stalled_fd, output, sizeof(output)) == 0, "A stalled client should be disconnected.");
+    close(stalled_fd);
+    serve_server_free(server);
+    // a client which never reads its reply (larger than the socket buffer) holds up no other
+    size_t num_slow_rows = 1 << 16;
+    policy = (serve_policy_t) {num_slow_rows, 1e-3};
+    server = serve_server_new(mlp, 6, 3, policy);
+    NDEBUG_ASSERT(serve_start(server, path), "Server should listen.");
+    int slow_fd = serve_connect(path);
+    uint32_t header = num_slow_rows;
+    tensor_entry_t* slow_rows = (tensor_entry_t*) calloc(num_slow_rows * 6, sizeof(tensor_entry_t));
+    bool sent = write(slow_fd, &header, sizeof(header)) == sizeof(header);
+    sent = sent && write(slow_fd, slow_rows, num_slow_rows * 6 * sizeof(tensor_entry_t)) == (ssize_t) (num_slow_rows * 6 * sizeof(tensor_entry_t));
+    NDEBUG_ASSERT(sent, "Could not send the slow request.");
+    NDEBUG_ASSERT(serve_clients_run(path, 1, inputs->tensor, expected), "A slow client should not block the others.");
+    serve_server_free(server);
+    close(slow_fd);
+    free(slow_rows);
+    unlink(path);
+    printf("PASS.\n");
+}
+
 void test_variable_multiply();
 void test_varaible_square();
 void test_variable_abs();
@@ -57,6 +1668,33 @@ int main(){
     test_variable_equality();
     test_variable_add();
     test_variable_subtract();
+    test_elementwise();
+    test_fill();
+    test_memory();
+    test_copy_on_write();
+    test_optimizer_sgd();
+    test_optimizer_adam();
+    test_matmul();
+    test_tune();
+    test_perf();
+    test_bmm();
+    test_linear();
+    test_requires_grad();
+    test_in_place();
+    test_forward_mode();
+    test_jit();
+    test_sparse();
+    test_embedding();
+    test_activations();
+    test_softmax();
+    test_conv2d();
+    test_dataloader();
+    test_checkpoint();
+    test_activation_checkpointing();
+    test_rng();
+    test_data_parallel();
+    test_distributed();
+    test_serve();
     printf("All tests passed! :D");
     return 0;
 }
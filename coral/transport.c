@@ -0,0 +1,314 @@
+#include "transport.h"
+#include "parallel.h"
+#include "assert.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define TRANSPORT_ALIGNMENT 64
+#define TRANSPORT_DEFAULT_SLOT_SIZE (1 << 18)
+#define TRANSPORT_CONNECT_ATTEMPTS 3000 // 10ms apart
+
+static transport_t* transport_new(int rank, int world_size, transport_all_reduce_fn_t all_reduce, transport_free_fn_t free_fn, void* state){
+    NDEBUG_ASSERT(world_size > 0 && rank >= 0 && rank < world_size, "Invalid rank!\n");
+    transport_t* transport = (transport_t*) malloc(sizeof(transport_t));
+    transport->rank = rank;
+    transport->world_size = world_size;
+    transport->all_reduce = all_reduce;
+    transport->free = free_fn;
+    transport->state = state;
+    return transport;
+}
+
+/**
+ * SHARED MEMORY
+ * segment: a header, then world_size input slots and one result slot of slot_size entries each
+*/
+
+typedef struct {
+    uint32_t ready; // set by rank 0 once the barrier is initialized
+    uint32_t world_size;
+    uint64_t slot_size;
+    pthread_barrier_t barrier;
+} shm_header_t;
+
+typedef struct {
+    void* mapping;
+    size_t mapping_size;
+    shm_header_t* header;
+    tensor_entry_t** slots; // world_size inputs, then the result
+} shm_state_t;
+
+static size_t shm_header_size(){
+    return (sizeof(shm_header_t) + TRANSPORT_ALIGNMENT - 1) / TRANSPORT_ALIGNMENT * TRANSPORT_ALIGNMENT;
+}
+
+static void shm_all_reduce(transport_t* transport, tensor_entry_t* data, size_t size){
+    shm_state_t* state = (shm_state_t*) transport->state;
+    size_t slot_size = state->header->slot_size;
+    tensor_entry_t* result = state->slots[transport->world_size];
+    for(size_t offset = 0; offset < size; offset += slot_size){
+        size_t piece = MIN(slot_size, size - offset);
+        memcpy(state->slots[transport->rank], data + offset, piece * sizeof(tensor_entry_t));
+        pthread_barrier_wait(&state->header->barrier);
+        size_t start, end;
+        parallel_range(piece, transport->rank, transport->world_size, &start, &end);
+        memcpy(result + start, state->slots[0] + start, (end - start) * sizeof(tensor_entry_t));
+        for(int rank = 1; rank < transport->world_size; rank++){
+            tensor_entry_t* restrict total = result + start;
+            const tensor_entry_t* restrict slot = state->slots[rank] + start;
+            for(size_t index = 0; index < end - start; index++){
+                total[index] += slot[index];
+            }
+        }
+        pthread_barrier_wait(&state->header->barrier);
+        // the next piece only writes the result after every rank has passed its first barrier, ie. copied this one out
+        memcpy(data + offset, result, piece * sizeof(tensor_entry_t));
+    }
+}
+
+static void shm_free(transport_t* transport){
+    shm_state_t* state = (shm_state_t*) transport->state;
+    munmap(state->mapping, state->mapping_size);
+    free(state->slots);
+    free(state);
+    free(transport);
+}
+
+transport_t* transport_shm_new(const char* name, int rank, int world_size, size_t slot_size){
+    if(slot_size == 0){
+        slot_size = TRANSPORT_DEFAULT_SLOT_SIZE;
+    }
+    // keep every slot cache line aligned
+    slot_size = (slot_size + TRANSPORT_ALIGNMENT / sizeof(tensor_entry_t) - 1) / (TRANSPORT_ALIGNMENT / sizeof(tensor_entry_t)) * (TRANSPORT_ALIGNMENT / sizeof(tensor_entry_t));
+    size_t mapping_size = shm_header_size() + (world_size + 1) * slot_size * sizeof(tensor_entry_t);
+    int fd = -1;
+    if(rank == 0){
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        int error = (fd < 0) ? -1 : ftruncate(fd, mapping_size);
+        NDEBUG_ASSERT(error == 0, "Could not create shared memory segment!\n");
+    }else{
+        // wait for rank 0 to create and size the segment
+        for(int attempt = 0; attempt < TRANSPORT_CONNECT_ATTEMPTS; attempt++){
+            fd = shm_open(name, O_RDWR, 0600);
+            struct stat segment_stat;
+            if(fd >= 0 && fstat(fd, &segment_stat) == 0 && (size_t) segment_stat.st_size == mapping_size){
+                break;
+            }
+            if(fd >= 0){
+                close(fd);
+                fd = -1;
+            }
+            usleep(10000);
+        }
+        NDEBUG_ASSERT(fd >= 0, "Could not attach to shared memory segment!\n");
+    }
+    void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    NDEBUG_ASSERT(mapping != MAP_FAILED, "Could not map shared memory segment!\n");
+    close(fd);
+    shm_header_t* header = (shm_header_t*) mapping;
+    if(rank == 0){
+        header->world_size = world_size;
+        header->slot_size = slot_size;
+        pthread_barrierattr_t attributes;
+        pthread_barrierattr_init(&attributes);
+        pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_barrier_init(&header->barrier, &attributes, world_size);
+        pthread_barrierattr_destroy(&attributes);
+        __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    }else{
+        while(__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) == 0){
+            usleep(1000);
+        }
+        NDEBUG_ASSERT(header->world_size == (uint32_t) world_size && header->slot_size == slot_size, "Shared memory segment does not match!\n");
+    }
+    shm_state_t* state = (shm_state_t*) malloc(sizeof(shm_state_t));
+    state->mapping = mapping;
+    state->mapping_size = mapping_size;
+    state->header = header;
+    state->slots = (tensor_entry_t**) malloc((world_size + 1) * sizeof(tensor_entry_t*));
+    for(int slot = 0; slot <= world_size; slot++){
+        state->slots[slot] = (tensor_entry_t*) ((char*) mapping + shm_header_size()) + slot * slot_size;
+    }
+    // once everyone is attached the name is no longer needed, and unlinking it now means no segment outlives a crash
+    pthread_barrier_wait(&header->barrier);
+    if(rank == 0){
+        shm_unlink(name);
+    }
+    return transport_new(rank, world_size, &shm_all_reduce, &shm_free, state);
+}
+
+/**
+ * TCP
+*/
+
+typedef struct {
+    int send_fd; // to rank + 1
+    int recv_fd; // from rank - 1
+    tensor_entry_t* scratch;
+    size_t scratch_size;
+} tcp_state_t;
+
+// sends send_bytes to send_fd while receiving recv_bytes from recv_fd; polling both, since with blocking
+// sends every rank could fill its socket buffer and wait on a neighbour that is waiting too
+static void tcp_exchange(tcp_state_t* state, const void* send_data, size_t send_bytes, void* recv_data, size_t recv_bytes){
+    const char* send_position = (const char*) send_data;
+    char* recv_position = (char*) recv_data;
+    while(send_bytes > 0 || recv_bytes > 0){
+        struct pollfd fds[2] = {{state->send_fd, send_bytes > 0 ? POLLOUT : 0, 0}, {state->recv_fd, recv_bytes > 0 ? POLLIN : 0, 0}};
+        int ready = poll(fds, 2, -1);
+        NDEBUG_ASSERT(ready > 0 || errno == EINTR, "Transport poll failed!\n");
+        if(send_bytes > 0 && (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))){
+            ssize_t sent = send(state->send_fd, send_position, send_bytes, MSG_NOSIGNAL);
+            NDEBUG_ASSERT(sent > 0 || errno == EAGAIN || errno == EWOULDBLOCK, "Transport send failed!\n");
+            if(sent > 0){
+                send_position += sent;
+                send_bytes -= (size_t) sent;
+            }
+        }
+        if(recv_bytes > 0 && (fds[1].revents & (POLLIN | POLLERR | POLLHUP))){
+            ssize_t received = recv(state->recv_fd, recv_position, recv_bytes, 0);
+            NDEBUG_ASSERT(received > 0 || (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)), "Transport receive failed!\n");
+            if(received > 0){
+                recv_position += received;
+                recv_bytes -= (size_t) received;
+            }
+        }
+    }
+}
+
+static size_t chunk_start(size_t size, int chunk, int num_chunks){
+    size_t start, end;
+    parallel_range(size, chunk, num_chunks, &start, &end);
+    return start;
+}
+
+static size_t chunk_size(size_t size, int chunk, int num_chunks){
+    size_t start, end;
+    parallel_range(size, chunk, num_chunks, &start, &end);
+    return end - start;
+}
+
+static void tcp_all_reduce(transport_t* transport, tensor_entry_t* data, size_t size){
+    int world_size = transport->world_size;
+    if(world_size == 1){
+        return;
+    }
+    tcp_state_t* state = (tcp_state_t*) transport->state;
+    size_t max_chunk = (size + world_size - 1) / world_size;
+    if(state->scratch_size < max_chunk){
+        free(state->scratch);
+        state->scratch = (tensor_entry_t*) malloc(max_chunk * sizeof(tensor_entry_t));
+        state->scratch_size = max_chunk;
+    }
+    // reduce-scatter: after step s, chunk (rank - s - 1) holds the sum over s + 2 ranks; in the end rank r owns chunk r + 1
+    for(int step = 0; step < world_size - 1; step++){
+        int send_chunk = ((transport->rank - step) % world_size + world_size) % world_size;
+        int recv_chunk = ((transport->rank - step - 1) % world_size + world_size) % world_size;
+        size_t recv_size = chunk_size(size, recv_chunk, world_size);
+        tcp_exchange(state, data + chunk_start(size, send_chunk, world_size), chunk_size(size, send_chunk, world_size) * sizeof(tensor_entry_t), state->scratch, recv_size * sizeof(tensor_entry_t));
+        tensor_entry_t* restrict total = data + chunk_start(size, recv_chunk, world_size);
+        const tensor_entry_t* restrict received = state->scratch;
+        for(size_t index = 0; index < recv_size; index++){
+            total[index] += received[index];
+        }
+    }
+    // all-gather: pass the reduced chunks around the ring
+    for(int step = 0; step < world_size - 1; step++){
+        int send_chunk = ((transport->rank + 1 - step) % world_size + world_size) % world_size;
+        int recv_chunk = ((transport->rank - step) % world_size + world_size) % world_size;
+        tcp_exchange(state, data + chunk_start(size, send_chunk, world_size), chunk_size(size, send_chunk, world_size) * sizeof(tensor_entry_t), data + chunk_start(size, recv_chunk, world_size), chunk_size(size, recv_chunk, world_size) * sizeof(tensor_entry_t));
+    }
+}
+
+static void tcp_free(transport_t* transport){
+    tcp_state_t* state = (tcp_state_t*) transport->state;
+    if(state->send_fd >= 0){
+        close(state->send_fd);
+        close(state->recv_fd);
+    }
+    free(state->scratch);
+    free(state);
+    free(transport);
+}
+
+static void socket_configure(int fd){
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int tcp_listen(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    NDEBUG_ASSERT(fd >= 0, "Could not create socket!\n");
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t) port);
+    int error = bind(fd, (struct sockaddr*) &address, sizeof(address));
+    NDEBUG_ASSERT(error == 0, "Could not bind transport port!\n");
+    error = listen(fd, 1);
+    NDEBUG_ASSERT(error == 0, "Could not listen on transport port!\n");
+    return fd;
+}
+
+// retries until the peer is listening
+static int tcp_connect(const char* host, int port){
+    char port_string[16];
+    snprintf(port_string, sizeof(port_string), "%d", port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    int error = getaddrinfo(host, port_string, &hints, &addresses);
+    NDEBUG_ASSERT(error == 0, "Could not resolve transport host!\n");
+    int fd = -1;
+    for(int attempt = 0; attempt < TRANSPORT_CONNECT_ATTEMPTS && fd < 0; attempt++){
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, addresses->ai_addr, addresses->ai_addrlen) != 0){
+            close(fd);
+            fd = -1;
+            usleep(10000);
+        }
+    }
+    freeaddrinfo(addresses);
+    NDEBUG_ASSERT(fd >= 0, "Could not connect to transport peer!\n");
+    return fd;
+}
+
+transport_t* transport_tcp_new(const char** hosts, int base_port, int rank, int world_size){
+    tcp_state_t* state = (tcp_state_t*) malloc(sizeof(tcp_state_t));
+    state->send_fd = -1;
+    state->recv_fd = -1;
+    state->scratch = NULL;
+    state->scratch_size = 0;
+    if(world_size > 1){
+        // listen before connecting, so that the ring can form in any order
+        int listen_fd = tcp_listen(base_port + rank);
+        int next = (rank + 1) % world_size;
+        state->send_fd = tcp_connect(hosts[next], base_port + next);
+        state->recv_fd = accept(listen_fd, NULL, NULL);
+        NDEBUG_ASSERT(state->recv_fd >= 0, "Could not accept transport peer!\n");
+        close(listen_fd);
+        socket_configure(state->send_fd);
+        socket_configure(state->recv_fd);
+    }
+    return transport_new(rank, world_size, &tcp_all_reduce, &tcp_free, state);
+}
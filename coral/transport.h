@@ -0,0 +1,49 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "tensor.h"
+#include <stddef.h>
+
+/**
+ * TRANSPORTS
+ * a group of world_size processes, each holding a rank in [0, world_size), which can sum buffers across the group
+ * every process must make the same sequence of calls
+*/
+
+typedef struct transport transport_t;
+
+// data (size entries) <- the elementwise sum of data over all ranks
+typedef void (* transport_all_reduce_fn_t)(transport_t* transport, tensor_entry_t* data, size_t size);
+typedef void (* transport_free_fn_t)(transport_t* transport);
+
+struct transport {
+    int rank;
+    int world_size;
+    transport_all_reduce_fn_t all_reduce;
+    transport_free_fn_t free;
+    void* state; // transport specific
+};
+
+/**
+ * POSIX shared memory, for processes on one machine
+ * rank 0 creates the segment name (eg. "/coral"), the others attach to it; buffers are reduced in pieces of
+ * at most slot_size entries (0 for a default): every rank copies its piece in, sums its share of the piece over
+ * all ranks, and copies the result out
+*/
+transport_t* transport_shm_new(const char* name, int rank, int world_size, size_t slot_size);
+
+/**
+ * TCP, a ring all-reduce (reduce-scatter then all-gather) over one connection to each neighbour
+ * rank r listens on base_port + r and connects to hosts[(r + 1) % world_size] (so several ranks may share a host)
+*/
+transport_t* transport_tcp_new(const char** hosts, int base_port, int rank, int world_size);
+
+static inline void transport_all_reduce(transport_t* transport, tensor_entry_t* data, size_t size){
+    (*transport->all_reduce)(transport, data, size);
+}
+
+static inline void transport_free(transport_t* transport){
+    (*transport->free)(transport);
+}
+
+#endif // TRANSPORT_H
@@ -0,0 +1,301 @@
+#include "tune.h"
+#include "parallel.h"
+#include "assert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#define TUNE_LINE_BYTES 512
+
+typedef struct {
+    uint64_t hash; // compared before the key, as lookups are per kernel call
+    char key[TUNE_KEY_BYTES];
+    int num_values;
+    size_t values[TUNE_MAX_VALUES];
+} tune_entry_t;
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t num_entries = 0;
+static size_t capacity = 0;
+static tune_entry_t* entries = NULL;
+static bool loaded = false;
+static char* file_setting = NULL;
+static int online_setting = -1; // -1 until set, for $CORAL_TUNE_ONLINE
+
+// FNV-1a
+static uint64_t key_hash(const char* key){
+    uint64_t hash = 14695981039346656037ull;
+    for(const char* c = key; *c != '\0'; c++){
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * MACHINE SIGNATURE
+*/
+
+static void machine_signature(char* signature, size_t bytes){
+    char model[TUNE_LINE_BYTES] = "unknown";
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    if(cpuinfo != NULL){
+        char line[TUNE_LINE_BYTES];
+        while(fgets(line, sizeof(line), cpuinfo) != NULL){
+            char* colon = strchr(line, ':');
+            if(strncmp(line, "model name", 10) == 0 && colon != NULL){
+                snprintf(model, sizeof(model), "%s", colon + 2);
+                model[strcspn(model, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(cpuinfo);
+    }
+    snprintf(signature, bytes, "%s x %d", model, parallel_num_cores());
+}
+
+/**
+ * TABLE
+ * every function below takes tune_lock
+*/
+
+static tune_entry_t* find_locked(const char* key){
+    uint64_t hash = key_hash(key);
+    for(size_t entry_index = 0; entry_index < num_entries; entry_index++){
+        if(entries[entry_index].hash == hash && strcmp(entries[entry_index].key, key) == 0){
+            return &entries[entry_index];
+        }
+    }
+    return NULL;
+}
+
+static void store_locked(const char* key, int num_values, const size_t* values){
+    NDEBUG_ASSERT(strlen(key) < TUNE_KEY_BYTES && num_values <= TUNE_MAX_VALUES, "Tuning key or values too long!\n");
+    tune_entry_t* entry = find_locked(key);
+    if(entry == NULL){
+        if(num_entries == capacity){
+            capacity = capacity > 0 ? 2 * capacity : 16;
+            entries = (tune_entry_t*) realloc(entries, capacity * sizeof(tune_entry_t));
+        }
+        entry = &entries[num_entries++];
+        entry->hash = key_hash(key);
+        snprintf(entry->key, TUNE_KEY_BYTES, "%s", key);
+    }
+    entry->num_values = num_values;
+    if(num_values > 0){
+        memcpy(entry->values, values, num_values * sizeof(size_t));
+    }
+}
+
+static const char* file_path(){
+    return file_setting != NULL ? file_setting : getenv("CORAL_TUNE_FILE");
+}
+
+// lines are "key = value value ...", after a "machine <signature>" header
+static void load_locked(){
+    if(loaded){
+        return;
+    }
+    loaded = true;
+    const char* path = file_path();
+    FILE* file = path != NULL ? fopen(path, "r") : NULL;
+    if(file == NULL){
+        return;
+    }
+    char signature[TUNE_LINE_BYTES];
+    machine_signature(signature, sizeof(signature));
+    char line[TUNE_LINE_BYTES];
+    bool same_machine = false;
+    while(fgets(line, sizeof(line), file) != NULL){
+        line[strcspn(line, "\n")] = '\0';
+        if(line[0] == '#' || line[0] == '\0'){
+            continue;
+        }
+        if(strncmp(line, "machine ", 8) == 0){
+            same_machine = strcmp(line + 8, signature) == 0;
+            continue;
+        }
+        char* separator = strstr(line, " = ");
+        if(!same_machine || separator == NULL){
+            continue;
+        }
+        *separator = '\0';
+        size_t values[TUNE_MAX_VALUES];
+        int num_values = 0;
+        char* cursor = separator + 3;
+        char* end;
+        while(num_values < TUNE_MAX_VALUES && (values[num_values] = strtoull(cursor, &end, 10), end != cursor)){
+            num_values++;
+            cursor = end;
+        }
+        if(num_values > 0 && strlen(line) < TUNE_KEY_BYTES){
+            store_locked(line, num_values, values);
+        }
+    }
+    fclose(file);
+}
+
+void tune_set_file(const char* path){
+    pthread_mutex_lock(&tune_lock);
+    free(file_setting);
+    file_setting = path != NULL ? strdup(path) : NULL;
+    num_entries = 0;
+    loaded = false;
+    pthread_mutex_unlock(&tune_lock);
+}
+
+void tune_set_online(bool online){
+    __atomic_store_n(&online_setting, online ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+bool tune_is_online(){
+    int online = __atomic_load_n(&online_setting, __ATOMIC_RELAXED);
+    if(online < 0){
+        const char* variable = getenv("CORAL_TUNE_ONLINE");
+        online = variable != NULL && strcmp(variable, "1") == 0;
+    }
+    return online == 1;
+}
+
+bool tune_lookup(const char* key, int num_values, size_t* values){
+    pthread_mutex_lock(&tune_lock);
+    load_locked();
+    tune_entry_t* entry = find_locked(key);
+    bool found = entry != NULL && entry->num_values == num_values;
+    if(found){
+        memcpy(values, entry->values, num_values * sizeof(size_t));
+    }
+    pthread_mutex_unlock(&tune_lock);
+    return found;
+}
+
+size_t tune_lookup_size(const char* key, size_t default_value){
+    size_t value = default_value;
+    tune_lookup(key, 1, &value);
+    return value;
+}
+
+void tune_store(const char* key, int num_values, const size_t* values){
+    pthread_mutex_lock(&tune_lock);
+    load_locked();
+    store_locked(key, num_values, values);
+    pthread_mutex_unlock(&tune_lock);
+}
+
+// a claimed key is entered without values (so that no lookup matches it) until its values are stored
+bool tune_claim(const char* key){
+    pthread_mutex_lock(&tune_lock);
+    load_locked();
+    bool claimed = find_locked(key) == NULL;
+    if(claimed){
+        store_locked(key, 0, NULL);
+    }
+    pthread_mutex_unlock(&tune_lock);
+    return claimed;
+}
+
+// written beside the file and renamed over it, so that a process loading it never sees it half written
+bool tune_save(){
+    pthread_mutex_lock(&tune_lock);
+    load_locked();
+    const char* path = file_path();
+    bool saved = false;
+    char temporary_path[TUNE_LINE_BYTES + 32];
+    FILE* file = NULL;
+    if(path != NULL){
+        snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", path, (int) getpid());
+        file = fopen(temporary_path, "w");
+    }
+    if(file != NULL){
+        char signature[TUNE_LINE_BYTES];
+        machine_signature(signature, sizeof(signature));
+        fprintf(file, "# coral tuning file\nmachine %s\n", signature);
+        for(size_t entry_index = 0; entry_index < num_entries; entry_index++){
+            // claimed, but not (yet) tuned
+            if(entries[entry_index].num_values == 0){
+                continue;
+            }
+            fprintf(file, "%s =", entries[entry_index].key);
+            for(int value_index = 0; value_index < entries[entry_index].num_values; value_index++){
+                fprintf(file, " %zu", entries[entry_index].values[value_index]);
+            }
+            fprintf(file, "\n");
+        }
+        saved = fclose(file) == 0 && rename(temporary_path, path) == 0;
+        if(!saved){
+            unlink(temporary_path);
+        }
+    }
+    pthread_mutex_unlock(&tune_lock);
+    return saved;
+}
+
+static void save_at_exit(){
+    tune_save();
+}
+
+static void register_save_at_exit(){
+    atexit(&save_at_exit);
+}
+
+void tune_save_at_exit(){
+    static pthread_once_t register_once = PTHREAD_ONCE_INIT;
+    pthread_once(&register_once, &register_save_at_exit);
+}
+
+/**
+ * BENCHMARKING
+*/
+
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+double tune_time(tune_fn_t fn, void* context, int num_runs){
+    (*fn)(context);
+    double best = 1e30;
+    for(int run = 0; run < num_runs; run++){
+        double start = now();
+        (*fn)(context);
+        double elapsed = now() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+typedef struct {
+    tune_workload_t workload;
+    void* context;
+    size_t size;
+} workload_run_t;
+
+static void workload_run(void* context){
+    workload_run_t* run = (workload_run_t*) context;
+    (*run->workload)(run->context, run->size);
+}
+
+// from the largest size down, as the parallel run wins from some size on
+size_t tune_threshold(const char* key, tune_workload_t workload, void* context, size_t min_size, size_t max_size){
+    size_t threshold = SIZE_MAX;
+    size_t always = 0;
+    size_t never = SIZE_MAX;
+    for(size_t size = max_size; size >= min_size && size > 0; size /= 2){
+        workload_run_t run = {workload, context, size};
+        tune_store(key, 1, &always);
+        double parallel_time = tune_time(&workload_run, &run, 5);
+        tune_store(key, 1, &never);
+        double serial_time = tune_time(&workload_run, &run, 5);
+        if(parallel_time >= serial_time){
+            break;
+        }
+        threshold = size;
+    }
+    tune_store(key, 1, &threshold);
+    return threshold;
+}
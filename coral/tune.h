@@ -0,0 +1,56 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * AUTOTUNING
+ * kernel parameters whose best values depend on the machine (gemm block sizes per shape, the work from which bmm
+ * and rng fills are split over threads) are looked up by key in a table of tuned values, falling back to the
+ * built in defaults for keys not in it
+ *
+ * the table is loaded on first use from the tuning file: that of tune_set_file, else $CORAL_TUNE_FILE (none if
+ * unset); the file is headed by the signature of the machine it was tuned on (cpu model and core count), and one
+ * tuned on another machine is ignored, so that a fleet may share a path but not its values
+ * values are tuned offline by the tune tool (tune_main.c), or online: with tune_set_online (or
+ * $CORAL_TUNE_ONLINE=1), the first gemm of each shape (and operand layout) not in the table benchmarks candidate
+ * block sizes and keeps the fastest, and the table is written back to the file at exit
+ * online, a key is tuned by the first thread to claim it; threads missing it meanwhile (eg. the other workers of
+ * data parallel training) go on with the defaults rather than benchmark alongside it, which would skew both timings
+*/
+
+#define TUNE_KEY_BYTES 64
+#define TUNE_MAX_VALUES 4
+
+// NULL for $CORAL_TUNE_FILE; forgets the values of the previous file
+void tune_set_file(const char* path);
+void tune_set_online(bool online);
+bool tune_is_online();
+
+// false (leaving values alone) if key has no tuned values
+bool tune_lookup(const char* key, int num_values, size_t* values);
+size_t tune_lookup_size(const char* key, size_t default_value);
+void tune_store(const char* key, int num_values, const size_t* values);
+// true for the first caller only (until tune_set_file) of a key which has no tuned values, who is to tune it
+bool tune_claim(const char* key);
+// writes the table to the tuning file; false if there is none or it could not be written
+bool tune_save();
+// has tune_save run at exit (registered once), so that online tuning never writes the file on the path of a kernel
+void tune_save_at_exit();
+
+/**
+ * BENCHMARKING
+*/
+
+typedef void (* tune_fn_t)(void* context);
+// the fastest of num_runs runs (after one warm up run), in seconds
+double tune_time(tune_fn_t fn, void* context, int num_runs);
+
+// runs a parallelisable workload of size units, serially or split over threads as the value of the key it is tuned for
+typedef void (* tune_workload_t)(void* context, size_t size);
+// stores under key the least power of two size in [min_size, max_size] from which on the parallel run of workload
+// beats the serial one (SIZE_MAX if it never does), and returns it
+size_t tune_threshold(const char* key, tune_workload_t workload, void* context, size_t min_size, size_t max_size);
+
+#endif // TUNE_H
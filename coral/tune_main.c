@@ -0,0 +1,53 @@
+#include "tune.h"
+#include "gemm.h"
+#include "bmm.h"
+#include "rng.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// the tune tool: tunes the parallel thresholds and the gemm block sizes of the given shapes (by default, square
+// shapes of sides 128 to 2048) on this machine, and writes them to the tuning file
+// usage: tune <file> [m n k]...
+
+// the layouts of a matmul forward (row major operands) and of its backward (one operand transposed)
+static void tune_gemm(size_t m, size_t n, size_t k){
+    static const gemm_layout_t layouts[3][2] = {
+        {GEMM_LAYOUT_ROWS, GEMM_LAYOUT_ROWS},
+        {GEMM_LAYOUT_ROWS, GEMM_LAYOUT_COLUMNS},
+        {GEMM_LAYOUT_COLUMNS, GEMM_LAYOUT_ROWS},
+    };
+    for(int layout_index = 0; layout_index < 3; layout_index++){
+        size_t blocks[3];
+        char key[TUNE_KEY_BYTES];
+        gemm_tune(m, n, k, layouts[layout_index][0], layouts[layout_index][1]);
+        gemm_tune_key(key, m, n, k, layouts[layout_index][0], layouts[layout_index][1]);
+        tune_lookup(key, 3, blocks);
+        printf("%s: blocks %zu x %zu x %zu\n", key, blocks[0], blocks[1], blocks[2]);
+    }
+}
+
+int main(int argc, char** argv){
+    if(argc < 2 || (argc - 2) % 3 != 0){
+        fprintf(stderr, "usage: %s <file> [m n k]...\n", argv[0]);
+        return 1;
+    }
+    tune_set_file(argv[1]);
+    tune_set_online(false);
+    bmm_tune();
+    printf("bmm_parallel_min_work: %zu\n", tune_lookup_size("bmm_parallel_min_work", 0));
+    rng_tune();
+    printf("rng_parallel_min_entries: %zu\n", tune_lookup_size("rng_parallel_min_entries", 0));
+    if(argc == 2){
+        for(size_t side = 128; side <= 2048; side *= 2){
+            tune_gemm(side, side, side);
+        }
+    }
+    for(int arg = 2; arg + 2 < argc; arg += 3){
+        tune_gemm(strtoull(argv[arg], NULL, 10), strtoull(argv[arg + 1], NULL, 10), strtoull(argv[arg + 2], NULL, 10));
+    }
+    if(!tune_save()){
+        fprintf(stderr, "could not write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,7 +1,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#define MAX(a,b) ((a) > (b)) ? (a) : (b)
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #define UNUSED(x) (void)(x)
 
 #endif
\ No newline at end of file
@@ -2,10 +2,143 @@
 #include "tensor.h"
 #include "grad.h"
 #include "shape.h"
-#include "util.h"
+#include "utils.h"
+#include "gemm.h"
+#include "conv.h"
+#include "rng.h"
+#include "sparse.h"
+#include "bmm.h"
+#include "jit.h"
+#include "elementwise.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+
+/**
+ * FORWARD MODE
+ * the tangent rule of each op sits beside its grad op, and is run by the op (see set_unary_tangent) when any input
+ * has a tangent; rules are written as broadcast kernels over every direction at once, for which a tangent is viewed
+ * with dimensions of length 1 inserted after the directions wherever its variable has fewer dimensions than the
+ * tensors it is combined with
+*/
+
+typedef tensor_t* (* variable_unary_tangent_op_t)(variable_t* input, variable_t* output);
+typedef tensor_t* (* variable_binary_tangent_op_t)(variable_t* left_input, variable_t* right_input, variable_t* output);
+// the tangent of one direction, from that direction of the tangent of the input
+typedef tensor_t* (* tangent_direction_op_t)(tensor_t* direction, void* context);
+
+// tangent kernels, entrywise tangent a times f'(x) of the saved entry b (the output of f where that suffices, otherwise
+// the input), broadcast over the directions of a
+ELEMENTWISE_DEFINE_BINARY(square_tangent, 2 * a * b)
+ELEMENTWISE_DEFINE_BINARY(abs_tangent, b >= 0 ? a : -a)
+ELEMENTWISE_DEFINE_BINARY(relu_tangent, b > 0 ? a : 0)
+ELEMENTWISE_DEFINE_BINARY(sigmoid_tangent, a * b * (1 - b))
+ELEMENTWISE_DEFINE_BINARY(tanh_tangent, a * (1 - b * b))
+ELEMENTWISE_DEFINE_BINARY(gelu_tangent, a * vmath_gelu_gradf(b))
+ELEMENTWISE_DEFINE_BINARY(log_tangent, a / b)
+
+static inline bool has_tangent(variable_t* variable){
+    return variable != NULL && variable->tangent != NULL;
+}
+
+static inline size_t tangent_num_directions(tensor_t* tangent){
+    return tangent->shape->dims[0];
+}
+
+// (num_directions x 1 x ... x 1 x shape), with num_dims dimensions after the directions
+static shape_t* tangent_shape(size_t num_directions, shape_t* shape, int num_dims){
+    NDEBUG_ASSERT(shape->num_dims <= num_dims && num_dims < TENSOR_MAX_DIMS, "Tangents need fewer than TENSOR_MAX_DIMS dimensions!\n");
+    size_t dims[TENSOR_MAX_DIMS];
+    int offset = num_dims - shape->num_dims;
+    dims[0] = num_directions;
+    for(int dim_index = 0; dim_index < offset; dim_index++){
+        dims[1 + dim_index] = 1;
+    }
+    for(int dim_index = 0; dim_index < shape->num_dims; dim_index++){
+        dims[1 + offset + dim_index] = shape->dims[dim_index];
+    }
+    return shape_new(num_dims + 1, dims);
+}
+
+// the tangent of variable, viewed with num_dims dimensions after the directions
+static tensor_t* tangent_extended(variable_t* variable, int num_dims){
+    tensor_t* tangent = variable->tangent;
+    if(TENSOR_NUM_DIMS(tangent) == num_dims + 1){
+        return tangent;
+    }
+    shape_t* shape = tangent_shape(tangent_num_directions(tangent), variable->tensor->shape, num_dims);
+    tensor_t* view = tensor_view_as_shape(tangent, shape);
+    shape_free(shape);
+    return view;
+}
+
+// tangent (with as many dimensions) broadcast to the full tangent shape of output, by adding a fill of zeros
+static tensor_t* tangent_broadcast(tensor_t* tangent, variable_t* output){
+    shape_t* shape = tangent_shape(tangent_num_directions(tangent), output->tensor->shape, TENSOR_NUM_DIMS(output->tensor));
+    if(!shape_equal(tangent->shape, shape)){
+        tangent = tensor_add(tangent, tensor_new_fill(shape, 0));
+    }
+    shape_free(shape);
+    return tangent;
+}
+
+// the sum of the terms of a tangent rule, either of which may be NULL (an input without a tangent)
+static tensor_t* tangent_add_terms(tensor_t* left_term, tensor_t* right_term){
+    if(left_term == NULL || right_term == NULL){
+        return left_term != NULL ? left_term : right_term;
+    }
+    NDEBUG_ASSERT(tangent_num_directions(left_term) == tangent_num_directions(right_term), "Tangents have different numbers of directions!\n");
+    return tensor_add(left_term, right_term);
+}
+
+// a tangent whose directions each need an op of their own (eg. gathering rows), applied direction by direction
+// into the tangent of output; the temporaries of each direction are freed as it is done
+static tensor_t* tangent_map_directions(variable_t* input, variable_t* output, tangent_direction_op_t op, void* context){
+    size_t num_directions = tangent_num_directions(input->tangent);
+    size_t input_size = input->tensor->shape->size;
+    size_t output_size = output->tensor->shape->size;
+    shape_t* shape = tangent_shape(num_directions, output->tensor->shape, TENSOR_NUM_DIMS(output->tensor));
+    tensor_t* output_tangent = tensor_new(shape);
+    shape_free(shape);
+    for(size_t direction_index = 0; direction_index < num_directions; direction_index++){
+        // read only, so a temporary that owns nothing rather than a view
+        tensor_t direction = {input->tangent->data + direction_index * input_size, input->tensor->shape, NULL};
+        tensor_scope_t scope;
+        tensor_scope_begin(&scope);
+        tensor_t* output_direction = (*op)(&direction, context);
+        memcpy(output_tangent->data + direction_index * output_size, output_direction->data, output_size * sizeof(tensor_entry_t));
+        tensor_scope_end(&scope, 0, NULL);
+    }
+    return output_tangent;
+}
+
+static inline void set_unary_tangent(variable_t* output, variable_t* input, variable_unary_tangent_op_t tangent_op){
+    if(has_tangent(input)){
+        output->tangent = (*tangent_op)(input, output);
+    }
+}
+
+static inline void set_binary_tangent(variable_t* output, variable_t* left_input, variable_t* right_input, variable_binary_tangent_op_t tangent_op){
+    if(has_tangent(left_input) || has_tangent(right_input)){
+        output->tangent = (*tangent_op)(left_input, right_input, output);
+    }
+}
+
+static inline void assert_no_tangent(variable_t* variable){
+    NDEBUG_ASSERT(!has_tangent(variable), "Op has no tangent rule for forward mode!\n");
+}
+
+void variable_set_tangent(variable_t* variable, tensor_t* tangent){
+    if(tangent != NULL){
+        bool valid = TENSOR_NUM_DIMS(tangent) == TENSOR_NUM_DIMS(variable->tensor) + 1;
+        shape_t* shape = tangent_shape(tangent_num_directions(tangent), variable->tensor->shape, TENSOR_NUM_DIMS(variable->tensor));
+        valid = valid && shape_equal(tangent->shape, shape);
+        shape_free(shape);
+        NDEBUG_ASSERT(valid, "Tangent must be (num_directions x the shape of the variable)!\n");
+    }
+    variable->tangent = tangent;
+}
 
 /**
  * CONSTRUCTORS
@@ -15,10 +148,43 @@ variable_t* variable_new_from_tensor(tensor_t* tensor){
     variable_t* new_variable = (variable_t *) malloc(sizeof(variable_t));
     new_variable->tensor = tensor;
     new_variable->gradient = tensor_new_zeros_like(tensor);
+    new_variable->sparse_gradient = NULL;
+    new_variable->grad_meta = grad_meta_new();
+    new_variable->tangent = NULL;
+    return new_variable;
+}
+
+// the output of an op (or a view or copy), which a graph reads as a value rather than a leaf, see jit_compile
+// its gradient is allocated once it requires grad (or is accumulated into), so that eg. a forward without grad or
+// through a frozen layer costs no output sized buffer of zeros per op
+static variable_t* variable_derived_new(tensor_t* tensor){
+    variable_t* new_variable = (variable_t *) malloc(sizeof(variable_t));
+    new_variable->tensor = tensor;
+    new_variable->gradient = NULL;
+    new_variable->sparse_gradient = NULL;
+    new_variable->grad_meta = grad_meta_new();
+    new_variable->grad_meta->derived = true;
+    new_variable->tangent = NULL;
+    return new_variable;
+}
+
+variable_t* variable_new_with_row_sparse_grad(tensor_t* tensor){
+    NDEBUG_ASSERT(TENSOR_NUM_DIMS(tensor) >= 1, "Row sparse gradients need at least one dimension!\n");
+    variable_t* new_variable = (variable_t *) malloc(sizeof(variable_t));
+    new_variable->tensor = tensor;
+    new_variable->gradient = NULL;
+    size_t num_rows = tensor->shape->dims[0];
+    new_variable->sparse_gradient = row_sparse_new(num_rows, num_rows > 0 ? tensor->shape->size / num_rows : 0);
     new_variable->grad_meta = grad_meta_new();
+    new_variable->tangent = NULL;
     return new_variable;
 }
 
+void variable_set_requires_grad(variable_t* variable, bool requires_grad){
+    NDEBUG_ASSERT(variable->grad_meta->num_inputs == 0, "Only leaves can set whether they require grad!\n");
+    variable->grad_meta->requires_grad = requires_grad;
+}
+
 variable_t* variable_new(int num_dims, ...){
     // parse dim arguments
     size_t dims[num_dims];
@@ -43,11 +209,16 @@ void variable_in_place_view_as(variable_t* variable, int num_dims, ...){
     }
     va_end(dim_args);
     shape_t* shape = shape_new(num_dims, &dims[0]);
-    tensor_in_place_view_as_shape(variable->tensor, shape);
+    variable_in_place_view_as_shape(variable, shape);
 }
 
 void variable_in_place_view_as_shape(variable_t* variable, shape_t* new_shape){
     tensor_in_place_view_as_shape(variable->tensor, new_shape);
+    if(variable->tangent != NULL){
+        shape_t* shape = tangent_shape(tangent_num_directions(variable->tangent), new_shape, new_shape->num_dims);
+        tensor_in_place_view_as_shape(variable->tangent, shape);
+        shape_free(shape);
+    }
 }
 
 
@@ -61,12 +232,17 @@ variable_t* variable_view_as(variable_t* variable, int num_dims, ...){
     }
     va_end(dim_args);
     shape_t* shape = shape_new(num_dims, &dims[0]);
-    tensor_t* new_tensor = tensor_view_as_shape(variable->tensor, shape);
-    return variable_new_from_tensor(new_tensor);
+    return variable_view_as_shape(variable, shape);
 }
 
 variable_t* variable_view_as_shape(variable_t* variable, shape_t* new_shape){
-    return variable_new_from_tensor(tensor_view_as_shape(variable->tensor, new_shape));
+    variable_t* new_variable = variable_derived_new(tensor_view_as_shape(variable->tensor, new_shape));
+    if(variable->tangent != NULL){
+        shape_t* shape = tangent_shape(tangent_num_directions(variable->tangent), new_shape, new_shape->num_dims);
+        new_variable->tangent = tensor_view_as_shape(variable->tangent, shape);
+        shape_free(shape);
+    }
+    return new_variable;
 }
 
 
@@ -82,10 +258,14 @@ variable_t* variable_new_like_with_value(variable_t* old_variable, tensor_entry_
     return variable_new_from_tensor(new_tensor);
 }
 
-// creates a new variable by copying the contents of old_variable
+// creates a new variable by copying the contents (and the tangent) of old_variable
 variable_t* variable_copy(variable_t* old_variable){
     tensor_t* new_tensor = tensor_copy(old_variable->tensor);
-    return variable_new_from_tensor(new_tensor);
+    variable_t* new_variable = variable_derived_new(new_tensor);
+    if(old_variable->tangent != NULL){
+        new_variable->tangent = tensor_copy(old_variable->tangent);
+    }
+    return new_variable;
 }
 
 /**
@@ -127,7 +307,9 @@ void variable_display_with_gradient(variable_t* variable, char* name){
     printf("Tensor:\n");
     tensor_display(variable->tensor);
     printf("Gradient:\n");
-    tensor_display(variable->gradient);
+    if(variable->gradient != NULL){
+        tensor_display(variable->gradient);
+    }
 }
 
 void variable_set_to_scalar(variable_t* variable, tensor_entry_t value){
@@ -149,37 +331,58 @@ void variable_set_to_scalar(variable_t* variable, tensor_entry_t value){
  * rely on these functions to update the computation graph
 */
 
-static inline tensor_t* add_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
+tensor_t* add_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
     UNUSED(input);
     UNUSED(other_input);
     return tensor_copy(output->gradient);
 }
 
+static tensor_t* add_tangent(variable_t* left_input, variable_t* right_input, variable_t* output){
+    int num_dims = TENSOR_NUM_DIMS(output->tensor);
+    tensor_t* left_term = has_tangent(left_input) ? tangent_extended(left_input, num_dims) : NULL;
+    tensor_t* right_term = has_tangent(right_input) ? tangent_extended(right_input, num_dims) : NULL;
+    return tangent_broadcast(tangent_add_terms(left_term, right_term), output);
+}
+
 // performs component-wise addition
 variable_t* add(variable_t* left_variable, variable_t* right_variable, bool use_grad){
     tensor_t* new_tensor = tensor_add(left_variable->tensor, right_variable->tensor);
-    variable_t* new_variable = variable_new_from_tensor(new_tensor);
+    variable_t* new_variable = variable_derived_new(new_tensor);
     if(use_grad){
         set_binary_grad_meta(new_variable, left_variable, right_variable, &add_backwards_grad, &add_backwards_grad);
     } 
+    set_binary_tangent(new_variable, left_variable, right_variable, &add_tangent);
+    jit_record_binary(JIT_OP_ADD, new_variable, left_variable, right_variable);
     return new_variable;
 }
 
 tensor_t* subtract_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
     UNUSED(input);
     UNUSED(other_input);
-    tensor_t* output_grad = tensor_copy(output->gradient);
-    tensor_in_place_multiply_by_scalar(output_grad, -1);
-    return output_grad;
+    return tensor_multiply_by_scalar(output->gradient, -1);
+}
+
+static tensor_t* subtract_tangent(variable_t* left_input, variable_t* right_input, variable_t* output){
+    int num_dims = TENSOR_NUM_DIMS(output->tensor);
+    if(!has_tangent(right_input)){
+        return tangent_broadcast(tangent_extended(left_input, num_dims), output);
+    }
+    tensor_t* right_term = tangent_extended(right_input, num_dims);
+    if(!has_tangent(left_input)){
+        return tangent_broadcast(tensor_multiply_by_scalar(right_term, -1), output);
+    }
+    return tensor_subtract(tangent_extended(left_input, num_dims), right_term);
 }
 
 // performs component-wise addition
 variable_t* subtract(variable_t* left_variable, variable_t* right_variable, bool use_grad){
     tensor_t* new_tensor = tensor_subtract(left_variable->tensor, right_variable->tensor);
-    variable_t* new_variable = variable_new_from_tensor(new_tensor);
+    variable_t* new_variable = variable_derived_new(new_tensor);
     if(use_grad){
         set_binary_grad_meta(new_variable, left_variable, right_variable, &add_backwards_grad, &subtract_backwards_grad);
     } 
+    set_binary_tangent(new_variable, left_variable, right_variable, &subtract_tangent);
+    jit_record_binary(JIT_OP_SUBTRACT, new_variable, left_variable, right_variable);
     return new_variable;
 }
 
@@ -188,13 +391,26 @@ tensor_t* multiply_backwards_grad(variable_t* input, variable_t* other_input, va
     return tensor_multiply(output->gradient, other_input->tensor);
 }
 
+// reads the inputs only (not the output, which may be NULL), so that an in place multiply can take it beforehand
+static tensor_t* multiply_tangent(variable_t* left_input, variable_t* right_input, variable_t* output){
+    UNUSED(output);
+    int num_dims = MAX(TENSOR_NUM_DIMS(left_input->tensor), TENSOR_NUM_DIMS(right_input->tensor));
+    tensor_t* left_term = has_tangent(left_input) ? tensor_multiply(tangent_extended(left_input, num_dims), right_input->tensor) : NULL;
+    tensor_t* right_term = has_tangent(right_input) ? tensor_multiply(tangent_extended(right_input, num_dims), left_input->tensor) : NULL;
+    return tangent_add_terms(left_term, right_term);
+}
+
 // returns a new variable whose value is given by the sum of left_variable and right_variable
 variable_t* multiply(variable_t* left_variable, variable_t* right_variable, bool use_grad){
     tensor_t* new_tensor = tensor_multiply(left_variable->tensor, right_variable->tensor);
-    variable_t* new_variable = variable_new_from_tensor(new_tensor);
+    variable_t* new_variable = variable_derived_new(new_tensor);
     if(use_grad){
         set_binary_grad_meta(new_variable, left_variable, right_variable, &multiply_backwards_grad, &multiply_backwards_grad);
+        save_for_backwards(new_variable, left_variable);
+        save_for_backwards(new_variable, right_variable);
     } 
+    set_binary_tangent(new_variable, left_variable, right_variable, &multiply_tangent);
+    jit_record_binary(JIT_OP_MULTIPLY, new_variable, left_variable, right_variable);
     return new_variable;
 }
 
@@ -204,50 +420,798 @@ tensor_t* square_backwards_grad(variable_t* variable, variable_t* result){
 
 // note that square is equivalent (in terms of correctness of result and grad meta update) to multiply
 
+static tensor_t* square_tangent(variable_t* input, variable_t* output){
+    UNUSED(output);
+    return elementwise_square_tangent(input->tangent, input->tensor);
+}
+
 variable_t* square(variable_t* variable, bool use_grad){
-    variable_t* new_variable = variable_new_from_tensor(tensor_multiply(variable->tensor, variable->tensor));
+    variable_t* new_variable = variable_derived_new(tensor_multiply(variable->tensor, variable->tensor));
     if(use_grad){
         set_unary_grad_meta(new_variable, variable, &square_backwards_grad);
+        save_for_backwards(new_variable, variable);
     }
+    set_unary_tangent(new_variable, variable, &square_tangent);
+    jit_record_unary(JIT_OP_SQUARE, new_variable, variable);
     return new_variable;
 }
 
 tensor_t* abs_value_backwards_grad(variable_t* input, variable_t* result){
-    return tensor_multiply(tensor_abs(input->tensor), result->gradient);
+    return tensor_multiply(tensor_abs_grad(input->tensor), result->gradient);
+}
+
+static tensor_t* abs_value_tangent(variable_t* input, variable_t* output){
+    UNUSED(output);
+    return elementwise_abs_tangent(input->tangent, input->tensor);
 }
 
 // returns a new variable whose value is given by the absolute value of variable
 static variable_t* abs_value(variable_t* variable, bool use_grad){
     tensor_t* new_tensor = tensor_abs(variable->tensor);
-    variable_t* new_variable =  variable_new_from_tensor(new_tensor);
+    variable_t* new_variable =  variable_derived_new(new_tensor);
     if(use_grad){
         set_unary_grad_meta(new_variable, variable, &abs_value_backwards_grad);
+        save_for_backwards(new_variable, variable);
     }
+    set_unary_tangent(new_variable, variable, &abs_value_tangent);
+    jit_record_unary(JIT_OP_ABS, new_variable, variable);
     return new_variable;
 }
 
+// the output gradient at every entry, as a fill tensor (see tensor.h)
 tensor_t* sum_backwards_grad(variable_t* input, variable_t* result){
-    return tensor_multiply(tensor_sum_grad(input->tensor), result->gradient);
+    return tensor_new_fill_like(input->tensor, tensor_get_entry(result->gradient, 0));
+}
 
+static tensor_t* sum_tangent(variable_t* input, variable_t* output){
+    // reduced over every dimension but the directions, then viewed in the shape of output
+    size_t num_directions = tangent_num_directions(input->tangent);
+    size_t dims[TENSOR_MAX_DIMS] = {num_directions, 1, 1, 1};
+    shape_t* reduced_shape = shape_new(TENSOR_NUM_DIMS(input->tangent), dims);
+    shape_t* shape = tangent_shape(num_directions, output->tensor->shape, TENSOR_NUM_DIMS(output->tensor));
+    tensor_t* tangent = tensor_reduce_to_shape(input->tangent, reduced_shape);
+    tensor_in_place_view_as_shape(tangent, shape);
+    shape_free(reduced_shape);
+    shape_free(shape);
+    return tangent;
 }
 
 variable_t* sum(variable_t* variable, bool use_grad){
-    variable_t* new_variable = variable_new_from_tensor(tensor_sum(variable->tensor));
+    variable_t* new_variable = variable_derived_new(tensor_sum(variable->tensor));
     if(use_grad){
         set_unary_grad_meta(new_variable, variable, &sum_backwards_grad);
     }
+    set_unary_tangent(new_variable, variable, &sum_tangent);
+    jit_record_unary(JIT_OP_SUM, new_variable, variable);
     return new_variable;
 }
 
 tensor_t* mean_backwards_grad(variable_t* input, variable_t* result){
-    return tensor_multiply(tensor_mean_grad(input->tensor), result->gradient);
+    return tensor_new_fill_like(input->tensor, tensor_get_entry(result->gradient, 0) / input->tensor->shape->size);
+}
+
+static tensor_t* mean_tangent(variable_t* input, variable_t* output){
+    tensor_t* tangent = sum_tangent(input, output);
+    tensor_in_place_divide_by_scalar(tangent, input->tensor->shape->size);
+    return tangent;
 }
 
 variable_t* mean(variable_t* variable, bool use_grad){
-    variable_t* new_variable = variable_new_from_tensor(tensor_mean(variable->tensor));
+    variable_t* new_variable = variable_derived_new(tensor_mean(variable->tensor));
     if(use_grad){
         set_unary_grad_meta(new_variable, variable, &mean_backwards_grad);
     }
+    set_unary_tangent(new_variable, variable, &mean_tangent);
+    jit_record_unary(JIT_OP_MEAN, new_variable, variable);
+    return new_variable;
+}
+
+/**
+ * ACTIVATIONS AND TRANSCENDENTALS
+ * NOTE: sigmoid, tanh, exp and relu grads are computed from the saved output rather than recomputed from the input
+*/
+
+tensor_t* relu_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    return tensor_relu_backwards_grad(output->tensor, output->gradient);
+}
+
+static tensor_t* relu_tangent(variable_t* input, variable_t* output){
+    return elementwise_relu_tangent(input->tangent, output->tensor);
+}
+
+variable_t* relu(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_relu(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &relu_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+    }
+    set_unary_tangent(new_variable, variable, &relu_tangent);
+    jit_record_unary(JIT_OP_RELU, new_variable, variable);
+    return new_variable;
+}
+
+tensor_t* sigmoid_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    return tensor_sigmoid_backwards_grad(output->tensor, output->gradient);
+}
+
+static tensor_t* sigmoid_tangent(variable_t* input, variable_t* output){
+    return elementwise_sigmoid_tangent(input->tangent, output->tensor);
+}
+
+variable_t* sigmoid(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_sigmoid(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &sigmoid_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+    }
+    set_unary_tangent(new_variable, variable, &sigmoid_tangent);
+    jit_record_unary(JIT_OP_SIGMOID, new_variable, variable);
+    return new_variable;
+}
+
+tensor_t* tanh_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    return tensor_tanh_backwards_grad(output->tensor, output->gradient);
+}
+
+static tensor_t* tanh_tangent(variable_t* input, variable_t* output){
+    return elementwise_tanh_tangent(input->tangent, output->tensor);
+}
+
+variable_t* hyperbolic_tangent(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_tanh(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &tanh_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+    }
+    set_unary_tangent(new_variable, variable, &tanh_tangent);
+    jit_record_unary(JIT_OP_TANH, new_variable, variable);
+    return new_variable;
+}
+
+tensor_t* gelu_backwards_grad(variable_t* input, variable_t* output){
+    return tensor_gelu_backwards_grad(input->tensor, output->gradient);
+}
+
+static tensor_t* gelu_tangent(variable_t* input, variable_t* output){
+    UNUSED(output);
+    return elementwise_gelu_tangent(input->tangent, input->tensor);
+}
+
+variable_t* gelu(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_gelu(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &gelu_backwards_grad);
+        save_for_backwards(new_variable, variable);
+    }
+    set_unary_tangent(new_variable, variable, &gelu_tangent);
+    return new_variable;
+}
+
+tensor_t* exp_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    return tensor_exp_backwards_grad(output->tensor, output->gradient);
+}
+
+static tensor_t* exp_tangent(variable_t* input, variable_t* output){
+    return tensor_multiply(input->tangent, output->tensor);
+}
+
+variable_t* exponential(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_exp(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &exp_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+    }
+    set_unary_tangent(new_variable, variable, &exp_tangent);
+    jit_record_unary(JIT_OP_EXP, new_variable, variable);
+    return new_variable;
+}
+
+tensor_t* log_backwards_grad(variable_t* input, variable_t* output){
+    return tensor_log_backwards_grad(input->tensor, output->gradient);
+}
+
+static tensor_t* log_tangent(variable_t* input, variable_t* output){
+    UNUSED(output);
+    return elementwise_log_tangent(input->tangent, input->tensor);
+}
+
+variable_t* logarithm(variable_t* variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_log(variable->tensor));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &log_backwards_grad);
+        save_for_backwards(new_variable, variable);
+    }
+    set_unary_tangent(new_variable, variable, &log_tangent);
+    jit_record_unary(JIT_OP_LOG, new_variable, variable);
+    return new_variable;
+}
+
+/**
+ * SOFTMAX AND CROSS ENTROPY
+ * NOTE: backward passes use the closed form gradients, from the saved output (softmax) or the saved
+ * per row log sum exp (cross entropy), rather than differentiating through exp, sum, divide and log
+*/
+
+// softmax: y * (t - sum(t * y)), log softmax: t - sum(t * exp(y)), sums along axis
+static tensor_t* softmax_tangent(variable_t* input, variable_t* output, int axis, bool log_output){
+    int num_dims = TENSOR_NUM_DIMS(output->tensor);
+    if(axis < 0){
+        axis += num_dims;
+    }
+    NDEBUG_ASSERT(0 <= axis && axis < num_dims, "Axis out of range!\n");
+    tensor_t* tangent = input->tangent;
+    size_t dims[TENSOR_MAX_DIMS];
+    memcpy(dims, tangent->shape->dims, (num_dims + 1) * sizeof(size_t));
+    dims[axis + 1] = 1;
+    shape_t* reduced_shape = shape_new(num_dims + 1, dims);
+    tensor_t* weights = log_output ? tensor_exp(output->tensor) : output->tensor;
+    tensor_t* reduction = tensor_reduce_to_shape(tensor_multiply(tangent, weights), reduced_shape);
+    shape_free(reduced_shape);
+    tensor_t* difference = tensor_subtract(tangent, reduction);
+    return log_output ? difference : tensor_multiply(difference, output->tensor);
+}
+
+tensor_t* softmax_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    int axis = *(int*) output->grad_meta->context;
+    return tensor_softmax_backwards_grad(output->tensor, output->gradient, axis);
+}
+
+variable_t* softmax(variable_t* variable, int axis, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_softmax(variable->tensor, axis));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &softmax_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+        int* context = (int*) malloc(sizeof(int));
+        *context = axis;
+        new_variable->grad_meta->context = context;
+    }
+    if(has_tangent(variable)){
+        new_variable->tangent = softmax_tangent(variable, new_variable, axis, false);
+    }
+    return new_variable;
+}
+
+tensor_t* log_softmax_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    int axis = *(int*) output->grad_meta->context;
+    return tensor_log_softmax_backwards_grad(output->tensor, output->gradient, axis);
+}
+
+variable_t* log_softmax(variable_t* variable, int axis, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_log_softmax(variable->tensor, axis));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &log_softmax_backwards_grad);
+        save_for_backwards(new_variable, new_variable);
+        int* context = (int*) malloc(sizeof(int));
+        *context = axis;
+        new_variable->grad_meta->context = context;
+    }
+    if(has_tangent(variable)){
+        new_variable->tangent = softmax_tangent(variable, new_variable, axis, true);
+    }
+    return new_variable;
+}
+
+typedef struct {
+    size_t* targets;
+    tensor_entry_t* log_sum_exp; // one per row
+} cross_entropy_context_t;
+
+tensor_t* cross_entropy_backwards_grad(variable_t* input, variable_t* output){
+    cross_entropy_context_t* context = (cross_entropy_context_t*) output->grad_meta->context;
+    return tensor_cross_entropy_backwards_grad(input->tensor, context->targets, context->log_sum_exp, output->gradient);
+}
+
+// mean over rows of sum(softmax(logits) * t) - t[target], summed over classes
+static tensor_t* cross_entropy_tangent(variable_t* logits, size_t* targets, variable_t* output){
+    tensor_t* tangent = logits->tangent;
+    size_t num_directions = tangent_num_directions(tangent);
+    size_t num_rows = logits->tensor->shape->dims[0];
+    size_t num_classes = logits->tensor->shape->dims[1];
+    size_t dims[3] = {num_directions, 1, 1};
+    shape_t* reduced_shape = shape_new(3, dims);
+    shape_t* shape = tangent_shape(num_directions, output->tensor->shape, TENSOR_NUM_DIMS(output->tensor));
+    tensor_t* output_tangent = tensor_reduce_to_shape(tensor_multiply(tangent, tensor_softmax(logits->tensor, 1)), reduced_shape);
+    tensor_in_place_view_as_shape(output_tangent, shape);
+    shape_free(reduced_shape);
+    shape_free(shape);
+    tensor_make_writable(output_tangent);
+    for(size_t direction_index = 0; direction_index < num_directions; direction_index++){
+        const tensor_entry_t* direction = tangent->data + direction_index * num_rows * num_classes;
+        for(size_t row = 0; row < num_rows; row++){
+            output_tangent->data[direction_index] -= direction[row * num_classes + targets[row]];
+        }
+        output_tangent->data[direction_index] /= num_rows;
+    }
+    return output_tangent;
+}
+
+variable_t* cross_entropy_loss(variable_t* logits, size_t* targets, bool use_grad){
+    size_t num_rows = logits->tensor->shape->dims[0];
+    cross_entropy_context_t* context = (cross_entropy_context_t*) malloc(sizeof(cross_entropy_context_t));
+    context->log_sum_exp = (tensor_entry_t*) malloc(num_rows * sizeof(tensor_entry_t));
+    variable_t* new_variable = variable_derived_new(tensor_cross_entropy(logits->tensor, targets, context->log_sum_exp));
+    if(use_grad){
+        context->targets = (size_t*) malloc(num_rows * sizeof(size_t));
+        memcpy(context->targets, targets, num_rows * sizeof(size_t));
+        set_unary_grad_meta(new_variable, logits, &cross_entropy_backwards_grad);
+        save_for_backwards(new_variable, logits);
+        new_variable->grad_meta->context = context;
+    }else{
+        free(context->log_sum_exp);
+        free(context);
+    }
+    if(has_tangent(logits)){
+        new_variable->tangent = cross_entropy_tangent(logits, targets, new_variable);
+    }
+    return new_variable;
+}
+
+/**
+ * CONVOLUTION AND POOLING
+*/
+
+// inputs are [input, weight, (bias)]
+void conv2d_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    grad_meta_t* grad_meta = output->grad_meta;
+    conv2d_params_t* params = (conv2d_params_t*) grad_meta->context;
+    tensor_t* input = grad_meta->inputs[0]->variable->tensor;
+    tensor_t* weight = grad_meta->inputs[1]->variable->tensor;
+    gradient_updates[0] = input_requires_grad(grad_meta, 0) ? tensor_new_like(input) : NULL;
+    gradient_updates[1] = input_requires_grad(grad_meta, 1) ? tensor_new_like(weight) : NULL;
+    gradient_updates[2] = (grad_meta->num_inputs == 3 && input_requires_grad(grad_meta, 2)) ? tensor_new_like(grad_meta->inputs[2]->variable->tensor) : NULL;
+    tensor_conv2d_backwards_grad(input, weight, output->gradient, params, gradient_updates[0], gradient_updates[1], gradient_updates[2]);
+}
+
+variable_t* conv2d(variable_t* input, variable_t* weight, variable_t* bias, const conv2d_params_t* params, bool use_grad){
+    assert_no_tangent(input);
+    assert_no_tangent(weight);
+    assert_no_tangent(bias);
+    tensor_t* new_tensor = tensor_conv2d(input->tensor, weight->tensor, bias ? bias->tensor : NULL, params);
+    variable_t* new_variable = variable_derived_new(new_tensor);
+    if(use_grad){
+        variable_t* inputs[3] = {input, weight, bias};
+        conv2d_params_t* context = (conv2d_params_t*) malloc(sizeof(conv2d_params_t));
+        *context = *params;
+        set_fused_grad_meta(new_variable, bias ? 3 : 2, inputs, &conv2d_backwards_grad, context);
+        save_for_backwards(new_variable, input);
+        save_for_backwards(new_variable, weight);
+    }
+    return new_variable;
+}
+
+tensor_t* max_pool2d_backwards_grad(variable_t* input, variable_t* output){
+    size_t* argmax = (size_t*) output->grad_meta->context;
+    return tensor_max_pool2d_backwards_grad(input->tensor, output->gradient, argmax);
+}
+
+variable_t* max_pool2d(variable_t* input, const pool2d_params_t* params, bool use_grad){
+    assert_no_tangent(input);
+    // the argmax of every window is saved so that backward is a single scatter
+    size_t* argmax = NULL;
+    variable_t* new_variable = variable_derived_new(tensor_max_pool2d(input->tensor, params, use_grad ? &argmax : NULL));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, input, &max_pool2d_backwards_grad);
+        new_variable->grad_meta->context = argmax;
+    }
+    return new_variable;
+}
+
+tensor_t* avg_pool2d_backwards_grad(variable_t* input, variable_t* output){
+    pool2d_params_t* params = (pool2d_params_t*) output->grad_meta->context;
+    return tensor_avg_pool2d_backwards_grad(input->tensor, output->gradient, params);
+}
+
+variable_t* avg_pool2d(variable_t* input, const pool2d_params_t* params, bool use_grad){
+    assert_no_tangent(input);
+    variable_t* new_variable = variable_derived_new(tensor_avg_pool2d(input->tensor, params));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, input, &avg_pool2d_backwards_grad);
+        pool2d_params_t* context = (pool2d_params_t*) malloc(sizeof(pool2d_params_t));
+        *context = *params;
+        new_variable->grad_meta->context = context;
+    }
+    return new_variable;
+}
+
+// grad with respect to the left input of a matrix multiplication: output_grad * right^T
+tensor_t* matmul_left_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
+    size_t m = input->tensor->shape->dims[0];
+    size_t k = input->tensor->shape->dims[1];
+    size_t n = other_input->tensor->shape->dims[1];
+    tensor_t* grad = tensor_new_like(input->tensor);
+    gemm(m, k, n, output->gradient->data, n, 1, other_input->tensor->data, 1, n, grad->data, k, false, NULL);
+    return grad;
+}
+
+// grad with respect to the right input of a matrix multiplication: left^T * output_grad
+tensor_t* matmul_right_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
+    size_t m = other_input->tensor->shape->dims[0];
+    size_t k = other_input->tensor->shape->dims[1];
+    size_t n = input->tensor->shape->dims[1];
+    tensor_t* grad = tensor_new_like(input->tensor);
+    gemm(k, n, m, other_input->tensor->data, 1, k, output->gradient->data, n, 1, grad->data, n, false, NULL);
+    return grad;
+}
+
+// left_tangent * right + left * right_tangent, each a batched product over the directions (and any batch dimensions)
+// NOTE: also the tangent rule of matmul, whose inputs are two dimensional
+static tensor_t* bmm_tangent(variable_t* left_input, variable_t* right_input, variable_t* output){
+    int num_dims = TENSOR_NUM_DIMS(output->tensor);
+    tensor_t* left_term = has_tangent(left_input) ? tensor_bmm(tangent_extended(left_input, num_dims), right_input->tensor) : NULL;
+    tensor_t* right_term = has_tangent(right_input) ? tensor_bmm(left_input->tensor, tangent_extended(right_input, num_dims)) : NULL;
+    return tangent_add_terms(left_term, right_term);
+}
+
+variable_t* matmul(variable_t* left_variable, variable_t* right_variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_matmul(left_variable->tensor, right_variable->tensor));
+    if(use_grad){
+        set_binary_grad_meta(new_variable, left_variable, right_variable, &matmul_left_backwards_grad, &matmul_right_backwards_grad);
+        save_for_backwards(new_variable, left_variable);
+        save_for_backwards(new_variable, right_variable);
+    }
+    set_binary_tangent(new_variable, left_variable, right_variable, &bmm_tangent);
+    jit_record_binary(JIT_OP_MATMUL, new_variable, left_variable, right_variable);
+    return new_variable;
+}
+
+// the batch dimensions of these are those of the output, and are reduced to those of input by the grad engine
+tensor_t* bmm_left_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
+    UNUSED(input);
+    return tensor_bmm_left_grad(output->gradient, other_input->tensor);
+}
+
+tensor_t* bmm_right_backwards_grad(variable_t* input, variable_t* other_input, variable_t* output){
+    UNUSED(input);
+    return tensor_bmm_right_grad(output->gradient, other_input->tensor);
+}
+
+variable_t* bmm(variable_t* left_variable, variable_t* right_variable, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_bmm(left_variable->tensor, right_variable->tensor));
+    if(use_grad){
+        set_binary_grad_meta(new_variable, left_variable, right_variable, &bmm_left_backwards_grad, &bmm_right_backwards_grad);
+        save_for_backwards(new_variable, left_variable);
+        save_for_backwards(new_variable, right_variable);
+    }
+    set_binary_tangent(new_variable, left_variable, right_variable, &bmm_tangent);
+    return new_variable;
+}
+
+// output = activation(input * weight + bias), inputs are [input, weight, (bias)]
+// the activation grad and the bias grad reduction are done in one pass over the output grad,
+// the result of which feeds both of the gemms for the input and weight grads
+void linear_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    grad_meta_t* grad_meta = output->grad_meta;
+    activation_t activation = *(activation_t*) grad_meta->context;
+    tensor_t* input = grad_meta->inputs[0]->variable->tensor;
+    tensor_t* weight = grad_meta->inputs[1]->variable->tensor;
+    bool has_bias = (grad_meta->num_inputs == 3) && input_requires_grad(grad_meta, 2);
+    size_t m = input->shape->dims[0];
+    size_t k = input->shape->dims[1];
+    size_t n = weight->shape->dims[1];
+    tensor_t* pre_activation_grad = output->gradient;
+    if(activation != ACTIVATION_NONE){
+        // written in place below, so its own buffer rather than one shared with the output gradient
+        pre_activation_grad = tensor_copy(output->gradient);
+        tensor_make_writable(pre_activation_grad);
+    }
+    tensor_t* bias_grad = has_bias ? tensor_new_like(grad_meta->inputs[2]->variable->tensor) : NULL;
+    gemm_epilogue_backwards(m, n, output->tensor->data, pre_activation_grad->data, activation, has_bias ? bias_grad->data : NULL);
+    // eg. the input of the first layer, or a frozen weight
+    tensor_t* input_grad = NULL;
+    if(input_requires_grad(grad_meta, 0)){
+        input_grad = tensor_new_like(input);
+        gemm(m, k, n, pre_activation_grad->data, n, 1, weight->data, 1, n, input_grad->data, k, false, NULL);
+    }
+    tensor_t* weight_grad = NULL;
+    if(input_requires_grad(grad_meta, 1)){
+        weight_grad = tensor_new_like(weight);
+        gemm(k, n, m, input->data, 1, k, pre_activation_grad->data, n, 1, weight_grad->data, n, false, NULL);
+    }
+    gradient_updates[0] = input_grad;
+    gradient_updates[1] = weight_grad;
+    gradient_updates[2] = bias_grad;
+}
+
+// the tangent of the pre activation, input_tangent * weight + input * weight_tangent + bias_tangent, through the
+// activation (whose derivative is taken from the output, as in gemm_epilogue_backwards)
+static tensor_t* linear_tangent(variable_t* input, variable_t* weight, variable_t* bias, activation_t activation, variable_t* output){
+    tensor_t* tangent = NULL;
+    if(has_tangent(input)){
+        tangent = tensor_bmm(input->tangent, weight->tensor);
+    }
+    if(has_tangent(weight)){
+        tangent = tangent_add_terms(tangent, tensor_bmm(input->tensor, weight->tangent));
+    }
+    if(has_tangent(bias)){
+        // a row, whatever the shape of the bias
+        size_t dims[3] = {tangent_num_directions(bias->tangent), 1, bias->tensor->shape->size};
+        shape_t* shape = shape_new(3, dims);
+        tangent = tangent_add_terms(tangent, tensor_view_as_shape(bias->tangent, shape));
+        shape_free(shape);
+    }
+    tangent = tangent_broadcast(tangent, output);
+    switch(activation){
+        case ACTIVATION_RELU:
+            return elementwise_relu_tangent(tangent, output->tensor);
+        case ACTIVATION_SIGMOID:
+            return elementwise_sigmoid_tangent(tangent, output->tensor);
+        case ACTIVATION_TANH:
+            return elementwise_tanh_tangent(tangent, output->tensor);
+        default:
+            return tangent;
+    }
+}
+
+variable_t* linear(variable_t* input, variable_t* weight, variable_t* bias, activation_t activation, bool use_grad){
+    tensor_t* new_tensor = tensor_linear(input->tensor, weight->tensor, bias ? bias->tensor : NULL, activation);
+    variable_t* new_variable = variable_derived_new(new_tensor);
+    if(use_grad){
+        variable_t* inputs[3] = {input, weight, bias};
+        activation_t* context = (activation_t*) malloc(sizeof(activation_t));
+        *context = activation;
+        set_fused_grad_meta(new_variable, bias ? 3 : 2, inputs, &linear_backwards_grad, context);
+        save_for_backwards(new_variable, input);
+        save_for_backwards(new_variable, weight);
+        if(activation != ACTIVATION_NONE){
+            save_for_backwards(new_variable, new_variable);
+        }
+    }
+    if(has_tangent(input) || has_tangent(weight) || has_tangent(bias)){
+        new_variable->tangent = linear_tangent(input, weight, bias, activation, new_variable);
+    }
+    variable_t* jit_inputs[3] = {input, weight, bias};
+    jit_record(JIT_OP_LINEAR, new_variable, bias ? 3 : 2, jit_inputs, activation);
+    return new_variable;
+}
+
+/**
+ * INDEXING
+ * rows are along dim 0
+*/
+
+typedef struct {
+    size_t num_indices;
+    size_t* indices;
+    size_t num_rows; // scatter_add only
+} index_context_t;
+
+static index_context_t* index_context_new(size_t num_indices, const size_t* indices, size_t num_rows){
+    index_context_t* context = (index_context_t*) malloc(sizeof(index_context_t));
+    context->num_indices = num_indices;
+    context->indices = (size_t*) malloc(num_indices * sizeof(size_t));
+    memcpy(context->indices, indices, num_indices * sizeof(size_t));
+    context->num_rows = num_rows;
+    return context;
+}
+
+// a row sparse input gets the rows of the output grad appended to its gradient, anything else a dense scatter
+void index_select_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    index_context_t* context = (index_context_t*) output->grad_meta->context;
+    variable_t* input = output->grad_meta->inputs[0]->variable;
+    if(input->sparse_gradient != NULL){
+        row_sparse_t* sparse_gradient = input->sparse_gradient;
+        for(size_t index = 0; index < context->num_indices; index++){
+            tensor_entry_t* row = row_sparse_append(sparse_gradient, context->indices[index]);
+            memcpy(row, output->gradient->data + index * sparse_gradient->row_size, sparse_gradient->row_size * sizeof(tensor_entry_t));
+        }
+        gradient_updates[0] = NULL;
+    }else{
+        gradient_updates[0] = tensor_scatter_add(output->gradient, context->num_indices, context->indices, input->tensor->shape->dims[0]);
+    }
+}
+
+static tensor_t* index_select_direction(tensor_t* direction, void* context){
+    index_context_t* index_context = (index_context_t*) context;
+    return tensor_index_select(direction, index_context->num_indices, index_context->indices);
+}
+
+variable_t* index_select(variable_t* variable, size_t num_indices, const size_t* indices, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_index_select(variable->tensor, num_indices, indices));
+    if(use_grad){
+        set_fused_grad_meta(new_variable, 1, &variable, &index_select_backwards_grad, index_context_new(num_indices, indices, 0));
+    }
+    if(has_tangent(variable)){
+        index_context_t context = {num_indices, (size_t*) indices, 0};
+        new_variable->tangent = tangent_map_directions(variable, new_variable, &index_select_direction, &context);
+    }
+    return new_variable;
+}
+
+tensor_t* scatter_add_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    index_context_t* context = (index_context_t*) output->grad_meta->context;
+    return tensor_index_select(output->gradient, context->num_indices, context->indices);
+}
+
+static tensor_t* scatter_add_direction(tensor_t* direction, void* context){
+    index_context_t* index_context = (index_context_t*) context;
+    return tensor_scatter_add(direction, index_context->num_indices, index_context->indices, index_context->num_rows);
+}
+
+variable_t* scatter_add(variable_t* source, size_t num_indices, const size_t* indices, size_t num_rows, bool use_grad){
+    variable_t* new_variable = variable_derived_new(tensor_scatter_add(source->tensor, num_indices, indices, num_rows));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, source, &scatter_add_backwards_grad);
+        new_variable->grad_meta->context = index_context_new(num_indices, indices, num_rows);
+    }
+    if(has_tangent(source)){
+        index_context_t context = {num_indices, (size_t*) indices, num_rows};
+        new_variable->tangent = tangent_map_directions(source, new_variable, &scatter_add_direction, &context);
+    }
+    return new_variable;
+}
+
+typedef struct {
+    sparse_tensor_t* input;
+    activation_t activation;
+} sparse_linear_context_t;
+
+// output = activation(input * weight + bias) for a sparse input, inputs are [weight, (bias)]
+// the weight grad input^T * output_grad scatters rows of the output grad, one per nonzero of input
+void sparse_linear_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    grad_meta_t* grad_meta = output->grad_meta;
+    sparse_linear_context_t* context = (sparse_linear_context_t*) grad_meta->context;
+    tensor_t* weight = grad_meta->inputs[0]->variable->tensor;
+    bool has_bias = (grad_meta->num_inputs == 2) && input_requires_grad(grad_meta, 1);
+    size_t m = context->input->num_rows;
+    size_t n = weight->shape->dims[1];
+    tensor_t* pre_activation_grad = output->gradient;
+    if(context->activation != ACTIVATION_NONE){
+        pre_activation_grad = tensor_copy(output->gradient);
+        tensor_make_writable(pre_activation_grad);
+    }
+    tensor_t* bias_grad = has_bias ? tensor_new_like(grad_meta->inputs[1]->variable->tensor) : NULL;
+    gemm_epilogue_backwards(m, n, output->tensor->data, pre_activation_grad->data, context->activation, has_bias ? bias_grad->data : NULL);
+    tensor_t* weight_grad = NULL;
+    if(input_requires_grad(grad_meta, 0)){
+        weight_grad = tensor_new_like(weight);
+        spmm_transpose_accumulate(context->input, pre_activation_grad->data, n, weight_grad->data);
+    }
+    gradient_updates[0] = weight_grad;
+    gradient_updates[1] = bias_grad;
+}
+
+variable_t* sparse_linear(sparse_tensor_t* input, variable_t* weight, variable_t* bias, activation_t activation, bool use_grad){
+    assert_no_tangent(weight);
+    assert_no_tangent(bias);
+    tensor_t* new_tensor = tensor_sparse_linear(input, weight->tensor, bias ? bias->tensor : NULL, activation);
+    variable_t* new_variable = variable_derived_new(new_tensor);
+    if(use_grad){
+        variable_t* inputs[2] = {weight, bias};
+        sparse_linear_context_t* context = (sparse_linear_context_t*) malloc(sizeof(sparse_linear_context_t));
+        context->input = input;
+        context->activation = activation;
+        set_fused_grad_meta(new_variable, bias ? 2 : 1, inputs, &sparse_linear_backwards_grad, context);
+        if(activation != ACTIVATION_NONE){
+            save_for_backwards(new_variable, new_variable);
+        }
+    }
+    return new_variable;
+}
+
+/**
+ * DROPOUT
+ * only the (seed, offset) of the mask is saved, backward regenerates it
+*/
+
+typedef struct {
+    tensor_entry_t p;
+    uint64_t seed;
+    uint64_t offset;
+} dropout_context_t;
+
+tensor_t* dropout_backwards_grad(variable_t* input, variable_t* output){
+    UNUSED(input);
+    dropout_context_t* context = (dropout_context_t*) output->grad_meta->context;
+    return tensor_dropout(output->gradient, context->p, context->seed, context->offset);
+}
+
+// the mask of the forward pass, regenerated for each direction
+static tensor_t* dropout_direction(tensor_t* direction, void* context){
+    dropout_context_t* dropout_context = (dropout_context_t*) context;
+    return tensor_dropout(direction, dropout_context->p, dropout_context->seed, dropout_context->offset);
+}
+
+variable_t* dropout(variable_t* variable, tensor_entry_t p, rng_t* rng, bool use_grad){
+    uint64_t offset = rng_reserve(rng, variable->tensor->shape->size);
+    variable_t* new_variable = variable_derived_new(tensor_dropout(variable->tensor, p, rng->seed, offset));
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, &dropout_backwards_grad);
+        dropout_context_t* context = (dropout_context_t*) malloc(sizeof(dropout_context_t));
+        context->p = p;
+        context->seed = rng->seed;
+        context->offset = offset;
+        new_variable->grad_meta->context = context;
+    }
+    if(has_tangent(variable)){
+        dropout_context_t context = {p, rng->seed, offset};
+        new_variable->tangent = tangent_map_directions(variable, new_variable, &dropout_direction, &context);
+    }
+    return new_variable;
+}
+
+/**
+ * IN PLACE OPS
+ * the output shares its tensor with the (left) input, whose buffer is overwritten rather than a new one allocated
+ * ops which saved the input for backwards (eg. a multiplication by it) then fail at backwards rather than compute a
+ * wrong gradient (see save_for_backwards); ops which saved nothing (eg. a linear layer without activation) or
+ * their own output (relu, sigmoid, tanh) are unaffected
+*/
+
+typedef void (* tensor_in_place_unary_op_t)(tensor_t* tensor);
+
+static void assert_in_place_allowed(variable_t* variable, bool use_grad){
+    bool is_grad_leaf = variable->grad_meta->num_inputs == 0 && variable_requires_grad(variable);
+    NDEBUG_ASSERT(!(use_grad && is_grad_leaf), "A leaf which requires grad cannot be modified in place!\n");
+}
+
+static variable_t* in_place_add(variable_t* left_variable, variable_t* right_variable, bool use_grad){
+    assert_in_place_allowed(left_variable, use_grad);
+    tensor_in_place_add(left_variable->tensor, right_variable->tensor);
+    variable_t* new_variable = variable_derived_new(left_variable->tensor);
+    if(use_grad){
+        set_binary_grad_meta(new_variable, left_variable, right_variable, &add_backwards_grad, &add_backwards_grad);
+    }
+    set_binary_tangent(new_variable, left_variable, right_variable, &add_tangent);
+    jit_record_binary(JIT_OP_ADD, new_variable, left_variable, right_variable);
+    return new_variable;
+}
+
+// inputs are [left, right], the context is the left input before it was overwritten (NULL if right needs no grad
+// and is not the left input); a right input of the left's tensor (eg. x.mul_(x)) was overwritten too, so is read
+// from the context
+void in_place_multiply_backwards_grad(variable_t* output, tensor_t** gradient_updates){
+    grad_meta_t* grad_meta = output->grad_meta;
+    tensor_t* left = (tensor_t*) grad_meta->context;
+    tensor_t* right = grad_meta->inputs[1]->variable->tensor;
+    if(right == grad_meta->inputs[0]->variable->tensor){
+        right = left;
+    }
+    gradient_updates[0] = input_requires_grad(grad_meta, 0) ? tensor_multiply(output->gradient, right) : NULL;
+    gradient_updates[1] = input_requires_grad(grad_meta, 1) ? tensor_multiply(output->gradient, left) : NULL;
+}
+
+static variable_t* in_place_multiply(variable_t* left_variable, variable_t* right_variable, bool use_grad){
+    assert_in_place_allowed(left_variable, use_grad);
+    // shares the buffer until the write below moves the left input to a new one, so it costs what the out of place
+    // op would, and only when the right input needs its gradient
+    bool aliased = right_variable->tensor == left_variable->tensor;
+    tensor_t* left = (use_grad && (aliased || variable_requires_grad(right_variable))) ? tensor_copy(left_variable->tensor) : NULL;
+    // from the left input before it is overwritten
+    bool has_tangents = has_tangent(left_variable) || has_tangent(right_variable);
+    tensor_t* tangent = has_tangents ? multiply_tangent(left_variable, right_variable, NULL) : NULL;
+    tensor_in_place_multiply(left_variable->tensor, right_variable->tensor);
+    variable_t* new_variable = variable_derived_new(left_variable->tensor);
+    new_variable->tangent = tangent;
+    if(use_grad){
+        variable_t* inputs[2] = {left_variable, right_variable};
+        set_fused_grad_meta(new_variable, 2, inputs, &in_place_multiply_backwards_grad, left);
+        if(!aliased){
+            save_for_backwards(new_variable, right_variable);
+        }
+    }
+    jit_record_binary(JIT_OP_MULTIPLY, new_variable, left_variable, right_variable);
+    return new_variable;
+}
+
+// for ops whose grad (and tangent) is computed from their output
+static variable_t* in_place_unary(variable_t* variable, tensor_in_place_unary_op_t op, variable_unary_grad_op_t grad_op,
+                                  variable_unary_tangent_op_t tangent_op, jit_op_t jit_op, bool use_grad){
+    assert_in_place_allowed(variable, use_grad);
+    (*op)(variable->tensor);
+    variable_t* new_variable = variable_derived_new(variable->tensor);
+    if(use_grad){
+        set_unary_grad_meta(new_variable, variable, grad_op);
+        save_for_backwards(new_variable, new_variable);
+    }
+    set_unary_tangent(new_variable, variable, tangent_op);
+    jit_record_unary(jit_op, new_variable, variable);
     return new_variable;
 }
 
@@ -256,31 +1220,130 @@ variable_t* mean(variable_t* variable, bool use_grad){
 */
 
 variable_t* variable_add(variable_t* left_variable, variable_t* right_variable){
-    return add(left_variable, right_variable, true);
+    return add(left_variable, right_variable, grad_is_enabled());
 }
 
 variable_t* variable_subtract(variable_t* left_variable, variable_t* right_variable){
-    return subtract(left_variable, right_variable, true);
+    return subtract(left_variable, right_variable, grad_is_enabled());
+}
+
+variable_t* variable_in_place_add(variable_t* left_variable, variable_t* right_variable){
+    return in_place_add(left_variable, right_variable, grad_is_enabled());
+}
+
+variable_t* variable_in_place_multiply(variable_t* left_variable, variable_t* right_variable){
+    return in_place_multiply(left_variable, right_variable, grad_is_enabled());
+}
+
+variable_t* variable_in_place_relu(variable_t* variable){
+    return in_place_unary(variable, &tensor_in_place_relu, &relu_backwards_grad, &relu_tangent, JIT_OP_RELU, grad_is_enabled());
+}
+
+variable_t* variable_in_place_sigmoid(variable_t* variable){
+    return in_place_unary(variable, &tensor_in_place_sigmoid, &sigmoid_backwards_grad, &sigmoid_tangent, JIT_OP_SIGMOID, grad_is_enabled());
+}
+
+variable_t* variable_in_place_tanh(variable_t* variable){
+    return in_place_unary(variable, &tensor_in_place_tanh, &tanh_backwards_grad, &tanh_tangent, JIT_OP_TANH, grad_is_enabled());
 }
 
 variable_t* variable_multiply(variable_t* left_variable, variable_t* right_variable){
-    return multiply(left_variable, right_variable, true);
+    return multiply(left_variable, right_variable, grad_is_enabled());
 }
 
 variable_t* variable_square(variable_t* variable){
-    return square(variable, true);
+    return square(variable, grad_is_enabled());
 }
 
 variable_t* variable_abs_value(variable_t* variable){
-    return abs_value(variable, true);
+    return abs_value(variable, grad_is_enabled());
 }
 
 variable_t* variable_sum(variable_t* variable){
-    return sum(variable, true);
+    return sum(variable, grad_is_enabled());
 }
 
 variable_t* variable_mean(variable_t* variable){
-    return mean(variable, true);
+    return mean(variable, grad_is_enabled());
+}
+
+variable_t* variable_relu(variable_t* variable){
+    return relu(variable, grad_is_enabled());
+}
+
+variable_t* variable_sigmoid(variable_t* variable){
+    return sigmoid(variable, grad_is_enabled());
+}
+
+variable_t* variable_tanh(variable_t* variable){
+    return hyperbolic_tangent(variable, grad_is_enabled());
+}
+
+variable_t* variable_gelu(variable_t* variable){
+    return gelu(variable, grad_is_enabled());
+}
+
+variable_t* variable_exp(variable_t* variable){
+    return exponential(variable, grad_is_enabled());
+}
+
+variable_t* variable_log(variable_t* variable){
+    return logarithm(variable, grad_is_enabled());
+}
+
+// softmax along axis (negative axes count from the end)
+variable_t* variable_softmax(variable_t* variable, int axis){
+    return softmax(variable, axis, grad_is_enabled());
+}
+
+variable_t* variable_log_softmax(variable_t* variable, int axis){
+    return log_softmax(variable, axis, grad_is_enabled());
+}
+
+// input, weight and output are NCHW, bias may be NULL
+variable_t* variable_conv2d(variable_t* input, variable_t* weight, variable_t* bias, const conv2d_params_t* params){
+    return conv2d(input, weight, bias, params, grad_is_enabled());
+}
+
+variable_t* variable_max_pool2d(variable_t* input, const pool2d_params_t* params){
+    return max_pool2d(input, params, grad_is_enabled());
+}
+
+variable_t* variable_avg_pool2d(variable_t* input, const pool2d_params_t* params){
+    return avg_pool2d(input, params, grad_is_enabled());
+}
+
+// rows indices[0], ..., indices[num_indices - 1] of variable, eg. an embedding lookup
+variable_t* variable_index_select(variable_t* variable, size_t num_indices, const size_t* indices){
+    return index_select(variable, num_indices, indices, grad_is_enabled());
+}
+
+// num_rows rows, row r the sum of the rows i of source with indices[i] = r
+variable_t* variable_scatter_add(variable_t* source, size_t num_indices, const size_t* indices, size_t num_rows){
+    return scatter_add(source, num_indices, indices, num_rows, grad_is_enabled());
+}
+
+// input is (batch x in) and not differentiable (it must outlive backwards), bias may be NULL
+variable_t* variable_sparse_linear(sparse_tensor_t* input, variable_t* weight, variable_t* bias, activation_t activation){
+    return sparse_linear(input, weight, bias, activation, grad_is_enabled());
+}
+
+// zeroes entries with probability p (drawn from rng) and scales the rest by 1 / (1 - p)
+variable_t* variable_dropout(variable_t* variable, tensor_entry_t p, rng_t* rng){
+    return dropout(variable, p, rng, grad_is_enabled());
+}
+
+variable_t* variable_matmul(variable_t* left_variable, variable_t* right_variable){
+    return matmul(left_variable, right_variable, grad_is_enabled());
+}
+
+variable_t* variable_bmm(variable_t* left_variable, variable_t* right_variable){
+    return bmm(left_variable, right_variable, grad_is_enabled());
+}
+
+// bias may be NULL
+variable_t* variable_linear(variable_t* input, variable_t* weight, variable_t* bias, activation_t activation){
+    return linear(input, weight, bias, activation, grad_is_enabled());
 }
 
 /**
@@ -297,4 +1360,9 @@ variable_t* variable_mse_loss(variable_t* actual, variable_t* expected){
     return variable_mean(variable_square(variable_subtract(actual, expected)));
 }
 
+// mean softmax cross entropy of (rows x classes) logits against one class index per row
+variable_t* variable_cross_entropy_loss(variable_t* logits, size_t* targets){
+    return cross_entropy_loss(logits, targets, grad_is_enabled());
+}
+
 
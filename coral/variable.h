@@ -2,6 +2,10 @@
 #define VARIABLE_H
 
 #include "tensor.h"
+#include "conv.h"
+#include "rng.h"
+#include "sparse.h"
+#include "bmm.h"
 #include <stdbool.h>
 
 // wrapper around tensor
@@ -11,12 +15,17 @@ typedef struct grad_meta grad_meta_t;
 
 struct variable {
     tensor_t* tensor;
-    tensor_t* gradient;
+    tensor_t* gradient; // NULL when the gradient is row sparse, or for an op output until it is needed (see grad.c)
+    row_sparse_t* sparse_gradient; // see variable_new_with_row_sparse_grad, otherwise NULL
     grad_meta_t* grad_meta;
+    tensor_t* tangent; // see FORWARD MODE, NULL if none
 };
 
 variable_t* variable_new(int num_dims, ...);
 variable_t* variable_new_from_tensor(tensor_t* tensor);
+// a leaf (eg. an embedding table) whose gradient is kept as the list of rows (along dim 0) that backwards touched,
+// rather than as a dense tensor of its size; it may only be used through variable_index_select
+variable_t* variable_new_with_row_sparse_grad(tensor_t* tensor);
 variable_t* variable_view_as(variable_t* variable, int num_dims, ...);
 variable_t* variable_view_as_shape(variable_t* variable, shape_t* new_shape);
 variable_t* variable_new_like(variable_t* old_variable);
@@ -30,10 +39,33 @@ static inline bool is_scalar(variable_t* variable){
     return tensor_is_scalar(variable->tensor);
 }
 
+/**
+ * FORWARD MODE
+ * a variable may carry a tangent, the derivatives of its entries along num_directions directions at once, stacked
+ * along a leading dimension: (num_directions x the shape of the variable)
+ * every op propagates the tangents of its inputs to its output as it runs (a Jacobian-vector product per direction),
+ * whether or not grad is enabled, so that nothing is kept for later: with grad disabled, the only memory used beyond
+ * the forward pass is the tangents of the variables still in use
+ * an input without a tangent is a constant (all of whose tangents are 0); tangents are limited to variables of fewer
+ * than TENSOR_MAX_DIMS dimensions, and the four dimensional ops (conv2d and pooling) and sparse_linear abort on one
+*/
+
+// tangent is (num_directions x the shape of variable), or NULL to clear it
+void variable_set_tangent(variable_t* variable, tensor_t* tangent);
+
+#define GRAD_META_MAX_INPUTS 3
+// the inputs and the output
+#define GRAD_META_MAX_SAVED (GRAD_META_MAX_INPUTS + 1)
+
 typedef variable_t* (* variable_binary_op_t)(variable_t* left_variable, variable_t* right_variable);
 typedef variable_t* (* variable_unary_op_t)(variable_t* left_variable, variable_t* right_variable);
 typedef tensor_t* (* variable_binary_grad_op_t)(variable_t* input, variable_t* other_input, variable_t* output);
 typedef tensor_t* (* variable_unary_grad_op_t)(variable_t* input, variable_t* output);
+// computes the gradient updates for every input of output at once (one entry of gradient_updates per input)
+// used by ops whose input gradients share intermediate work (eg. linear)
+typedef void (* variable_fused_grad_op_t)(variable_t* output, tensor_t** gradient_updates);
+// called during backwards once the gradient of variable is complete (see set_grad_hook)
+typedef void (* variable_grad_hook_t)(variable_t* variable, void* context);
 typedef void (* generic_op_t)();
 
 #define variable_grad_op_t generic_op_t
@@ -52,18 +84,49 @@ static inline input_t* input_new(variable_t* input, variable_grad_op_t grad_op){
 }
 
 struct grad_meta{
-    int ref_count;
+    int ref_count; // of the inputs that require grad
+    bool requires_grad; // see variable_requires_grad
     int num_inputs; // 0 for leaf
-    input_t* inputs[2];
+    bool derived; // made by an op, or a view or copy, even without a recorded graph (grad disabled): never a leaf
+    input_t* inputs[GRAD_META_MAX_INPUTS];
+    variable_fused_grad_op_t fused_grad_op; // if set, used in place of the per-input grad ops
+    void* context; // op specific data saved for the backward pass
+    variable_grad_hook_t grad_hook;
+    void* grad_hook_context;
+    int num_saved; // see save_for_backwards
+    tensor_t* saved[GRAD_META_MAX_SAVED];
+    unsigned int saved_versions[GRAD_META_MAX_SAVED];
 };
 
 static inline grad_meta_t* grad_meta_new(){
     grad_meta_t* new_grad_meta = (grad_meta_t*) malloc(sizeof(grad_meta_t));
     new_grad_meta->ref_count = 0;
+    new_grad_meta->requires_grad = true;
     new_grad_meta->num_inputs = 0;
+    new_grad_meta->derived = false;
+    new_grad_meta->fused_grad_op = NULL;
+    new_grad_meta->context = NULL;
+    new_grad_meta->grad_hook = NULL;
+    new_grad_meta->grad_hook_context = NULL;
+    new_grad_meta->num_saved = 0;
     return new_grad_meta;
 }
 
+// whether backwards computes the gradient of variable: set per leaf (true unless cleared, eg. for targets or
+// frozen weights), and for the output of an op iff it is set for any of its inputs, so that backwards skips (the
+// grad ops, reductions and accumulations of) every subgraph that cannot reach a leaf which requires grad
+static inline bool variable_requires_grad(variable_t* variable){
+    return variable->grad_meta->requires_grad;
+}
+
+// for fused grad ops, which may leave the update of an input that does not require grad NULL
+static inline bool input_requires_grad(grad_meta_t* grad_meta, int input_index){
+    return variable_requires_grad(grad_meta->inputs[input_index]->variable);
+}
+
+// leaves only
+void variable_set_requires_grad(variable_t* variable, bool requires_grad);
+
 void variable_display(variable_t* variable, char* name);
 void variable_display_with_gradient(variable_t* variable, char* name);
 
@@ -71,20 +134,50 @@ void variable_in_place_apply_index_fn(variable_t* variable, tensor_index_fn_t in
 void variable_in_place_view_as(variable_t* variable, int num_dims, ...);
 void variable_in_place_view_as_shape(variable_t* variable, shape_t* new_shape);
 
+// differentiable ops which overwrite the tensor of their (left) input, rather than allocate one, and return a variable
+// sharing it; backwards fails if an op which saved the input for backwards would read its overwritten values
+// the input may not be a leaf which requires grad
+variable_t* variable_in_place_add(variable_t* left_variable, variable_t* right_variable);
+variable_t* variable_in_place_multiply(variable_t* left_variable, variable_t* right_variable);
+variable_t* variable_in_place_relu(variable_t* variable);
+variable_t* variable_in_place_sigmoid(variable_t* variable);
+variable_t* variable_in_place_tanh(variable_t* variable);
+
 variable_t* variable_add(variable_t* left_variable, variable_t* right_variable);
 variable_t* variable_subtract(variable_t* left_variable, variable_t* right_variable);
 variable_t* variable_multiply(variable_t* left_variable, variable_t* right_variable);
 variable_t* variable_abs_value(variable_t* variable);
 variable_t* variable_sum(variable_t* variable);
+variable_t* variable_relu(variable_t* variable);
+variable_t* variable_sigmoid(variable_t* variable);
+variable_t* variable_tanh(variable_t* variable);
+variable_t* variable_gelu(variable_t* variable);
+variable_t* variable_exp(variable_t* variable);
+variable_t* variable_log(variable_t* variable);
+variable_t* variable_softmax(variable_t* variable, int axis);
+variable_t* variable_log_softmax(variable_t* variable, int axis);
+variable_t* variable_conv2d(variable_t* input, variable_t* weight, variable_t* bias, const conv2d_params_t* params);
+variable_t* variable_max_pool2d(variable_t* input, const pool2d_params_t* params);
+variable_t* variable_avg_pool2d(variable_t* input, const pool2d_params_t* params);
+variable_t* variable_index_select(variable_t* variable, size_t num_indices, const size_t* indices);
+variable_t* variable_scatter_add(variable_t* source, size_t num_indices, const size_t* indices, size_t num_rows);
+variable_t* variable_sparse_linear(sparse_tensor_t* input, variable_t* weight, variable_t* bias, activation_t activation);
+variable_t* variable_dropout(variable_t* variable, tensor_entry_t p, rng_t* rng);
+variable_t* variable_matmul(variable_t* left_variable, variable_t* right_variable);
+// (..., m x k) * (..., k x n), broadcasting over the leading (batch) dimensions
+variable_t* variable_bmm(variable_t* left_variable, variable_t* right_variable);
+variable_t* variable_linear(variable_t* input, variable_t* weight, variable_t* bias, activation_t activation);
 
 variable_t* variable_mae_loss(variable_t* actual, variable_t* expected);
 variable_t* variable_mse_loss(variable_t* actual, variable_t* expected);
+variable_t* variable_cross_entropy_loss(variable_t* logits, size_t* targets);
 
 static inline tensor_entry_t get_entry(variable_t* variable, size_t index){
     return tensor_get_entry(variable->tensor, index);
 }
 
 static inline void set_entry(variable_t* variable, size_t index, tensor_entry_t value){
+    tensor_make_writable(variable->tensor);
     tensor_set_entry(variable->tensor, index, value);
 }
 
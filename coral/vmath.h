@@ -0,0 +1,122 @@
+#ifndef VMATH_H
+#define VMATH_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * VECTORIZABLE ELEMENTARY FUNCTIONS
+ * NOTE: every function here is branch-free (selects only) and built from +, *, /, min/max and bit casts,
+ * so that loops calling them are vectorized by the compiler, unlike calls into libm
+ *
+ * accuracy (max error against double precision libm, measured over the stated domains):
+ * - vmath_expf:     relative error < 1e-7 on [-87, 88]; inputs outside are clamped to it
+ * - vmath_logf:     absolute error < 5e-8 for x in [0.5, 2], relative error < 1e-7 elsewhere on normal floats;
+ *                   -inf at 0, NaN for negative inputs (subnormal inputs are not supported)
+ * - vmath_tanhf:    absolute error < 2e-7 everywhere, relative error < 1e-7 for |x| < 0.625
+ * - vmath_sigmoidf: absolute error < 1e-7, relative error < 2e-7 on [-87, 88]
+ * - vmath_geluf:    the tanh form of gelu, which differs from the exact (erf) form by less than 5e-4;
+ *                   absolute error < 5e-7 against the tanh form itself
+*/
+
+static inline float vmath_float_from_bits(uint32_t bits){
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+static inline uint32_t vmath_bits_from_float(float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    return bits;
+}
+
+// Cody-Waite reduction x = n ln(2) + r with |r| <= ln(2)/2, then a degree 6 minimax polynomial for e^r
+static inline float vmath_expf(float x){
+    x = x < 88.3762626647949f ? x : 88.3762626647949f;
+    x = x > -87.3365447504019f ? x : -87.3365447504019f;
+    // round to nearest: adding 1.5 * 2^23 leaves the integer part in the low mantissa bits
+    float shifted = x * 1.44269504088896341f + 12582912.0f;
+    float n = shifted - 12582912.0f;
+    float r = x - n * 0.693359375f;
+    r = r + n * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    // 2^n: n in [-126, 128), so (n + 127) fits the exponent field; 2^128 is formed as 2 * 2^127
+    // |n| < 2^22, so the integer n is the difference of the bit patterns
+    int32_t exponent = (int32_t) (vmath_bits_from_float(shifted) - 0x4b400000u);
+    int32_t high = (int32_t) ((uint32_t) (exponent + 128) >> 8); // 1 iff exponent == 128
+    float scale = vmath_float_from_bits((uint32_t) (exponent - high + 127) << 23);
+    float high_scale = vmath_float_from_bits((uint32_t) (high + 127) << 23);
+    return p * scale * high_scale;
+}
+
+// x = m 2^e with m in [sqrt(1/2), sqrt(2)), then a degree 9 polynomial for log(1 + (m - 1))
+static inline float vmath_logf(float x){
+    uint32_t bits = vmath_bits_from_float(x);
+    int32_t exponent = (int32_t) ((bits >> 23) & 0xff) - 126;
+    float m = vmath_float_from_bits((bits & 0x007fffff) | 0x3f000000); // m in [0.5, 1)
+    int below = m < 0.707106781186547524f;
+    exponent -= below;
+    m = below ? m + m - 1.0f : m - 1.0f;
+    float e = (float) exponent;
+    float z = m * m;
+    float p = 7.0376836292e-2f;
+    p = p * m - 1.1514610310e-1f;
+    p = p * m + 1.1676998740e-1f;
+    p = p * m - 1.2420140846e-1f;
+    p = p * m + 1.4249322787e-1f;
+    p = p * m - 1.6668057665e-1f;
+    p = p * m + 2.0000714765e-1f;
+    p = p * m - 2.4999993993e-1f;
+    p = p * m + 3.3333331174e-1f;
+    float y = m * z * p;
+    y += e * -2.12194440e-4f;
+    y += -0.5f * z;
+    float result = m + y + e * 0.693359375f;
+    result = (x == 0.0f) ? -__builtin_inff() : result;
+    result = ((x < 0.0f) | (x != x)) ? __builtin_nanf("") : result;
+    result = (x == __builtin_inff()) ? x : result;
+    return result;
+}
+
+// odd polynomial near zero (where 1 - 2 / (e^2x + 1) would cancel), exp based elsewhere
+static inline float vmath_tanhf(float x){
+    float z = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * z + 2.06390887954e-2f;
+    p = p * z - 5.37397155531e-2f;
+    p = p * z + 1.33314422036e-1f;
+    p = p * z - 3.33332819422e-1f;
+    float small = p * z * x + x;
+    float large = 1.0f - 2.0f / (vmath_expf(2.0f * x) + 1.0f);
+    float abs_x = x < 0 ? -x : x;
+    return abs_x < 0.625f ? small : large;
+}
+
+static inline float vmath_sigmoidf(float x){
+    return 1.0f / (1.0f + vmath_expf(-x));
+}
+
+#define VMATH_GELU_SCALE 0.7978845608028654f // sqrt(2 / pi)
+#define VMATH_GELU_CUBIC 0.044715f
+
+static inline float vmath_geluf(float x){
+    float inner = VMATH_GELU_SCALE * (x + VMATH_GELU_CUBIC * x * x * x);
+    return 0.5f * x * (1.0f + vmath_tanhf(inner));
+}
+
+// d/dx gelu(x)
+static inline float vmath_gelu_gradf(float x){
+    float inner = VMATH_GELU_SCALE * (x + VMATH_GELU_CUBIC * x * x * x);
+    float t = vmath_tanhf(inner);
+    float inner_grad = VMATH_GELU_SCALE * (1.0f + 3.0f * VMATH_GELU_CUBIC * x * x);
+    return 0.5f * (1.0f + t) + 0.5f * x * (1.0f - t * t) * inner_grad;
+}
+
+#endif // VMATH_H